@@ -0,0 +1,597 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "anim.h"
+#include "chunk.h"
+#include "decode.h"
+#include "error.h"
+#include "zlib.h"
+
+typedef float v4f32 __attribute__((vector_size(16)));
+
+/* a frame's fcTL and the chunks after it up to the next one */
+struct anim_frame {
+        const struct frame_chunk *fc;
+        struct chunk *first;
+        struct chunk *end;
+};
+
+struct png_anim {
+        struct png_image *img;
+        const struct anim_chunk *ac;
+
+        /*
+         * does the IDAT data make up the first frame? if not, it's a
+         * default image that isn't part of the animation.
+         */
+        bool idat_frame;
+
+        /* reused for every frame */
+        struct png_decoder dec;
+        struct zlib_stream stream;
+        struct png_pixels canvas;
+
+        /* where each frame is, from one pass over the chunks */
+        struct anim_frame *index;
+
+        /* the next frame to draw */
+        uint32_t frame;
+
+        /* the frame being drawn, and the last one drawn */
+        const struct frame_chunk *fc;
+        const struct frame_chunk *prev;
+
+        /*
+         * snapshots of the canvas just before every interval'th frame was
+         * drawn (with the frame before it disposed of), so png_anim_seek
+         * can start from the nearest one. they're taken as the frames go
+         * by, and keyframes[0] stays NULL, since frame 0 starts from a
+         * clear canvas.
+         */
+        uint8_t **keyframes;
+        uint32_t interval;
+
+        /* what was under prev before it was drawn, for DISPOSE_PREVIOUS */
+        uint8_t *saved;
+
+        /* one converted row of the frame, for blending */
+        uint8_t *row;
+
+        /* frame data split over several chunks gets glued together here */
+        uint8_t *data;
+        size_t data_size;
+};
+
+uint32_t png_anim_frames(const struct png_anim *anim)
+{
+        return anim->ac->frames;
+}
+
+uint32_t png_anim_plays(const struct png_anim *anim)
+{
+        return anim->ac->plays;
+}
+
+/*
+ * blend one pixel over another, section 4.2.1 of the APNG spec. neither
+ * is premultiplied, so the result's color is the average of the two
+ * weighted by how much each one shows, and that's done for all four
+ * channels at once. the alpha lane gets the combined coverage instead.
+ */
+static inline void blend_pixel(uint8_t *dst, const uint8_t *src)
+{
+        v4f32 s = {src[0], src[1], src[2], src[3]};
+        v4f32 d = {dst[0], dst[1], dst[2], dst[3]};
+        v4f32 out;
+        float sa, da, a;
+
+        sa = src[3] / 255.0f;
+        da = dst[3] / 255.0f * (1 - sa);
+        a = sa + da;
+
+        out = (s * sa + d * da) / a + 0.5f;
+        dst[0] = out[0];
+        dst[1] = out[1];
+        dst[2] = out[2];
+        dst[3] = a * 255 + 0.5f;
+}
+
+/*
+ * blend n pixels from src over dst, which are step bytes apart. most
+ * pixels in most frames are either fully opaque or fully transparent, so
+ * those are copied or skipped, four at a time when they're adjacent.
+ */
+static void blend_row(uint8_t *dst, const uint8_t *src, uint32_t n,
+                      size_t step)
+{
+        uint32_t i = 0;
+        uint8_t a;
+
+        if (step == 4) {
+                for (; i + 4 <= n; i += 4, src += 16, dst += 16) {
+                        a = src[3] & src[7] & src[11] & src[15];
+                        if (a == 0xff) {
+                                memcpy(dst, src, 16);
+                                continue;
+                        }
+                        a = src[3] | src[7] | src[11] | src[15];
+                        if (!a)
+                                continue;
+                        break;
+                }
+        }
+
+        for (; i < n; i++, src += 4, dst += step) {
+                if (src[3] == 0xff)
+                        memcpy(dst, src, 4);
+                else if (src[3])
+                        blend_pixel(dst, src);
+        }
+}
+
+static int anim_row(struct png_decoder *dec, const uint8_t *row)
+{
+        struct png_anim *anim = dec->priv;
+        const struct frame_chunk *fc = anim->fc;
+        struct png_pixels *canvas = &anim->canvas;
+        uint8_t *out;
+
+        out = canvas->data
+                + (size_t)(fc->y + dec->y0 + dec->pass_y * dec->dy)
+                * canvas->stride + (size_t)(fc->x + dec->x0) * 4;
+
+        if (fc->blend == BLEND_SOURCE) {
+                convert_row(dec, row, 0, dec->pass_w, out, dec->dx * 4);
+        } else {
+                convert_row(dec, row, 0, dec->pass_w, anim->row, 4);
+                blend_row(out, anim->row, dec->pass_w, dec->dx * 4);
+        }
+        return 0;
+}
+
+/* copy a frame's region of the canvas to or from buf */
+static void copy_region(struct png_anim *anim, const struct frame_chunk *fc,
+                        uint8_t *buf, bool save)
+{
+        uint8_t *p;
+        size_t len;
+        uint32_t y;
+
+        len = (size_t)fc->width * 4;
+        p = anim->canvas.data + (size_t)fc->y * anim->canvas.stride
+                + (size_t)fc->x * 4;
+        for (y = 0; y < fc->height; y++, p += anim->canvas.stride,
+             buf += len) {
+                if (save)
+                        memcpy(buf, p, len);
+                else
+                        memcpy(p, buf, len);
+        }
+}
+
+/* clear a frame's region to transparent black */
+static void clear_region(struct png_anim *anim, const struct frame_chunk *fc)
+{
+        uint8_t *p;
+        uint32_t y;
+
+        p = anim->canvas.data + (size_t)fc->y * anim->canvas.stride
+                + (size_t)fc->x * 4;
+        for (y = 0; y < fc->height; y++, p += anim->canvas.stride)
+                memset(p, 0, (size_t)fc->width * 4);
+}
+
+/* check that a frame fits on the canvas */
+static int anim_check_frame(struct png_anim *anim, uint32_t frame)
+{
+        const struct frame_chunk *fc = anim->index[frame].fc;
+
+        if (fc->x >= anim->canvas.width
+            || anim->canvas.width - fc->x < fc->width
+            || fc->y >= anim->canvas.height
+            || anim->canvas.height - fc->y < fc->height)
+                return -P_EINVAL;
+
+        /* the default image always covers the whole canvas */
+        if (!frame && anim->idat_frame
+            && (fc->width != anim->canvas.width
+                || fc->height != anim->canvas.height))
+                return -P_EINVAL;
+
+        return 0;
+}
+
+/*
+ * find every frame's fcTL and data chunks, checking the sequence numbers
+ * along the way. nothing is inflated, so this is cheap even for long
+ * animations, and then any frame can be found straight away.
+ */
+static int anim_index(struct png_anim *anim)
+{
+        struct chunk *chunk;
+        uint32_t n = 0, seq = 0, frames = anim->ac->frames;
+        int error;
+
+        anim->index = calloc(frames, sizeof *anim->index);
+        if (!anim->index)
+                return -P_ENOMEM;
+
+        for (chunk = anim->img->first; chunk; chunk = chunk->next) {
+                switch (chunk->c_tmpl->ct_type_idx) {
+                case CHUNK_FCTL:
+                        if (frame_chunk(chunk)->seq != seq++)
+                                return -P_EINVAL;
+                        if (n)
+                                anim->index[n - 1].end = chunk;
+
+                        /* fcTLs past the number acTL gave are ignored */
+                        if (n == frames)
+                                return 0;
+
+                        anim->index[n].fc = frame_chunk(chunk);
+                        anim->index[n].first = chunk->next;
+                        error = anim_check_frame(anim, n);
+                        if (error)
+                                return error;
+                        n++;
+                        break;
+                case CHUNK_FDAT:
+                        /* frame data with no frame to go with it */
+                        if (!n || frame_data_chunk(chunk)->seq != seq++)
+                                return -P_EINVAL;
+                        break;
+                default:
+                        break;
+                }
+        }
+
+        /* fewer frames than acTL said */
+        return n == frames ? 0 : -P_EINVAL;
+}
+
+/*
+ * find the zlib stream for the current frame, which is in the IDAT or
+ * fdAT chunks up until the next fcTL. if there's just one chunk it's used
+ * in place, otherwise they're glued together in anim->data.
+ */
+static int anim_gather(struct png_anim *anim, const uint8_t **src,
+                       size_t *size)
+{
+        struct anim_frame *af = &anim->index[anim->frame];
+        enum chunk_enum type;
+        struct chunk *chunk;
+        const uint8_t *buf;
+        size_t total = 0, len;
+        unsigned count = 0;
+        uint8_t *tmp;
+
+        type = !anim->frame && anim->idat_frame ? CHUNK_IDAT : CHUNK_FDAT;
+        for (chunk = af->first; chunk != af->end; chunk = chunk->next) {
+                if (chunk->c_tmpl->ct_type_idx != type)
+                        continue;
+                if (type == CHUNK_FDAT) {
+                        *src = frame_data_chunk(chunk)->buf;
+                        total += chunk->length - 4;
+                } else {
+                        *src = data_chunk(chunk)->buf;
+                        total += chunk->length;
+                }
+                count++;
+        }
+
+        if (!count)
+                return -P_ENOCHUNK;
+
+        *size = total;
+        if (count == 1)
+                return 0;
+
+        if (total > anim->data_size) {
+                tmp = realloc(anim->data, total);
+                if (!tmp)
+                        return -P_ENOMEM;
+                anim->data = tmp;
+                anim->data_size = total;
+        }
+
+        total = 0;
+        for (chunk = af->first; chunk != af->end; chunk = chunk->next) {
+                if (chunk->c_tmpl->ct_type_idx != type)
+                        continue;
+                if (type == CHUNK_FDAT) {
+                        buf = frame_data_chunk(chunk)->buf;
+                        len = chunk->length - 4;
+                } else {
+                        buf = data_chunk(chunk)->buf;
+                        len = chunk->length;
+                }
+                memcpy(anim->data + total, buf, len);
+                total += len;
+        }
+        *src = anim->data;
+        return 0;
+}
+
+/*
+ * inflate and draw the current frame. if it's the IDAT frame and the image
+ * was parsed with PARSE_DEFER_CRC, the crcs get checked alongside, as in
+ * png_decode. once they've been found good they aren't checked again, so
+ * going round the animation a second time costs nothing extra.
+ */
+static int anim_draw(struct png_anim *anim)
+{
+        struct zlib_stream *stream = &anim->stream;
+        struct png_decoder *dec = &anim->dec;
+        struct crc_check *check = NULL;
+        int error, crc_error;
+
+        error = anim_gather(anim, &stream->z_src, &stream->z_src_end);
+        if (error)
+                return error;
+
+        if (!anim->frame && anim->idat_frame) {
+                error = crc_check_start(anim->img, 0, &check);
+                if (error)
+                        return error;
+        }
+
+        /* the window allocated for the first frame does for the rest */
+        stream->z_src_idx = 0;
+        stream->z_src_bidx = 0;
+        stream->z_dst_idx = 0;
+        decoder_reset(dec, anim->fc->width, anim->fc->height);
+
+        error = zlib_decompress(stream);
+        if (error == Z_STOPPED)
+                error = dec->error;
+        else if (!error && !dec->done)
+                error = -P_E2SMALL;
+
+        /* corrupt data probably explains anything else that went wrong */
+        crc_error = crc_check_wait(check);
+        if (crc_error)
+                error = crc_error;
+        return error;
+}
+
+/* start over from the first frame with a clear canvas */
+static void anim_rewind(struct png_anim *anim)
+{
+        anim->frame = 0;
+        anim->prev = NULL;
+        memset(anim->canvas.data, 0,
+               anim->canvas.stride * anim->canvas.height);
+}
+
+/* size of the canvas, and so of each keyframe */
+static size_t canvas_size(const struct png_anim *anim)
+{
+        return anim->canvas.stride * anim->canvas.height;
+}
+
+/*
+ * keep a copy of the canvas as it is before drawing anim->frame. keyframes
+ * are only a shortcut, so if there's no memory for one we do without.
+ */
+static void anim_snapshot(struct png_anim *anim)
+{
+        uint8_t *snap;
+
+        snap = malloc(canvas_size(anim));
+        if (!snap)
+                return;
+
+        memcpy(snap, anim->canvas.data, canvas_size(anim));
+        anim->keyframes[anim->frame / anim->interval] = snap;
+}
+
+static void free_keyframes(struct png_anim *anim)
+{
+        uint32_t i;
+
+        if (!anim->keyframes)
+                return;
+
+        for (i = 0; i * anim->interval < anim->ac->frames; i++)
+                free(anim->keyframes[i]);
+        free(anim->keyframes);
+        anim->keyframes = NULL;
+}
+
+int png_anim_next(struct png_anim *anim, const struct png_pixels **canvas,
+                  const struct frame_chunk **frame)
+{
+        const struct frame_chunk *prev;
+        int error;
+
+        if (anim->frame == anim->ac->frames)
+                anim_rewind(anim);
+
+        /* get rid of the last frame */
+        prev = anim->prev;
+        if (prev && prev->dispose == DISPOSE_BACKGROUND)
+                clear_region(anim, prev);
+        else if (prev && prev->dispose == DISPOSE_PREVIOUS)
+                copy_region(anim, prev, anim->saved, false);
+
+        /* about to draw a keyframe we haven't got a snapshot of yet */
+        if (anim->frame && anim->keyframes
+            && anim->frame % anim->interval == 0
+            && !anim->keyframes[anim->frame / anim->interval])
+                anim_snapshot(anim);
+
+        anim->fc = anim->index[anim->frame].fc;
+
+        /*
+         * DISPOSE_PREVIOUS on the first frame is the same as
+         * DISPOSE_BACKGROUND, which is what we get by saving the clear
+         * canvas
+         */
+        if (anim->fc->dispose == DISPOSE_PREVIOUS) {
+                if (!anim->saved) {
+                        anim->saved = malloc(anim->canvas.stride
+                                             * anim->canvas.height);
+                        if (!anim->saved)
+                                return -P_ENOMEM;
+                }
+                copy_region(anim, anim->fc, anim->saved, true);
+        }
+
+        error = anim_draw(anim);
+        if (error)
+                return error;
+
+        anim->prev = anim->fc;
+        anim->frame++;
+
+        *canvas = &anim->canvas;
+        if (frame)
+                *frame = anim->fc;
+        return 0;
+}
+
+int png_anim_set_keyframes(struct png_anim *anim, size_t budget)
+{
+        uint32_t frames = anim->ac->frames;
+        size_t slots;
+
+        free_keyframes(anim);
+
+        /* frame 0 is a keyframe for free */
+        slots = budget / canvas_size(anim) + 1;
+        if (slots > frames)
+                slots = frames;
+        anim->interval = (frames + slots - 1) / slots;
+
+        anim->keyframes = calloc((frames - 1) / anim->interval + 1,
+                                 sizeof *anim->keyframes);
+        return anim->keyframes ? 0 : -P_ENOMEM;
+}
+
+int png_anim_seek(struct png_anim *anim, uint32_t n,
+                  const struct png_pixels **canvas,
+                  const struct frame_chunk **frame)
+{
+        uint32_t k;
+        int error;
+
+        if (n >= anim->ac->frames)
+                return -P_ERANGE;
+
+        /* the nearest keyframe at or before n that we have */
+        for (k = anim->keyframes ? n / anim->interval : 0; k; k--)
+                if (anim->keyframes[k])
+                        break;
+        k *= anim->interval;
+
+        /* unless we're already between it and n */
+        if (anim->frame < k || anim->frame > n) {
+                if (k) {
+                        memcpy(anim->canvas.data,
+                               anim->keyframes[k / anim->interval],
+                               canvas_size(anim));
+                        anim->frame = k;
+                        anim->prev = NULL;
+                } else {
+                        anim_rewind(anim);
+                }
+        }
+
+        do {
+                error = png_anim_next(anim, canvas, frame);
+                if (error)
+                        return error;
+        } while (anim->frame <= n);
+
+        return 0;
+}
+
+int png_anim_new(struct png_image *img, struct png_anim **animp)
+{
+        struct png_anim *anim;
+        struct chunk *chunk;
+        size_t stride;
+        int error;
+
+        chunk = lookup_chunk(img, CHUNK_ACTL);
+        if (!chunk)
+                return -P_ENOCHUNK;
+
+        anim = calloc(1, sizeof *anim);
+        if (!anim)
+                return -P_ENOMEM;
+        anim->img = img;
+        anim->ac = anim_chunk(chunk);
+
+        /* the IDAT data is the first frame if there's a fcTL before it */
+        for (chunk = img->first; chunk; chunk = chunk->next) {
+                if (chunk->c_tmpl->ct_type_idx == CHUNK_FCTL)
+                        anim->idat_frame = true;
+                if (chunk->c_tmpl->ct_type_idx == CHUNK_FCTL
+                    || chunk->c_tmpl->ct_type_idx == CHUNK_IDAT)
+                        break;
+        }
+
+        error = decoder_init(&anim->dec, img);
+        if (error)
+                goto out_anim;
+        anim->dec.row = anim_row;
+        anim->dec.priv = anim;
+
+        error = -P_ENOMEM;
+        stride = (size_t)anim->dec.width * 4;
+        anim->row = malloc(stride);
+        if (!anim->row)
+                goto out_decoder;
+
+        anim->canvas.width = anim->dec.width;
+        anim->canvas.height = anim->dec.height;
+        anim->canvas.stride = stride;
+        anim->canvas.data = malloc(stride * anim->dec.height);
+        if (!anim->canvas.data)
+                goto out_row;
+
+        error = anim_index(anim);
+        if (!error)
+                error = png_anim_set_keyframes(anim, ANIM_KEYFRAME_BUDGET);
+        if (error)
+                goto out_canvas;
+
+        /* rows go to the decoder as they're finished, as in png_decode */
+        anim->stream.z_drain = decoder_drain;
+        anim->stream.z_drain_size = ((size_t)anim->dec.width * anim->dec.bits
+                                     + 7) / 8 + 1;
+        anim->stream.z_priv = &anim->dec;
+
+        anim->frame = anim->ac->frames;
+        *animp = anim;
+        return 0;
+
+out_canvas:
+        free_keyframes(anim);
+        free(anim->index);
+        free(anim->canvas.data);
+out_row:
+        free(anim->row);
+out_decoder:
+        decoder_fini(&anim->dec);
+out_anim:
+        free(anim);
+        return error;
+}
+
+void png_anim_free(struct png_anim *anim)
+{
+        zlib_end(&anim->stream);
+        free(anim->stream.z_dst);
+        decoder_fini(&anim->dec);
+        free(anim->canvas.data);
+        free(anim->saved);
+        free(anim->row);
+        free(anim->data);
+        free_keyframes(anim);
+        free(anim->index);
+        free(anim);
+}
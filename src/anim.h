@@ -0,0 +1,64 @@
+#ifndef PNG_ANIM_H
+#define PNG_ANIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "decode.h"
+
+/*
+ * APNG decoding. frames are drawn one after another onto a canvas the
+ * size of the image, each one blended into its own region of it and then
+ * disposed of as its fcTL says before the next is drawn. one inflater,
+ * one unfiltering decoder and the canvas are kept around from frame to
+ * frame, and drawing (and disposing of) a frame only touches its region.
+ */
+struct png_anim;
+
+/*
+ * set up to decode the animation in img, whose chunks have been parsed
+ * and have to stay put (along with the buffer they were parsed from)
+ * until png_anim_free. returns -P_ENOCHUNK if img isn't animated. if img
+ * was parsed with PARSE_DEFER_CRC, the IDAT crcs are checked when the
+ * frame they make up is first drawn.
+ */
+int png_anim_new(struct png_image *img, struct png_anim **anim);
+
+/* frames in the animation, and times to play it (0 for forever) */
+uint32_t png_anim_frames(const struct png_anim *anim);
+uint32_t png_anim_plays(const struct png_anim *anim);
+
+/*
+ * draw the next frame, going back to the first after the last. *canvas
+ * is pointed at the result, which is good until the next call, and *frame
+ * (if frame isn't NULL) at the frame's fcTL, for its delay and region.
+ */
+int png_anim_next(struct png_anim *anim, const struct png_pixels **canvas,
+                  const struct frame_chunk **frame);
+
+/*
+ * draw frame n (from 0), and point *canvas and *frame at it as
+ * png_anim_next does, which then carries on from frame n + 1. getting
+ * there means drawing every frame before it since the canvas was last
+ * clear, so snapshots of the canvas are taken every so often as frames are
+ * drawn, and seeking starts from the nearest one (or from where we are, if
+ * that's closer).
+ */
+int png_anim_seek(struct png_anim *anim, uint32_t n,
+                  const struct png_pixels **canvas,
+                  const struct frame_chunk **frame);
+
+/*
+ * keep up to budget bytes of snapshots, spread evenly over the animation,
+ * so a seek never draws more than about frames * canvas size / budget
+ * frames. png_anim_new starts out with ANIM_KEYFRAME_BUDGET. any
+ * snapshots already taken are thrown away.
+ */
+int png_anim_set_keyframes(struct png_anim *anim, size_t budget);
+
+#define ANIM_KEYFRAME_BUDGET (16UL << 20)
+
+void png_anim_free(struct png_anim *anim);
+
+#endif /* PNG_ANIM_H */
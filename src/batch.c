@@ -0,0 +1,425 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "chunk.h"
+#include "error.h"
+#include "input.h"
+#include "push.h"
+#include "trace.h"
+
+/*
+ * there's no liburing here, so this talks to the kernel directly. see
+ * io_uring(7) for how the rings work.
+ */
+
+/* what a completion is for. user_data is slot index << 2 | op */
+enum batch_op {
+        BATCH_OPEN = 0,
+        BATCH_READ,
+        BATCH_CLOSE
+};
+
+struct batch_ring {
+        int fd;
+
+        /* submission queue */
+        void *sq_map;
+        size_t sq_map_size;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        /* completion queue. cq_map is sq_map if the kernel maps them once */
+        void *cq_map;
+        size_t cq_map_size;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        /* sqes queued since the last io_uring_enter */
+        unsigned to_submit;
+};
+
+/* a file in flight */
+struct batch_slot {
+        struct png_batch *batch;
+
+        size_t file;
+        int fd;
+        off_t off;
+        int error;
+
+        /* this slot's piece of the buffer pool */
+        uint8_t *buf;
+
+        struct png_push *push;
+};
+
+struct png_batch {
+        const char *const *fnames;
+        size_t n;
+
+        /* next file to start */
+        size_t next;
+
+        const struct png_batch_ops *ops;
+        void *priv;
+
+        size_t buf_size;
+        struct batch_ring ring;
+
+        /* one per file in flight */
+        struct batch_slot slots[];
+};
+
+static int slot_row(const struct png_row *row, void *priv)
+{
+        struct batch_slot *slot = priv;
+        struct png_batch *batch = slot->batch;
+
+        if (!batch->ops->row)
+                return 0;
+        return batch->ops->row(slot->file, row, batch->priv);
+}
+
+static int ring_setup(struct batch_ring *ring, unsigned entries)
+{
+        struct io_uring_params p;
+        uint8_t *sq, *cq;
+
+        memset(ring, 0, sizeof *ring);
+        memset(&p, 0, sizeof p);
+        ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring->fd < 0)
+                return -P_ENOTSUP;
+
+        ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_map_size = p.cq_off.cqes
+                + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_map_size > ring->sq_map_size)
+                        ring->sq_map_size = ring->cq_map_size;
+                ring->cq_map_size = ring->sq_map_size;
+        }
+
+        ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_SQ_RING);
+        if (ring->sq_map == MAP_FAILED)
+                goto out_close;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_map = ring->sq_map;
+        } else {
+                ring->cq_map = mmap(NULL, ring->cq_map_size,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ring->fd,
+                                    IORING_OFF_CQ_RING);
+                if (ring->cq_map == MAP_FAILED)
+                        goto out_sq;
+        }
+
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+                goto out_cq;
+
+        sq = ring->sq_map;
+        ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+        ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+        cq = ring->cq_map;
+        ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+        ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        return 0;
+
+out_cq:
+        if (ring->cq_map != ring->sq_map)
+                munmap(ring->cq_map, ring->cq_map_size);
+out_sq:
+        munmap(ring->sq_map, ring->sq_map_size);
+out_close:
+        close(ring->fd);
+        return -P_ENOMEM;
+}
+
+static void ring_free(struct batch_ring *ring)
+{
+        munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_map != ring->sq_map)
+                munmap(ring->cq_map, ring->cq_map_size);
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+}
+
+/*
+ * grab the next sqe. every slot has at most one request in flight and the
+ * ring has an entry per slot, so this can't run out.
+ */
+static struct io_uring_sqe *ring_sqe(struct batch_ring *ring)
+{
+        struct io_uring_sqe *sqe;
+        unsigned tail, idx;
+
+        tail = *ring->sq_tail;
+        idx = tail & *ring->sq_mask;
+        sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof *sqe);
+
+        ring->sq_array[idx] = idx;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ring->to_submit++;
+        return sqe;
+}
+
+static void queue(struct png_batch *batch, struct batch_slot *slot,
+                  enum batch_op op)
+{
+        struct io_uring_sqe *sqe;
+
+        sqe = ring_sqe(&batch->ring);
+        sqe->opcode = op == BATCH_OPEN ? IORING_OP_OPENAT
+                : op == BATCH_READ ? IORING_OP_READ : IORING_OP_CLOSE;
+        sqe->user_data = (uint64_t)(slot - batch->slots) << 2 | op;
+
+        switch (op) {
+        case BATCH_OPEN:
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uintptr_t)batch->fnames[slot->file];
+                sqe->open_flags = O_RDONLY | O_CLOEXEC;
+                break;
+        case BATCH_READ:
+                sqe->fd = slot->fd;
+                sqe->addr = (uintptr_t)slot->buf;
+                sqe->len = batch->buf_size;
+                sqe->off = slot->off;
+                break;
+        case BATCH_CLOSE:
+                sqe->fd = slot->fd;
+                break;
+        }
+}
+
+/* set a free slot up for the next file. returns false if there's none left */
+static bool slot_next(struct png_batch *batch, struct batch_slot *slot)
+{
+        for (; batch->next < batch->n; batch->next++) {
+                slot->file = batch->next;
+                slot->off = 0;
+                slot->fd = -1;
+                slot->error = 0;
+                slot->push = png_push_new(slot_row, slot);
+                if (slot->push) {
+                        batch->next++;
+                        return true;
+                }
+                batch->ops->done(slot->file, -P_ENOMEM, NULL, batch->priv);
+        }
+        return false;
+}
+
+/* start the next file in a free slot. returns false if there's none left */
+static bool slot_start(struct png_batch *batch, struct batch_slot *slot)
+{
+        if (!slot_next(batch, slot))
+                return false;
+        queue(batch, slot, BATCH_OPEN);
+        return true;
+}
+
+/* report a file and move on. returns false if the slot is now idle */
+static bool slot_finish(struct png_batch *batch, struct batch_slot *slot)
+{
+        batch->ops->done(slot->file, slot->error,
+                         png_push_image(slot->push), batch->priv);
+        png_push_free(slot->push);
+        slot->push = NULL;
+        return slot_start(batch, slot);
+}
+
+/*
+ * handle a completion. returns false if the slot has nothing more in
+ * flight and no more files to start.
+ */
+static bool complete(struct png_batch *batch, struct batch_slot *slot,
+                     enum batch_op op, int res)
+{
+        int err;
+
+        switch (op) {
+        case BATCH_OPEN:
+                if (res < 0) {
+                        slot->error = -P_EIO;
+                        return slot_finish(batch, slot);
+                }
+                slot->fd = res;
+                queue(batch, slot, BATCH_READ);
+                return true;
+
+        case BATCH_READ:
+                if (res < 0) {
+                        slot->error = -P_EIO;
+                } else if (!res) {
+                        slot->error = png_push_finish(slot->push);
+                } else {
+                        /* the decoding happens while other reads are out */
+                        slot->off += res;
+                        trace_image(slot->file);
+                        err = png_push_feed(slot->push, slot->buf, res);
+                        if (err) {
+                                slot->error = err;
+                        } else if (png_push_finish(slot->push)) {
+                                /* not at IEND yet, keep reading */
+                                queue(batch, slot, BATCH_READ);
+                                return true;
+                        }
+                }
+                queue(batch, slot, BATCH_CLOSE);
+                return true;
+
+        case BATCH_CLOSE:
+                return slot_finish(batch, slot);
+        }
+        return false;
+}
+
+static int batch_uring(struct png_batch *batch, unsigned depth)
+{
+        struct batch_ring *ring = &batch->ring;
+        struct io_uring_cqe *cqe;
+        unsigned head, active = 0;
+        unsigned i;
+        uint64_t data;
+        int ret;
+
+        for (i = 0; i < depth; i++)
+                active += slot_start(batch, &batch->slots[i]);
+
+        while (active) {
+                ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+                              1, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -P_EIO;
+                }
+                ring->to_submit -= ret;
+
+                head = *ring->cq_head;
+                while (head != __atomic_load_n(ring->cq_tail,
+                                               __ATOMIC_ACQUIRE)) {
+                        cqe = &ring->cqes[head & *ring->cq_mask];
+                        data = cqe->user_data;
+                        ret = cqe->res;
+                        head++;
+                        __atomic_store_n(ring->cq_head, head,
+                                         __ATOMIC_RELEASE);
+
+                        if (!complete(batch, &batch->slots[data >> 2],
+                                      (enum batch_op)(data & 3), ret))
+                                active--;
+                }
+        }
+        return 0;
+}
+
+/* no io_uring: one file at a time, through the pread input backend */
+static void batch_pread(struct png_batch *batch)
+{
+        struct batch_slot *slot = batch->slots;
+        struct png_input in;
+        const uint8_t *buf;
+        ssize_t ret;
+
+        while (slot_next(batch, slot)) {
+                trace_image(slot->file);
+                slot->error = input_open(&in, batch->fnames[slot->file],
+                                         INPUT_PREAD, batch->buf_size * 4);
+                if (slot->error)
+                        goto finish;
+
+                while (!slot->error && (ret = input_next(&in, &buf)) > 0)
+                        slot->error = png_push_feed(slot->push, buf, ret);
+                if (!slot->error && ret < 0)
+                        slot->error = ret;
+                if (!slot->error)
+                        slot->error = png_push_finish(slot->push);
+                input_close(&in);
+finish:
+                batch->ops->done(slot->file, slot->error,
+                                 png_push_image(slot->push), batch->priv);
+                png_push_free(slot->push);
+                slot->push = NULL;
+        }
+}
+
+int png_batch_decode(const char *const *fnames, size_t n,
+                     const struct png_batch_ops *ops, void *priv,
+                     unsigned depth, size_t buf_size, unsigned flags)
+{
+        struct png_batch *batch;
+        uint8_t *pool;
+        unsigned i;
+        int error;
+
+        if (!depth)
+                depth = BATCH_DEPTH;
+        if (!buf_size)
+                buf_size = BATCH_BUF_SIZE;
+        if (depth > n)
+                depth = n ? n : 1;
+
+        batch = calloc(1, sizeof *batch + depth * sizeof *batch->slots);
+        pool = malloc(depth * buf_size);
+        if (!batch || !pool) {
+                error = -P_ENOMEM;
+                goto out;
+        }
+
+        batch->fnames = fnames;
+        batch->n = n;
+        batch->ops = ops;
+        batch->priv = priv;
+        batch->buf_size = buf_size;
+
+        for (i = 0; i < depth; i++) {
+                batch->slots[i].batch = batch;
+                batch->slots[i].buf = pool + i * buf_size;
+        }
+
+        if (!(flags & BATCH_NO_URING)
+            && !ring_setup(&batch->ring, depth)) {
+                error = batch_uring(batch, depth);
+                ring_free(&batch->ring);
+        } else {
+                batch_pread(batch);
+                error = 0;
+        }
+
+out:
+        free(pool);
+        free(batch);
+        return error;
+}
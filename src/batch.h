@@ -0,0 +1,50 @@
+#ifndef PNG_BATCH_H
+#define PNG_BATCH_H
+
+#include <stddef.h>
+
+#include "chunk.h"
+#include "push.h"
+
+/*
+ * batch decoding of lots of (usually small) files. with io_uring, the
+ * opens, reads and closes for up to depth files at a time are submitted
+ * together, and each file's push decoder is fed from read completions as
+ * they come in, so decoding one file overlaps with waiting on the others.
+ * if io_uring isn't available we fall back to reading the files one by
+ * one with the pread input backend.
+ */
+
+/* defaults for png_batch_decode */
+#define BATCH_DEPTH 32
+#define BATCH_BUF_SIZE (64UL << 10)
+
+/* png_batch_decode flags */
+#define BATCH_NO_URING 0x1 /* always use the pread fallback */
+
+struct png_batch_ops {
+        /*
+         * called with each row of file number file. return nonzero to stop
+         * decoding that file. may be NULL.
+         */
+        int (*row)(size_t file, const struct png_row *row, void *priv);
+
+        /*
+         * called once per file when it is finished with. err is 0 if it
+         * decoded, 1 if row stopped it, or a negative error. img holds the
+         * chunks parsed so far and is only valid during the call.
+         */
+        void (*done)(size_t file, int err, struct png_image *img, void *priv);
+};
+
+/*
+ * decode n files. depth is how many are in flight at once and buf_size is
+ * the size of each one's read buffer (0 for the defaults). returns 0 once
+ * every file has been handed to done, or a negative error if we couldn't
+ * get going at all.
+ */
+int png_batch_decode(const char *const *fnames, size_t n,
+                     const struct png_batch_ops *ops, void *priv,
+                     unsigned depth, size_t buf_size, unsigned flags);
+
+#endif /* PNG_BATCH_H */
@@ -0,0 +1,623 @@
+/*
+ * benchmark the input backends: decode files with the push decoder, reading
+ * them with mmap and with pread, from a cold and from a warm page cache.
+ * each run is in its own process so page faults and peak rss can be pinned
+ * on it.
+ *
+ * with -z, benchmark zlib_compress instead: the image data of each file
+ * (or the file itself, if it isn't a png) is compressed at every level and
+ * inflated again to check it, reporting ratio and throughput both ways.
+ *
+ * -m runs the microbenchmarks in micro.h, and -d times parsing and decoding
+ * whole files from memory: the files given, or the synthetic corpus from
+ * corpus.h if there aren't any. both do warmup runs first, then report
+ * percentiles of the timed ones, as a table or (with -j) as json. -g just
+ * writes the corpus out to a directory.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "corpus.h"
+#include "decode.h"
+#include "error.h"
+#include "input.h"
+#include "micro.h"
+#include "push.h"
+#include "zlib.h"
+
+static const char *backend_names[] = {
+        [INPUT_MMAP] = "mmap",
+        [INPUT_PREAD] = "pread",
+};
+
+struct result {
+        double secs;
+        long majflt;
+        long minflt;
+        long maxrss;
+};
+
+static int discard_row(const struct png_row *row, void *priv)
+{
+        (void)row;
+        (void)priv;
+        return 0;
+}
+
+/* decode a file, throwing the rows away */
+static int decode_file(const char *fname, enum input_backend backend,
+                       size_t ring_size)
+{
+        struct png_input in;
+        struct png_push *push;
+        const uint8_t *buf;
+        ssize_t ret;
+        int err;
+
+        err = input_open(&in, fname, backend, ring_size);
+        if (err)
+                return err;
+
+        push = png_push_new(discard_row, NULL);
+        if (!push) {
+                input_close(&in);
+                return -P_ENOMEM;
+        }
+
+        while ((ret = input_next(&in, &buf)) > 0) {
+                err = png_push_feed(push, buf, ret);
+                if (err)
+                        break;
+        }
+        if (!err && ret < 0)
+                err = ret;
+        if (!err)
+                err = png_push_finish(push);
+
+        png_push_free(push);
+        input_close(&in);
+        return err;
+}
+
+/* kick a file out of the page cache */
+static void drop_cache(const char *fname)
+{
+        int fd;
+
+        fd = open(fname, O_RDONLY);
+        if (fd == -1)
+                return;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* decode a file in a child process */
+static int run(const char *fname, enum input_backend backend,
+               size_t ring_size, struct result *res)
+{
+        struct rusage ru;
+        double start;
+        pid_t pid;
+        int status;
+
+        start = now();
+        pid = fork();
+        if (pid == -1)
+                return -P_EIO;
+        if (!pid)
+                _exit(-decode_file(fname, backend, ring_size));
+
+        while (wait4(pid, &status, 0, &ru) == -1)
+                if (errno != EINTR)
+                        return -P_EIO;
+        res->secs = now() - start;
+
+        if (!WIFEXITED(status))
+                return -P_EINVAL;
+        if (WEXITSTATUS(status))
+                return -WEXITSTATUS(status);
+
+        res->majflt = ru.ru_majflt;
+        res->minflt = ru.ru_minflt;
+        res->maxrss = ru.ru_maxrss;
+        return 0;
+}
+
+/*
+ * the inflated image data of a png, filter bytes and all, since that's what
+ * an encoder would be compressing. anything else is used as it is
+ */
+static int load_corpus(const char *fname, uint8_t **buf, size_t *size)
+{
+        struct zlib_stream stream;
+        struct png_image img;
+        struct chunk *chunk;
+        uint8_t *file, *idat = NULL, *tmp;
+        size_t file_size, idat_size = 0;
+        int err;
+
+        err = input_read_file(fname, &file, &file_size);
+        if (err)
+                return err;
+        if (file_size < sizeof png_magic
+            || memcmp(file, png_magic, sizeof png_magic)) {
+                *buf = file;
+                *size = file_size;
+                return 0;
+        }
+
+        err = parse_png(file, file_size, &img, 0);
+        if (err)
+                goto out;
+
+        for (chunk = img.first; chunk; chunk = chunk->next) {
+                if (chunk->c_tmpl->ct_type_idx != CHUNK_IDAT)
+                        continue;
+                tmp = realloc(idat, idat_size + chunk->length);
+                if (!tmp) {
+                        err = -P_ENOMEM;
+                        goto out;
+                }
+                idat = tmp;
+                memcpy(idat + idat_size, data_chunk(chunk)->buf,
+                       chunk->length);
+                idat_size += chunk->length;
+        }
+
+        memset(&stream, 0, sizeof stream);
+        stream.z_src = idat;
+        stream.z_src_end = idat_size;
+        err = idat ? zlib_decompress(&stream) : -P_ENOCHUNK;
+        zlib_end(&stream);
+        if (err) {
+                free(stream.z_dst);
+                goto out;
+        }
+        *buf = stream.z_dst;
+        *size = stream.z_dst_idx;
+
+out:
+        free(idat);
+        free_chunks(&img);
+        free(file);
+        return err;
+}
+
+/* compress buf at level, and inflate it again to make sure it's right */
+static int compress_once(const uint8_t *buf, size_t size, int level,
+                         size_t *out_size, double *csecs, double *dsecs)
+{
+        struct zlib_stream comp, decomp;
+        double start;
+        int err;
+
+        memset(&comp, 0, sizeof comp);
+        comp.z_src = buf;
+        comp.z_src_end = size;
+        start = now();
+        err = zlib_compress(&comp, level);
+        *csecs = now() - start;
+        if (err)
+                return err;
+        *out_size = comp.z_dst_idx;
+
+        memset(&decomp, 0, sizeof decomp);
+        decomp.z_src = comp.z_dst;
+        decomp.z_src_end = comp.z_dst_idx;
+        start = now();
+        err = zlib_decompress(&decomp);
+        *dsecs = now() - start;
+        zlib_end(&decomp);
+
+        if (!err && (decomp.z_dst_idx != size
+                     || memcmp(decomp.z_dst, buf, size)))
+                err = -P_EBADCSUM;
+
+        free(decomp.z_dst);
+        free(comp.z_dst);
+        return err;
+}
+
+static void compress_bench(const char *fname, unsigned iters)
+{
+        double csecs, dsecs, best_c, best_d;
+        size_t size, out_size;
+        uint8_t *buf;
+        unsigned n;
+        int level, err;
+
+        err = load_corpus(fname, &buf, &size);
+        if (err) {
+                fprintf(stderr, "%s: %s\n", fname, e2msg(err));
+                return;
+        }
+
+        for (level = ZLIB_LEVEL_STORE; level <= ZLIB_LEVEL_BEST; level++) {
+                for (n = 0; n < iters; n++) {
+                        err = compress_once(buf, size, level, &out_size,
+                                            &csecs, &dsecs);
+                        if (err)
+                                break;
+                        if (!n || csecs < best_c)
+                                best_c = csecs;
+                        if (!n || dsecs < best_d)
+                                best_d = dsecs;
+                }
+                if (err) {
+                        fprintf(stderr, "%s: level %d: %s\n", fname, level,
+                                e2msg(err));
+                        break;
+                }
+
+                printf("%-24s %5d %10zu %10zu %7.2f%% %10.1f %10.1f\n",
+                       fname, level, size, out_size,
+                       size ? 100.0 * out_size / size : 100.0,
+                       size / best_c / 1e6, size / best_d / 1e6);
+        }
+
+        free(buf);
+}
+
+/* a png in memory, for decode_mem */
+struct mem_file {
+        const char *name;
+        uint8_t *buf;
+        size_t size;
+};
+
+/* parse and decode a png from memory. returns its size */
+static long decode_mem(void *priv)
+{
+        struct mem_file *f = priv;
+        struct png_pixels pixels;
+        struct png_image img;
+        int err;
+
+        err = parse_png(f->buf, f->size, &img, 0);
+        if (err)
+                return err;
+
+        err = png_decode(&img, &pixels);
+        if (!err)
+                png_pixels_free(&pixels);
+        free_chunks(&img);
+        return err ? err : (long)f->size;
+}
+
+/* run fn warmup times, then reps more, timing each of those */
+static long time_runs(long (*fn)(void *priv), void *priv, unsigned warmup,
+                      unsigned reps, double *secs)
+{
+        double start;
+        unsigned n;
+        long ret = 0;
+
+        for (n = 0; n < warmup; n++) {
+                ret = fn(priv);
+                if (ret < 0)
+                        return ret;
+        }
+        for (n = 0; n < reps; n++) {
+                start = now();
+                ret = fn(priv);
+                secs[n] = now() - start;
+                if (ret < 0)
+                        return ret;
+        }
+        return ret;
+}
+
+static int cmp_double(const void *lhs, const void *rhs)
+{
+        double a = *(const double *)lhs, b = *(const double *)rhs;
+
+        return (a > b) - (a < b);
+}
+
+/* the pth percentile of n sorted times, by nearest rank */
+static double percentile(const double *secs, unsigned n, unsigned p)
+{
+        unsigned rank = (p * n + 99) / 100;
+
+        return secs[rank ? rank - 1 : 0];
+}
+
+static void json_string(const char *s)
+{
+        putchar('"');
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\')
+                        printf("\\%c", *s);
+                else if ((unsigned char)*s < 0x20)
+                        printf("\\u%04x", *s);
+                else
+                        putchar(*s);
+        }
+        putchar('"');
+}
+
+/* have we printed a json result yet, so the next needs a comma */
+static bool json_started;
+
+/*
+ * print the results of reps timed runs over bytes bytes each. throughput
+ * is worked out from the median
+ */
+static void report(const char *kind, const char *name, long bytes,
+                   double *secs, unsigned reps, bool json)
+{
+        static const unsigned pcts[] = {50, 90, 99};
+        double p50;
+        unsigned i;
+
+        qsort(secs, reps, sizeof *secs, cmp_double);
+        p50 = percentile(secs, reps, 50);
+
+        if (!json) {
+                printf("%-6s %-24s %10ld %9.3f", kind, name, bytes,
+                       secs[0] * 1e3);
+                for (i = 0; i < sizeof pcts / sizeof *pcts; i++)
+                        printf(" %9.3f", percentile(secs, reps, pcts[i]) * 1e3);
+                printf(" %9.3f %10.1f\n", secs[reps - 1] * 1e3,
+                       bytes / p50 / 1e6);
+                return;
+        }
+
+        printf("%s\n  {\"kind\": \"%s\", \"name\": ",
+               json_started ? "," : "[", kind);
+        json_string(name);
+        printf(", \"bytes\": %ld, \"reps\": %u, \"min_ms\": %.6f", bytes,
+               reps, secs[0] * 1e3);
+        for (i = 0; i < sizeof pcts / sizeof *pcts; i++)
+                printf(", \"p%u_ms\": %.6f", pcts[i],
+                       percentile(secs, reps, pcts[i]) * 1e3);
+        printf(", \"max_ms\": %.6f, \"mb_per_s\": %.3f}",
+               secs[reps - 1] * 1e3, bytes / p50 / 1e6);
+        json_started = true;
+}
+
+static int micro_bench(const struct micro *m, unsigned warmup, unsigned reps,
+                       double *secs, bool json)
+{
+        void *state;
+        long ret;
+        int err;
+
+        err = m->setup(&state);
+        if (err)
+                return err;
+        ret = time_runs(m->run, state, warmup, reps, secs);
+        m->teardown(state);
+        if (ret < 0)
+                return ret;
+
+        report("micro", m->name, ret, secs, reps, json);
+        return 0;
+}
+
+static int decode_bench(struct mem_file *f, unsigned warmup, unsigned reps,
+                        double *secs, bool json)
+{
+        long ret;
+
+        ret = time_runs(decode_mem, f, warmup, reps, secs);
+        if (ret < 0)
+                return ret;
+
+        report("decode", f->name, ret, secs, reps, json);
+        return 0;
+}
+
+/* -m and -d. files are what -d decodes; NULL for the corpus */
+static int timed_benches(bool micro, bool decode, char **files,
+                         unsigned nfiles, unsigned warmup, unsigned reps,
+                         bool json)
+{
+        const struct micro *m;
+        struct mem_file f;
+        double *secs;
+        size_t i, n;
+        int err = 0;
+
+        secs = malloc(reps * sizeof *secs);
+        if (!secs)
+                return -P_ENOMEM;
+
+        if (!json)
+                printf("%-6s %-24s %10s %9s %9s %9s %9s %9s %10s\n", "kind",
+                       "name", "bytes", "min ms", "p50 ms", "p90 ms",
+                       "p99 ms", "max ms", "MB/s");
+
+        n = micro ? zlib_nmicros + chunk_nmicros : 0;
+        for (i = 0; i < n; i++) {
+                m = i < zlib_nmicros ? &zlib_micros[i]
+                        : &chunk_micros[i - zlib_nmicros];
+                err = micro_bench(m, warmup, reps, secs, json);
+                if (err) {
+                        fprintf(stderr, "%s: %s\n", m->name, e2msg(err));
+                        goto out;
+                }
+        }
+
+        n = !decode ? 0 : nfiles ? nfiles : corpus_nspecs;
+        for (i = 0; i < n; i++) {
+                if (nfiles) {
+                        f.name = files[i];
+                        err = input_read_file(f.name, &f.buf, &f.size);
+                } else {
+                        f.name = corpus_specs[i].name;
+                        err = corpus_png(&corpus_specs[i], &f.buf, &f.size);
+                }
+                if (!err) {
+                        err = decode_bench(&f, warmup, reps, secs, json);
+                        free(f.buf);
+                }
+                if (err) {
+                        fprintf(stderr, "%s: %s\n", f.name, e2msg(err));
+                        goto out;
+                }
+        }
+
+out:
+        if (json && json_started)
+                printf("\n]\n");
+        free(secs);
+        return err;
+}
+
+static void usage(void)
+{
+        fprintf(stderr, "usage: bench [-z] [-n iterations] [-r ring size] "
+                "file...\n"
+                "       bench -m|-d [-j] [-w warmup] [-n reps] [file...]\n"
+                "       bench -g dir\n");
+        exit(1);
+}
+
+int main(int argc, char **argv)
+{
+        struct result res, best;
+        enum input_backend backend;
+        size_t ring_size = 0;
+        unsigned iters = 0, warmup = 3;
+        unsigned i, n;
+        bool cold, compress = false, micro = false, decode = false;
+        bool json = false;
+        const char *corpus_dir = NULL;
+        off_t size;
+        int opt, err, fd;
+
+        while ((opt = getopt(argc, argv, "dg:jmn:r:w:z")) != -1) {
+                switch (opt) {
+                case 'd':
+                        decode = true;
+                        break;
+                case 'g':
+                        corpus_dir = optarg;
+                        break;
+                case 'j':
+                        json = true;
+                        break;
+                case 'm':
+                        micro = true;
+                        break;
+                case 'n':
+                        iters = atoi(optarg);
+                        if (!iters)
+                                usage();
+                        break;
+                case 'r':
+                        ring_size = strtoul(optarg, NULL, 0);
+                        if (!ring_size)
+                                usage();
+                        break;
+                case 'w':
+                        warmup = atoi(optarg);
+                        break;
+                case 'z':
+                        compress = true;
+                        break;
+                default:
+                        usage();
+                }
+        }
+
+        if (corpus_dir) {
+                err = corpus_write(corpus_dir);
+                if (err) {
+                        fprintf(stderr, "%s: %s\n", corpus_dir, e2msg(err));
+                        return 1;
+                }
+                return 0;
+        }
+
+        if (micro || decode) {
+                err = timed_benches(micro, decode, argv + optind,
+                                    argc - optind, warmup,
+                                    iters ? iters : 30, json);
+                return err ? 1 : 0;
+        }
+
+        if (!iters)
+                iters = 5;
+        if (optind >= argc)
+                usage();
+
+        if (compress) {
+                printf("%-24s %5s %10s %10s %8s %10s %10s\n", "file",
+                       "level", "bytes", "deflated", "ratio", "comp MB/s",
+                       "inflate MB/s");
+                for (; optind < argc; optind++)
+                        compress_bench(argv[optind], iters);
+                return 0;
+        }
+
+        printf("%-24s %-6s %-5s %10s %10s %8s %8s %10s\n", "file", "input",
+               "cache", "ms", "MB/s", "majflt", "minflt", "maxrss KB");
+
+        for (; optind < argc; optind++) {
+                fd = open(argv[optind], O_RDONLY);
+                if (fd == -1) {
+                        perror(argv[optind]);
+                        continue;
+                }
+                size = lseek(fd, 0, SEEK_END);
+                close(fd);
+
+                for (i = 0; i < 4; i++) {
+                        backend = i / 2 ? INPUT_PREAD : INPUT_MMAP;
+                        cold = !(i % 2);
+
+                        /* warm runs go after one to fill the cache */
+                        if (!cold)
+                                run(argv[optind], backend, ring_size, &res);
+
+                        /* report the best run of each */
+                        for (err = 0, n = 0; !err && n < iters; n++) {
+                                if (cold)
+                                        drop_cache(argv[optind]);
+                                err = run(argv[optind], backend, ring_size,
+                                          &res);
+                                if (!n || res.secs < best.secs)
+                                        best = res;
+                        }
+                        if (err) {
+                                fprintf(stderr, "%s: %s\n", argv[optind],
+                                        e2msg(err));
+                                break;
+                        }
+
+                        printf("%-24s %-6s %-5s %10.2f %10.1f %8ld %8ld "
+                               "%10ld\n", argv[optind],
+                               backend_names[backend], cold ? "cold" : "warm",
+                               best.secs * 1e3, size / best.secs / 1e6,
+                               best.majflt, best.minflt, best.maxrss);
+                }
+        }
+
+        return 0;
+}
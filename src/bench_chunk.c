@@ -0,0 +1,95 @@
+/*
+ * microbenchmarks of chunk.c. like bench_zlib.c, this includes chunk.c
+ * whole to get at its static functions, and stands in for chunk.o in
+ * bench.
+ */
+
+#include "chunk.c"
+
+#include "corpus.h"
+#include "micro.h"
+
+static volatile uint32_t sink;
+
+static int crc_setup(void **state)
+{
+        uint8_t *buf;
+        size_t i;
+
+        buf = malloc(MICRO_SIZE);
+        if (!buf)
+                return -P_ENOMEM;
+        for (i = 0; i < MICRO_SIZE; i++)
+                buf[i] = i * 2654435761u >> 24;
+        *state = buf;
+        return 0;
+}
+
+static long crc_run(void *state)
+{
+        sink = do_crc(state, MICRO_SIZE);
+        return MICRO_SIZE;
+}
+
+static void crc_teardown(void *state)
+{
+        free(state);
+}
+
+/* a file with a few hundred small chunks, so parsing is mostly overhead */
+struct parse_state {
+        uint8_t *buf;
+        size_t size;
+};
+
+static int parse_setup(void **state)
+{
+        struct parse_state *ps;
+        int err;
+
+        ps = malloc(sizeof *ps);
+        if (!ps)
+                return -P_ENOMEM;
+        err = corpus_png(corpus_find("rgb8-text256"), &ps->buf, &ps->size);
+        if (err) {
+                free(ps);
+                return err;
+        }
+        *state = ps;
+        return 0;
+}
+
+static long parse_run(void *state)
+{
+        struct parse_state *ps = state;
+        struct png_image img;
+        size_t off;
+        ssize_t ret;
+
+        img.first = NULL;
+        for (off = 8; off < ps->size; off += ret) {
+                ret = parse_next_chunk(ps->buf + off, ps->size - off, &img,
+                                       0);
+                if (ret < 0) {
+                        free_chunks(&img);
+                        return ret;
+                }
+        }
+        free_chunks(&img);
+        return ps->size;
+}
+
+static void parse_teardown(void *state)
+{
+        struct parse_state *ps = state;
+
+        free(ps->buf);
+        free(ps);
+}
+
+const struct micro chunk_micros[] = {
+        {"do_crc", crc_setup, crc_run, crc_teardown},
+        {"parse_next_chunk", parse_setup, parse_run, parse_teardown},
+};
+
+const size_t chunk_nmicros = sizeof chunk_micros / sizeof *chunk_micros;
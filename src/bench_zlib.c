@@ -0,0 +1,250 @@
+/*
+ * microbenchmarks of zlib.c's inner loops. zlib.c is included whole so its
+ * static functions can be called from here; this file stands in for
+ * zlib.o in bench.
+ */
+
+#include "zlib.c"
+
+#include "corpus.h"
+#include "micro.h"
+
+/* the same bytes every time, from a fixed xorshift */
+static uint8_t *noise_buf(size_t size)
+{
+        uint32_t x = 2463534242u;
+        uint8_t *buf;
+        size_t i;
+
+        buf = malloc(size);
+        if (!buf)
+                return NULL;
+        for (i = 0; i < size; i++) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                buf[i] = x;
+        }
+        return buf;
+}
+
+/* somewhere for results to go, so the loops can't be optimized away */
+static volatile uint32_t sink;
+
+static int buf_setup(void **state)
+{
+        *state = noise_buf(MICRO_SIZE);
+        return *state ? 0 : -P_ENOMEM;
+}
+
+static void buf_teardown(void *state)
+{
+        free(state);
+}
+
+/* reads of 1 to 15 bits in turn, about what a deflate stream does */
+static long read_bits_run(void *state)
+{
+        struct zlib_stream stream;
+        uint32_t sum = 0;
+        unsigned nbits = 1;
+
+        memset(&stream, 0, sizeof stream);
+        stream.z_src = state;
+        stream.z_src_end = MICRO_SIZE;
+
+        while (stream.z_src_idx + 4 < MICRO_SIZE) {
+                sum += read_bits(&stream, nbits);
+                nbits = nbits % 15 + 1;
+        }
+        sink = sum;
+        return MICRO_SIZE;
+}
+
+struct huff_state {
+        struct zlib_stream stream;
+        uint8_t *z;
+        size_t z_size;
+};
+
+/*
+ * a static block of nothing but literals: noise with no byte the same as
+ * the one before it, so corpus_deflate_static never finds a run
+ */
+static int huff_read_setup(void **state)
+{
+        struct huff_state *hs;
+        uint8_t *buf;
+        size_t i;
+        int err;
+
+        buf = noise_buf(MICRO_SIZE);
+        if (!buf)
+                return -P_ENOMEM;
+        for (i = 1; i < MICRO_SIZE; i++)
+                if (buf[i] == buf[i - 1])
+                        buf[i]++;
+
+        hs = calloc(1, sizeof *hs);
+        if (!hs) {
+                free(buf);
+                return -P_ENOMEM;
+        }
+        err = corpus_deflate_static(buf, MICRO_SIZE, &hs->z, &hs->z_size);
+        free(buf);
+        if (!err)
+                err = make_static_trees(&hs->stream);
+        if (err) {
+                free(hs->z);
+                free(hs);
+                return err;
+        }
+
+        hs->stream.z_src = hs->z;
+        hs->stream.z_src_end = hs->z_size;
+        *state = hs;
+        return 0;
+}
+
+static long huff_read_run(void *state)
+{
+        struct huff_state *hs = state;
+        struct zlib_stream *stream = &hs->stream;
+        uint16_t sym;
+        long n = 0;
+        int err;
+
+        /* skip the zlib header and the block header */
+        stream->z_src_idx = 2;
+        stream->z_src_bidx = 0;
+        read_bits(stream, BLK_BFINAL_BTS + BLK_BTYPE_BTS);
+
+        while (!(err = huff_read(stream, stream->z_lltree, &sym))) {
+                if (sym == 256)
+                        return n;
+                if (sym > 256)
+                        return -P_EINVAL;
+                n++;
+        }
+        return err;
+}
+
+static void huff_read_teardown(void *state)
+{
+        struct huff_state *hs = state;
+
+        free_trees(&hs->stream);
+        free(hs->z);
+        free(hs);
+}
+
+/*
+ * inflating data like filtered photographs: noisy small differences, about
+ * half of which come out as literals with codes short enough for the
+ * lookup table to pair them up. the noise is cut down to 0-31, with 16-31
+ * half as likely as the rest
+ */
+static int literals_setup(void **state)
+{
+        struct huff_state *hs;
+        struct zlib_stream *stream;
+        uint8_t *buf;
+        size_t i;
+        int err;
+
+        buf = noise_buf(MICRO_SIZE);
+        if (!buf)
+                return -P_ENOMEM;
+        for (i = 0; i < MICRO_SIZE; i++)
+                buf[i] = (buf[i] & 31) >> (buf[i] >> 7);
+
+        hs = calloc(1, sizeof *hs);
+        if (!hs) {
+                free(buf);
+                return -P_ENOMEM;
+        }
+        stream = &hs->stream;
+        stream->z_src = buf;
+        stream->z_src_end = MICRO_SIZE;
+        err = zlib_compress(stream, ZLIB_LEVEL_DEFAULT);
+        free(buf);
+        if (err) {
+                free(stream->z_dst);
+                free(hs);
+                return err;
+        }
+
+        hs->z = stream->z_dst;
+        hs->z_size = stream->z_dst_idx;
+        memset(stream, 0, sizeof *stream);
+        stream->z_dst = malloc(MICRO_SIZE);
+        if (!stream->z_dst) {
+                free(hs->z);
+                free(hs);
+                return -P_ENOMEM;
+        }
+
+        *state = hs;
+        return 0;
+}
+
+static long literals_run(void *state)
+{
+        struct huff_state *hs = state;
+        struct zlib_stream *stream = &hs->stream;
+        int err;
+
+        stream->z_src = hs->z;
+        stream->z_src_end = hs->z_size;
+        stream->z_src_idx = 0;
+        stream->z_src_bidx = 0;
+        stream->z_dst_idx = 0;
+        stream->z_dst_end = MICRO_SIZE;
+        err = zlib_decompress(stream);
+        if (err)
+                return err;
+        return stream->z_dst_idx;
+}
+
+static void literals_teardown(void *state)
+{
+        struct huff_state *hs = state;
+
+        zlib_end(&hs->stream);
+        free(hs->stream.z_dst);
+        free(hs->z);
+        free(hs);
+}
+
+/* overlapping copies, at the sort of lengths and distances matches have */
+static long zlib_memcpy_run(void *state)
+{
+        static const uint16_t dists[] =
+                {1, 2, 3, 4, 7, 8, 16, 32, 100, 258, 1000, 4096};
+        uint8_t *buf = state;
+        size_t pos, len, i = 0;
+        long n = 0;
+
+        for (pos = 4096; pos + 258 < MICRO_SIZE; pos += len, i++) {
+                len = 3 + i * 37 % 256;
+                zlib_memcpy(buf + pos, buf + pos - dists[i % 12], len);
+                n += len;
+        }
+        return n;
+}
+
+static long adler32_run(void *state)
+{
+        sink = adler32_update(1, state, MICRO_SIZE);
+        return MICRO_SIZE;
+}
+
+const struct micro zlib_micros[] = {
+        {"read_bits", buf_setup, read_bits_run, buf_teardown},
+        {"huff_read", huff_read_setup, huff_read_run, huff_read_teardown},
+        {"literals", literals_setup, literals_run, literals_teardown},
+        {"zlib_memcpy", buf_setup, zlib_memcpy_run, buf_teardown},
+        {"adler32", buf_setup, adler32_run, buf_teardown},
+};
+
+const size_t zlib_nmicros = sizeof zlib_micros / sizeof *zlib_micros;
@@ -0,0 +1,421 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "decode.h"
+#include "error.h"
+#include "util.h"
+
+/* a decoded image, in the cache or not */
+struct cache_entry {
+        struct png_pixels pixels;
+
+        /* the key: the file's hash and size, and what it was decoded to */
+        uint64_t hash;
+        size_t size;
+        uint32_t w;
+        uint32_t h;
+
+        /* what it counts against the budget */
+        size_t bytes;
+
+        /* one for the cache while it's in there, and one per user */
+        atomic_uint refs;
+
+        /* next in its hash bucket */
+        struct cache_entry *next;
+
+        /* neighbours on the lru list, most recently used first */
+        struct cache_entry *newer;
+        struct cache_entry *older;
+};
+
+struct cache_shard {
+        pthread_mutex_t lock;
+
+        /* hash table of entries, nbuckets (a power of two) long */
+        struct cache_entry **buckets;
+        size_t nbuckets;
+
+        struct cache_entry *newest;
+        struct cache_entry *oldest;
+
+        size_t images;
+        size_t bytes;
+        size_t budget;
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+};
+
+struct png_cache {
+        struct cache_shard shards[CACHE_SHARDS];
+};
+
+/* initial buckets per shard; the table doubles when it fills up */
+#define CACHE_BUCKETS 16
+
+/*
+ * the xxhash64 algorithm: four lanes of multiply-rotate over 32 bytes at a
+ * time, then the tail, then an avalanche. words are read in host order,
+ * which is fine for a key that never leaves the process.
+ */
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t rotl64(uint64_t x, unsigned r)
+{
+        return x << r | x >> (64 - r);
+}
+
+static inline uint64_t read64(const uint8_t *buf)
+{
+        uint64_t v;
+
+        memcpy(&v, buf, sizeof v);
+        return v;
+}
+
+static inline uint32_t read32(const uint8_t *buf)
+{
+        uint32_t v;
+
+        memcpy(&v, buf, sizeof v);
+        return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in)
+{
+        return rotl64(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v)
+{
+        return (acc ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static uint64_t hash64(const uint8_t *buf, size_t size)
+{
+        const uint8_t *end = buf + size;
+        uint64_t v1, v2, v3, v4, h;
+
+        if (size >= 32) {
+                v1 = XXH_P1 + XXH_P2;
+                v2 = XXH_P2;
+                v3 = 0;
+                v4 = -XXH_P1;
+                do {
+                        v1 = xxh_round(v1, read64(buf));
+                        v2 = xxh_round(v2, read64(buf + 8));
+                        v3 = xxh_round(v3, read64(buf + 16));
+                        v4 = xxh_round(v4, read64(buf + 24));
+                        buf += 32;
+                } while (end - buf >= 32);
+
+                h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12)
+                        + rotl64(v4, 18);
+                h = xxh_merge(h, v1);
+                h = xxh_merge(h, v2);
+                h = xxh_merge(h, v3);
+                h = xxh_merge(h, v4);
+        } else {
+                h = XXH_P5;
+        }
+
+        h += size;
+        for (; end - buf >= 8; buf += 8)
+                h = rotl64(h ^ xxh_round(0, read64(buf)), 27) * XXH_P1
+                        + XXH_P4;
+        if (end - buf >= 4) {
+                h = rotl64(h ^ read32(buf) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+                buf += 4;
+        }
+        for (; buf < end; buf++)
+                h = rotl64(h ^ *buf * XXH_P5, 11) * XXH_P1;
+
+        h ^= h >> 33;
+        h *= XXH_P2;
+        h ^= h >> 29;
+        h *= XXH_P3;
+        h ^= h >> 32;
+        return h;
+}
+
+static void entry_put(struct cache_entry *e)
+{
+        if (atomic_fetch_sub(&e->refs, 1) == 1) {
+                png_pixels_free(&e->pixels);
+                free(e);
+        }
+}
+
+/* the low bits pick the shard, so buckets use the ones above them */
+static struct cache_entry **shard_bucket(struct cache_shard *shard,
+                                         uint64_t hash)
+{
+        return &shard->buckets[(hash / CACHE_SHARDS)
+                               & (shard->nbuckets - 1)];
+}
+
+static struct cache_entry *shard_find(struct cache_shard *shard,
+                                      uint64_t hash, size_t size,
+                                      uint32_t w, uint32_t h)
+{
+        struct cache_entry *e;
+
+        for (e = *shard_bucket(shard, hash); e; e = e->next)
+                if (e->hash == hash && e->size == size
+                    && e->w == w && e->h == h)
+                        return e;
+        return NULL;
+}
+
+static void lru_unlink(struct cache_shard *shard, struct cache_entry *e)
+{
+        if (e->newer)
+                e->newer->older = e->older;
+        else
+                shard->newest = e->older;
+        if (e->older)
+                e->older->newer = e->newer;
+        else
+                shard->oldest = e->newer;
+}
+
+static void lru_push(struct cache_shard *shard, struct cache_entry *e)
+{
+        e->newer = NULL;
+        e->older = shard->newest;
+        if (shard->newest)
+                shard->newest->newer = e;
+        else
+                shard->oldest = e;
+        shard->newest = e;
+}
+
+/* drop the cache's reference to the least recently used entry */
+static void shard_evict(struct cache_shard *shard)
+{
+        struct cache_entry *e = shard->oldest, **p;
+
+        lru_unlink(shard, e);
+        for (p = shard_bucket(shard, e->hash); *p != e; p = &(*p)->next)
+                ;
+        *p = e->next;
+
+        shard->images--;
+        shard->bytes -= e->bytes;
+        shard->evictions++;
+        entry_put(e);
+}
+
+/* double the hash table. if we can't, chains just get longer */
+static void shard_grow(struct cache_shard *shard)
+{
+        struct cache_entry **old = shard->buckets, *e, *next, **b;
+        size_t i, n = shard->nbuckets;
+
+        shard->buckets = calloc(2 * n, sizeof *shard->buckets);
+        if (!shard->buckets) {
+                shard->buckets = old;
+                return;
+        }
+        shard->nbuckets = 2 * n;
+
+        for (i = 0; i < n; i++) {
+                for (e = old[i]; e; e = next) {
+                        next = e->next;
+                        b = shard_bucket(shard, e->hash);
+                        e->next = *b;
+                        *b = e;
+                }
+        }
+        free(old);
+}
+
+/* add a new entry, making room for it first */
+static void shard_insert(struct cache_shard *shard, struct cache_entry *e)
+{
+        struct cache_entry **b;
+
+        while (shard->oldest && shard->bytes + e->bytes > shard->budget)
+                shard_evict(shard);
+
+        if (shard->images >= shard->nbuckets)
+                shard_grow(shard);
+
+        b = shard_bucket(shard, e->hash);
+        e->next = *b;
+        *b = e;
+        lru_push(shard, e);
+        atomic_fetch_add(&e->refs, 1);
+
+        shard->images++;
+        shard->bytes += e->bytes;
+}
+
+struct png_cache *png_cache_new(size_t budget)
+{
+        struct png_cache *cache;
+        struct cache_shard *shard;
+        unsigned i;
+
+        cache = calloc(1, sizeof *cache);
+        if (!cache)
+                return NULL;
+
+        for (i = 0; i < CACHE_SHARDS; i++) {
+                shard = &cache->shards[i];
+                shard->budget = budget / CACHE_SHARDS;
+                shard->nbuckets = CACHE_BUCKETS;
+                shard->buckets = calloc(CACHE_BUCKETS,
+                                        sizeof *shard->buckets);
+                if (!shard->buckets)
+                        goto fail;
+                pthread_mutex_init(&shard->lock, NULL);
+        }
+
+        return cache;
+fail:
+        while (i--) {
+                pthread_mutex_destroy(&cache->shards[i].lock);
+                free(cache->shards[i].buckets);
+        }
+        free(cache);
+        return NULL;
+}
+
+void png_cache_free(struct png_cache *cache)
+{
+        struct cache_shard *shard;
+        unsigned i;
+
+        if (!cache)
+                return;
+
+        for (i = 0; i < CACHE_SHARDS; i++) {
+                shard = &cache->shards[i];
+                while (shard->oldest)
+                        shard_evict(shard);
+                free(shard->buckets);
+                pthread_mutex_destroy(&shard->lock);
+        }
+        free(cache);
+}
+
+/* parse and decode a whole file in memory */
+static int decode_file(const uint8_t *buf, size_t size, uint32_t w,
+                       uint32_t h, struct png_pixels *out)
+{
+        struct png_image img;
+        int error;
+
+        error = parse_png(buf, size, &img, 0);
+        if (error)
+                return error;
+
+        if (w || h)
+                error = png_decode_scaled(&img, w, h, out);
+        else
+                error = png_decode(&img, out);
+
+        free_chunks(&img);
+        return error;
+}
+
+int png_cache_decode(struct png_cache *cache, const uint8_t *buf,
+                     size_t size, uint32_t w, uint32_t h,
+                     const struct png_pixels **out)
+{
+        struct cache_shard *shard;
+        struct cache_entry *e, *old;
+        uint64_t hash;
+        int error;
+
+        hash = hash64(buf, size);
+        shard = &cache->shards[hash % CACHE_SHARDS];
+
+        pthread_mutex_lock(&shard->lock);
+        e = shard_find(shard, hash, size, w, h);
+        if (e) {
+                shard->hits++;
+                lru_unlink(shard, e);
+                lru_push(shard, e);
+                atomic_fetch_add(&e->refs, 1);
+                pthread_mutex_unlock(&shard->lock);
+                *out = &e->pixels;
+                return 0;
+        }
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+
+        /* decode without the lock, so hits on the shard don't wait on us */
+        e = calloc(1, sizeof *e);
+        if (!e)
+                return -P_ENOMEM;
+        error = decode_file(buf, size, w, h, &e->pixels);
+        if (error) {
+                free(e);
+                return error;
+        }
+
+        e->hash = hash;
+        e->size = size;
+        e->w = w;
+        e->h = h;
+        e->bytes = sizeof *e + e->pixels.stride * e->pixels.height;
+        atomic_init(&e->refs, 1);
+
+        pthread_mutex_lock(&shard->lock);
+
+        /* someone else may have decoded it while we were */
+        old = shard_find(shard, hash, size, w, h);
+        if (old) {
+                atomic_fetch_add(&old->refs, 1);
+                pthread_mutex_unlock(&shard->lock);
+                entry_put(e);
+                *out = &old->pixels;
+                return 0;
+        }
+
+        if (e->bytes <= shard->budget)
+                shard_insert(shard, e);
+        pthread_mutex_unlock(&shard->lock);
+
+        *out = &e->pixels;
+        return 0;
+}
+
+void png_cache_put(const struct png_pixels *pixels)
+{
+        entry_put(container_of(pixels, struct cache_entry, pixels));
+}
+
+void png_cache_stats(struct png_cache *cache, struct png_cache_stats *stats)
+{
+        struct cache_shard *shard;
+        unsigned i;
+
+        memset(stats, 0, sizeof *stats);
+        for (i = 0; i < CACHE_SHARDS; i++) {
+                shard = &cache->shards[i];
+                pthread_mutex_lock(&shard->lock);
+                stats->hits += shard->hits;
+                stats->misses += shard->misses;
+                stats->evictions += shard->evictions;
+                stats->images += shard->images;
+                stats->bytes += shard->bytes;
+                pthread_mutex_unlock(&shard->lock);
+        }
+}
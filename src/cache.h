@@ -0,0 +1,61 @@
+#ifndef PNG_CACHE_H
+#define PNG_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decode.h"
+
+/*
+ * a cache of decoded images, for programs that decode the same few files
+ * over and over. images are keyed by a 64 bit hash of the whole file (so
+ * the same bytes under another name still hit) and the size they were
+ * decoded at, and the least recently used ones are thrown out to stay
+ * under a byte budget. the cache is split into CACHE_SHARDS shards by
+ * key, each with its own lock, lru list and share of the budget, so
+ * threads looking up different images rarely wait on each other.
+ *
+ * what comes back is a reference to pixels that never change. they stay
+ * valid until handed back with png_cache_put, even if they're evicted in
+ * the meantime, so a hit doesn't copy anything.
+ */
+#define CACHE_SHARDS 16
+
+struct png_cache;
+
+struct png_cache_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+
+        /* what the cache is holding on to right now */
+        size_t images;
+        size_t bytes;
+};
+
+/* make a cache that holds at most budget bytes of pixels */
+struct png_cache *png_cache_new(size_t budget);
+
+/*
+ * drop everything in the cache and free it. images that are still
+ * referenced stick around until they're put.
+ */
+void png_cache_free(struct png_cache *cache);
+
+/*
+ * get the png file at buf (size bytes, from the signature on) decoded to
+ * w x h, or at full size if both are 0 (see png_decode_scaled), from the
+ * cache, or decode it and add it on a miss. *out is set to a reference to
+ * the pixels, which must not be modified. an image too big for its shard
+ * of the budget is decoded but not kept.
+ */
+int png_cache_decode(struct png_cache *cache, const uint8_t *buf,
+                     size_t size, uint32_t w, uint32_t h,
+                     const struct png_pixels **out);
+
+/* hand back a reference from png_cache_decode */
+void png_cache_put(const struct png_pixels *pixels);
+
+void png_cache_stats(struct png_cache *cache, struct png_cache_stats *stats);
+
+#endif /* PNG_CACHE_H */
@@ -4,10 +4,15 @@
 #include <string.h>
 
 #include "chunk.h"
+#include "crc.h"
 #include "error.h"
 #include "int.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
-#include "zlib.h"
+
+const uint8_t png_magic[PNG_MAGIC_SIZE] = {137, 80, 78, 71, 13, 10, 26, 10};
 
 extern struct chunk_template header_chunk_tmpl;
 extern struct chunk_template palette_chunk_tmpl;
@@ -18,6 +23,9 @@ extern struct chunk_template background_chunk_tmpl;
 extern struct chunk_template dimension_chunk_tmpl;
 extern struct chunk_template time_chunk_tmpl;
 extern struct chunk_template text_chunk_tmpl;
+extern struct chunk_template anim_chunk_tmpl;
+extern struct chunk_template frame_chunk_tmpl;
+extern struct chunk_template frame_data_chunk_tmpl;
 extern struct chunk_template unknown_chunk_tmpl;
 
 static struct chunk_template* c_tmpl_mapping[] = {
@@ -30,6 +38,9 @@ static struct chunk_template* c_tmpl_mapping[] = {
         [CHUNK_PHYS] = &dimension_chunk_tmpl,
         [CHUNK_TIME] = &time_chunk_tmpl,
         [CHUNK_TEXT] = &text_chunk_tmpl,
+        [CHUNK_ACTL] = &anim_chunk_tmpl,
+        [CHUNK_FCTL] = &frame_chunk_tmpl,
+        [CHUNK_FDAT] = &frame_data_chunk_tmpl,
         [CHUNK_UNKNOWN] = &unknown_chunk_tmpl
 };
 
@@ -94,19 +105,38 @@ static struct chunk *alloc_chunk(int32_t type, size_t length,
         return chunk;
 }
 
-/* placeholder to crc */
-static uint32_t do_crc(const uint8_t *buf, size_t size)
+struct chunk *new_chunk(struct png_image *img, enum chunk_enum type,
+                        size_t length)
 {
-        (void)buf;
-        (void)size;
+        return alloc_chunk(c_tmpl_mapping[type]->ct_type, length, img);
+}
 
-        return 0;
+void free_chunks(struct png_image *img)
+{
+        struct chunk *chunk, *next;
+
+        for (chunk = img->first; chunk; chunk = next) {
+                next = chunk->next;
+                if (chunk->c_tmpl->ct_ops.free)
+                        chunk->c_tmpl->ct_ops.free(chunk);
+                else
+                        free(chunk);
+        }
+        img->first = NULL;
+}
+
+static uint32_t do_crc(const uint8_t *buf, size_t size)
+{
+        return crc32(buf, size);
 }
 
 /* read the next chunk out of a buffer. return nr of bytes read */
-ssize_t parse_next_chunk(const uint8_t *buf, size_t size, struct png_image *img)
+static ssize_t parse_chunk(const uint8_t *buf, size_t size,
+                           struct png_image *img, unsigned flags,
+                           struct chunk_stats *stats)
 {
-        uint32_t length, crc;
+        uint32_t length, crc, want;
+        uint64_t t0, tr;
         int32_t type;
         size_t count;
         ssize_t ret;
@@ -146,7 +176,7 @@ ssize_t parse_next_chunk(const uint8_t *buf, size_t size, struct png_image *img)
                 if (ret < 0)
                         return ret;
         } else {
-                printf("skipped read for %s chunk with type %d %d %d %d\n",
+                pr_debug("skipped read for %s chunk with type %d %d %d %d\n",
                        chunk->c_tmpl->ct_name,
                        (type >> 24) & 0xff,
                        (type >> 16) & 0xff,
@@ -165,98 +195,116 @@ ssize_t parse_next_chunk(const uint8_t *buf, size_t size, struct png_image *img)
          * field.
          */
         crc = __read_png_int_raw(buf + count);
-        if (crc != do_crc(buf + 4, length + 4))
-                crc = 0; /* placeholder b/c no crc: return 0; */
+        if (flags & PARSE_DEFER_CRC
+            && chunk->c_tmpl->ct_type_idx == CHUNK_IDAT) {
+                data_chunk(chunk)->crc = crc;
+                data_chunk(chunk)->crc_unchecked = true;
+        } else if (!(flags & PARSE_CRC_OK)) {
+                t0 = stats ? stats_clock() : 0;
+                tr = trace_begin();
+                want = do_crc(buf + 4, length + 4);
+                trace_end("crc", tr);
+                if (stats)
+                        stats->cs_crc_ns += stats_clock() - t0;
+                if (crc != want)
+                        return -P_EBADCSUM;
+        }
         count += 4;
 
         return count;
 }
 
+ssize_t parse_next_chunk(const uint8_t *buf, size_t size,
+                         struct png_image *img, unsigned flags)
+{
+        uint64_t tr;
+        ssize_t ret;
 
-/* definitions for header chunk. see section 11.2.2 */
-
-/* bit values for various header fields */
-#define __COLOR_GREYSCALE  0    
-#define __COLOR_INDEXED    1
-#define __COLOR_TRUE       2
-#define __COLOR_ALPHA      4
-#define COLOR_GREYSCALE    __COLOR_GREYSCALE
-#define COLOR_TRUE         __COLOR_TRUE
-#define COLOR_INDEXED      (__COLOR_INDEXED | __COLOR_TRUE)
-#define COLOR_GREY_ALPHA   (__COLOR_GREYSCALE | __COLOR_ALPHA)
-#define COLOR_TRUE_ALPHA   (__COLOR_TRUE | __COLOR_ALPHA)
-
-#define ZTYPE_DEFLATE      0
-#define FILTER_ADAPTIVE    0
-#define INTERLACE_NONE     0
-#define INTERLACE_ADAM7    1
-
-#define HEADER_DISK_SIZE   13
-
-/* each image has exactly one header chunk. basic metadata about the image */
-struct header_chunk {
-        /* base chunk */
-        struct chunk chunk;
-
-        /* width of the image in pixels */
-        uint32_t width;
-
-        /* height of the image in pixels */
-        uint32_t height;
-
-        /* pixel depth i.e. bits per pixel */
-        char depth;
-
-        /* type of color in the image. one of COLOR_* */
-        char color;
+        tr = trace_begin();
+        ret = parse_chunk(buf, size, img, flags, NULL);
+        trace_end("parse chunk", tr);
+        return ret;
+}
 
-        /* compression type. must be ZTYPE_DEFLATE */
-        char ztype;
+int parse_png(const uint8_t *buf, size_t size, struct png_image *img,
+              unsigned flags)
+{
+        size_t off;
+        ssize_t ret;
 
-        /* filtering type. must be FILTER_ADAPTIVE */
-        char filter;
+        img->first = NULL;
+        if (size < sizeof png_magic
+            || memcmp(buf, png_magic, sizeof png_magic))
+                return -P_EINVAL;
 
-        /* interlace type. one of INTERLACE_* */
-        char interlace;
-};
+        for (off = sizeof png_magic; off < size; off += ret) {
+                ret = parse_next_chunk(buf + off, size - off, img, flags);
+                if (ret < 0) {
+                        free_chunks(img);
+                        return ret;
+                }
+        }
+        return 0;
+}
 
-static inline struct header_chunk *header_chunk(const struct chunk *chunk)
+ssize_t parse_next_chunk_stats(const uint8_t *buf, size_t size,
+                               struct png_image *img, unsigned flags,
+                               struct chunk_stats *stats)
 {
-        return container_of(chunk, struct header_chunk, chunk);
+        uint64_t t0, tr;
+        ssize_t ret;
+
+        t0 = stats_clock();
+        tr = trace_begin();
+        ret = parse_chunk(buf, size, img, flags, stats);
+        trace_end("parse chunk", tr);
+        stats->cs_parse_ns += stats_clock() - t0;
+        if (ret > 0) {
+                stats->cs_chunks++;
+                stats->cs_bytes += ret;
+        }
+        return ret;
 }
 
-static ssize_t header_read(struct chunk *chunk, const uint8_t *buf, size_t size)
+ssize_t write_chunk(const struct chunk *chunk, uint8_t *buf, size_t size)
 {
-        struct header_chunk *hc;
-        uint32_t width, height;
-        char depth, color, ztype, filter, interlace;
+        ssize_t ret = 0;
 
-        if (size < HEADER_DISK_SIZE)
+        if (chunk->length > PNG_UINT_MAX)
+                return -P_ERANGE;
+        if (size < chunk->length + MIN_CHUNK_SIZE)
                 return -P_E2SMALL;
-        if (chunk->length != HEADER_DISK_SIZE)
+
+        __write_png_int_raw(buf, chunk->length);
+        __write_png_int_raw(buf + 4, chunk->c_tmpl->ct_type);
+        if (chunk->c_tmpl->ct_ops.write)
+                ret = chunk->c_tmpl->ct_ops.write(chunk, buf + 8);
+        if ((size_t)ret != chunk->length)
                 return -P_EINVAL;
 
-        hc = header_chunk(chunk);
+        /* same as parse_next_chunk: the crc is over type and data */
+        __write_png_int_raw(buf + 8 + chunk->length,
+                            do_crc(buf + 4, chunk->length + 4));
 
-        if (!read_png_uint(buf, &width))
-                return -P_ERANGE;
-        buf += 4;
+        return chunk->length + MIN_CHUNK_SIZE;
+}
 
-        if (!read_png_uint(buf, &height))
-                return -P_ERANGE;
-        buf += 4;
 
-        depth = *buf++;
+/* definitions for header chunk. see section 11.2.2 */
+
+#define HEADER_DISK_SIZE   13
+
+/*
+ * validate that that the color is a valid value, and at the same time
+ * validate that the bit depth is valid for that color. see the
+ * restrictions in Table 11.1 of the standard
+ */
+static int header_check(char depth, char color, char interlace)
+{
         /* power of 2 \in [1,16] */
         if (depth < 0 || depth > 16 || __builtin_popcount(depth) != 1)
                 return -P_EINVAL;
 
-        /*
-         * validate that that the color is a valid value, and at the same
-         * time validate that the bit depth is valid for that color.
-         * see the restrictions in Table 11.1 of the standard
-         */
-        color = *buf++;
         switch (color) {
         case COLOR_GREYSCALE:
                 /* all depths valid */
@@ -278,6 +326,36 @@ static ssize_t header_read(struct chunk *chunk, const uint8_t *buf, size_t size)
                 return -P_EINVAL;
         }
 
+        if (interlace != INTERLACE_NONE && interlace != INTERLACE_ADAM7)
+                return -P_EINVAL;
+
+        return 0;
+}
+
+static ssize_t header_read(struct chunk *chunk, const uint8_t *buf, size_t size)
+{
+        struct header_chunk *hc;
+        uint32_t width, height;
+        char depth, color, ztype, filter, interlace;
+
+        if (size < HEADER_DISK_SIZE)
+                return -P_E2SMALL;
+        if (chunk->length != HEADER_DISK_SIZE)
+                return -P_EINVAL;
+
+        hc = header_chunk(chunk);
+
+        if (!read_png_uint(buf, &width))
+                return -P_ERANGE;
+        buf += 4;
+
+        if (!read_png_uint(buf, &height))
+                return -P_ERANGE;
+        buf += 4;
+
+        depth = *buf++;
+        color = *buf++;
+
         ztype = *buf++;
         if (ztype != ZTYPE_DEFLATE)
                 return -P_EINVAL;
@@ -287,7 +365,7 @@ static ssize_t header_read(struct chunk *chunk, const uint8_t *buf, size_t size)
                 return -P_EINVAL;
 
         interlace = *buf++;
-        if (interlace != INTERLACE_NONE && interlace != INTERLACE_ADAM7)
+        if (header_check(depth, color, interlace))
                 return -P_EINVAL;
 
         hc->width = width;
@@ -328,6 +406,50 @@ static struct chunk *header_alloc()
         return hc ? &hc->chunk : NULL;
 }
 
+static ssize_t header_write(const struct chunk *chunk, uint8_t *buf)
+{
+        struct header_chunk *hc;
+
+        hc = header_chunk(chunk);
+
+        __write_png_int_raw(buf, hc->width);
+        __write_png_int_raw(buf + 4, hc->height);
+        buf[8] = hc->depth;
+        buf[9] = hc->color;
+        buf[10] = hc->ztype;
+        buf[11] = hc->filter;
+        buf[12] = hc->interlace;
+
+        return HEADER_DISK_SIZE;
+}
+
+int add_header_chunk(struct png_image *img, uint32_t width, uint32_t height,
+                     char depth, char color, char interlace)
+{
+        struct header_chunk *hc;
+        struct chunk *chunk;
+
+        if (!width || !height || width > PNG_UINT_MAX || height > PNG_UINT_MAX)
+                return -P_ERANGE;
+        if (header_check(depth, color, interlace))
+                return -P_EINVAL;
+
+        chunk = new_chunk(img, CHUNK_IHDR, HEADER_DISK_SIZE);
+        if (!chunk)
+                return -P_ENOMEM;
+
+        hc = header_chunk(chunk);
+        hc->width = width;
+        hc->height = height;
+        hc->depth = depth;
+        hc->color = color;
+        hc->ztype = ZTYPE_DEFLATE;
+        hc->filter = FILTER_ADAPTIVE;
+        hc->interlace = interlace;
+
+        return 0;
+}
+
 struct chunk_template header_chunk_tmpl = {
         .ct_type = BYTES_TO_TYPE(73, 72, 68, 82),
         .ct_name = "header",
@@ -336,40 +458,16 @@ struct chunk_template header_chunk_tmpl = {
                 .read = header_read,
                 .print_info = header_print_info,
                 .free = header_free,
-                .alloc = header_alloc
+                .alloc = header_alloc,
+                .write = header_write
         }
 };
 
 
 /* definitions for palette chunk. see section 11.2.3 */
 
-#define MAX_PALETTE_ENTRIES  256U
 #define PALETE_ENTRY_SIZE    3U
 
-/* a single entry in a static color palette */
-struct palette_entry {
-        char red;
-        char green;
-        char blue;
-};
-
-/* each image has exactly one palette chunk */
-struct palette_chunk {
-        /* base chunk */
-        struct chunk chunk;
-
-        /* number of entries in the palette */
-        unsigned entries;
-
-        /* palette itself. we porentailly waste some memory here */
-        struct palette_entry palette[MAX_PALETTE_ENTRIES];
-};                 
-
-static inline struct palette_chunk *palette_chunk(const struct chunk *chunk)
-{
-        return container_of(chunk, struct palette_chunk, chunk);
-}
-
 static ssize_t palette_read(struct chunk *chunk, const uint8_t *buf, size_t size)
 {
         struct palette_chunk *pc;
@@ -389,7 +487,7 @@ static ssize_t palette_read(struct chunk *chunk, const uint8_t *buf, size_t size
 
         pc->entries = length/PALETE_ENTRY_SIZE;
 
-        if (size > pc->entries * PALETE_ENTRY_SIZE)
+        if (size < pc->entries * PALETE_ENTRY_SIZE)
                 return -P_E2SMALL;
 
         for (i = 0; i < pc->entries; i++) {
@@ -429,6 +527,42 @@ static struct chunk *palette_alloc()
         return pc ? &pc->chunk : NULL;
 }
 
+static ssize_t palette_write(const struct chunk *chunk, uint8_t *buf)
+{
+        struct palette_chunk *pc;
+        unsigned i;
+
+        pc = palette_chunk(chunk);
+
+        for (i = 0; i < pc->entries; i++) {
+                *buf++ = pc->palette[i].red;
+                *buf++ = pc->palette[i].green;
+                *buf++ = pc->palette[i].blue;
+        }
+
+        return pc->entries * PALETE_ENTRY_SIZE;
+}
+
+int add_palette_chunk(struct png_image *img,
+                      const struct palette_entry *palette, unsigned entries)
+{
+        struct palette_chunk *pc;
+        struct chunk *chunk;
+
+        if (!entries || entries > MAX_PALETTE_ENTRIES)
+                return -P_EINVAL;
+
+        chunk = new_chunk(img, CHUNK_PLTE, entries * PALETE_ENTRY_SIZE);
+        if (!chunk)
+                return -P_ENOMEM;
+
+        pc = palette_chunk(chunk);
+        pc->entries = entries;
+        memcpy(pc->palette, palette, entries * sizeof *palette);
+
+        return 0;
+}
+
 struct chunk_template palette_chunk_tmpl = {
         .ct_type = BYTES_TO_TYPE(80, 76, 84, 69),
         .ct_name = "palette",
@@ -437,47 +571,26 @@ struct chunk_template palette_chunk_tmpl = {
                 .read = palette_read,
                 .print_info = palette_print_info,
                 .free = palette_free,
-                .alloc = palette_alloc
+                .alloc = palette_alloc,
+                .write = palette_write
         }
 };
 
 
 /* definitions for data chunk. section 11.2.4 */
 
-struct data_chunk {
-        /* base chunk */
-        struct chunk chunk;
-
-        /*
-         * pointer to chunk data. read only (must me later concatenated
-         * to be beaningful)
-         */
-        const uint8_t *buf;
-};
-
-static inline struct data_chunk *data_chunk(const struct chunk *chunk)
-{
-        return container_of(chunk, struct data_chunk, chunk);
-}
-
 static ssize_t data_read(struct chunk *chunk, const uint8_t *buf, size_t size)
 {
         struct data_chunk *dc;
-        ssize_t ret;
-        struct zlib_stream stream;
         (void)size;
-        
+
+        /*
+         * the data chunks only make sense concatenated, so we just remember
+         * where this one is. inflating is left to png_decode()
+         */
         dc = data_chunk(chunk);
         dc->buf = buf;
 
-        memset(&stream, 0, sizeof stream);
-        stream.z_src = buf;
-        stream.z_src_end = chunk->length;
-
-        ret = zlib_decompress(&stream);
-        if (ret < 0)
-                printf("zlib_decompress failed with %s\n", e2msg(ret));
-        
         return dc->chunk.length;
 }
 
@@ -499,7 +612,20 @@ static struct chunk *data_alloc()
 {
         struct data_chunk *dc;
         dc = malloc(sizeof *dc);
-        return dc ? &dc->chunk : NULL;
+        if (!dc)
+                return NULL;
+        dc->crc_unchecked = false;
+        return &dc->chunk;
+}
+
+static ssize_t data_write(const struct chunk *chunk, uint8_t *buf)
+{
+        struct data_chunk *dc;
+
+        dc = data_chunk(chunk);
+        memcpy(buf, dc->buf, dc->chunk.length);
+
+        return dc->chunk.length;
 }
 
 struct chunk_template data_chunk_tmpl = {
@@ -510,10 +636,171 @@ struct chunk_template data_chunk_tmpl = {
                 .read = data_read,
                 .print_info = data_print_info,
                 .free = data_free,
-                .alloc = data_alloc
+                .alloc = data_alloc,
+                .write = data_write
         }
 };
 
+/* deferred IDAT crcs are checked in pieces of about this many bytes */
+#define CRC_PIECE_SIZE ((size_t)1 << 20)
+
+/* a run of bytes within one chunk, and (once a job gets to it) its crc */
+struct crc_piece {
+        const uint8_t *buf;
+        size_t size;
+        uint32_t crc;
+};
+
+/* a batch of consecutive pieces for one worker */
+struct crc_job {
+        struct pool_job job;
+        struct crc_piece *pieces;
+        size_t n;
+};
+
+struct crc_check {
+        struct png_image *img;
+        struct pool *pool;
+        struct crc_piece *pieces;
+        struct crc_job *jobs;
+        size_t njobs;
+};
+
+static void crc_job_run(struct pool_job *job)
+{
+        struct crc_job *cj = container_of(job, struct crc_job, job);
+        uint64_t tr;
+        size_t i;
+
+        tr = trace_begin();
+        for (i = 0; i < cj->n; i++)
+                cj->pieces[i].crc = crc32(cj->pieces[i].buf,
+                                          cj->pieces[i].size);
+        trace_end("crc", tr);
+}
+
+static bool crc_unchecked(const struct chunk *chunk)
+{
+        return chunk->c_tmpl->ct_type_idx == CHUNK_IDAT
+                && data_chunk(chunk)->crc_unchecked;
+}
+
+/* the crc covers the type field too, which comes right before the data */
+static size_t crc_pieces(const struct chunk *chunk)
+{
+        return (chunk->length + 4 + CRC_PIECE_SIZE - 1) / CRC_PIECE_SIZE;
+}
+
+int crc_check_start(struct png_image *img, unsigned threads,
+                    struct crc_check **check)
+{
+        struct crc_check *cc;
+        struct crc_piece *piece;
+        struct crc_job *job;
+        struct chunk *chunk;
+        const uint8_t *buf;
+        size_t npieces = 0, size, n, i;
+
+        *check = NULL;
+        for (chunk = img->first; chunk; chunk = chunk->next)
+                if (crc_unchecked(chunk))
+                        npieces += crc_pieces(chunk);
+        if (!npieces)
+                return 0;
+
+        cc = calloc(1, sizeof *cc);
+        if (!cc)
+                return -P_ENOMEM;
+        cc->img = img;
+        cc->pieces = malloc(npieces * sizeof *cc->pieces);
+        cc->jobs = malloc(npieces * sizeof *cc->jobs);
+        if (!cc->pieces || !cc->jobs)
+                goto out_nomem;
+
+        piece = cc->pieces;
+        for (chunk = img->first; chunk; chunk = chunk->next) {
+                if (!crc_unchecked(chunk))
+                        continue;
+                buf = data_chunk(chunk)->buf - 4;
+                size = chunk->length + 4;
+                for (i = 0; i < crc_pieces(chunk); i++, piece++) {
+                        n = size < CRC_PIECE_SIZE ? size : CRC_PIECE_SIZE;
+                        piece->buf = buf;
+                        piece->size = n;
+                        buf += n;
+                        size -= n;
+                }
+        }
+
+        /* lots of little chunks get done a piece's worth at a time */
+        for (i = 0; i < npieces; i += job->n) {
+                job = &cc->jobs[cc->njobs++];
+                job->job.fn = crc_job_run;
+                job->pieces = &cc->pieces[i];
+                size = 0;
+                for (job->n = 0; i + job->n < npieces && size < CRC_PIECE_SIZE;
+                     job->n++)
+                        size += cc->pieces[i + job->n].size;
+        }
+
+        if (threads != 1 && cc->njobs > 1) {
+                cc->pool = pool_new(threads);
+                if (!cc->pool)
+                        goto out_nomem;
+        }
+
+        for (i = 0; i < cc->njobs; i++) {
+                if (cc->pool)
+                        pool_submit(cc->pool, &cc->jobs[i].job);
+                else
+                        crc_job_run(&cc->jobs[i].job);
+        }
+
+        *check = cc;
+        return 0;
+
+out_nomem:
+        free(cc->jobs);
+        free(cc->pieces);
+        free(cc);
+        return -P_ENOMEM;
+}
+
+int crc_check_wait(struct crc_check *check)
+{
+        struct crc_piece *piece;
+        struct chunk *chunk;
+        uint32_t crc;
+        size_t i;
+        int error = 0;
+
+        if (!check)
+                return 0;
+
+        if (check->pool)
+                pool_free(check->pool);
+
+        /* pieces are in the same order as the chunks they came from */
+        piece = check->pieces;
+        for (chunk = check->img->first; chunk; chunk = chunk->next) {
+                if (!crc_unchecked(chunk))
+                        continue;
+                crc = piece++->crc;
+                for (i = 1; i < crc_pieces(chunk); i++, piece++)
+                        crc = crc32_combine(crc, piece->crc, piece->size);
+
+                if (crc != data_chunk(chunk)->crc)
+                        error = -P_EBADCSUM;
+                else
+                        data_chunk(chunk)->crc_unchecked = false;
+        }
+
+        free(check->jobs);
+        free(check->pieces);
+        free(check);
+        return error;
+}
+
 
 /* definitions for end chunk 11.2.5 */
 
@@ -808,9 +1095,6 @@ struct dimension_chunk {
         uint8_t unit;
 };
 
-#define DIMEN_UNIT_UNKNOWN 0
-#define DIMEN_UNIT_METER 1
-
 #define DIMEN_DISK_SIZE 9
 
 static inline struct dimension_chunk *dimension_chunk(const struct chunk *chunk)
@@ -875,6 +1159,42 @@ static struct chunk *dimension_alloc()
         return dc ? &dc->chunk : NULL;
 }
 
+static ssize_t dimension_write(const struct chunk *chunk, uint8_t *buf)
+{
+        struct dimension_chunk *dc;
+
+        dc = dimension_chunk(chunk);
+
+        __write_png_int_raw(buf, dc->ppu_x);
+        __write_png_int_raw(buf + 4, dc->ppu_y);
+        buf[8] = dc->unit;
+
+        return DIMEN_DISK_SIZE;
+}
+
+int add_dimension_chunk(struct png_image *img, uint32_t ppu_x, uint32_t ppu_y,
+                        uint8_t unit)
+{
+        struct dimension_chunk *dc;
+        struct chunk *chunk;
+
+        if (ppu_x > PNG_UINT_MAX || ppu_y > PNG_UINT_MAX)
+                return -P_ERANGE;
+        if (unit != DIMEN_UNIT_UNKNOWN && unit != DIMEN_UNIT_METER)
+                return -P_EINVAL;
+
+        chunk = new_chunk(img, CHUNK_PHYS, DIMEN_DISK_SIZE);
+        if (!chunk)
+                return -P_ENOMEM;
+
+        dc = dimension_chunk(chunk);
+        dc->ppu_x = ppu_x;
+        dc->ppu_y = ppu_y;
+        dc->unit = unit;
+
+        return 0;
+}
+
 struct chunk_template dimension_chunk_tmpl = {
         .ct_type = BYTES_TO_TYPE(112, 72, 89, 115),
         .ct_name = "physical dimensions",
@@ -883,7 +1203,8 @@ struct chunk_template dimension_chunk_tmpl = {
                 .read = dimension_read,
                 .print_info = dimension_print_info,
                 .free = dimension_free,
-                .alloc = dimension_alloc
+                .alloc = dimension_alloc,
+                .write = dimension_write
         }
 };
 
@@ -951,43 +1272,26 @@ static inline struct time_chunk *time_chunk(const struct chunk *chunk)
         return container_of(chunk, struct time_chunk, chunk);
 }
 
-static ssize_t time_read(struct chunk *chunk, const uint8_t *buf, size_t size)
+static int time_check(uint16_t year, uint8_t month, uint8_t day, uint8_t hour,
+                      uint8_t minute, uint8_t second)
 {
-        struct time_chunk *tc;
-        uint16_t year;
-        uint8_t month, day, hour, minute, second;
-
-        tc = time_chunk(chunk);
-
-        if (size < TIME_DISK_SIZE)
-                return -P_E2SMALL;
-
-        /* first field is year. any values are valid (lol, sort of) */
-        year = read_png_uint16(buf);
-        buf += sizeof year;
-
-        /* next is month, 1 indexed */
-        month = *buf++;
+        /* month, 1 indexed */
         if (month < 1 || month > 12)
                 return -P_EINVAL;
 
         /* day, 1 indexed */
-        day = *buf++;
         if (day < 1 || day > 31)
                 return -P_EINVAL;
 
         /* hour, 0 indexed */
-        hour = *buf++;
         if (hour > 23)
                 return -P_EINVAL;
 
         /* minute, 0 indexed */
-        minute = *buf++;
         if (minute > 59)
                 return -P_EINVAL;
 
         /* seconds, 0 indexed, and leap seconds are okay */
-        second = *buf++;
         if (second > 60)
                 return -P_EINVAL;
 
@@ -1017,10 +1321,37 @@ static ssize_t time_read(struct chunk *chunk, const uint8_t *buf, size_t size)
                 break;
         }
 
+        return 0;
+}
+
+static ssize_t time_read(struct chunk *chunk, const uint8_t *buf, size_t size)
+{
+        struct time_chunk *tc;
+        uint16_t year;
+        uint8_t month, day, hour, minute, second;
+
+        tc = time_chunk(chunk);
+
+        if (size < TIME_DISK_SIZE)
+                return -P_E2SMALL;
+
+        /* first field is year. any values are valid (lol, sort of) */
+        year = read_png_uint16(buf);
+        buf += sizeof year;
+
+        month = *buf++;
+        day = *buf++;
+        hour = *buf++;
+        minute = *buf++;
+        second = *buf++;
+        if (time_check(year, month, day, hour, minute, second))
+                return -P_EINVAL;
+
         tc->year = year;
         tc->month = month;
         tc->day = day;
         tc->hour = hour;
+        tc->minute = minute;
         tc->second = second;
 
         return TIME_DISK_SIZE;
@@ -1049,6 +1380,46 @@ static struct chunk *time_alloc()
         return tc ? &tc->chunk : NULL;
 }
 
+static ssize_t time_write(const struct chunk *chunk, uint8_t *buf)
+{
+        struct time_chunk *tc;
+
+        tc = time_chunk(chunk);
+
+        write_png_uint16(buf, tc->year);
+        buf[2] = tc->month;
+        buf[3] = tc->day;
+        buf[4] = tc->hour;
+        buf[5] = tc->minute;
+        buf[6] = tc->second;
+
+        return TIME_DISK_SIZE;
+}
+
+int add_time_chunk(struct png_image *img, uint16_t year, uint8_t month,
+                   uint8_t day, uint8_t hour, uint8_t minute, uint8_t second)
+{
+        struct time_chunk *tc;
+        struct chunk *chunk;
+
+        if (time_check(year, month, day, hour, minute, second))
+                return -P_EINVAL;
+
+        chunk = new_chunk(img, CHUNK_TIME, TIME_DISK_SIZE);
+        if (!chunk)
+                return -P_ENOMEM;
+
+        tc = time_chunk(chunk);
+        tc->year = year;
+        tc->month = month;
+        tc->day = day;
+        tc->hour = hour;
+        tc->minute = minute;
+        tc->second = second;
+
+        return 0;
+}
+
 struct chunk_template time_chunk_tmpl = {
         .ct_type = BYTES_TO_TYPE(116, 73, 77, 69),
         .ct_name = "timestamp",
@@ -1057,7 +1428,8 @@ struct chunk_template time_chunk_tmpl = {
                 .read = time_read,
                 .print_info = time_print_info,
                 .free = time_free,
-                .alloc = time_alloc
+                .alloc = time_alloc,
+                .write = time_write
         }
 };
 
@@ -1155,16 +1527,79 @@ static void text_print_info(FILE *stream, const struct chunk *chunk)
 
 static void text_free(struct chunk *chunk)
 {
-        free(text_chunk(chunk));
+        struct text_chunk *tc;
+
+        tc = text_chunk(chunk);
+        free(tc->keyword);
+        free(tc->text);
+        free(tc);
 }
 
 static struct chunk *text_alloc()
 {
         struct text_chunk *tc;
-        tc = malloc(sizeof *tc);
+
+        /* zeroed, so a chunk that fails to read can still be freed */
+        tc = calloc(1, sizeof *tc);
         return tc ? &tc->chunk : 0;
 }
 
+static ssize_t text_write(const struct chunk *chunk, uint8_t *buf)
+{
+        struct text_chunk *tc;
+
+        tc = text_chunk(chunk);
+
+        memcpy(buf, tc->keyword, tc->key_len);
+        if (tc->text_len)
+                memcpy(buf + tc->key_len, tc->text, tc->text_len);
+
+        return tc->key_len + tc->text_len;
+}
+
+int add_text_chunk(struct png_image *img, const char *keyword,
+                   const char *text, size_t text_len)
+{
+        struct text_chunk *tc;
+        struct chunk *chunk;
+        char *key_copy, *text_copy = NULL;
+        size_t key_len;
+
+        /* keyword is 1-79 bytes, plus the null */
+        key_len = strlen(keyword) + 1;
+        if (key_len < 2 || key_len > TEXT_KEYWORD_MAXLEN)
+                return -P_EINVAL;
+
+        key_copy = malloc(key_len);
+        if (!key_copy)
+                return -P_ENOMEM;
+        memcpy(key_copy, keyword, key_len);
+
+        if (text_len) {
+                text_copy = malloc(text_len);
+                if (!text_copy)
+                        goto nomem;
+                memcpy(text_copy, text, text_len);
+        }
+
+        chunk = new_chunk(img, CHUNK_TEXT, key_len + text_len);
+        if (!chunk)
+                goto nomem;
+
+        tc = text_chunk(chunk);
+        tc->keyword = key_copy;
+        tc->key_len = key_len;
+        tc->text = text_copy;
+        tc->text_len = text_len;
+
+        return 0;
+
+nomem:
+        free(text_copy);
+        free(key_copy);
+        return -P_ENOMEM;
+}
+
 struct chunk_template text_chunk_tmpl = {
         .ct_type = BYTES_TO_TYPE(116, 69, 88, 116),
         .ct_name = "text",
@@ -1173,6 +1608,209 @@ struct chunk_template text_chunk_tmpl = {
                 .read = text_read,
                 .print_info = text_print_info,
                 .free = text_free,
-                .alloc = text_alloc
+                .alloc = text_alloc,
+                .write = text_write
+        }
+};
+
+
+/* definitions for the APNG animation control chunk */
+
+#define ANIM_DISK_SIZE 8
+
+static ssize_t anim_read(struct chunk *chunk, const uint8_t *buf, size_t size)
+{
+        struct anim_chunk *ac;
+        uint32_t frames, plays;
+
+        ac = anim_chunk(chunk);
+
+        if (size < ANIM_DISK_SIZE)
+                return -P_E2SMALL;
+
+        /* an animation with no frames makes no sense */
+        if (!read_png_uint(buf, &frames) || !frames)
+                return -P_ERANGE;
+        if (!read_png_uint(buf + 4, &plays))
+                return -P_ERANGE;
+
+        ac->frames = frames;
+        ac->plays = plays;
+        return ANIM_DISK_SIZE;
+}
+
+static void anim_print_info(FILE *stream, const struct chunk *chunk)
+{
+        struct anim_chunk *ac;
+
+        ac = anim_chunk(chunk);
+        fprintf(stream, "animation: %u frames, ", ac->frames);
+        if (ac->plays)
+                fprintf(stream, "played %u times\n", ac->plays);
+        else
+                fprintf(stream, "played forever\n");
+}
+
+static void anim_free(struct chunk *chunk)
+{
+        free(anim_chunk(chunk));
+}
+
+static struct chunk *anim_alloc()
+{
+        struct anim_chunk *ac;
+        ac = malloc(sizeof *ac);
+        return ac ? &ac->chunk : NULL;
+}
+
+struct chunk_template anim_chunk_tmpl = {
+        .ct_type = BYTES_TO_TYPE(97, 99, 84, 76),
+        .ct_name = "animation control",
+        .ct_type_idx = CHUNK_ACTL,
+        .ct_ops = {
+                .read = anim_read,
+                .print_info = anim_print_info,
+                .free = anim_free,
+                .alloc = anim_alloc
+        }
+};
+
+
+/* definitions for the APNG frame control chunk */
+
+#define FRAME_DISK_SIZE 26
+
+static ssize_t frame_read(struct chunk *chunk, const uint8_t *buf, size_t size)
+{
+        struct frame_chunk *fc;
+        uint32_t seq, width, height, x, y;
+        uint8_t dispose, blend;
+
+        fc = frame_chunk(chunk);
+
+        if (size < FRAME_DISK_SIZE)
+                return -P_E2SMALL;
+
+        /*
+         * whether the region fits on the canvas is up to whoever draws
+         * it, since IHDR might not have been parsed yet
+         */
+        if (!read_png_uint(buf, &seq)
+            || !read_png_uint(buf + 4, &width) || !width
+            || !read_png_uint(buf + 8, &height) || !height
+            || !read_png_uint(buf + 12, &x)
+            || !read_png_uint(buf + 16, &y))
+                return -P_ERANGE;
+
+        dispose = buf[24];
+        blend = buf[25];
+        if (dispose > DISPOSE_PREVIOUS || blend > BLEND_OVER)
+                return -P_EINVAL;
+
+        fc->seq = seq;
+        fc->width = width;
+        fc->height = height;
+        fc->x = x;
+        fc->y = y;
+        fc->delay_num = read_png_uint16(buf + 20);
+        fc->delay_den = read_png_uint16(buf + 22);
+        fc->dispose = dispose;
+        fc->blend = blend;
+        return FRAME_DISK_SIZE;
+}
+
+static void frame_print_info(FILE *stream, const struct chunk *chunk)
+{
+        static const char *const dispose_names[] = {
+                [DISPOSE_NONE] = "none",
+                [DISPOSE_BACKGROUND] = "background",
+                [DISPOSE_PREVIOUS] = "previous"
+        };
+        struct frame_chunk *fc;
+
+        fc = frame_chunk(chunk);
+        fprintf(stream, "frame %u: %ux%u at (%u,%u), delay %u/%u, "
+                "dispose %s, blend %s\n", fc->seq, fc->width, fc->height,
+                fc->x, fc->y, fc->delay_num, fc->delay_den,
+                fc->dispose <= DISPOSE_PREVIOUS
+                ? dispose_names[fc->dispose] : "bad",
+                fc->blend == BLEND_OVER ? "over" : "source");
+}
+
+static void frame_free(struct chunk *chunk)
+{
+        free(frame_chunk(chunk));
+}
+
+static struct chunk *frame_alloc()
+{
+        struct frame_chunk *fc;
+        fc = malloc(sizeof *fc);
+        return fc ? &fc->chunk : NULL;
+}
+
+struct chunk_template frame_chunk_tmpl = {
+        .ct_type = BYTES_TO_TYPE(102, 99, 84, 76),
+        .ct_name = "frame control",
+        .ct_type_idx = CHUNK_FCTL,
+        .ct_ops = {
+                .read = frame_read,
+                .print_info = frame_print_info,
+                .free = frame_free,
+                .alloc = frame_alloc
+        }
+};
+
+
+/* definitions for the APNG frame data chunk */
+
+static ssize_t frame_data_read(struct chunk *chunk, const uint8_t *buf,
+                               size_t size)
+{
+        struct frame_data_chunk *fd;
+
+        fd = frame_data_chunk(chunk);
+
+        if (chunk->length < 4 || size < chunk->length)
+                return -P_E2SMALL;
+
+        if (!read_png_uint(buf, &fd->seq))
+                return -P_ERANGE;
+
+        /* same as IDAT: just remember where the data is */
+        fd->buf = buf + 4;
+        return chunk->length;
+}
+
+static void frame_data_print_info(FILE *stream, const struct chunk *chunk)
+{
+        struct frame_data_chunk *fd;
+
+        fd = frame_data_chunk(chunk);
+        fprintf(stream, "frame data %u: %zu bytes long with base %p\n",
+                fd->seq, fd->chunk.length - 4, (void*)fd->buf);
+}
+
+static void frame_data_free(struct chunk *chunk)
+{
+        free(frame_data_chunk(chunk));
+}
+
+static struct chunk *frame_data_alloc()
+{
+        struct frame_data_chunk *fd;
+        fd = malloc(sizeof *fd);
+        return fd ? &fd->chunk : NULL;
+}
+
+struct chunk_template frame_data_chunk_tmpl = {
+        .ct_type = BYTES_TO_TYPE(102, 100, 65, 84),
+        .ct_name = "frame data",
+        .ct_type_idx = CHUNK_FDAT,
+        .ct_ops = {
+                .read = frame_data_read,
+                .print_info = frame_data_print_info,
+                .free = frame_data_free,
+                .alloc = frame_data_alloc
         }
 };
@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include "util.h"
+
 /*
  * limits in bytes for chunk size. this is the size of the whole chunk --
  * *including* the length, type, and crc fields. This is in contrast to
@@ -19,6 +21,10 @@
 #define MIN_CHUNK_SIZE ((size_t)12)
 #define MAX_CHUNK_SIZE ((size_t)((1 << 31) + 11))
 
+/* the eight bytes every png starts with */
+#define PNG_MAGIC_SIZE 8
+extern const uint8_t png_magic[PNG_MAGIC_SIZE];
+
 /* simple ints so we can have arrays of chunks */
 enum chunk_enum {
         CHUNK_IHDR = 0,
@@ -30,6 +36,9 @@ enum chunk_enum {
         CHUNK_PHYS,
         CHUNK_TIME,
         CHUNK_TEXT,
+        CHUNK_ACTL,
+        CHUNK_FCTL,
+        CHUNK_FDAT,
         CHUNK_UNKNOWN
 };
 
@@ -53,9 +62,15 @@ struct chunk_ops {
         
         /* alocate a chunk. if null, a generic chunk is allocated */
         struct chunk *(*alloc)();
+
+        /*
+         * write the chunk data field (chunk->length bytes of it) to buf.
+         * return nr bytes written. If null, the data field is empty.
+         */
+        ssize_t (*write)(const struct chunk *chunk, uint8_t *buf);
 };
 
-struct chunk *chunk_lookup(struct png_image *img, enum chunk_enum type);
+struct chunk *lookup_chunk(struct png_image *img, enum chunk_enum type);
 
 /* generic data for every chunk in a png image */
 struct chunk_template {
@@ -90,7 +105,295 @@ struct png_image {
         struct chunk *first;
 };
 
-/* read a chunk from a buffer and return a chunk of the correct type */
-ssize_t parse_next_chunk(const uint8_t *buf, size_t size, struct png_image *img);
+/*
+ * read a chunk from a buffer and return a chunk of the correct type. flags
+ * is any of the PARSE_* flags below
+ */
+ssize_t parse_next_chunk(const uint8_t *buf, size_t size,
+                         struct png_image *img, unsigned flags);
+
+/*
+ * parse a whole png in memory, magic and all, into img. returns 0,
+ * -P_EINVAL if buf doesn't start with the magic, or the first error from
+ * parse_next_chunk, in which case img is left empty.
+ */
+int parse_png(const uint8_t *buf, size_t size, struct png_image *img,
+              unsigned flags);
+
+/* what parse_next_chunk_stats did. times are in nanoseconds */
+struct chunk_stats {
+        /* chunks parsed, and the bytes they took up */
+        uint64_t cs_chunks;
+        uint64_t cs_bytes;
+
+        /* all of parsing, and the part of it spent checking crcs */
+        uint64_t cs_parse_ns;
+        uint64_t cs_crc_ns;
+};
+
+/*
+ * parse_next_chunk, adding to stats as it goes. zero stats before the
+ * first chunk
+ */
+ssize_t parse_next_chunk_stats(const uint8_t *buf, size_t size,
+                               struct png_image *img, unsigned flags,
+                               struct chunk_stats *stats);
+
+/*
+ * don't check IDAT crcs as they're parsed, just remember them. they get
+ * checked by whatever inflates the data (see crc_check_start), which can
+ * then do it on other threads while it inflates. buf has to stick around
+ * until then.
+ */
+#define PARSE_DEFER_CRC 0x1
+
+/*
+ * don't check the crc at all, because it's known to be good. this is for
+ * chunks found through a sidecar (see sidecar.h) that were checked before.
+ */
+#define PARSE_CRC_OK 0x2
+
+struct crc_check;
+
+/*
+ * check the crcs of any IDAT chunks in img that were parsed with
+ * PARSE_DEFER_CRC, on threads threads (0 for one per cpu). big chunks are
+ * split into pieces whose crcs are glued back together with
+ * crc32_combine, and small ones are batched up. with threads 1 it's all
+ * done before returning. *check is set to NULL if there's nothing to do.
+ */
+int crc_check_start(struct png_image *img, unsigned threads,
+                    struct crc_check **check);
+
+/*
+ * wait for a crc_check_start to finish and free it. returns 0 or
+ * -P_EBADCSUM. chunks whose crcs were good don't get checked again.
+ */
+int crc_check_wait(struct crc_check *check);
+
+/* free every chunk in an image */
+void free_chunks(struct png_image *img);
+
+/*
+ * write a whole chunk (length, type, data and crc) to a buffer. return nr
+ * bytes written, which is chunk->length + MIN_CHUNK_SIZE
+ */
+ssize_t write_chunk(const struct chunk *chunk, uint8_t *buf, size_t size);
+
+/*
+ * allocate an empty chunk of the given type and put it at the end of img's
+ * list. the add_*_chunk functions below fill one in for writing out, and
+ * return 0 or a negative error
+ */
+struct chunk *new_chunk(struct png_image *img, enum chunk_enum type,
+                        size_t length);
+
+/* definitions for header chunk. see section 11.2.2 */
+
+/* bit values for various header fields */
+#define __COLOR_GREYSCALE  0
+#define __COLOR_INDEXED    1
+#define __COLOR_TRUE       2
+#define __COLOR_ALPHA      4
+#define COLOR_GREYSCALE    __COLOR_GREYSCALE
+#define COLOR_TRUE         __COLOR_TRUE
+#define COLOR_INDEXED      (__COLOR_INDEXED | __COLOR_TRUE)
+#define COLOR_GREY_ALPHA   (__COLOR_GREYSCALE | __COLOR_ALPHA)
+#define COLOR_TRUE_ALPHA   (__COLOR_TRUE | __COLOR_ALPHA)
+
+#define ZTYPE_DEFLATE      0
+#define FILTER_ADAPTIVE    0
+#define INTERLACE_NONE     0
+#define INTERLACE_ADAM7    1
+
+/* filter types each row is tagged with under FILTER_ADAPTIVE, section 9.2 */
+#define FILTER_NONE        0
+#define FILTER_SUB         1
+#define FILTER_UP          2
+#define FILTER_AVERAGE     3
+#define FILTER_PAETH       4
+#define FILTER_TYPES       5
+
+/* each image has exactly one header chunk. basic metadata about the image */
+struct header_chunk {
+        /* base chunk */
+        struct chunk chunk;
+
+        /* width of the image in pixels */
+        uint32_t width;
+
+        /* height of the image in pixels */
+        uint32_t height;
+
+        /* pixel depth i.e. bits per pixel */
+        char depth;
+
+        /* type of color in the image. one of COLOR_* */
+        char color;
+
+        /* compression type. must be ZTYPE_DEFLATE */
+        char ztype;
+
+        /* filtering type. must be FILTER_ADAPTIVE */
+        char filter;
+
+        /* interlace type. one of INTERLACE_* */
+        char interlace;
+};
+
+static inline struct header_chunk *header_chunk(const struct chunk *chunk)
+{
+        return container_of(chunk, struct header_chunk, chunk);
+}
+
+int add_header_chunk(struct png_image *img, uint32_t width, uint32_t height,
+                     char depth, char color, char interlace);
+
+
+/* definitions for palette chunk. see section 11.2.3 */
+
+#define MAX_PALETTE_ENTRIES  256U
+
+/* a single entry in a static color palette */
+struct palette_entry {
+        char red;
+        char green;
+        char blue;
+};
+
+/* each image has exactly one palette chunk */
+struct palette_chunk {
+        /* base chunk */
+        struct chunk chunk;
+
+        /* number of entries in the palette */
+        unsigned entries;
+
+        /* palette itself. we porentailly waste some memory here */
+        struct palette_entry palette[MAX_PALETTE_ENTRIES];
+};
+
+static inline struct palette_chunk *palette_chunk(const struct chunk *chunk)
+{
+        return container_of(chunk, struct palette_chunk, chunk);
+}
+
+int add_palette_chunk(struct png_image *img,
+                      const struct palette_entry *palette, unsigned entries);
+
+
+/* definitions for data chunk. section 11.2.4 */
+
+struct data_chunk {
+        /* base chunk */
+        struct chunk chunk;
+
+        /*
+         * pointer to chunk data. read only (must me later concatenated
+         * to be beaningful)
+         */
+        const uint8_t *buf;
+
+        /* crc from the file, if PARSE_DEFER_CRC left it to be checked */
+        uint32_t crc;
+        bool crc_unchecked;
+};
+
+static inline struct data_chunk *data_chunk(const struct chunk *chunk)
+{
+        return container_of(chunk, struct data_chunk, chunk);
+}
+
+
+/*
+ * definitions for the animation chunks of APNG (see the APNG spec at
+ * wiki.mozilla.org/APNG_Specification). fcTL and fdAT share one sequence
+ * number space, starting from 0, so they can't be reordered.
+ */
+
+/* animation control (acTL) */
+struct anim_chunk {
+        /* base chunk */
+        struct chunk chunk;
+
+        /* frames in the animation, which is the number of fcTL chunks */
+        uint32_t frames;
+
+        /* times to play the animation, or 0 for forever */
+        uint32_t plays;
+};
+
+static inline struct anim_chunk *anim_chunk(const struct chunk *chunk)
+{
+        return container_of(chunk, struct anim_chunk, chunk);
+}
+
+/* what to do with a frame's region once it's been shown */
+#define DISPOSE_NONE       0
+#define DISPOSE_BACKGROUND 1
+#define DISPOSE_PREVIOUS   2
+
+/* how a frame is drawn into the region */
+#define BLEND_SOURCE       0
+#define BLEND_OVER         1
+
+/* frame control (fcTL). comes before the data for each frame */
+struct frame_chunk {
+        /* base chunk */
+        struct chunk chunk;
+
+        uint32_t seq;
+
+        /* region of the canvas the frame covers */
+        uint32_t width;
+        uint32_t height;
+        uint32_t x;
+        uint32_t y;
+
+        /* how long to show the frame, in seconds, as a fraction */
+        uint16_t delay_num;
+        uint16_t delay_den;
+
+        uint8_t dispose;
+        uint8_t blend;
+};
+
+static inline struct frame_chunk *frame_chunk(const struct chunk *chunk)
+{
+        return container_of(chunk, struct frame_chunk, chunk);
+}
+
+/* frame data (fdAT). like IDAT, but with a sequence number up front */
+struct frame_data_chunk {
+        /* base chunk */
+        struct chunk chunk;
+
+        uint32_t seq;
+
+        /* the data after the sequence number, chunk.length - 4 bytes of it */
+        const uint8_t *buf;
+};
+
+static inline struct frame_data_chunk *frame_data_chunk(const struct chunk *chunk)
+{
+        return container_of(chunk, struct frame_data_chunk, chunk);
+}
+
+/* ancillary chunks we know how to write. see chunk.c for their layout */
+
+/* pixel dimensions (pHYs) units */
+#define DIMEN_UNIT_UNKNOWN 0
+#define DIMEN_UNIT_METER 1
+
+int add_dimension_chunk(struct png_image *img, uint32_t ppu_x, uint32_t ppu_y,
+                        uint8_t unit);
+
+/* tIME. month and day are 1 indexed */
+int add_time_chunk(struct png_image *img, uint16_t year, uint8_t month,
+                   uint8_t day, uint8_t hour, uint8_t minute, uint8_t second);
+
+/* tEXt. keyword is null terminated, 1-79 bytes. text is text_len bytes */
+int add_text_chunk(struct png_image *img, const char *keyword,
+                   const char *text, size_t text_len);
 
 #endif /* PNG_CHUNK_H */
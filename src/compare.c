@@ -0,0 +1,629 @@
+/*
+ * decode the same images with libpngem and with the system zlib and
+ * libpng, to see how far apart they are. for every image, the image data
+ * is inflated by zlib_decompress and by zlib's inflate, and the whole file
+ * is parsed and decoded by png_decode and by libpng. the outputs have to
+ * match byte for byte. the image data is also inflated once more through a
+ * z_drain that stops every time it's called, resuming each time, which has
+ * to come out the same too. throughput ratios (ours over theirs, so below 1 is
+ * slower) are reported per image, and then per category: the kinds of
+ * deflate block the image uses, its color type, and its size.
+ *
+ * images come from the files given, or the synthetic corpus (corpus.h)
+ * if there aren't any. the ratios can be saved with -s and checked
+ * against later with -b; any category that falls more than -t percent
+ * below its baseline fails the run, as does any mismatch.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "compare_sys.h"
+#include "corpus.h"
+#include "decode.h"
+#include "error.h"
+#include "input.h"
+#include "stats.h"
+#include "zlib.h"
+
+/* the ways images are grouped for the summary */
+enum dim {
+        DIM_BLOCKS,
+        DIM_COLOR,
+        DIM_SIZE,
+        NR_DIMS
+};
+
+static const char *dim_names[NR_DIMS] = {
+        [DIM_BLOCKS] = "blocks",
+        [DIM_COLOR] = "color",
+        [DIM_SIZE] = "size",
+};
+
+static const char *color_names[] = {
+        [COLOR_GREYSCALE] = "grey",
+        [COLOR_TRUE] = "rgb",
+        [COLOR_INDEXED] = "indexed",
+        [COLOR_GREY_ALPHA] = "greya",
+        [COLOR_TRUE_ALPHA] = "rgba",
+};
+
+/* how often the stopping z_drain gets called */
+#define RESUME_DRAIN_SIZE 1000
+
+/* images of fewer pixels than these are small, then medium */
+#define SMALL_PIXELS (256UL << 10)
+#define MEDIUM_PIXELS (1UL << 20)
+
+struct image {
+        const char *name;
+        uint8_t *buf;
+        size_t size;
+
+        /* the image data, and how big it is inflated */
+        uint8_t *idat;
+        size_t idat_size;
+        size_t inflated;
+        uint32_t width;
+        uint32_t height;
+
+        /* which group it's in, for each dim */
+        const char *cat[NR_DIMS];
+
+        /* output of the last run of each */
+        uint8_t *ours_inflated;
+        uint8_t *sys_inflated;
+        struct png_pixels ours_px;
+        uint8_t *sys_px;
+};
+
+/* seconds for the median run of each, and the ratios they make */
+struct timing {
+        double ours_inflate;
+        double sys_inflate;
+        double ours_decode;
+        double sys_decode;
+};
+
+/* geometric means of the ratios of every image in one category */
+struct category {
+        enum dim dim;
+        const char *value;
+        double log_inflate;
+        double log_decode;
+        unsigned n;
+};
+
+#define MAX_CATEGORIES 64
+
+static struct category categories[MAX_CATEGORIES];
+static unsigned ncategories;
+
+static const char *block_mix(const struct zlib_stats *zs)
+{
+        unsigned kinds = !!zs->zs_stored_blocks + !!zs->zs_static_blocks
+                + !!zs->zs_dynamic_blocks;
+
+        if (kinds > 1)
+                return "mixed";
+        if (zs->zs_stored_blocks)
+                return "stored";
+        if (zs->zs_static_blocks)
+                return "static";
+        return "dynamic";
+}
+
+/*
+ * pull out the image data and work out what category the image is in.
+ * decoding it with stats once is what tells us the kinds of blocks
+ */
+static int prepare(struct image *im)
+{
+        struct png_decode_stats stats;
+        struct zlib_stream stream;
+        struct header_chunk *hc;
+        struct png_pixels px;
+        struct png_image img;
+        struct chunk *chunk;
+        uint64_t pixels;
+        uint8_t *idat;
+        int err;
+
+        err = parse_png(im->buf, im->size, &img, 0);
+        if (err)
+                return err;
+
+        err = -P_ENOCHUNK;
+        chunk = lookup_chunk(&img, CHUNK_IHDR);
+        if (!chunk)
+                goto out;
+        hc = header_chunk(chunk);
+        im->width = hc->width;
+        im->height = hc->height;
+        im->cat[DIM_COLOR] = color_names[(unsigned)hc->color];
+        pixels = (uint64_t)hc->width * hc->height;
+        im->cat[DIM_SIZE] = pixels < SMALL_PIXELS ? "small"
+                : pixels < MEDIUM_PIXELS ? "medium" : "large";
+
+        memset(&stats, 0, sizeof stats);
+        err = png_decode_stats(&img, &px, &stats);
+        if (err)
+                goto out;
+        png_pixels_free(&px);
+        im->cat[DIM_BLOCKS] = block_mix(&stats.zlib);
+
+        for (chunk = img.first; chunk; chunk = chunk->next) {
+                if (chunk->c_tmpl->ct_type_idx != CHUNK_IDAT)
+                        continue;
+                err = -P_ENOMEM;
+                idat = realloc(im->idat, im->idat_size + chunk->length);
+                if (!idat)
+                        goto out;
+                im->idat = idat;
+                memcpy(im->idat + im->idat_size, data_chunk(chunk)->buf,
+                       chunk->length);
+                im->idat_size += chunk->length;
+        }
+
+        memset(&stream, 0, sizeof stream);
+        stream.z_src = im->idat;
+        stream.z_src_end = im->idat_size;
+        err = zlib_decompress(&stream);
+        zlib_end(&stream);
+        free(stream.z_dst);
+        if (err)
+                goto out;
+        im->inflated = stream.z_dst_idx;
+
+        err = -P_ENOMEM;
+        im->ours_inflated = malloc(im->inflated);
+        im->sys_inflated = malloc(im->inflated);
+        if (im->ours_inflated && im->sys_inflated)
+                err = 0;
+out:
+        free_chunks(&img);
+        return err;
+}
+
+static void image_free(struct image *im)
+{
+        free(im->idat);
+        free(im->ours_inflated);
+        free(im->sys_inflated);
+        png_pixels_free(&im->ours_px);
+        free(im->sys_px);
+}
+
+static int ours_inflate(struct image *im)
+{
+        struct zlib_stream stream;
+        int err;
+
+        /* into a buffer that's already the right size, same as zlib */
+        memset(&stream, 0, sizeof stream);
+        stream.z_src = im->idat;
+        stream.z_src_end = im->idat_size;
+        stream.z_dst = im->ours_inflated;
+        stream.z_dst_end = im->inflated;
+        err = zlib_decompress(&stream);
+        zlib_end(&stream);
+
+        /* it only grows the buffer if the data is bad, but still */
+        im->ours_inflated = stream.z_dst;
+        if (!err && stream.z_dst_idx != im->inflated)
+                err = -P_EINVAL;
+        return err;
+}
+
+static int theirs_inflate(struct image *im)
+{
+        return sys_inflate(im->idat, im->idat_size, im->sys_inflated,
+                           im->inflated);
+}
+
+static int ours_decode(struct image *im)
+{
+        struct png_image img;
+        int err;
+
+        png_pixels_free(&im->ours_px);
+        err = parse_png(im->buf, im->size, &img, 0);
+        if (err)
+                return err;
+        err = png_decode(&img, &im->ours_px);
+        free_chunks(&img);
+        return err;
+}
+
+static int theirs_decode(struct image *im)
+{
+        uint32_t w, h;
+
+        free(im->sys_px);
+        im->sys_px = NULL;
+        return sys_png_decode(im->buf, im->size, &im->sys_px, &w, &h);
+}
+
+static int cmp_double(const void *lhs, const void *rhs)
+{
+        double a = *(const double *)lhs, b = *(const double *)rhs;
+
+        return (a > b) - (a < b);
+}
+
+/* seconds for the median of reps runs of fn, after warmup untimed ones */
+static int time_median(int (*fn)(struct image *im), struct image *im,
+                       unsigned warmup, unsigned reps, double *secs,
+                       double *median)
+{
+        uint64_t start;
+        unsigned n;
+        int err;
+
+        for (n = 0; n < warmup; n++) {
+                err = fn(im);
+                if (err)
+                        return err;
+        }
+        for (n = 0; n < reps; n++) {
+                start = stats_clock();
+                err = fn(im);
+                secs[n] = (stats_clock() - start) / 1e9;
+                if (err)
+                        return err;
+        }
+
+        qsort(secs, reps, sizeof *secs, cmp_double);
+        *median = secs[reps / 2];
+        return 0;
+}
+
+/* check the two decodes agree, saying where they don't */
+static bool same_pixels(const struct image *im)
+{
+        const uint8_t *ours, *theirs;
+        size_t row = (size_t)im->width * 4, x;
+        uint32_t y;
+
+        for (y = 0; y < im->height; y++) {
+                ours = im->ours_px.data + y * im->ours_px.stride;
+                theirs = im->sys_px + y * row;
+                if (!memcmp(ours, theirs, row))
+                        continue;
+                for (x = 0; ours[x] == theirs[x]; x++)
+                        ;
+                fprintf(stderr, "FAIL: %s: pixel (%zu,%u) is %02x%02x%02x%02x"
+                        " but libpng says %02x%02x%02x%02x\n", im->name,
+                        x / 4, y, ours[x & ~3], ours[(x & ~3) + 1],
+                        ours[(x & ~3) + 2], ours[(x & ~3) + 3],
+                        theirs[x & ~3], theirs[(x & ~3) + 1],
+                        theirs[(x & ~3) + 2], theirs[(x & ~3) + 3]);
+                return false;
+        }
+        return true;
+}
+
+static bool same_inflated(const struct image *im)
+{
+        size_t i;
+
+        if (!memcmp(im->ours_inflated, im->sys_inflated, im->inflated))
+                return true;
+        for (i = 0; im->ours_inflated[i] == im->sys_inflated[i]; i++)
+                ;
+        fprintf(stderr, "FAIL: %s: inflated byte %zu is %02x but zlib says "
+                "%02x\n", im->name, i, im->ours_inflated[i],
+                im->sys_inflated[i]);
+        return false;
+}
+
+/* where stop_drain puts what it's given */
+struct resume {
+        uint8_t *out;
+        size_t size;
+        size_t len;
+        bool overflow;
+};
+
+static int stop_drain(struct zlib_stream *stream, const uint8_t *buf,
+                      size_t size)
+{
+        struct resume *r = stream->z_priv;
+
+        if (size > r->size - r->len) {
+                r->overflow = true;
+                return 1;
+        }
+        memcpy(r->out + r->len, buf, size);
+        r->len += size;
+        return 1;
+}
+
+/*
+ * inflate the image data stopping at every drain and carrying on again,
+ * and check nothing went missing or got doubled along the way
+ */
+static bool resumes_cleanly(const struct image *im)
+{
+        struct zlib_stream stream;
+        struct resume r = { .size = im->inflated };
+        unsigned stops = 0;
+        bool ok;
+        int err;
+
+        r.out = malloc(im->inflated ? im->inflated : 1);
+        if (!r.out) {
+                fprintf(stderr, "FAIL: %s: %s\n", im->name,
+                        e2msg(-P_ENOMEM));
+                return false;
+        }
+
+        memset(&stream, 0, sizeof stream);
+        stream.z_src = im->idat;
+        stream.z_src_end = im->idat_size;
+        stream.z_drain = stop_drain;
+        stream.z_drain_size = RESUME_DRAIN_SIZE;
+        stream.z_priv = &r;
+        err = zlib_decompress(&stream);
+        while (err == Z_STOPPED && !r.overflow) {
+                stops++;
+                err = zlib_inflate(&stream);
+        }
+        zlib_end(&stream);
+        free(stream.z_dst);
+
+        ok = !err && !r.overflow && r.len == im->inflated
+                && !memcmp(r.out, im->sys_inflated, im->inflated);
+        if (!ok)
+                fprintf(stderr, "FAIL: %s: inflating with %u stops gave %s\n",
+                        im->name, stops, err < 0 ? e2msg(err)
+                        : "different output");
+        free(r.out);
+        return ok;
+}
+
+static struct category *category(enum dim dim, const char *value)
+{
+        struct category *c;
+        unsigned i;
+
+        for (i = 0; i < ncategories; i++) {
+                c = &categories[i];
+                if (c->dim == dim && !strcmp(c->value, value))
+                        return c;
+        }
+        if (ncategories == MAX_CATEGORIES)
+                return NULL;
+
+        c = &categories[ncategories++];
+        c->dim = dim;
+        c->value = value;
+        return c;
+}
+
+/*
+ * time and check one image. returns 1 if the outputs don't match, or a
+ * negative error
+ */
+static int compare(struct image *im, unsigned warmup, unsigned reps)
+{
+        struct timing t;
+        struct category *c;
+        double *secs, r_inflate, r_decode, px;
+        unsigned d;
+        int err;
+
+        secs = malloc(reps * sizeof *secs);
+        if (!secs)
+                return -P_ENOMEM;
+
+        err = prepare(im);
+        if (!err)
+                err = time_median(ours_inflate, im, warmup, reps, secs,
+                                  &t.ours_inflate);
+        if (!err)
+                err = time_median(theirs_inflate, im, warmup, reps, secs,
+                                  &t.sys_inflate);
+        if (!err)
+                err = time_median(ours_decode, im, warmup, reps, secs,
+                                  &t.ours_decode);
+        if (!err)
+                err = time_median(theirs_decode, im, warmup, reps, secs,
+                                  &t.sys_decode);
+        free(secs);
+        if (err)
+                return err;
+
+        if (!same_inflated(im) || !resumes_cleanly(im) || !same_pixels(im))
+                return 1;
+
+        /* decode speed is in bytes of RGBA out */
+        px = (double)im->width * im->height * 4;
+        r_inflate = t.sys_inflate / t.ours_inflate;
+        r_decode = t.sys_decode / t.ours_decode;
+        printf("%-24s %-7s %-7s %-6s %9.1f %9.1f %6.3f %9.1f %9.1f %6.3f\n",
+               im->name, im->cat[DIM_BLOCKS], im->cat[DIM_COLOR],
+               im->cat[DIM_SIZE], im->inflated / t.ours_inflate / 1e6,
+               im->inflated / t.sys_inflate / 1e6, r_inflate,
+               px / t.ours_decode / 1e6, px / t.sys_decode / 1e6, r_decode);
+
+        for (d = 0; d < NR_DIMS; d++) {
+                c = category(d, im->cat[d]);
+                if (!c)
+                        continue;
+                c->log_inflate += log(r_inflate);
+                c->log_decode += log(r_decode);
+                c->n++;
+        }
+        return 0;
+}
+
+static double mean_ratio(double log_sum, unsigned n)
+{
+        return exp(log_sum / n);
+}
+
+static void summarize(FILE *save)
+{
+        const struct category *c;
+        unsigned d, i;
+
+        printf("\n%-7s %-8s %6s %8s %8s\n", "by", "category", "images",
+               "inflate", "decode");
+        for (d = 0; d < NR_DIMS; d++) {
+                for (i = 0; i < ncategories; i++) {
+                        c = &categories[i];
+                        if (c->dim != d)
+                                continue;
+                        printf("%-7s %-8s %6u %8.3f %8.3f\n", dim_names[d],
+                               c->value, c->n,
+                               mean_ratio(c->log_inflate, c->n),
+                               mean_ratio(c->log_decode, c->n));
+                        if (save)
+                                fprintf(save, "%s %s %f %f\n", dim_names[d],
+                                        c->value,
+                                        mean_ratio(c->log_inflate, c->n),
+                                        mean_ratio(c->log_decode, c->n));
+                }
+        }
+}
+
+/*
+ * check each category against the ratios in a baseline saved by -s.
+ * returns how many fell more than tolerance percent behind
+ */
+static unsigned check_baseline(FILE *f, double tolerance)
+{
+        const struct category *c;
+        char dim[32], value[32];
+        double inflate, decode, floor = 1 - tolerance / 100;
+        unsigned i, failed = 0;
+
+        while (fscanf(f, "%31s %31s %lf %lf", dim, value, &inflate,
+                      &decode) == 4) {
+                for (i = 0; i < ncategories; i++) {
+                        c = &categories[i];
+                        if (strcmp(dim_names[c->dim], dim)
+                            || strcmp(c->value, value))
+                                continue;
+                        if (mean_ratio(c->log_inflate, c->n)
+                            < inflate * floor) {
+                                fprintf(stderr, "FAIL: %s %s inflate ratio "
+                                        "%.3f, baseline %.3f\n", dim, value,
+                                        mean_ratio(c->log_inflate, c->n),
+                                        inflate);
+                                failed++;
+                        }
+                        if (mean_ratio(c->log_decode, c->n)
+                            < decode * floor) {
+                                fprintf(stderr, "FAIL: %s %s decode ratio "
+                                        "%.3f, baseline %.3f\n", dim, value,
+                                        mean_ratio(c->log_decode, c->n),
+                                        decode);
+                                failed++;
+                        }
+                }
+        }
+        return failed;
+}
+
+static void usage(void)
+{
+        fprintf(stderr, "usage: compare [-n reps] [-w warmup] [-s save] "
+                "[-b baseline [-t percent]] [file...]\n");
+        exit(2);
+}
+
+int main(int argc, char **argv)
+{
+        const char *save_name = NULL, *base_name = NULL;
+        unsigned reps = 10, warmup = 2, failed = 0;
+        double tolerance = 10;
+        struct image im;
+        size_t i, n;
+        FILE *f;
+        int opt, err;
+
+        while ((opt = getopt(argc, argv, "b:n:s:t:w:")) != -1) {
+                switch (opt) {
+                case 'b':
+                        base_name = optarg;
+                        break;
+                case 'n':
+                        reps = atoi(optarg);
+                        if (!reps)
+                                usage();
+                        break;
+                case 's':
+                        save_name = optarg;
+                        break;
+                case 't':
+                        tolerance = atof(optarg);
+                        break;
+                case 'w':
+                        warmup = atoi(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+
+        printf("libpngem against zlib %s and libpng %s. ratios are ours "
+               "over theirs\n\n", sys_zlib_version(), sys_png_version());
+        printf("%-24s %-7s %-7s %-6s %9s %9s %6s %9s %9s %6s\n", "image",
+               "blocks", "color", "size", "inf MB/s", "zlib", "ratio",
+               "dec MB/s", "libpng", "ratio");
+
+        n = optind < argc ? (size_t)(argc - optind) : corpus_nspecs;
+        for (i = 0; i < n; i++) {
+                memset(&im, 0, sizeof im);
+                if (optind < argc) {
+                        im.name = argv[optind + i];
+                        err = input_read_file(im.name, &im.buf, &im.size);
+                } else {
+                        im.name = corpus_specs[i].name;
+                        err = corpus_png(&corpus_specs[i], &im.buf,
+                                         &im.size);
+                }
+                if (!err)
+                        err = compare(&im, warmup, reps);
+                if (err < 0)
+                        fprintf(stderr, "FAIL: %s: %s\n", im.name,
+                                e2msg(err));
+                failed += !!err;
+                image_free(&im);
+                free(im.buf);
+        }
+
+        f = NULL;
+        if (save_name && !(f = fopen(save_name, "w")))
+                perror(save_name);
+        summarize(f);
+        if (f)
+                fclose(f);
+
+        if (base_name) {
+                f = fopen(base_name, "r");
+                if (!f) {
+                        perror(base_name);
+                        return 1;
+                }
+                failed += check_baseline(f, tolerance);
+                fclose(f);
+        }
+
+        if (failed) {
+                fprintf(stderr, "FAIL: %u problem%s\n", failed,
+                        failed == 1 ? "" : "s");
+                return 1;
+        }
+        return 0;
+}
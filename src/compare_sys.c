@@ -0,0 +1,124 @@
+#include <png.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compare_sys.h"
+#include "error.h"
+
+int sys_inflate(const uint8_t *src, size_t size, uint8_t *out,
+                size_t out_size)
+{
+        z_stream zs;
+        int ret;
+
+        memset(&zs, 0, sizeof zs);
+        if (inflateInit(&zs) != Z_OK)
+                return -P_ENOMEM;
+
+        zs.next_in = (Bytef *)src;
+        zs.avail_in = size;
+        zs.next_out = out;
+        zs.avail_out = out_size;
+        ret = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+
+        if (ret != Z_STREAM_END || zs.total_out != out_size)
+                return -P_EINVAL;
+        return 0;
+}
+
+/* where libpng reads from */
+struct mem_reader {
+        const uint8_t *buf;
+        size_t size;
+        size_t off;
+};
+
+static void mem_read(png_structp png, png_bytep data, png_size_t n)
+{
+        struct mem_reader *r = png_get_io_ptr(png);
+
+        if (r->size - r->off < n)
+                png_error(png, "read past the end");
+        memcpy(data, r->buf + r->off, n);
+        r->off += n;
+}
+
+int sys_png_decode(const uint8_t *buf, size_t size, uint8_t **rgba,
+                   uint32_t *w, uint32_t *h)
+{
+        struct mem_reader r = {buf, size, 0};
+        png_structp png;
+        png_infop info;
+        png_bytep *volatile rows = NULL;
+        uint8_t *volatile out = NULL;
+        png_uint_32 y, height;
+        int color, depth;
+
+        png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+                                     NULL);
+        if (!png)
+                return -P_ENOMEM;
+        info = png_create_info_struct(png);
+        if (!info) {
+                png_destroy_read_struct(&png, NULL, NULL);
+                return -P_ENOMEM;
+        }
+
+        if (setjmp(png_jmpbuf(png))) {
+                png_destroy_read_struct(&png, &info, NULL);
+                free(rows);
+                free(out);
+                return -P_EINVAL;
+        }
+
+        png_set_read_fn(png, &r, mem_read);
+        png_read_info(png, info);
+
+        color = png_get_color_type(png, info);
+        depth = png_get_bit_depth(png, info);
+        if (color == PNG_COLOR_TYPE_PALETTE)
+                png_set_palette_to_rgb(png);
+        if (color == PNG_COLOR_TYPE_GRAY && depth < 8)
+                png_set_expand_gray_1_2_4_to_8(png);
+        if (depth == 16)
+                png_set_strip_16(png);
+        if (!(color & PNG_COLOR_MASK_COLOR))
+                png_set_gray_to_rgb(png);
+        if (!(color & PNG_COLOR_MASK_ALPHA))
+                png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+        png_set_interlace_handling(png);
+        png_read_update_info(png, info);
+
+        *w = png_get_image_width(png, info);
+        *h = height = png_get_image_height(png, info);
+        if (png_get_rowbytes(png, info) != (size_t)*w * 4)
+                png_error(png, "not RGBA after transforms");
+
+        out = malloc((size_t)*w * 4 * height);
+        rows = malloc(height * sizeof *rows);
+        if (!out || !rows)
+                png_error(png, "out of memory");
+        for (y = 0; y < height; y++)
+                rows[y] = out + (size_t)y * *w * 4;
+
+        png_read_image(png, rows);
+        png_read_end(png, NULL);
+        png_destroy_read_struct(&png, &info, NULL);
+
+        free(rows);
+        *rgba = out;
+        return 0;
+}
+
+const char *sys_zlib_version(void)
+{
+        return zlibVersion();
+}
+
+const char *sys_png_version(void)
+{
+        return png_get_libpng_ver(NULL);
+}
@@ -0,0 +1,32 @@
+#ifndef PNG_COMPARE_SYS_H
+#define PNG_COMPARE_SYS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * the system zlib and libpng, for compare. they live in a file of their
+ * own because the system's zlib.h and ours can't both be included.
+ */
+
+/*
+ * inflate size bytes of zlib stream at src into out, which has to come to
+ * exactly out_size bytes. returns 0 or a negative error.
+ */
+int sys_inflate(const uint8_t *src, size_t size, uint8_t *out,
+                size_t out_size);
+
+/*
+ * decode a png in memory with libpng into 8 bit RGBA, the same way
+ * png_decode does: 16 bit samples are cut to their high byte, low bit
+ * depth greys are scaled up, and tRNS is ignored. *rgba is malloced, with
+ * rows *w * 4 bytes apart.
+ */
+int sys_png_decode(const uint8_t *buf, size_t size, uint8_t **rgba,
+                   uint32_t *w, uint32_t *h);
+
+/* which zlib and libpng we're up against */
+const char *sys_zlib_version(void);
+const char *sys_png_version(void);
+
+#endif /* PNG_COMPARE_SYS_H */
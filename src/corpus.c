@@ -0,0 +1,548 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "corpus.h"
+#include "error.h"
+#include "zlib.h"
+
+#define ADAM7_PASSES 7
+
+static const uint8_t adam7_x0[] = {0, 4, 0, 2, 0, 1, 0};
+static const uint8_t adam7_y0[] = {0, 0, 4, 0, 2, 0, 1};
+static const uint8_t adam7_dx[] = {8, 8, 4, 4, 2, 2, 1};
+static const uint8_t adam7_dy[] = {8, 8, 8, 4, 4, 2, 2};
+
+/* a spec, without all the prefixes */
+#define SPEC(name, w, h, depth, color, adam7, filter, btype, idat, text)  \
+        {name, w, h, depth, COLOR_##color, adam7, FILTER_##filter,      \
+         CORPUS_##btype, idat, text}
+
+/* 256x256, every filter in turn, dynamic blocks, nothing special */
+#define PLAIN(name, depth, color)                                       \
+        SPEC(name, 256, 256, depth, color, false, CYCLE, DYNAMIC, 1, 0)
+
+/* so that SPEC's filter can be CYCLE */
+#define FILTER_CYCLE CORPUS_FILTER_CYCLE
+
+const struct corpus_spec corpus_specs[] = {
+        /* every color type and bit depth */
+        PLAIN("grey1", 1, GREYSCALE),
+        PLAIN("grey2", 2, GREYSCALE),
+        PLAIN("grey4", 4, GREYSCALE),
+        PLAIN("grey8", 8, GREYSCALE),
+        PLAIN("grey16", 16, GREYSCALE),
+        PLAIN("rgb8", 8, TRUE),
+        PLAIN("rgb16", 16, TRUE),
+        PLAIN("pal1", 1, INDEXED),
+        PLAIN("pal2", 2, INDEXED),
+        PLAIN("pal4", 4, INDEXED),
+        PLAIN("pal8", 8, INDEXED),
+        PLAIN("greya8", 8, GREY_ALPHA),
+        PLAIN("greya16", 16, GREY_ALPHA),
+        PLAIN("rgba8", 8, TRUE_ALPHA),
+        PLAIN("rgba16", 16, TRUE_ALPHA),
+
+        /* one filter type throughout */
+        SPEC("rgb8-none", 256, 256, 8, TRUE, false, NONE, DYNAMIC, 1, 0),
+        SPEC("rgb8-sub", 256, 256, 8, TRUE, false, SUB, DYNAMIC, 1, 0),
+        SPEC("rgb8-up", 256, 256, 8, TRUE, false, UP, DYNAMIC, 1, 0),
+        SPEC("rgb8-avg", 256, 256, 8, TRUE, false, AVERAGE, DYNAMIC, 1, 0),
+        SPEC("rgb8-paeth", 256, 256, 8, TRUE, false, PAETH, DYNAMIC, 1, 0),
+
+        /* the other two block types */
+        SPEC("rgb8-stored", 256, 256, 8, TRUE, false, CYCLE, STORED, 1, 0),
+        SPEC("rgb8-static", 256, 256, 8, TRUE, false, CYCLE, STATIC, 1, 0),
+        SPEC("grey8-static", 256, 256, 8, GREYSCALE, false, UP, STATIC, 1, 0),
+
+        /* adam7 */
+        SPEC("grey1-adam7", 256, 256, 1, GREYSCALE, true, CYCLE, DYNAMIC, 1, 0),
+        SPEC("pal4-adam7", 256, 256, 4, INDEXED, true, CYCLE, DYNAMIC, 1, 0),
+        SPEC("rgb8-adam7", 256, 256, 8, TRUE, true, CYCLE, DYNAMIC, 1, 0),
+        SPEC("rgba16-adam7", 256, 256, 16, TRUE_ALPHA, true, CYCLE, DYNAMIC,
+             1, 0),
+        SPEC("rgb8-adam7-small", 13, 7, 8, TRUE, true, CYCLE, DYNAMIC, 1, 0),
+
+        /* lots of chunks */
+        SPEC("rgb8-idat64", 256, 256, 8, TRUE, false, CYCLE, DYNAMIC, 64, 0),
+        SPEC("rgb8-idat1k", 256, 256, 8, TRUE, false, CYCLE, DYNAMIC, 1024, 0),
+        SPEC("rgb8-text256", 256, 256, 8, TRUE, false, CYCLE, DYNAMIC, 1, 256),
+
+        /* something big enough to time throughput on */
+        SPEC("rgba8-large", 2048, 2048, 8, TRUE_ALPHA, false, CYCLE, DYNAMIC,
+             16, 0),
+};
+
+const size_t corpus_nspecs = sizeof corpus_specs / sizeof *corpus_specs;
+
+const struct corpus_spec *corpus_find(const char *name)
+{
+        size_t i;
+
+        for (i = 0; i < corpus_nspecs; i++)
+                if (!strcmp(corpus_specs[i].name, name))
+                        return &corpus_specs[i];
+        return NULL;
+}
+
+/* a bit writer for corpus_deflate_static. bits go in lsb first */
+struct bit_writer {
+        uint8_t *buf;
+        size_t len;
+        uint64_t acc;
+        unsigned n;
+};
+
+static void put_bits(struct bit_writer *w, uint32_t bits, unsigned n)
+{
+        w->acc |= (uint64_t)bits << w->n;
+        w->n += n;
+        while (w->n >= 8) {
+                w->buf[w->len++] = w->acc;
+                w->acc >>= 8;
+                w->n -= 8;
+        }
+}
+
+/* huffman codes go in msb first, see section 3.1.1 */
+static void put_code(struct bit_writer *w, uint32_t code, unsigned len)
+{
+        uint32_t rev = 0;
+        unsigned i;
+
+        for (i = 0; i < len; i++)
+                rev |= (code >> i & 1) << (len - 1 - i);
+        put_bits(w, rev, len);
+}
+
+/* a literal/length symbol's fixed code, section 3.2.6 */
+static void put_static(struct bit_writer *w, unsigned sym)
+{
+        if (sym < 144)
+                put_code(w, 0x30 + sym, 8);
+        else if (sym < 256)
+                put_code(w, 0x190 + sym - 144, 9);
+        else if (sym < 280)
+                put_code(w, sym - 256, 7);
+        else
+                put_code(w, 0xc0 + sym - 280, 8);
+}
+
+static const uint16_t len_base[] =
+        {3, 4, 5, 6, 7, 8, 9, 10, 11, 13,
+         15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+         67, 83, 99, 115, 131, 163, 195, 227, 258};
+
+static const uint8_t len_extra[] =
+        {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+         4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+/* a match of len bytes at distance 1 */
+static void put_run(struct bit_writer *w, unsigned len)
+{
+        unsigned i = sizeof len_base / sizeof *len_base - 1;
+
+        while (len_base[i] > len)
+                i--;
+        put_static(w, 257 + i);
+        put_bits(w, len - len_base[i], len_extra[i]);
+
+        /* distance code 0 is distance 1, with no extra bits */
+        put_code(w, 0, 5);
+}
+
+int corpus_deflate_static(const uint8_t *src, size_t size, uint8_t **out,
+                          size_t *out_size)
+{
+        struct bit_writer w;
+        uint32_t adler;
+        size_t i, run;
+
+        /* 9 bits for the worst literal, plus headers and the checksum */
+        memset(&w, 0, sizeof w);
+        w.buf = malloc(size + size / 8 + 16);
+        if (!w.buf)
+                return -P_ENOMEM;
+
+        /* 32K window, no dictionary, fastest */
+        w.buf[w.len++] = 0x78;
+        w.buf[w.len++] = 0x01;
+
+        /* one final static block */
+        put_bits(&w, 1, 1);
+        put_bits(&w, 1, 2);
+
+        for (i = 0; i < size; i += run) {
+                run = 0;
+                if (i)
+                        while (i + run < size && run < 258
+                               && src[i + run] == src[i - 1])
+                                run++;
+
+                if (run >= 3) {
+                        put_run(&w, run);
+                } else {
+                        put_static(&w, src[i]);
+                        run = 1;
+                }
+        }
+
+        put_static(&w, 256);
+        if (w.n)
+                put_bits(&w, 0, 8 - w.n);
+
+        adler = adler32_update(1, src, size);
+        w.buf[w.len++] = adler >> 24;
+        w.buf[w.len++] = adler >> 16;
+        w.buf[w.len++] = adler >> 8;
+        w.buf[w.len++] = adler;
+
+        *out = w.buf;
+        *out_size = w.len;
+        return 0;
+}
+
+static unsigned spec_channels(const struct corpus_spec *spec)
+{
+        switch (spec->color) {
+        case COLOR_TRUE:
+                return 3;
+        case COLOR_GREY_ALPHA:
+                return 2;
+        case COLOR_TRUE_ALPHA:
+                return 4;
+        default:
+                return 1;
+        }
+}
+
+/* a well mixed hash of a sample's coordinates */
+static uint32_t noise(uint32_t x, uint32_t y, uint32_t c)
+{
+        uint32_t h = x * 0x9e3779b1U ^ y * 0x85ebca6bU ^ c * 0xc2b2ae35U;
+
+        h ^= h >> 15;
+        h *= 0x2c1b3c6dU;
+        h ^= h >> 12;
+        h *= 0x297a2d39U;
+        h ^= h >> 15;
+        return h;
+}
+
+/*
+ * channel c of pixel (x, y): smooth gradients with a little noise on top,
+ * so that the filters have something to do and the data compresses about
+ * like a photo does
+ */
+static uint32_t sample(const struct corpus_spec *spec, uint32_t x, uint32_t y,
+                       unsigned c)
+{
+        uint32_t v, n = noise(x, y, c);
+
+        v = (x * (c + 2) * 256 / spec->width
+             + y * (c + 1) * 256 / spec->height + (n & 7)) & 0xff;
+        if (spec->depth == 16)
+                return v << 8 | (n >> 8 & 0xff);
+        return v >> (8 - spec->depth);
+}
+
+/* pack pass row y of a pass starting at (x0, y0) every (dx, dy) pixels */
+static void pack_row(const struct corpus_spec *spec, uint8_t *row,
+                     uint32_t x0, uint32_t dx, uint32_t y, uint32_t w)
+{
+        unsigned channels = spec_channels(spec), c, shift;
+        uint32_t i, v;
+        size_t bit;
+
+        if (spec->depth < 8) {
+                memset(row, 0, ((size_t)w * spec->depth + 7) / 8);
+                for (i = 0, bit = 0; i < w; i++, bit += spec->depth) {
+                        shift = 8 - spec->depth - bit % 8;
+                        row[bit / 8] |= sample(spec, x0 + i * dx, y, 0)
+                                << shift;
+                }
+                return;
+        }
+
+        for (i = 0; i < w; i++) {
+                for (c = 0; c < channels; c++) {
+                        v = sample(spec, x0 + i * dx, y, c);
+                        if (spec->depth == 16)
+                                *row++ = v >> 8;
+                        *row++ = v;
+                }
+        }
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+        int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+        if (pa <= pb && pa <= pc)
+                return a;
+        return pb <= pc ? b : c;
+}
+
+/* filter a raw row with type, writing the type byte and len bytes to out */
+static void filter_row(uint8_t *out, const uint8_t *x, const uint8_t *b,
+                       size_t len, unsigned bpp, int type)
+{
+        uint8_t a, c;
+        size_t i;
+
+        *out++ = type;
+        for (i = 0; i < len; i++) {
+                a = i >= bpp ? x[i - bpp] : 0;
+                c = i >= bpp ? b[i - bpp] : 0;
+                switch (type) {
+                case FILTER_SUB:
+                        out[i] = x[i] - a;
+                        break;
+                case FILTER_UP:
+                        out[i] = x[i] - b[i];
+                        break;
+                case FILTER_AVERAGE:
+                        out[i] = x[i] - ((a + b[i]) >> 1);
+                        break;
+                case FILTER_PAETH:
+                        out[i] = x[i] - paeth(a, b[i], c);
+                        break;
+                default:
+                        out[i] = x[i];
+                }
+        }
+}
+
+/* the filtered image data, every pass of it */
+static int filtered_data(const struct corpus_spec *spec, uint8_t **out,
+                         size_t *size)
+{
+        unsigned bits = spec->depth * spec_channels(spec);
+        unsigned bpp = (bits + 7) / 8, p, passes;
+        uint32_t x0, y0, dx, dy, w, h, j;
+        size_t row_bytes, total = 0, nrows = 0;
+        uint8_t *data, *cur, *prev, *tmp;
+
+        passes = spec->interlaced ? ADAM7_PASSES : 1;
+        for (p = 0; p < passes; p++) {
+                x0 = spec->interlaced ? adam7_x0[p] : 0;
+                y0 = spec->interlaced ? adam7_y0[p] : 0;
+                dx = spec->interlaced ? adam7_dx[p] : 1;
+                dy = spec->interlaced ? adam7_dy[p] : 1;
+                if (spec->width <= x0 || spec->height <= y0)
+                        continue;
+                w = (spec->width - x0 + dx - 1) / dx;
+                h = (spec->height - y0 + dy - 1) / dy;
+                total += h * (1 + ((size_t)w * bits + 7) / 8);
+        }
+
+        row_bytes = ((size_t)spec->width * bits + 7) / 8;
+        data = malloc(total);
+        cur = malloc(row_bytes);
+        prev = malloc(row_bytes);
+        if (!data || !cur || !prev) {
+                free(data);
+                free(cur);
+                free(prev);
+                return -P_ENOMEM;
+        }
+
+        *out = data;
+        *size = total;
+        for (p = 0; p < passes; p++) {
+                x0 = spec->interlaced ? adam7_x0[p] : 0;
+                y0 = spec->interlaced ? adam7_y0[p] : 0;
+                dx = spec->interlaced ? adam7_dx[p] : 1;
+                dy = spec->interlaced ? adam7_dy[p] : 1;
+                if (spec->width <= x0 || spec->height <= y0)
+                        continue;
+                w = (spec->width - x0 + dx - 1) / dx;
+                h = (spec->height - y0 + dy - 1) / dy;
+                row_bytes = ((size_t)w * bits + 7) / 8;
+
+                memset(prev, 0, row_bytes);
+                for (j = 0; j < h; j++, nrows++) {
+                        pack_row(spec, cur, x0, dx, y0 + j * dy, w);
+                        filter_row(data, cur, prev, row_bytes, bpp,
+                                   spec->filter == CORPUS_FILTER_CYCLE
+                                   ? (int)(nrows % FILTER_TYPES)
+                                   : spec->filter);
+                        data += 1 + row_bytes;
+                        tmp = prev;
+                        prev = cur;
+                        cur = tmp;
+                }
+        }
+
+        free(cur);
+        free(prev);
+        return 0;
+}
+
+static int compress_data(const struct corpus_spec *spec, const uint8_t *data,
+                         size_t size, uint8_t **out, size_t *out_size)
+{
+        struct zlib_stream stream;
+        int err;
+
+        if (spec->btype == CORPUS_STATIC)
+                return corpus_deflate_static(data, size, out, out_size);
+
+        memset(&stream, 0, sizeof stream);
+        stream.z_src = data;
+        stream.z_src_end = size;
+        err = zlib_compress(&stream, spec->btype == CORPUS_STORED
+                            ? ZLIB_LEVEL_STORE : ZLIB_LEVEL_DEFAULT);
+        if (err) {
+                free(stream.z_dst);
+                return err;
+        }
+
+        *out = stream.z_dst;
+        *out_size = stream.z_dst_idx;
+        return 0;
+}
+
+/* the chunks other than IDAT and IEND */
+static int spec_chunks(const struct corpus_spec *spec, struct png_image *img)
+{
+        struct palette_entry plte[MAX_PALETTE_ENTRIES];
+        char text[32];
+        unsigned i, n;
+        int err;
+
+        err = add_header_chunk(img, spec->width, spec->height, spec->depth,
+                               spec->color, spec->interlaced
+                               ? INTERLACE_ADAM7 : INTERLACE_NONE);
+        if (err)
+                return err;
+
+        if (spec->color == COLOR_INDEXED) {
+                n = 1U << spec->depth;
+                for (i = 0; i < n; i++) {
+                        plte[i].red = i * 255 / (n - 1);
+                        plte[i].green = noise(i, 0, 1);
+                        plte[i].blue = 255 - i * 255 / (n - 1);
+                }
+                err = add_palette_chunk(img, plte, n);
+                if (err)
+                        return err;
+        }
+
+        for (i = 0; i < spec->text_chunks; i++) {
+                n = snprintf(text, sizeof text, "corpus text chunk %u", i);
+                err = add_text_chunk(img, "Comment", text, n);
+                if (err)
+                        return err;
+        }
+
+        return 0;
+}
+
+int corpus_png(const struct corpus_spec *spec, uint8_t **buf, size_t *size)
+{
+        struct png_image img;
+        struct chunk *chunk, *idat, *iend;
+        uint8_t *data = NULL, *z = NULL, *out = NULL;
+        size_t data_size, z_size, total, off, piece, n;
+        unsigned pieces, i;
+        ssize_t ret;
+        int err;
+
+        img.first = NULL;
+        err = spec_chunks(spec, &img);
+        if (err)
+                goto out;
+
+        err = filtered_data(spec, &data, &data_size);
+        if (!err)
+                err = compress_data(spec, data, data_size, &z, &z_size);
+        if (err)
+                goto out;
+
+        err = -P_ENOMEM;
+        idat = new_chunk(&img, CHUNK_IDAT, 0);
+        iend = new_chunk(&img, CHUNK_IEND, 0);
+        if (!idat || !iend)
+                goto out;
+
+        pieces = spec->idat_chunks ? spec->idat_chunks : 1;
+        if (pieces > z_size)
+                pieces = z_size;
+        piece = z_size / pieces;
+
+        total = sizeof png_magic + z_size + pieces * MIN_CHUNK_SIZE;
+        for (chunk = img.first; chunk; chunk = chunk->next)
+                total += chunk->length + MIN_CHUNK_SIZE;
+        out = malloc(total);
+        if (!out)
+                goto out;
+
+        memcpy(out, png_magic, sizeof png_magic);
+        off = sizeof png_magic;
+        for (chunk = img.first; chunk; chunk = chunk->next) {
+                if (chunk != idat) {
+                        ret = write_chunk(chunk, out + off, total - off);
+                        if (ret < 0) {
+                                err = ret;
+                                goto out;
+                        }
+                        off += ret;
+                        continue;
+                }
+
+                /* the last piece picks up the remainder */
+                for (i = 0, n = 0; i < pieces; i++, n += idat->length) {
+                        idat->length = i + 1 < pieces ? piece : z_size - n;
+                        data_chunk(idat)->buf = z + n;
+                        ret = write_chunk(idat, out + off, total - off);
+                        if (ret < 0) {
+                                err = ret;
+                                goto out;
+                        }
+                        off += ret;
+                }
+        }
+
+        *buf = out;
+        *size = off;
+        out = NULL;
+        err = 0;
+out:
+        free(out);
+        free(z);
+        free(data);
+        free_chunks(&img);
+        return err;
+}
+
+int corpus_write(const char *dir)
+{
+        char path[4096];
+        uint8_t *buf;
+        size_t i, size;
+        FILE *f;
+        int err = 0;
+
+        for (i = 0; i < corpus_nspecs && !err; i++) {
+                err = corpus_png(&corpus_specs[i], &buf, &size);
+                if (err)
+                        break;
+
+                snprintf(path, sizeof path, "%s/%s.png", dir,
+                         corpus_specs[i].name);
+                f = fopen(path, "wb");
+                if (!f || fwrite(buf, 1, size, f) != size)
+                        err = -P_EIO;
+                if (f && fclose(f))
+                        err = -P_EIO;
+                free(buf);
+        }
+
+        return err;
+}
@@ -0,0 +1,70 @@
+#ifndef PNG_CORPUS_H
+#define PNG_CORPUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * synthetic pngs for benchmarking. every image is a function of its spec
+ * alone, so the same corpus comes out every time, on every machine. the
+ * specs cover every color type and bit depth, each filter type, stored,
+ * static and dynamic deflate blocks, adam7 interlacing, and files with lots
+ * of chunks.
+ */
+
+/* which kind of deflate blocks the image data is compressed into */
+enum corpus_btype {
+        CORPUS_STORED,
+        CORPUS_STATIC,
+        CORPUS_DYNAMIC,
+};
+
+/* filter every row with a different type in turn */
+#define CORPUS_FILTER_CYCLE (-1)
+
+struct corpus_spec {
+        const char *name;
+
+        uint32_t width;
+        uint32_t height;
+        uint8_t depth;
+        uint8_t color;
+        bool interlaced;
+
+        /* FILTER_* for every row, or CORPUS_FILTER_CYCLE */
+        int filter;
+
+        enum corpus_btype btype;
+
+        /* the image data is split into this many IDAT chunks */
+        unsigned idat_chunks;
+
+        /* and this many tEXt chunks go in front of it */
+        unsigned text_chunks;
+};
+
+extern const struct corpus_spec corpus_specs[];
+extern const size_t corpus_nspecs;
+
+/* the spec called name, or NULL */
+const struct corpus_spec *corpus_find(const char *name);
+
+/*
+ * generate the png for spec into a malloced buffer, which the caller
+ * frees. returns 0 or a negative error.
+ */
+int corpus_png(const struct corpus_spec *spec, uint8_t **buf, size_t *size);
+
+/*
+ * deflate size bytes of src into a zlib stream made of a single static
+ * Huffman block, using only literals and runs (matches at distance 1).
+ * *out is malloced.
+ */
+int corpus_deflate_static(const uint8_t *src, size_t size, uint8_t **out,
+                          size_t *out_size);
+
+/* write every image in the corpus to dir, as <name>.png */
+int corpus_write(const char *dir);
+
+#endif /* PNG_CORPUS_H */
@@ -0,0 +1,27 @@
+#ifndef PNG_CRC_H
+#define PNG_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32 as used by png chunks (and gzip, zip, ...). see annex D of the
+ * standard. crc32_update continues a crc from a previous call, so a crc
+ * over a buffer that arrives in pieces is crc32_update(crc32_update(0,
+ * a, na), b, nb).
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t size);
+
+static inline uint32_t crc32(const uint8_t *buf, size_t size)
+{
+        return crc32_update(0, buf, size);
+}
+
+/*
+ * given crc1 of a and crc2 of b, where b is len2 bytes long, return the
+ * crc of a followed by b. this lets pieces of a buffer be crc'd separately
+ * (and at the same time) and glued back together afterwards.
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+#endif /* PNG_CRC_H */
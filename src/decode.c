@@ -0,0 +1,1269 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "decode.h"
+#include "error.h"
+#include "pool.h"
+#include "ring.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+#include "zlib.h"
+
+/* adam7 pass geometry, section 8.2 */
+#define ADAM7_PASSES 7
+
+static const uint8_t adam7_x0[] = {0, 4, 0, 2, 0, 1, 0};
+static const uint8_t adam7_y0[] = {0, 0, 4, 0, 2, 0, 1};
+static const uint8_t adam7_dx[] = {8, 8, 4, 4, 2, 2, 1};
+static const uint8_t adam7_dy[] = {8, 8, 8, 4, 4, 2, 2};
+
+static unsigned color_channels(uint8_t color)
+{
+        switch (color) {
+        case COLOR_TRUE:
+                return 3;
+        case COLOR_GREY_ALPHA:
+                return 2;
+        case COLOR_TRUE_ALPHA:
+                return 4;
+        default:
+                return 1;
+        }
+}
+
+/* bytes in a row of w pixels, not counting the filter byte */
+static size_t row_size(const struct png_decoder *dec, uint32_t w)
+{
+        return ((size_t)w * dec->bits + 7) / 8;
+}
+
+/* set up the next pass with any pixels in it, starting at dec->pass */
+static void decoder_start_pass(struct png_decoder *dec)
+{
+        unsigned p;
+
+        for (; dec->pass < (dec->interlaced ? ADAM7_PASSES : 1); dec->pass++) {
+                p = dec->pass;
+                if (dec->interlaced) {
+                        dec->x0 = adam7_x0[p];
+                        dec->y0 = adam7_y0[p];
+                        dec->dx = adam7_dx[p];
+                        dec->dy = adam7_dy[p];
+                } else {
+                        dec->x0 = dec->y0 = 0;
+                        dec->dx = dec->dy = 1;
+                }
+
+                if (dec->width <= dec->x0 || dec->height <= dec->y0)
+                        continue;
+
+                dec->pass_w = (dec->width - dec->x0 + dec->dx - 1) / dec->dx;
+                dec->pass_h = (dec->height - dec->y0 + dec->dy - 1) / dec->dy;
+                dec->pass_y = 0;
+                dec->row_bytes = row_size(dec, dec->pass_w);
+                dec->fill = 0;
+
+                /* the row before the first row of a pass is all zeros */
+                memset(dec->prev, 0, dec->row_bytes + 1);
+                return;
+        }
+
+        dec->done = true;
+}
+
+int decoder_init(struct png_decoder *dec, struct png_image *img)
+{
+        struct chunk *chunk;
+        struct header_chunk *hc;
+        size_t size;
+
+        memset(dec, 0, sizeof *dec);
+
+        chunk = lookup_chunk(img, CHUNK_IHDR);
+        if (!chunk)
+                return -P_ENOCHUNK;
+        hc = header_chunk(chunk);
+
+        if (!hc->width || !hc->height)
+                return -P_EINVAL;
+
+        dec->width = hc->width;
+        dec->height = hc->height;
+        dec->depth = hc->depth;
+        dec->color = hc->color;
+        dec->interlaced = hc->interlace == INTERLACE_ADAM7;
+        dec->bits = dec->depth * color_channels(dec->color);
+        dec->bpp = (dec->bits + 7) / 8;
+
+        if (dec->color == COLOR_INDEXED) {
+                chunk = lookup_chunk(img, CHUNK_PLTE);
+                if (!chunk)
+                        return -P_ENOCHUNK;
+                dec->plte = palette_chunk(chunk);
+        }
+
+        /* no pass is wider than the full image */
+        size = row_size(dec, dec->width) + 1;
+        dec->cur = malloc(size);
+        dec->prev = malloc(size);
+        if (!dec->cur || !dec->prev) {
+                free(dec->cur);
+                free(dec->prev);
+                return -P_ENOMEM;
+        }
+
+        decoder_start_pass(dec);
+        return 0;
+}
+
+void decoder_reset(struct png_decoder *dec, uint32_t width, uint32_t height)
+{
+        dec->width = width;
+        dec->height = height;
+        dec->pass = 0;
+        dec->done = false;
+        dec->stopped = false;
+        dec->stream = NULL;
+        dec->error = 0;
+        decoder_start_pass(dec);
+}
+
+void decoder_fini(struct png_decoder *dec)
+{
+        free(dec->cur);
+        free(dec->prev);
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+        int p, pa, pb, pc;
+
+        p = a + b - c;
+        pa = abs(p - a);
+        pb = abs(p - b);
+        pc = abs(p - c);
+
+        if (pa <= pb && pa <= pc)
+                return a;
+        if (pb <= pc)
+                return b;
+        return c;
+}
+
+/*
+ * undo the filter on cur in place. both rows start with the filter type
+ * byte, and len does not count it. see section 9.2
+ */
+static int unfilter_row(uint8_t *cur, const uint8_t *prev, size_t len,
+                        unsigned bpp)
+{
+        uint8_t *x = cur + 1;
+        const uint8_t *b = prev + 1;
+        size_t i;
+
+        switch (cur[0]) {
+        case FILTER_NONE:
+                break;
+
+        case FILTER_SUB:
+                for (i = bpp; i < len; i++)
+                        x[i] += x[i - bpp];
+                break;
+
+        case FILTER_UP:
+                for (i = 0; i < len; i++)
+                        x[i] += b[i];
+                break;
+
+        case FILTER_AVERAGE:
+                for (i = 0; i < bpp && i < len; i++)
+                        x[i] += b[i] >> 1;
+                for (; i < len; i++)
+                        x[i] += (x[i - bpp] + b[i]) >> 1;
+                break;
+
+        case FILTER_PAETH:
+                for (i = 0; i < bpp && i < len; i++)
+                        x[i] += b[i];
+                for (; i < len; i++)
+                        x[i] += paeth(x[i - bpp], b[i], b[i - bpp]);
+                break;
+
+        default:
+                return -P_EINVAL;
+        }
+
+        return 0;
+}
+
+int decoder_feed(struct png_decoder *dec, const uint8_t *buf,
+                 size_t size)
+{
+        struct png_decode_stats *stats = dec->stats;
+        uint64_t t0 = 0, t1 = 0, tr;
+        uint8_t *tmp;
+        size_t n;
+        int error, stop;
+
+        while (size && !dec->done) {
+                n = dec->row_bytes + 1 - dec->fill;
+                if (n > size)
+                        n = size;
+
+                memcpy(dec->cur + dec->fill, buf, n);
+                dec->fill += n;
+                buf += n;
+                size -= n;
+
+                if (dec->fill < dec->row_bytes + 1)
+                        break;
+
+                if (stats)
+                        t0 = stats_clock();
+                tr = trace_begin();
+                error = unfilter_row(dec->cur, dec->prev, dec->row_bytes,
+                                     dec->bpp);
+                trace_end("unfilter", tr);
+                if (error)
+                        return error;
+                if (stats)
+                        t1 = stats_clock();
+
+                tr = trace_begin();
+                stop = dec->row(dec, dec->cur + 1);
+                trace_end("convert", tr);
+                if (stats) {
+                        stats->unfilter_ns += t1 - t0;
+                        stats->convert_ns += stats_clock() - t1;
+                        stats->rows++;
+                        stats->filters[dec->cur[0]]++;
+                }
+                if (stop) {
+                        dec->stopped = true;
+                        return 1;
+                }
+
+                tmp = dec->prev;
+                dec->prev = dec->cur;
+                dec->cur = tmp;
+                dec->fill = 0;
+
+                if (++dec->pass_y == dec->pass_h) {
+                        dec->pass++;
+                        decoder_start_pass(dec);
+                }
+        }
+
+        /* anything past the last row is ignored */
+        return 0;
+}
+
+/* output sink for zlib_decompress */
+int decoder_drain(struct zlib_stream *stream, const uint8_t *buf,
+                  size_t size)
+{
+        struct png_decoder *dec = stream->z_priv;
+        int ret;
+
+        dec->stream = stream;
+        ret = decoder_feed(dec, buf, size);
+        if (ret < 0) {
+                dec->error = ret;
+                return 1;
+        }
+        return ret;
+}
+
+/* unpack sample i from a row of samples that are less than a byte wide */
+static inline unsigned unpack(const uint8_t *row, size_t i, unsigned depth)
+{
+        size_t bit = i * depth;
+        unsigned shift = 8 - depth - bit % 8;
+
+        return (row[bit / 8] >> shift) & ((1U << depth) - 1);
+}
+
+void convert_row(const struct png_decoder *dec, const uint8_t *row,
+                 size_t i, size_t n, uint8_t *out, size_t step)
+{
+        const struct palette_entry *pe;
+        unsigned s, v, scale;
+
+        /* 16 bit samples are truncated to their most significant byte */
+        s = dec->depth == 16 ? 2 : 1;
+
+        switch (dec->color) {
+        case COLOR_GREYSCALE:
+                scale = dec->depth < 8 ? 255 / ((1U << dec->depth) - 1) : 1;
+                for (; n; n--, i++, out += step) {
+                        v = dec->depth < 8
+                                ? unpack(row, i, dec->depth) * scale
+                                : row[i * s];
+                        out[0] = out[1] = out[2] = v;
+                        out[3] = 0xff;
+                }
+                break;
+
+        case COLOR_INDEXED:
+                for (; n; n--, i++, out += step) {
+                        v = dec->depth < 8 ? unpack(row, i, dec->depth)
+                                : row[i];
+                        if (v < dec->plte->entries) {
+                                pe = &dec->plte->palette[v];
+                                out[0] = pe->red;
+                                out[1] = pe->green;
+                                out[2] = pe->blue;
+                        } else {
+                                out[0] = out[1] = out[2] = 0;
+                        }
+                        out[3] = 0xff;
+                }
+                break;
+
+        case COLOR_GREY_ALPHA:
+                for (row += 2 * s * i; n; n--, row += 2 * s, out += step) {
+                        out[0] = out[1] = out[2] = row[0];
+                        out[3] = row[s];
+                }
+                break;
+
+        case COLOR_TRUE:
+                for (row += 3 * s * i; n; n--, row += 3 * s, out += step) {
+                        out[0] = row[0];
+                        out[1] = row[s];
+                        out[2] = row[2 * s];
+                        out[3] = 0xff;
+                }
+                break;
+
+        case COLOR_TRUE_ALPHA:
+                for (row += 4 * s * i; n; n--, row += 4 * s, out += step) {
+                        out[0] = row[0];
+                        out[1] = row[s];
+                        out[2] = row[2 * s];
+                        out[3] = row[3 * s];
+                }
+                break;
+        }
+}
+
+static int pixels_alloc(struct png_pixels *pixels, uint32_t w, uint32_t h)
+{
+        pixels->width = w;
+        pixels->height = h;
+        pixels->stride = (size_t)w * 4;
+        pixels->data = malloc(pixels->stride * h);
+        return pixels->data ? 0 : -P_ENOMEM;
+}
+
+/* what the region row callback needs to know */
+struct region {
+        struct png_rect rect;
+        struct png_pixels *out;
+
+        /*
+         * the last pass with any rows inside rect, and whether to stop
+         * once we're past rect in that pass
+         */
+        unsigned last_pass;
+        bool stop;
+};
+
+/* does pass p have any pixels in rows [y, yend) of the image? */
+static bool pass_hits_rows(const struct png_decoder *dec, unsigned p,
+                           uint32_t y, uint32_t yend)
+{
+        uint32_t first;
+
+        if (dec->width <= adam7_x0[p])
+                return false;
+
+        /* first row of the pass at or below y */
+        first = adam7_y0[p];
+        if (y > first)
+                first += (y - first + adam7_dy[p] - 1) / adam7_dy[p]
+                        * adam7_dy[p];
+
+        return first < yend && first < dec->height;
+}
+
+static int region_row(struct png_decoder *dec, const uint8_t *row)
+{
+        struct region *r = dec->priv;
+        uint32_t y, i0, i1, rx, rend;
+        uint8_t *out;
+
+        y = dec->y0 + dec->pass_y * dec->dy;
+        rx = r->rect.x;
+        rend = r->rect.x + r->rect.w;
+
+        if (y >= r->rect.y && y < r->rect.y + r->rect.h) {
+                /* first pixel of this pass at or after rx, and before rend */
+                i0 = rx > dec->x0 ? (rx - dec->x0 + dec->dx - 1) / dec->dx : 0;
+                i1 = rend > dec->x0
+                        ? (rend - dec->x0 + dec->dx - 1) / dec->dx : 0;
+                if (i1 > dec->pass_w)
+                        i1 = dec->pass_w;
+
+                if (i0 < i1) {
+                        out = r->out->data
+                                + (size_t)(y - r->rect.y) * r->out->stride
+                                + (size_t)(dec->x0 + i0 * dec->dx - rx) * 4;
+                        convert_row(dec, row, i0, i1 - i0, out, dec->dx * 4);
+                }
+        }
+
+        /*
+         * once the last pass gets past the bottom of rect, nothing later in
+         * the stream can touch it
+         */
+        return r->stop && dec->pass == r->last_pass
+                && y + dec->dy >= r->rect.y + r->rect.h;
+}
+
+struct png_index {
+        struct zlib_index zi;
+
+        /* the image it's for, so it doesn't get used on another one */
+        uint32_t width;
+        uint32_t height;
+        uint8_t depth;
+        uint8_t color;
+
+        /* set once a whole decode has gone through */
+        bool complete;
+};
+
+/* what a decoder had at a checkpoint, hung off of c_priv */
+struct row_state {
+        uint32_t pass_y;
+        size_t fill;
+
+        /* the previous row, then as much of the current one as we had */
+        uint8_t rows[];
+};
+
+/* zi_save callback: stash the decoder's rows with a new checkpoint */
+static int index_save(struct zlib_stream *stream, struct zlib_checkpoint *cp)
+{
+        const struct png_decoder *dec = stream->z_priv;
+        struct row_state *rs;
+        size_t prev = dec->row_bytes + 1;
+
+        rs = malloc(sizeof *rs + prev + dec->fill);
+        if (!rs)
+                return -P_ENOMEM;
+
+        rs->pass_y = dec->pass_y;
+        rs->fill = dec->fill;
+        memcpy(rs->rows, dec->prev, prev);
+        memcpy(rs->rows + prev, dec->cur, dec->fill);
+        cp->c_priv = rs;
+        return 0;
+}
+
+/*
+ * set a stream up for a decode with dec->index: either build the index
+ * along the way, or pick up from the last checkpoint before the first row
+ * we want
+ */
+static int index_start(struct png_decoder *dec, struct zlib_stream *stream)
+{
+        struct png_index *index = dec->index;
+        const struct zlib_checkpoint *cp;
+        const struct row_state *rs;
+        int error;
+
+        if (!index->complete) {
+                if (!dec->interlaced)
+                        stream->z_index = &index->zi;
+                return zlib_inflate_init(stream);
+        }
+
+        cp = zlib_index_find(&index->zi, (size_t)dec->start_row
+                             * (dec->row_bytes + 1));
+        if (!cp)
+                return zlib_inflate_init(stream);
+
+        error = zlib_inflate_resume(stream, cp);
+        if (error)
+                return error;
+
+        rs = cp->c_priv;
+        dec->pass_y = rs->pass_y;
+        dec->fill = rs->fill;
+        memcpy(dec->prev, rs->rows, dec->row_bytes + 1);
+        memcpy(dec->cur, rs->rows + dec->row_bytes + 1, rs->fill);
+        return 0;
+}
+
+void png_index_free(struct png_index *index)
+{
+        if (!index)
+                return;
+        zlib_index_free(&index->zi);
+        free(index);
+}
+
+/*
+ * The zlib stream is split over all of the data chunks. If there's just
+ * one we can use it in place, otherwise glue them together into *owned.
+ */
+static int gather_data(struct png_image *img, const uint8_t **src,
+                       size_t *size, uint8_t **owned)
+{
+        struct chunk *chunk;
+        struct data_chunk *dc;
+        unsigned count = 0;
+        size_t total = 0;
+        uint8_t *buf;
+
+        *owned = NULL;
+        for (chunk = img->first; chunk; chunk = chunk->next) {
+                if (chunk->c_tmpl->ct_type_idx != CHUNK_IDAT)
+                        continue;
+                dc = data_chunk(chunk);
+                count++;
+                total += chunk->length;
+                *src = dc->buf;
+        }
+
+        if (!count)
+                return -P_ENOCHUNK;
+
+        *size = total;
+        if (count == 1)
+                return 0;
+
+        buf = malloc(total);
+        if (!buf)
+                return -P_ENOMEM;
+
+        total = 0;
+        for (chunk = img->first; chunk; chunk = chunk->next) {
+                if (chunk->c_tmpl->ct_type_idx != CHUNK_IDAT)
+                        continue;
+                memcpy(buf + total, data_chunk(chunk)->buf, chunk->length);
+                total += chunk->length;
+        }
+
+        *src = buf;
+        *owned = buf;
+        return 0;
+}
+
+/* how inflated data gets from the stream to the decoder */
+enum decode_mode {
+        /* inflate and unfilter in turn, one row at a time */
+        DECODE_SERIAL,
+
+        /* inflate on another thread, passing rows over through a ring */
+        DECODE_PIPELINED,
+
+        /* inflate everything with zlib_decompress_parallel, then unfilter */
+        DECODE_PARALLEL,
+};
+
+/* room for inflated data on its way between threads in DECODE_PIPELINED */
+#define PIPELINE_RING_SIZE (1 << 20)
+
+/* the inflating half of a pipelined decode */
+struct pipeline {
+        struct pool_job job;
+        struct zlib_stream *stream;
+        struct ring *ring;
+        int error;
+};
+
+/* zlib_stream output sink that hands inflated bytes to the other thread */
+static int pipeline_drain(struct zlib_stream *stream, const uint8_t *buf,
+                          size_t size)
+{
+        struct pipeline *pl = stream->z_priv;
+
+        return ring_write(pl->ring, buf, size);
+}
+
+static void pipeline_run(struct pool_job *job)
+{
+        struct pipeline *pl = container_of(job, struct pipeline, job);
+
+        pl->error = zlib_decompress(pl->stream);
+        ring_close(pl->ring);
+}
+
+/*
+ * inflate stream on a thread of its own, while this one unfilters and
+ * converts whatever has come out so far. returns like zlib_decompress does
+ * with decoder_drain, so Z_STOPPED means look at dec->error.
+ */
+static int decode_pipelined(struct png_decoder *dec,
+                            struct zlib_stream *stream)
+{
+        struct pipeline pl;
+        struct pool *pool;
+        const uint8_t *buf;
+        size_t n;
+        int error = 0;
+
+        pl.ring = ring_new(PIPELINE_RING_SIZE);
+        if (!pl.ring)
+                return -P_ENOMEM;
+        pool = pool_new(1);
+        if (!pool) {
+                ring_free(pl.ring);
+                return -P_ENOMEM;
+        }
+
+        pl.job.fn = pipeline_run;
+        pl.stream = stream;
+        stream->z_drain = pipeline_drain;
+        stream->z_drain_size = row_size(dec, dec->width) + 1;
+        stream->z_priv = &pl;
+        pool_submit(pool, &pl.job);
+
+        while ((n = ring_peek(pl.ring, &buf))) {
+                error = decoder_feed(dec, buf, n);
+                ring_consume(pl.ring, n);
+                if (error) {
+                        /* the inflater gives up at its next write */
+                        ring_stop(pl.ring);
+                        break;
+                }
+        }
+
+        pool_wait(pool, &pl.job);
+        pool_free(pool);
+        ring_free(pl.ring);
+
+        /*
+         * the inflater may have finished before we stopped it, so don't
+         * count on it returning Z_STOPPED
+         */
+        if (error < 0)
+                dec->error = error;
+        if (error)
+                return Z_STOPPED;
+        return pl.error;
+}
+
+/*
+ * inflate the image data, handing rows to dec->row as they are completed.
+ * if src_read is not NULL, the number of compressed bytes consumed is
+ * written to it. DECODE_PARALLEL inflates on threads threads, and holds on
+ * to the whole lot before unfiltering any of it. other than with
+ * DECODE_SERIAL, crcs left by PARSE_DEFER_CRC are checked on threads
+ * threads while all that goes on.
+ */
+static int decode_rows(struct png_image *img, struct png_decoder *dec,
+                       size_t *src_read, enum decode_mode mode,
+                       unsigned threads)
+{
+        struct zlib_stream stream;
+        struct crc_check *check;
+        uint8_t *owned;
+        uint64_t t0 = 0;
+        int error, crc_error;
+
+        memset(&stream, 0, sizeof stream);
+        error = gather_data(img, &stream.z_src, &stream.z_src_end, &owned);
+        if (error)
+                return error;
+
+        /* serial crc checks are all done by crc_check_start */
+        if (dec->stats) {
+                stream.z_stats = &dec->stats->zlib;
+                t0 = stats_clock();
+        }
+        error = crc_check_start(img, mode == DECODE_SERIAL ? 1 : threads,
+                                &check);
+        if (dec->stats)
+                dec->stats->crc_ns += stats_clock() - t0;
+        if (error) {
+                free(owned);
+                return error;
+        }
+
+        switch (mode) {
+        case DECODE_SERIAL:
+                /* hand rows over as soon as they are complete */
+                stream.z_drain = decoder_drain;
+                stream.z_drain_size = row_size(dec, dec->width) + 1;
+                stream.z_priv = dec;
+
+                if (dec->index) {
+                        error = index_start(dec, &stream);
+                        if (!error)
+                                error = zlib_inflate(&stream);
+                } else {
+                        error = zlib_decompress(&stream);
+                }
+                break;
+        case DECODE_PIPELINED:
+                error = decode_pipelined(dec, &stream);
+                break;
+        case DECODE_PARALLEL:
+                error = zlib_decompress_parallel(&stream, threads);
+                if (!error) {
+                        dec->stream = &stream;
+                        error = decoder_feed(dec, stream.z_dst,
+                                             stream.z_dst_idx);
+                        if (error < 0)
+                                dec->error = error;
+                        else if (error)
+                                error = Z_STOPPED;
+                }
+                break;
+        }
+
+        if (error == Z_STOPPED)
+                error = dec->error;
+        else if (!error && !dec->done)
+                error = -P_E2SMALL;
+
+        /* corrupt data probably explains anything else that went wrong */
+        crc_error = crc_check_wait(check);
+        if (crc_error)
+                error = crc_error;
+
+        if (src_read)
+                *src_read = stream.z_src_idx + !!stream.z_src_bidx;
+
+        zlib_end(&stream);
+        free(stream.z_dst);
+        free(owned);
+        return error;
+}
+
+static int decode_region(struct png_image *img, const struct png_rect *rect,
+                         struct png_pixels *out, size_t *src_read,
+                         enum decode_mode mode, unsigned threads,
+                         struct png_index *index,
+                         struct png_decode_stats *stats)
+{
+        struct png_decoder dec;
+        struct region region;
+        unsigned p;
+        int error;
+
+        memset(out, 0, sizeof *out);
+
+        error = decoder_init(&dec, img);
+        if (error)
+                return error;
+
+        error = -P_ERANGE;
+        if (!rect->w || !rect->h
+            || rect->x >= dec.width || dec.width - rect->x < rect->w
+            || rect->y >= dec.height || dec.height - rect->y < rect->h)
+                goto out_decoder;
+
+        error = pixels_alloc(out, rect->w, rect->h);
+        if (error)
+                goto out_decoder;
+
+        region.rect = *rect;
+        region.out = out;
+        region.last_pass = 0;
+        for (p = 0; dec.interlaced && p < ADAM7_PASSES; p++)
+                if (pass_hits_rows(&dec, p, rect->y, rect->y + rect->h))
+                        region.last_pass = p;
+
+        /*
+         * there's nothing to save by stopping at the bottom of the image,
+         * and not stopping means the checksum gets verified
+         */
+        region.stop = rect->y + rect->h < dec.height;
+
+        dec.row = region_row;
+        dec.priv = &region;
+        dec.index = index;
+        dec.start_row = rect->y;
+        dec.stats = stats;
+
+        error = decode_rows(img, &dec, src_read, mode, threads);
+        if (error)
+                png_pixels_free(out);
+out_decoder:
+        decoder_fini(&dec);
+        return error;
+}
+
+int png_decode_region(struct png_image *img, const struct png_rect *rect,
+                      struct png_pixels *out, size_t *src_read)
+{
+        return decode_region(img, rect, out, src_read, DECODE_SERIAL, 1,
+                             NULL, NULL);
+}
+
+/* decode_region over the whole image */
+static int decode_whole(struct png_image *img, struct png_pixels *out,
+                        enum decode_mode mode, unsigned threads,
+                        struct png_index *index,
+                        struct png_decode_stats *stats)
+{
+        struct png_rect rect;
+        struct chunk *chunk;
+
+        chunk = lookup_chunk(img, CHUNK_IHDR);
+        if (!chunk)
+                return -P_ENOCHUNK;
+
+        rect.x = 0;
+        rect.y = 0;
+        rect.w = header_chunk(chunk)->width;
+        rect.h = header_chunk(chunk)->height;
+        return decode_region(img, &rect, out, NULL, mode, threads, index,
+                             stats);
+}
+
+int png_decode_threads(struct png_image *img, struct png_pixels *out,
+                       unsigned threads)
+{
+        return decode_whole(img, out, threads == 1 ? DECODE_SERIAL
+                            : DECODE_PARALLEL, threads, NULL, NULL);
+}
+
+int png_decode_pipelined(struct png_image *img, struct png_pixels *out)
+{
+        return decode_whole(img, out, DECODE_PIPELINED, 0, NULL, NULL);
+}
+
+int png_decode(struct png_image *img, struct png_pixels *out)
+{
+        return png_decode_threads(img, out, 1);
+}
+
+int png_decode_stats(struct png_image *img, struct png_pixels *out,
+                     struct png_decode_stats *stats)
+{
+        uint64_t t0;
+        int error;
+
+        t0 = stats_clock();
+        error = decode_whole(img, out, DECODE_SERIAL, 1, NULL, stats);
+        stats->total_ns += stats_clock() - t0;
+        return error;
+}
+
+int png_decode_indexed(struct png_image *img, size_t spacing,
+                       struct png_pixels *out, struct png_index **index)
+{
+        struct header_chunk *hc;
+        struct png_index *pi;
+        struct chunk *chunk;
+        int error;
+
+        chunk = lookup_chunk(img, CHUNK_IHDR);
+        if (!chunk)
+                return -P_ENOCHUNK;
+        hc = header_chunk(chunk);
+
+        pi = calloc(1, sizeof *pi);
+        if (!pi)
+                return -P_ENOMEM;
+        zlib_index_init(&pi->zi, spacing);
+        pi->zi.zi_save = index_save;
+        pi->width = hc->width;
+        pi->height = hc->height;
+        pi->depth = hc->depth;
+        pi->color = hc->color;
+
+        error = decode_whole(img, out, DECODE_SERIAL, 1, pi, NULL);
+        if (error) {
+                png_index_free(pi);
+                return error;
+        }
+
+        pi->complete = true;
+        *index = pi;
+        return 0;
+}
+
+int png_decode_rows(struct png_image *img, struct png_index *index,
+                    uint32_t y, uint32_t h, struct png_pixels *out)
+{
+        struct header_chunk *hc;
+        struct png_rect rect;
+        struct chunk *chunk;
+
+        chunk = lookup_chunk(img, CHUNK_IHDR);
+        if (!chunk)
+                return -P_ENOCHUNK;
+        hc = header_chunk(chunk);
+
+        if (!index->complete || hc->width != index->width
+            || hc->height != index->height || hc->depth != index->depth
+            || hc->color != index->color)
+                return -P_EINVAL;
+
+        rect.x = 0;
+        rect.y = y;
+        rect.w = hc->width;
+        rect.h = h;
+        return decode_region(img, &rect, out, NULL, DECODE_SERIAL, 1, index,
+                             NULL);
+}
+
+void png_pixels_free(struct png_pixels *pixels)
+{
+        free(pixels->data);
+        pixels->data = NULL;
+}
+
+
+/*
+ * Scaled decoding uses an area (box) filter: each output pixel is the
+ * average of the source pixels it covers, with source pixels that straddle
+ * an output pixel boundary split between the two by coverage. Since we
+ * only ever scale down, a source pixel touches at most two output pixels
+ * along each axis, so an axis map just records, for each source index, the
+ * first output index it touches and its weight into that one and the
+ * next. Weights are fixed point, and sum to exactly 1 << bits for every
+ * output pixel.
+ */
+struct axis_tap {
+        uint32_t dst;
+        uint32_t w0;
+        uint32_t w1;
+};
+
+/* fixed point scales for the horizontal and vertical weights */
+#define SCALE_XBITS 16
+#define SCALE_YBITS 15
+
+static struct axis_tap *axis_map(uint32_t src, uint32_t dst, unsigned bits)
+{
+        struct axis_tap *taps;
+        uint64_t lo, hi, edge, cum, n, prev;
+        uint32_t i, j;
+
+        taps = malloc(src * sizeof *taps);
+        if (!taps)
+                return NULL;
+
+        /*
+         * measure in units of 1/(src*dst) of the image so that every
+         * boundary is an integer: source pixel i covers [i*dst, (i+1)*dst)
+         * and output pixel j covers [j*src, (j+1)*src). Rounding the
+         * running total rather than each weight keeps the sums exact.
+         */
+        cum = prev = 0;
+        for (i = 0, j = 0; i < src; i++) {
+                lo = (uint64_t)i * dst;
+                hi = lo + dst;
+                edge = (uint64_t)(j + 1) * src;
+
+                taps[i].dst = j;
+                cum += (hi < edge ? hi : edge) - lo;
+                n = ((cum << bits) + src / 2) / src;
+                taps[i].w0 = n - prev;
+                prev = n;
+                taps[i].w1 = 0;
+
+                if (hi >= edge) {
+                        j++;
+                        cum = hi - edge;
+                        prev = ((cum << bits) + src / 2) / src;
+                        taps[i].w1 = prev;
+                }
+        }
+
+        return taps;
+}
+
+/* what the scaled row callback needs */
+struct scaler {
+        struct png_pixels *out;
+        struct axis_tap *xtaps;
+        struct axis_tap *ytaps;
+
+        /* one source row converted to RGBA */
+        uint8_t *rgba;
+
+        /* one horizontally filtered row, with a spare pixel at the end */
+        uint32_t *hacc;
+
+        /*
+         * vertical accumulators, one row per output row with a spare at the
+         * end. for non-interlaced images only two of them are ever live at
+         * once, so we keep a ring of two and emit rows as they complete.
+         * adam7 passes revisit every output row, so interlaced images need
+         * one for every output row.
+         */
+        uint32_t *vacc;
+        uint32_t nvacc;
+};
+
+static uint32_t *scaler_vrow(struct scaler *sc, uint32_t j)
+{
+        return sc->vacc + (size_t)(j % sc->nvacc) * (sc->out->width + 1) * 4;
+}
+
+/*
+ * horizontally filter n converted pixels that sit at image columns
+ * x0, x0 + dx, ... into hacc
+ */
+static void scale_row_h(struct scaler *sc, const uint8_t *px, uint32_t n,
+                        uint32_t x0, uint32_t dx)
+{
+        const struct axis_tap *t;
+        uint32_t *h0, *h1;
+        unsigned c;
+
+        memset(sc->hacc, 0, (sc->out->width + 1) * 4 * sizeof *sc->hacc);
+
+        for (t = &sc->xtaps[x0]; n; n--, px += 4, t += dx) {
+                h0 = sc->hacc + t->dst * 4;
+                h1 = h0 + 4;
+                for (c = 0; c < 4; c++) {
+                        h0[c] += t->w0 * px[c];
+                        h1[c] += t->w1 * px[c];
+                }
+        }
+}
+
+/* add the horizontally filtered row into the vertical accumulators */
+static void scale_row_v(struct scaler *sc, const struct axis_tap *t)
+{
+        uint32_t *v0, *v1;
+        uint32_t h;
+        size_t i, n;
+
+        v0 = scaler_vrow(sc, t->dst);
+        v1 = scaler_vrow(sc, t->dst + 1);
+        n = (size_t)(sc->out->width + 1) * 4;
+
+        /*
+         * drop the low byte of the horizontal sums so that the vertical
+         * ones fit in 32 bits: 255 << 8 times weights summing to 1 << 15.
+         * these loops are written so that the compiler can vectorize them.
+         */
+        for (i = 0; i < n; i++) {
+                h = sc->hacc[i] >> 8;
+                v0[i] += h * t->w0;
+        }
+        if (t->w1)
+                for (i = 0; i < n; i++)
+                        v1[i] += (sc->hacc[i] >> 8) * t->w1;
+}
+
+/* write out finished output row j and clear its accumulator */
+static void scale_emit(struct scaler *sc, uint32_t j)
+{
+        const unsigned shift = SCALE_XBITS - 8 + SCALE_YBITS;
+        uint32_t *v;
+        uint8_t *out;
+        size_t i, n;
+
+        if (j >= sc->out->height)
+                return;
+
+        v = scaler_vrow(sc, j);
+        out = sc->out->data + (size_t)j * sc->out->stride;
+        n = (size_t)sc->out->width * 4;
+        for (i = 0; i < n; i++)
+                out[i] = (v[i] + (1U << (shift - 1))) >> shift;
+
+        memset(v, 0, (n + 4) * sizeof *v);
+}
+
+static int scaled_row(struct png_decoder *dec, const uint8_t *row)
+{
+        struct scaler *sc = dec->priv;
+        const struct axis_tap *t;
+        uint32_t y;
+
+        y = dec->y0 + dec->pass_y * dec->dy;
+        t = &sc->ytaps[y];
+
+        convert_row(dec, row, 0, dec->pass_w, sc->rgba, 4);
+        scale_row_h(sc, sc->rgba, dec->pass_w, dec->x0, dec->dx);
+        scale_row_v(sc, t);
+
+        /* a row is done once the next source row has moved past it */
+        if (!dec->interlaced
+            && (y + 1 == dec->height || sc->ytaps[y + 1].dst != t->dst))
+                scale_emit(sc, t->dst);
+
+        return 0;
+}
+
+int png_decode_scaled(struct png_image *img, uint32_t w, uint32_t h,
+                      struct png_pixels *out)
+{
+        struct png_decoder dec;
+        struct scaler sc;
+        uint32_t j;
+        int error;
+
+        memset(out, 0, sizeof *out);
+        memset(&sc, 0, sizeof sc);
+
+        error = decoder_init(&dec, img);
+        if (error)
+                return error;
+
+        error = -P_ERANGE;
+        if (!w || !h || w > dec.width || h > dec.height)
+                goto out_decoder;
+
+        error = pixels_alloc(out, w, h);
+        if (error)
+                goto out_decoder;
+
+        error = -P_ENOMEM;
+        sc.out = out;
+        sc.nvacc = dec.interlaced ? h + 1 : 2;
+        sc.xtaps = axis_map(dec.width, w, SCALE_XBITS);
+        sc.ytaps = axis_map(dec.height, h, SCALE_YBITS);
+        sc.rgba = malloc((size_t)dec.width * 4);
+        sc.hacc = malloc((size_t)(w + 1) * 4 * sizeof *sc.hacc);
+        sc.vacc = calloc((size_t)sc.nvacc * (w + 1) * 4, sizeof *sc.vacc);
+        if (!sc.xtaps || !sc.ytaps || !sc.rgba || !sc.hacc || !sc.vacc)
+                goto out_scaler;
+
+        dec.row = scaled_row;
+        dec.priv = &sc;
+
+        error = decode_rows(img, &dec, NULL, DECODE_SERIAL, 1);
+        if (!error && dec.interlaced)
+                for (j = 0; j < h; j++)
+                        scale_emit(&sc, j);
+
+out_scaler:
+        free(sc.xtaps);
+        free(sc.ytaps);
+        free(sc.rgba);
+        free(sc.hacc);
+        free(sc.vacc);
+        if (error)
+                png_pixels_free(out);
+out_decoder:
+        decoder_fini(&dec);
+        return error;
+}
+
+
+/*
+ * After adam7 pass p, every pixel whose coordinates are multiples of these
+ * has been decoded, so a preview can fill each block from its top left.
+ */
+static const uint8_t preview_bw[] = {8, 4, 4, 2, 2, 1, 1};
+static const uint8_t preview_bh[] = {8, 8, 4, 4, 2, 2, 1};
+
+/* what the progressive row callback needs */
+struct progressive {
+        struct png_pixels *out;
+        unsigned last_pass;
+        int (*cb)(const struct png_pixels *preview, unsigned pass,
+                  size_t src_read, void *priv);
+        void *priv;
+};
+
+/*
+ * fill in the pixels that later passes haven't delivered yet by replicating
+ * the decoded pixel at the top left of each block. Block origins are never
+ * overwritten, so this can be done in place, and later passes simply
+ * overwrite the guesses.
+ */
+static void preview_fill(struct png_pixels *px, unsigned pass)
+{
+        uint32_t bw = preview_bw[pass], bh = preview_bh[pass];
+        uint32_t x, y, k;
+        uint8_t *row, *src;
+
+        for (y = 0; y < px->height; y++) {
+                row = px->data + (size_t)y * px->stride;
+                if (y & (bh - 1)) {
+                        src = px->data + (size_t)(y & ~(bh - 1)) * px->stride;
+                        memcpy(row, src, (size_t)px->width * 4);
+                        continue;
+                }
+
+                for (x = 0; bw > 1 && x < px->width; x += bw)
+                        for (k = 1; k < bw && x + k < px->width; k++)
+                                memcpy(row + (x + k) * 4, row + x * 4, 4);
+        }
+}
+
+static int progressive_row(struct png_decoder *dec, const uint8_t *row)
+{
+        struct progressive *pr = dec->priv;
+        struct png_pixels *out = pr->out;
+        unsigned pass;
+        uint32_t y;
+
+        y = dec->y0 + dec->pass_y * dec->dy;
+        convert_row(dec, row, 0, dec->pass_w,
+                    out->data + (size_t)y * out->stride + dec->x0 * 4,
+                    dec->dx * 4);
+
+        if (dec->pass_y + 1 < dec->pass_h)
+                return 0;
+
+        /*
+         * that was the last row of the pass. empty passes that follow it
+         * are done too. passes are numbered from 1 to the outside world.
+         */
+        pass = ADAM7_PASSES;
+        if (dec->interlaced) {
+                for (pass = dec->pass + 1; pass < ADAM7_PASSES; pass++)
+                        if (dec->width > adam7_x0[pass]
+                            && dec->height > adam7_y0[pass])
+                                break;
+                if (pass < ADAM7_PASSES)
+                        preview_fill(out, pass - 1);
+        }
+
+        if (pr->cb && pr->cb(out, pass, dec->stream->z_src_idx, pr->priv))
+                return 1;
+
+        /* no point stopping after the last pass, let the checksum run */
+        return pass >= pr->last_pass && pass < ADAM7_PASSES;
+}
+
+int png_decode_progressive(struct png_image *img, unsigned last_pass,
+                           int (*cb)(const struct png_pixels *preview,
+                                     unsigned pass, size_t src_read,
+                                     void *priv),
+                           void *priv, struct png_pixels *out,
+                           size_t *src_read)
+{
+        struct png_decoder dec;
+        struct progressive pr;
+        int error;
+
+        memset(out, 0, sizeof *out);
+
+        error = decoder_init(&dec, img);
+        if (error)
+                return error;
+
+        error = -P_ERANGE;
+        if (last_pass < 1 || last_pass > ADAM7_PASSES)
+                goto out_decoder;
+
+        error = pixels_alloc(out, dec.width, dec.height);
+        if (error)
+                goto out_decoder;
+
+        pr.out = out;
+        pr.last_pass = last_pass;
+        pr.cb = cb;
+        pr.priv = priv;
+
+        dec.row = progressive_row;
+        dec.priv = &pr;
+
+        error = decode_rows(img, &dec, src_read, DECODE_SERIAL, 1);
+        if (error)
+                png_pixels_free(out);
+out_decoder:
+        decoder_fini(&dec);
+        return error;
+}
@@ -0,0 +1,241 @@
+#ifndef PNG_DECODE_H
+#define PNG_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "zlib.h"
+
+/* decoded pixels. always 8 bits per channel RGBA */
+struct png_pixels {
+        uint32_t width;
+        uint32_t height;
+
+        /* bytes from the start of one row to the start of the next */
+        size_t stride;
+
+        uint8_t *data;
+};
+
+/* a rectangle within an image, in pixels */
+struct png_rect {
+        uint32_t x;
+        uint32_t y;
+        uint32_t w;
+        uint32_t h;
+};
+
+/* decode a whole image whose chunks have already been parsed */
+int png_decode(struct png_image *img, struct png_pixels *out);
+
+/*
+ * png_decode with the image data inflated on threads threads (0 for one
+ * per cpu) by zlib_decompress_parallel. It all has to be inflated before
+ * any of it can be unfiltered, so this holds on to the whole filtered
+ * image. Streams deflated in independent pieces (see ENCODE_INDEPENDENT in
+ * encode.h) split up best.
+ */
+int png_decode_threads(struct png_image *img, struct png_pixels *out,
+                       unsigned threads);
+
+/*
+ * png_decode with inflating and unfiltering overlapped: the image data is
+ * inflated on a thread of its own, which passes the inflated scanlines
+ * through a ring to the calling thread to be unfiltered and converted. This
+ * works for any stream, but can't go faster than the slower of the two.
+ */
+int png_decode_pipelined(struct png_image *img, struct png_pixels *out);
+
+/*
+ * Decode only the pixels inside rect. Every scanline up to the last one
+ * touching rect still has to be inflated and unfiltered, but inflating
+ * stops as soon as that scanline is complete, and nothing outside rect is
+ * converted or stored. If src_read is not NULL, the number of compressed
+ * bytes that were consumed is written to it.
+ */
+int png_decode_region(struct png_image *img, const struct png_rect *rect,
+                      struct png_pixels *out, size_t *src_read);
+
+/*
+ * Decode straight to a w x h image no bigger than the source, using an
+ * area filter. Scanlines are filtered into a small ring of accumulator
+ * rows as they come out of the inflater, so the full resolution image is
+ * never held in memory. (Adam7 interlaced images visit every output row
+ * once per pass, so for those the accumulators cover the whole output.)
+ */
+int png_decode_scaled(struct png_image *img, uint32_t w, uint32_t h,
+                      struct png_pixels *out);
+
+/*
+ * Decode an Adam7 interlaced image progressively. After each pass, the
+ * pixels decoded so far are upsampled in place into a full size preview
+ * and cb (if not NULL) is called with it, the pass number (1-7), and the
+ * number of compressed bytes consumed so far. Decoding stops after pass
+ * last_pass, or as soon as cb returns nonzero, and out holds the latest
+ * preview. Non-interlaced images just get a single callback for pass 7.
+ */
+int png_decode_progressive(struct png_image *img, unsigned last_pass,
+                           int (*cb)(const struct png_pixels *preview,
+                                     unsigned pass, size_t src_read,
+                                     void *priv),
+                           void *priv, struct png_pixels *out,
+                           size_t *src_read);
+
+/*
+ * Checkpoints into an image's compressed data, so that a band of rows can
+ * be decoded without inflating everything before it (see
+ * zlib_inflate_resume). Each one holds a deflated 32K window and about two
+ * rows of decoder state.
+ */
+struct png_index;
+
+/* a reasonable distance between checkpoints, in inflated bytes */
+#define PNG_INDEX_SPACING (1UL << 20)
+
+/*
+ * png_decode, also building an index with a checkpoint at the first block
+ * boundary after every spacing bytes of inflated data. Adam7 interlaced
+ * images get an index with no checkpoints, since every pass covers the
+ * whole image anyway.
+ */
+int png_decode_indexed(struct png_image *img, size_t spacing,
+                       struct png_pixels *out, struct png_index **index);
+
+/*
+ * Decode rows [y, y + h) of an image into a full width, h row image,
+ * inflating from the last checkpoint in index before row y rather than
+ * from the start, and stopping after row y + h - 1. index has to have come
+ * from png_decode_indexed on the same image.
+ */
+int png_decode_rows(struct png_image *img, struct png_index *index,
+                    uint32_t y, uint32_t h, struct png_pixels *out);
+
+void png_index_free(struct png_index *index);
+
+/*
+ * where png_decode_stats spent its time, and what it found. times are in
+ * nanoseconds
+ */
+struct png_decode_stats {
+        /* inflating, with z_drain's share being unfilter and convert */
+        struct zlib_stats zlib;
+
+        /* scanlines unfiltered (counting every pass), by filter type */
+        uint64_t rows;
+        uint64_t filters[5];
+
+        /* unfiltering rows, and converting them to RGBA */
+        uint64_t unfilter_ns;
+        uint64_t convert_ns;
+
+        /* checking IDAT crcs that parsing left to us (PARSE_DEFER_CRC) */
+        uint64_t crc_ns;
+
+        /* the whole decode */
+        uint64_t total_ns;
+};
+
+/*
+ * png_decode, filling in stats along the way. stats cost a clock read or
+ * two per row and per block, and a few increments per symbol; none of
+ * that happens for the other decode calls.
+ */
+int png_decode_stats(struct png_image *img, struct png_pixels *out,
+                     struct png_decode_stats *stats);
+
+void png_pixels_free(struct png_pixels *pixels);
+
+/*
+ * State for turning a stream of inflated bytes into unfiltered scanlines.
+ * For interlaced images, each adam7 pass is treated as its own (smaller)
+ * image, and scanlines are handed out pass by pass.
+ */
+struct png_decoder {
+        /* image geometry and format, from the header */
+        uint32_t width;
+        uint32_t height;
+        uint8_t depth;
+        uint8_t color;
+        bool interlaced;
+        const struct palette_chunk *plte;
+
+        /* bits per pixel, and bytes per pixel rounded up */
+        unsigned bits;
+        unsigned bpp;
+
+        /* current pass (always 0 if not interlaced) and its geometry */
+        unsigned pass;
+        uint32_t x0, y0, dx, dy;
+        uint32_t pass_w;
+        uint32_t pass_h;
+
+        /* row within the current pass */
+        uint32_t pass_y;
+
+        /* bytes in a row of the current pass, not counting the filter byte */
+        size_t row_bytes;
+
+        /*
+         * current and previous row, each prefixed with its filter type
+         * byte. fill is how much of cur we have so far.
+         */
+        uint8_t *cur;
+        uint8_t *prev;
+        size_t fill;
+
+        /* called with each unfiltered row. return nonzero to stop */
+        int (*row)(struct png_decoder *dec, const uint8_t *row);
+        void *priv;
+
+        /* set once every row of every pass has been handed out */
+        bool done;
+
+        /* set if the row callback stopped us */
+        bool stopped;
+
+        /* the stream feeding us, so row callbacks can see how far it got */
+        const struct zlib_stream *stream;
+
+        /*
+         * if set, decode_rows takes checkpoints into index as it goes or,
+         * once the index is complete, starts from the last one before row
+         * start_row
+         */
+        struct png_index *index;
+        uint32_t start_row;
+
+        /* if set, decoder_feed and decode_rows add to these */
+        struct png_decode_stats *stats;
+
+        int error;
+};
+
+/* set up a decoder for an image whose IHDR (and PLTE) have been parsed */
+int decoder_init(struct png_decoder *dec, struct png_image *img);
+void decoder_fini(struct png_decoder *dec);
+
+/*
+ * start over on a width x height image in the same format, no wider than
+ * the one dec was set up for. this is how APNG frames share a decoder.
+ */
+void decoder_reset(struct png_decoder *dec, uint32_t width, uint32_t height);
+
+/*
+ * feed inflated bytes to a decoder. returns 1 if the row callback asked
+ * us to stop, 0 to keep going, or a negative error.
+ */
+int decoder_feed(struct png_decoder *dec, const uint8_t *buf, size_t size);
+
+/* zlib_stream output sink that feeds a decoder (set z_priv to it) */
+int decoder_drain(struct zlib_stream *stream, const uint8_t *buf,
+                  size_t size);
+
+/*
+ * convert n pixels of an unfiltered row, starting at pixel i, to RGBA.
+ * consecutive pixels are written step bytes apart.
+ */
+void convert_row(const struct png_decoder *dec, const uint8_t *row,
+                 size_t i, size_t n, uint8_t *out, size_t step);
+
+#endif /* PNG_DECODE_H */
@@ -0,0 +1,1483 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "zlib.h"
+
+/*
+ * The compressing half of zlib.c. Input is copied into a sliding window a
+ * piece at a time, so a stream can be compressed as it's produced, with
+ * nothing bigger than the window held on to. Matches are found with hash
+ * chains over the last 32K of input, and the resulting stream of literals and
+ * length/distance pairs is cut into blocks which are each written out as
+ * whichever of a stored, static or dynamic Huffman block is smallest.
+ * Levels 1-3 take the first match they find (greedy), 4-8 check whether
+ * the next byte starts a better match before committing (lazy), and 9
+ * finds every match at every position and picks the cheapest
+ * way through them (optimal parse).
+ */
+
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MAX_DIST ZLIB_WINDOW_SIZE
+#define DEFLATE_WMASK (ZLIB_WINDOW_SIZE - 1)
+
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1U << DEFLATE_HASH_BITS)
+
+/* greedy and lazy matching write a block per this many symbols */
+#define DEFLATE_BLOCK_SYMS (1U << 14)
+
+/* optimal parsing works on pieces of this many input bytes */
+#define DEFLATE_OPT_BLOCK (1U << 15)
+
+/*
+ * input needed past the current position before we'll go on without a
+ * flush: enough for a whole optimal parsing piece and its longest match
+ */
+#define DEFLATE_LOOKAHEAD (DEFLATE_OPT_BLOCK + DEFLATE_MAX_MATCH + 1)
+
+/*
+ * size of the window input is copied into. once it's full, the oldest
+ * ZLIB_WINDOW_SIZE bytes are slid out of the front, which always leaves a
+ * full window behind the current position
+ */
+#define DEFLATE_WIN_SIZE (2 * ZLIB_WINDOW_SIZE + DEFLATE_LOOKAHEAD)
+
+/* chain entries optimal parsing checks while it's in a long run */
+#define DEFLATE_RUN_CHAIN 8
+
+/* a 3 byte match further back than this is rarely worth it */
+#define DEFLATE_TOO_FAR 4096
+
+/* stored blocks hold at most this many bytes */
+#define STORED_MAX 65535
+
+/* alphabet sizes, and the longest allowed codes. see section 3.2.7 */
+#define LL_CODES 286
+#define LL_STATIC 288 /* static blocks have two codes that never get used */
+#define D_CODES 30
+#define CL_CODES 19
+#define MAX_BITS 15
+#define MAX_CL_BITS 7
+
+#define END_OF_BLOCK 256
+
+#define BTYPE_STORED 0
+#define BTYPE_STATIC 1
+#define BTYPE_DYNAMIC 2
+
+/*
+ * length and distance codes. these are the same tables that are above
+ * deflate_huffman in zlib.c, indexed by code - 257 and code respectively
+ */
+static const uint8_t len_extra[] =
+        {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+         4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+static const uint16_t len_base[] =
+        {3, 4, 5, 6, 7, 8, 9, 10, 11, 13,
+         15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+         67, 83, 99, 115, 131, 163, 195, 227, 258};
+
+static const uint8_t dist_extra[] =
+        {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+         9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static const uint16_t dist_base[] =
+        {1, 2, 3, 4, 5, 7, 9, 13, 17, 25,
+         33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+         1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+
+/* the order code length code lengths are written in */
+static const uint8_t cl_order[CL_CODES] =
+        {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+enum deflate_strategy {
+        DEFLATE_STORE = 0,
+        DEFLATE_GREEDY,
+        DEFLATE_LAZY,
+        DEFLATE_OPTIMAL
+};
+
+/* how hard each level tries. the numbers are the ones zlib uses */
+struct deflate_level {
+        /* search a quarter as hard once we already have a match this long */
+        uint16_t good;
+
+        /*
+         * lazy: don't look for a better match once we have one this long.
+         * greedy: only hash every position of matches up to this long
+         */
+        uint16_t lazy;
+
+        /* stop searching once we find a match this long */
+        uint16_t nice;
+
+        /* how many hash chain entries to check */
+        uint16_t chain;
+
+        enum deflate_strategy strategy;
+};
+
+static const struct deflate_level levels[] = {
+        /* 0 */ {0, 0, 0, 0, DEFLATE_STORE},
+        /* 1 */ {4, 4, 8, 4, DEFLATE_GREEDY},
+        /* 2 */ {4, 5, 16, 8, DEFLATE_GREEDY},
+        /* 3 */ {4, 6, 32, 32, DEFLATE_GREEDY},
+        /* 4 */ {4, 4, 16, 16, DEFLATE_LAZY},
+        /* 5 */ {8, 16, 32, 32, DEFLATE_LAZY},
+        /* 6 */ {8, 16, 128, 128, DEFLATE_LAZY},
+        /* 7 */ {8, 32, 128, 256, DEFLATE_LAZY},
+        /* 8 */ {32, 128, 258, 1024, DEFLATE_LAZY},
+        /* 9 */ {32, 258, 258, 4096, DEFLATE_OPTIMAL},
+};
+
+/* a literal (dist == 0) or a match */
+struct deflate_sym {
+        uint16_t litlen;
+        uint16_t dist;
+};
+
+/* a match found by the optimal parser */
+struct deflate_match {
+        uint16_t len;
+        uint16_t dist;
+};
+
+/* a node for package-merge */
+struct pm_node {
+        uint32_t weight;
+        int leaf;
+        const struct pm_node *left;
+        const struct pm_node *right;
+};
+
+struct optimal;
+
+struct deflate_state {
+        struct zlib_stream *stream;
+        const struct deflate_level *level;
+
+        /* sticky error, from growing z_dst */
+        int error;
+
+        /*
+         * the window. there are end bytes of input in it, and we've
+         * gotten as far as pos with them. positions everywhere else are
+         * indexes into it as well
+         */
+        uint8_t *src;
+        size_t pos;
+        size_t end;
+
+        /* has the zlib header gone out yet? */
+        bool started;
+
+        /* raw deflate, with no zlib header or trailer */
+        bool raw;
+
+        /* running adler32 of the input */
+        uint32_t adler;
+
+        /*
+         * hash chains. head[h] is the most recent position (plus one, so
+         * that 0 means none) whose next 3 bytes hash to h, and prev[pos &
+         * DEFLATE_WMASK] is the position before pos with the same hash.
+         */
+        size_t head[DEFLATE_HASH_SIZE];
+        size_t prev[ZLIB_WINDOW_SIZE];
+
+        /*
+         * symbols for the current block, and where its input started. if
+         * that's been slid out of the window, the block can't be stored
+         */
+        struct deflate_sym *syms;
+        size_t nsyms;
+        size_t block_start;
+        bool can_store;
+
+        uint32_t ll_freq[LL_CODES];
+        uint32_t d_freq[D_CODES];
+
+        /*
+         * lazy matching: the match at pos - 1, and whether the literal
+         * there still has to go out
+         */
+        unsigned prev_len;
+        unsigned prev_dist;
+        bool pending;
+
+        /* for optimal parsing */
+        struct optimal *opt;
+
+        /* scratch space for build_lengths */
+        struct pm_node pm_leaves[LL_CODES];
+        struct pm_node pm_lists[MAX_BITS][2 * LL_CODES];
+
+        /* bits not yet written out, lsb first */
+        uint64_t bitbuf;
+        unsigned bitcnt;
+};
+
+static unsigned len_code(unsigned len)
+{
+        unsigned v = len - DEFLATE_MIN_MATCH;
+        unsigned n;
+
+        if (v < 8)
+                return 257 + v;
+        if (len == DEFLATE_MAX_MATCH)
+                return 285;
+
+        n = 31 - __builtin_clz(v);
+        return 257 + 4 * (n - 1) + ((v >> (n - 2)) & 3);
+}
+
+static unsigned dist_code(unsigned dist)
+{
+        unsigned v = dist - 1;
+        unsigned n;
+
+        if (v < 4)
+                return v;
+
+        n = 31 - __builtin_clz(v);
+        return 2 * n + ((v >> (n - 1)) & 1);
+}
+
+static inline uint32_t hash3(const uint8_t *p)
+{
+        uint32_t v = (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+
+        return (v * 0x9e3779b1U) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline void insert(struct deflate_state *s, size_t pos)
+{
+        uint32_t h;
+
+        if (s->end - pos < DEFLATE_MIN_MATCH)
+                return;
+
+        h = hash3(s->src + pos);
+        s->prev[pos & DEFLATE_WMASK] = s->head[h];
+        s->head[h] = pos + 1;
+}
+
+/*
+ * walk up to chain entries of the hash chain for pos looking for a match
+ * longer than best. returns its length (or 0 if there's none) and sets
+ * *dist. if matches is not NULL, every improvement along the way is
+ * recorded there as well, shortest first, and *nmatches is set to how many
+ * there were.
+ */
+static unsigned longest_match(struct deflate_state *s, size_t pos,
+                              unsigned best, unsigned chain, unsigned *dist,
+                              struct deflate_match *matches,
+                              unsigned *nmatches)
+{
+        const uint8_t *src = s->src + pos;
+        const uint8_t *cand;
+        unsigned max, len, found = 0;
+        size_t c, next;
+
+        if (nmatches)
+                *nmatches = 0;
+
+        max = s->end - pos < DEFLATE_MAX_MATCH
+                ? s->end - pos : DEFLATE_MAX_MATCH;
+        if (max < DEFLATE_MIN_MATCH || best >= max)
+                return 0;
+        if (best < DEFLATE_MIN_MATCH - 1)
+                best = DEFLATE_MIN_MATCH - 1;
+
+        if (best >= s->level->good)
+                chain >>= 2;
+
+        next = s->head[hash3(src)];
+        while (next && chain--) {
+                c = next - 1;
+                if (pos - c > DEFLATE_MAX_DIST)
+                        break;
+
+                /* check the byte that would make this one better first */
+                cand = s->src + c;
+                if (cand[best] == src[best] && cand[0] == src[0]) {
+                        for (len = 1; len < max && cand[len] == src[len];
+                             len++)
+                                ;
+                        if (len > best) {
+                                best = len;
+                                found = len;
+                                *dist = pos - c;
+                                if (matches) {
+                                        matches[*nmatches].len = len;
+                                        matches[*nmatches].dist = pos - c;
+                                        (*nmatches)++;
+                                }
+                                if (len >= s->level->nice || len == max)
+                                        break;
+                        }
+                }
+
+                next = s->prev[c & DEFLATE_WMASK];
+                if (next > c)
+                        break;
+        }
+
+        return found;
+}
+
+/* output */
+
+/*
+ * make room for n more bytes in z_dst. everything that writes output
+ * reserves what it needs for the worst case up front, so none of the put_*
+ * functions need to check
+ */
+static int reserve(struct deflate_state *s, size_t n)
+{
+        struct zlib_stream *stream = s->stream;
+        uint8_t *dst;
+        size_t size;
+
+        if (s->error)
+                return s->error;
+        if (stream->z_dst && stream->z_dst_end - stream->z_dst_idx >= n)
+                return 0;
+
+        size = stream->z_dst_idx + n;
+        if (size < 2 * stream->z_dst_end)
+                size = 2 * stream->z_dst_end;
+        dst = realloc(stream->z_dst, size);
+        if (!dst)
+                return s->error = -P_ENOMEM;
+        stream->z_dst = dst;
+        stream->z_dst_end = size;
+        return 0;
+}
+
+static void put_bits(struct deflate_state *s, uint32_t bits, unsigned n)
+{
+        struct zlib_stream *stream = s->stream;
+        uint8_t *dst;
+
+        s->bitbuf |= (uint64_t)bits << s->bitcnt;
+        s->bitcnt += n;
+        if (s->bitcnt >= 32) {
+                dst = stream->z_dst + stream->z_dst_idx;
+                dst[0] = s->bitbuf;
+                dst[1] = s->bitbuf >> 8;
+                dst[2] = s->bitbuf >> 16;
+                dst[3] = s->bitbuf >> 24;
+                stream->z_dst_idx += 4;
+                s->bitbuf >>= 32;
+                s->bitcnt -= 32;
+        }
+}
+
+/* write out any whole bytes, and pad a partial one with zeros */
+static void align_bits(struct deflate_state *s)
+{
+        struct zlib_stream *stream = s->stream;
+
+        while (s->bitcnt > 0) {
+                stream->z_dst[stream->z_dst_idx++] = s->bitbuf;
+                s->bitbuf >>= 8;
+                s->bitcnt = s->bitcnt > 8 ? s->bitcnt - 8 : 0;
+        }
+        s->bitbuf = 0;
+}
+
+static void put_bytes(struct deflate_state *s, const uint8_t *buf,
+                      size_t size)
+{
+        struct zlib_stream *stream = s->stream;
+
+        memcpy(stream->z_dst + stream->z_dst_idx, buf, size);
+        stream->z_dst_idx += size;
+}
+
+/* huffman codes */
+
+static int pm_cmp(const void *_lhs, const void *_rhs)
+{
+        const struct pm_node *lhs = _lhs;
+        const struct pm_node *rhs = _rhs;
+
+        if (lhs->weight != rhs->weight)
+                return lhs->weight < rhs->weight ? -1 : 1;
+        return lhs->leaf - rhs->leaf;
+}
+
+static void pm_count(const struct pm_node *node, uint8_t *lens)
+{
+        for (; node->leaf < 0; node = node->right)
+                pm_count(node->left, lens);
+        lens[node->leaf]++;
+}
+
+/*
+ * work out code lengths no longer than limit for symbols with the given
+ * frequencies, using package-merge. symbols with a frequency of 0 get no
+ * code. there are always at least two codes, since inflaters don't all
+ * cope with trees that have fewer.
+ */
+static void build_lengths(struct deflate_state *s, uint32_t *freq,
+                          unsigned n, unsigned limit, uint8_t *lens)
+{
+        struct pm_node *leaves, *prev, *cur;
+        unsigned nleaves, nprev, ncur, i, k, level, max;
+
+        nleaves = 0;
+        for (i = 0; i < n; i++)
+                nleaves += !!freq[i];
+        for (i = 0; nleaves < 2; i++) {
+                if (!freq[i]) {
+                        freq[i] = 1;
+                        nleaves++;
+                }
+        }
+
+        leaves = s->pm_leaves;
+        for (i = 0, k = 0; i < n; i++) {
+                lens[i] = 0;
+                if (freq[i]) {
+                        leaves[k].weight = freq[i];
+                        leaves[k].leaf = i;
+                        k++;
+                }
+        }
+        qsort(leaves, nleaves, sizeof *leaves, pm_cmp);
+
+        /*
+         * list l holds the cheapest items for codes of up to l + 1 bits:
+         * the leaves, merged with pairs of items from list l - 1. only the
+         * cheapest 2n - 2 items of each list ever matter.
+         */
+        max = 2 * nleaves - 2;
+        prev = leaves;
+        nprev = nleaves;
+        for (level = 1; level < limit; level++) {
+                cur = s->pm_lists[level];
+                ncur = 0;
+                i = 0;
+                k = 0;
+                while (ncur < max && (i < nleaves || k + 1 < nprev)) {
+                        if (k + 1 < nprev && (i >= nleaves
+                            || prev[k].weight + prev[k + 1].weight
+                               < leaves[i].weight)) {
+                                cur[ncur].weight = prev[k].weight
+                                        + prev[k + 1].weight;
+                                cur[ncur].leaf = -1;
+                                cur[ncur].left = &prev[k];
+                                cur[ncur].right = &prev[k + 1];
+                                k += 2;
+                        } else {
+                                cur[ncur] = leaves[i++];
+                        }
+                        ncur++;
+                }
+                prev = cur;
+                nprev = ncur;
+        }
+
+        /* a leaf's code length is how many of these it turns up in */
+        for (i = 0; i < max; i++)
+                pm_count(&prev[i], lens);
+}
+
+/* canonical codes for the given lengths, bit reversed to go out lsb first */
+static void build_codes(const uint8_t *lens, unsigned n, uint16_t *codes)
+{
+        uint16_t count[MAX_BITS + 1] = {0};
+        uint16_t next[MAX_BITS + 1];
+        unsigned i, b, code;
+        uint16_t rev;
+
+        for (i = 0; i < n; i++)
+                count[lens[i]]++;
+        count[0] = 0;
+
+        code = 0;
+        for (b = 1; b <= MAX_BITS; b++) {
+                code = (code + count[b - 1]) << 1;
+                next[b] = code;
+        }
+
+        for (i = 0; i < n; i++) {
+                if (!lens[i])
+                        continue;
+                code = next[lens[i]]++;
+                for (rev = 0, b = 0; b < lens[i]; b++)
+                        rev |= ((code >> b) & 1) << (lens[i] - 1 - b);
+                codes[i] = rev;
+        }
+}
+
+/* the fixed codes of static blocks, see section 3.2.6 */
+static void static_lengths(uint8_t *ll_lens, uint8_t *d_lens)
+{
+        unsigned i;
+
+        for (i = 0; i < LL_STATIC; i++)
+                ll_lens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        for (i = 0; i < D_CODES; i++)
+                d_lens[i] = 5;
+}
+
+/* bits needed for the symbols of the current block with the given codes */
+static size_t data_cost(const struct deflate_state *s, const uint8_t *ll_lens,
+                        const uint8_t *d_lens)
+{
+        size_t bits = 0;
+        unsigned i;
+
+        for (i = 0; i < LL_CODES; i++)
+                bits += (size_t)s->ll_freq[i] * (ll_lens[i]
+                        + (i > END_OF_BLOCK ? len_extra[i - 257] : 0));
+        for (i = 0; i < D_CODES; i++)
+                bits += (size_t)s->d_freq[i] * (d_lens[i] + dist_extra[i]);
+        return bits;
+}
+
+/*
+ * the header of a dynamic block: the code lengths of both trees, run
+ * length encoded with the code length alphabet (see make_dynamic_trees in
+ * zlib.c), and then that encoded again
+ */
+struct dyn_header {
+        unsigned hlit;
+        unsigned hdist;
+        unsigned hclen;
+
+        /* code length symbols, and the extra bits that go with each */
+        uint8_t syms[LL_CODES + D_CODES];
+        uint8_t extra[LL_CODES + D_CODES];
+        unsigned nsyms;
+
+        uint32_t cl_freq[CL_CODES];
+        uint8_t cl_lens[CL_CODES];
+        uint16_t cl_codes[CL_CODES];
+};
+
+static void rle_lengths(struct dyn_header *h, const uint8_t *lens,
+                        unsigned n)
+{
+        unsigned i, run, r;
+
+        for (i = 0; i < n; i += run) {
+                for (run = 1; i + run < n && lens[i + run] == lens[i]; run++)
+                        ;
+
+                if (!lens[i] && run >= 3) {
+                        r = run > 138 ? 138 : run;
+                        h->syms[h->nsyms] = r > 10 ? 18 : 17;
+                        h->extra[h->nsyms++] = r > 10 ? r - 11 : r - 3;
+                        run = r;
+                } else if (lens[i] && run >= 4) {
+                        /* the length once, then repeats of it */
+                        h->syms[h->nsyms] = lens[i];
+                        h->extra[h->nsyms++] = 0;
+                        r = run - 1 > 6 ? 6 : run - 1;
+                        h->syms[h->nsyms] = 16;
+                        h->extra[h->nsyms++] = r - 3;
+                        run = r + 1;
+                } else {
+                        h->syms[h->nsyms] = lens[i];
+                        h->extra[h->nsyms++] = 0;
+                        run = 1;
+                }
+        }
+}
+
+/* work out a dynamic block header, returning its size in bits */
+static size_t build_header(struct deflate_state *s, struct dyn_header *h,
+                           const uint8_t *ll_lens, const uint8_t *d_lens)
+{
+        static const uint8_t cl_extra[CL_CODES] = {[16] = 2, [17] = 3,
+                                                   [18] = 7};
+        uint8_t lens[LL_CODES + D_CODES];
+        size_t bits;
+        unsigned i;
+
+        for (h->hlit = LL_CODES; h->hlit > 257 && !ll_lens[h->hlit - 1];
+             h->hlit--)
+                ;
+        for (h->hdist = D_CODES; h->hdist > 1 && !d_lens[h->hdist - 1];
+             h->hdist--)
+                ;
+
+        /* runs are allowed to go from one tree into the other */
+        memcpy(lens, ll_lens, h->hlit);
+        memcpy(lens + h->hlit, d_lens, h->hdist);
+        h->nsyms = 0;
+        rle_lengths(h, lens, h->hlit + h->hdist);
+
+        memset(h->cl_freq, 0, sizeof h->cl_freq);
+        for (i = 0; i < h->nsyms; i++)
+                h->cl_freq[h->syms[i]]++;
+        build_lengths(s, h->cl_freq, CL_CODES, MAX_CL_BITS, h->cl_lens);
+        build_codes(h->cl_lens, CL_CODES, h->cl_codes);
+
+        for (h->hclen = CL_CODES; h->hclen > 4
+             && !h->cl_lens[cl_order[h->hclen - 1]]; h->hclen--)
+                ;
+
+        bits = 5 + 5 + 4 + 3 * h->hclen;
+        for (i = 0; i < h->nsyms; i++)
+                bits += h->cl_lens[h->syms[i]] + cl_extra[h->syms[i]];
+        return bits;
+}
+
+static void put_header(struct deflate_state *s, const struct dyn_header *h)
+{
+        static const uint8_t cl_extra[CL_CODES] = {[16] = 2, [17] = 3,
+                                                   [18] = 7};
+        unsigned i;
+
+        put_bits(s, h->hlit - 257, 5);
+        put_bits(s, h->hdist - 1, 5);
+        put_bits(s, h->hclen - 4, 4);
+        for (i = 0; i < h->hclen; i++)
+                put_bits(s, h->cl_lens[cl_order[i]], 3);
+        for (i = 0; i < h->nsyms; i++) {
+                put_bits(s, h->cl_codes[h->syms[i]],
+                         h->cl_lens[h->syms[i]]);
+                put_bits(s, h->extra[i], cl_extra[h->syms[i]]);
+        }
+}
+
+static void put_syms(struct deflate_state *s, const uint8_t *ll_lens,
+                     const uint16_t *ll_codes, const uint8_t *d_lens,
+                     const uint16_t *d_codes)
+{
+        const struct deflate_sym *sym;
+        unsigned code;
+        size_t i;
+
+        for (i = 0; i < s->nsyms; i++) {
+                sym = &s->syms[i];
+                if (!sym->dist) {
+                        put_bits(s, ll_codes[sym->litlen],
+                                 ll_lens[sym->litlen]);
+                        continue;
+                }
+
+                code = len_code(sym->litlen);
+                put_bits(s, ll_codes[code], ll_lens[code]);
+                put_bits(s, sym->litlen - len_base[code - 257],
+                         len_extra[code - 257]);
+
+                code = dist_code(sym->dist);
+                put_bits(s, d_codes[code], d_lens[code]);
+                put_bits(s, sym->dist - dist_base[code], dist_extra[code]);
+        }
+        put_bits(s, ll_codes[END_OF_BLOCK], ll_lens[END_OF_BLOCK]);
+}
+
+/* write src[start, end) as stored blocks */
+static void put_stored(struct deflate_state *s, size_t start, size_t end,
+                       bool final)
+{
+        uint8_t lens[4];
+        size_t n;
+
+        do {
+                n = end - start > STORED_MAX ? STORED_MAX : end - start;
+                put_bits(s, final && start + n == end, 1);
+                put_bits(s, BTYPE_STORED, 2);
+                align_bits(s);
+
+                lens[0] = n;
+                lens[1] = n >> 8;
+                lens[2] = ~n;
+                lens[3] = ~n >> 8;
+                put_bytes(s, lens, 4);
+                put_bytes(s, s->src + start, n);
+                start += n;
+        } while (start < end);
+}
+
+/* bits that put_stored would take, given the bits already pending */
+static size_t stored_cost(const struct deflate_state *s, size_t len)
+{
+        size_t blocks = len ? (len + STORED_MAX - 1) / STORED_MAX : 1;
+
+        /* the first header might need padding, later ones always do */
+        return ((s->bitcnt + 3 + 7) & ~7UL) - s->bitcnt
+                + (blocks - 1) * 8 + blocks * 32 + len * 8;
+}
+
+/* bits a dynamic block of the symbols collected so far would take */
+static size_t dynamic_cost(struct deflate_state *s)
+{
+        uint8_t ll_lens[LL_CODES], d_lens[D_CODES];
+        struct dyn_header h;
+
+        s->ll_freq[END_OF_BLOCK] = 1;
+        build_lengths(s, s->ll_freq, LL_CODES, MAX_BITS, ll_lens);
+        build_lengths(s, s->d_freq, D_CODES, MAX_BITS, d_lens);
+        return 3 + build_header(s, &h, ll_lens, d_lens)
+                + data_cost(s, ll_lens, d_lens);
+}
+
+/*
+ * write out the symbols collected since block_start, which cover the input
+ * up to end, as whichever kind of block comes out smallest
+ */
+static void flush_block(struct deflate_state *s, size_t end, bool final)
+{
+        uint8_t ll_lens[LL_CODES], d_lens[D_CODES];
+        uint8_t st_ll_lens[LL_STATIC], st_d_lens[D_CODES];
+        uint16_t ll_codes[LL_STATIC], d_codes[D_CODES];
+        struct dyn_header h;
+        size_t dyn, fixed, stored, best;
+
+        s->ll_freq[END_OF_BLOCK] = 1;
+
+        static_lengths(st_ll_lens, st_d_lens);
+        fixed = 3 + data_cost(s, st_ll_lens, st_d_lens);
+        stored = s->can_store ? stored_cost(s, end - s->block_start)
+                : SIZE_MAX;
+
+        build_lengths(s, s->ll_freq, LL_CODES, MAX_BITS, ll_lens);
+        build_lengths(s, s->d_freq, D_CODES, MAX_BITS, d_lens);
+        dyn = 3 + build_header(s, &h, ll_lens, d_lens)
+                + data_cost(s, ll_lens, d_lens);
+
+        /* put_bits can have 63 bits pending on top of the block */
+        best = dyn < fixed ? dyn : fixed;
+        best = stored < best ? stored : best;
+        if (reserve(s, best / 8 + 16))
+                return;
+
+        if (stored <= fixed && stored <= dyn) {
+                put_stored(s, s->block_start, end, final);
+        } else if (fixed <= dyn) {
+                put_bits(s, final, 1);
+                put_bits(s, BTYPE_STATIC, 2);
+                build_codes(st_ll_lens, LL_STATIC, ll_codes);
+                build_codes(st_d_lens, D_CODES, d_codes);
+                put_syms(s, st_ll_lens, ll_codes, st_d_lens, d_codes);
+        } else {
+                put_bits(s, final, 1);
+                put_bits(s, BTYPE_DYNAMIC, 2);
+                put_header(s, &h);
+                build_codes(ll_lens, LL_CODES, ll_codes);
+                build_codes(d_lens, D_CODES, d_codes);
+                put_syms(s, ll_lens, ll_codes, d_lens, d_codes);
+        }
+
+        s->nsyms = 0;
+        s->block_start = end;
+        s->can_store = true;
+        memset(s->ll_freq, 0, sizeof s->ll_freq);
+        memset(s->d_freq, 0, sizeof s->d_freq);
+}
+
+static inline void emit_literal(struct deflate_state *s, uint8_t c)
+{
+        s->syms[s->nsyms].litlen = c;
+        s->syms[s->nsyms].dist = 0;
+        s->nsyms++;
+        s->ll_freq[c]++;
+}
+
+static inline void emit_match(struct deflate_state *s, unsigned len,
+                              unsigned dist)
+{
+        s->syms[s->nsyms].litlen = len;
+        s->syms[s->nsyms].dist = dist;
+        s->nsyms++;
+        s->ll_freq[len_code(len)]++;
+        s->d_freq[dist_code(dist)]++;
+}
+
+/* strategies */
+
+/*
+ * the strategies each work through the window from pos for as long as
+ * there's more than DEFLATE_LOOKAHEAD bytes past it, or all the way to the
+ * end when flushing. except for deflate_stored, ending the block after a
+ * flush is up to the caller
+ */
+
+/*
+ * level 0 writes stored blocks out as the input comes in. they're kept to
+ * a window's worth so that block_start never gets slid out
+ */
+static void deflate_stored(struct deflate_state *s, int flush)
+{
+        bool final;
+        size_t n;
+
+        s->pos = s->end;
+        for (;;) {
+                n = s->pos - s->block_start;
+                if (n > ZLIB_WINDOW_SIZE)
+                        n = ZLIB_WINDOW_SIZE;
+                else if (flush == ZLIB_NO_FLUSH ? n < ZLIB_WINDOW_SIZE
+                         : !n && flush != ZLIB_FINISH)
+                        return;
+
+                final = flush == ZLIB_FINISH && s->block_start + n == s->pos;
+                if (reserve(s, n + 16))
+                        return;
+                put_stored(s, s->block_start, s->block_start + n, final);
+                s->block_start += n;
+                if (final)
+                        return;
+        }
+}
+
+/* take the longest match at each position, no questions asked */
+static void deflate_greedy(struct deflate_state *s, int flush)
+{
+        size_t lookahead = flush ? 0 : DEFLATE_LOOKAHEAD;
+        size_t pos = s->pos, stop, i;
+        unsigned len, dist = 0;
+
+        while (s->end - pos > lookahead) {
+                len = longest_match(s, pos, 0, s->level->chain, &dist, NULL,
+                                    NULL);
+                if (len == DEFLATE_MIN_MATCH && dist > DEFLATE_TOO_FAR)
+                        len = 0;
+
+                if (len) {
+                        emit_match(s, len, dist);
+
+                        /* long matches only get their first byte hashed */
+                        stop = pos + (len <= s->level->lazy ? len : 1);
+                        for (i = pos; i < stop; i++)
+                                insert(s, i);
+                        pos += len;
+                } else {
+                        emit_literal(s, s->src[pos]);
+                        insert(s, pos++);
+                }
+
+                if (s->nsyms == DEFLATE_BLOCK_SYMS)
+                        flush_block(s, pos, false);
+        }
+        s->pos = pos;
+}
+
+/*
+ * before taking the match at pos, see if the one at pos + 1 is longer. if
+ * so, pos goes out as a literal and we go again from pos + 1
+ */
+static void deflate_lazy(struct deflate_state *s, int flush)
+{
+        size_t lookahead = flush ? 0 : DEFLATE_LOOKAHEAD;
+        unsigned len, dist = 0, prev_len = s->prev_len;
+        unsigned prev_dist = s->prev_dist;
+        bool pending = s->pending;
+        size_t pos = s->pos, stop;
+
+        while (s->end - pos > lookahead) {
+                len = 0;
+                if (prev_len < s->level->lazy)
+                        len = longest_match(s, pos, prev_len,
+                                            s->level->chain, &dist, NULL,
+                                            NULL);
+                if (len == DEFLATE_MIN_MATCH && dist > DEFLATE_TOO_FAR)
+                        len = 0;
+                insert(s, pos);
+
+                if (prev_len >= DEFLATE_MIN_MATCH && len <= prev_len) {
+                        /* the match at pos - 1 wins */
+                        emit_match(s, prev_len, prev_dist);
+                        stop = pos - 1 + prev_len;
+                        for (pos++; pos < stop; pos++)
+                                insert(s, pos);
+                        prev_len = 0;
+                        pending = false;
+                } else {
+                        if (pending)
+                                emit_literal(s, s->src[pos - 1]);
+                        pending = true;
+                        prev_len = len;
+                        prev_dist = dist;
+                        pos++;
+                }
+
+                if (s->nsyms == DEFLATE_BLOCK_SYMS)
+                        flush_block(s, pos - pending, false);
+        }
+
+        /* nothing can start at pos - 1 and run past the end */
+        if (flush && pending) {
+                emit_literal(s, s->src[pos - 1]);
+                prev_len = 0;
+                pending = false;
+        }
+        s->pos = pos;
+        s->prev_len = prev_len;
+        s->prev_dist = prev_dist;
+        s->pending = pending;
+}
+
+/* optimal parsing */
+
+/* cost in bits of each literal/length and distance symbol */
+struct deflate_costs {
+        uint32_t lit[256];
+        uint32_t len[DEFLATE_MAX_MATCH + 1];
+        uint32_t dist[D_CODES];
+};
+
+static void costs_from_lengths(struct deflate_costs *c,
+                               const uint8_t *ll_lens, const uint8_t *d_lens)
+{
+        unsigned i, code;
+
+        for (i = 0; i < 256; i++)
+                c->lit[i] = ll_lens[i] ? ll_lens[i] : MAX_BITS;
+        for (i = DEFLATE_MIN_MATCH; i <= DEFLATE_MAX_MATCH; i++) {
+                code = len_code(i);
+                c->len[i] = (ll_lens[code] ? ll_lens[code] : MAX_BITS)
+                        + len_extra[code - 257];
+        }
+        for (i = 0; i < D_CODES; i++)
+                c->dist[i] = (d_lens[i] ? d_lens[i] : MAX_BITS)
+                        + dist_extra[i];
+}
+
+struct optimal {
+        /* matches at each position of the piece, longest last */
+        struct deflate_match *matches;
+        size_t nmatches;
+        size_t cap;
+        uint32_t *first;
+
+        /* cheapest way to get to each position, and how we got there */
+        uint32_t *cost;
+        struct deflate_match *from;
+};
+
+/*
+ * merge two lists of matches, each shortest first, into one, keeping only
+ * the closer match when two are as long and dropping any that aren't longer
+ * than the one before
+ */
+static unsigned merge_matches(struct deflate_match *out,
+                              const struct deflate_match *a, unsigned na,
+                              const struct deflate_match *b, unsigned nb)
+{
+        const struct deflate_match *m;
+        unsigned i = 0, j = 0, n = 0;
+
+        while (i < na || j < nb) {
+                if (j == nb || (i < na && (a[i].len < b[j].len
+                                           || (a[i].len == b[j].len
+                                               && a[i].dist <= b[j].dist))))
+                        m = &a[i++];
+                else
+                        m = &b[j++];
+                if (n && m->len <= out[n - 1].len)
+                        continue;
+                out[n++] = *m;
+        }
+        return n;
+}
+
+/* collect the matches at each position of src[start, end) */
+static int find_matches(struct deflate_state *s, struct optimal *o,
+                        size_t start, size_t end)
+{
+        struct deflate_match found[DEFLATE_MAX_MATCH];
+        struct deflate_match near[DEFLATE_MAX_MATCH];
+        struct deflate_match prev[DEFLATE_MAX_MATCH];
+        struct deflate_match *m;
+        const uint8_t *src, *ref;
+        unsigned i, j, n = 0, nnear, dist, len, max;
+        size_t pos;
+
+        o->nmatches = 0;
+        for (pos = start; pos < end; pos++) {
+                o->first[pos - start] = o->nmatches;
+
+                /*
+                 * after a match of at least nice bytes, every match at
+                 * the last position is one shorter at this one, and the
+                 * longest might go further still. searching the whole
+                 * chain again in a long run would just find the same
+                 * matches over and over, so only look at the closest few
+                 * candidates for anything short and cheap that's new
+                 */
+                if (n && found[n - 1].len >= s->level->nice) {
+                        for (i = 0, j = 0; i < n; i++) {
+                                if (found[i].len <= DEFLATE_MIN_MATCH)
+                                        continue;
+                                prev[j].len = found[i].len - 1;
+                                prev[j++].dist = found[i].dist;
+                        }
+
+                        max = s->end - pos < DEFLATE_MAX_MATCH
+                                ? s->end - pos : DEFLATE_MAX_MATCH;
+                        src = s->src + pos;
+                        ref = src - prev[j - 1].dist;
+                        len = prev[j - 1].len;
+                        while (len < max && src[len] == ref[len])
+                                len++;
+                        prev[j - 1].len = len;
+
+                        longest_match(s, pos, 0, DEFLATE_RUN_CHAIN, &dist,
+                                      near, &nnear);
+                        n = merge_matches(found, near, nnear, prev, j);
+                } else {
+                        longest_match(s, pos, 0, s->level->chain, &dist,
+                                      found, &n);
+                }
+                insert(s, pos);
+                if (!n)
+                        continue;
+
+                if (o->nmatches + n > o->cap) {
+                        o->cap = 2 * (o->nmatches + n);
+                        m = realloc(o->matches, o->cap * sizeof *m);
+                        if (!m)
+                                return -P_ENOMEM;
+                        o->matches = m;
+                }
+                memcpy(o->matches + o->nmatches, found, n * sizeof *found);
+                o->nmatches += n;
+        }
+        o->first[end - start] = o->nmatches;
+        return 0;
+}
+
+/*
+ * find the cheapest parse of src[start, end) and add its symbols to the
+ * block
+ */
+static void parse_piece(struct deflate_state *s, struct optimal *o,
+                        const struct deflate_costs *c, size_t start,
+                        size_t end)
+{
+        const struct deflate_match *m;
+        size_t n = end - start, i, j;
+        unsigned len, max, k;
+        uint32_t cost, dcost;
+
+        o->cost[0] = 0;
+        for (i = 1; i <= n; i++)
+                o->cost[i] = UINT32_MAX;
+
+        for (i = 0; i < n; i++) {
+                cost = o->cost[i] + c->lit[s->src[start + i]];
+                if (cost < o->cost[i + 1]) {
+                        o->cost[i + 1] = cost;
+                        o->from[i + 1].len = 1;
+                }
+
+                /*
+                 * matches come shortest first, so each length is best
+                 * served by the first (closest) match that reaches it
+                 */
+                len = DEFLATE_MIN_MATCH;
+                for (j = o->first[i]; j < o->first[i + 1]; j++) {
+                        m = &o->matches[j];
+                        dcost = o->cost[i] + c->dist[dist_code(m->dist)];
+                        max = m->len < n - i ? m->len : n - i;
+                        for (; len <= max; len++) {
+                                cost = dcost + c->len[len];
+                                if (cost < o->cost[i + len]) {
+                                        o->cost[i + len] = cost;
+                                        o->from[i + len].len = len;
+                                        o->from[i + len].dist = m->dist;
+                                }
+                        }
+                }
+        }
+
+        /* walk back from the end to count the symbols, then fill them in */
+        for (i = n, k = 0; i > 0; i -= o->from[i].len)
+                k++;
+        s->nsyms += k;
+        for (i = n, k = s->nsyms; i > 0; i -= o->from[i].len) {
+                if (o->from[i].len == 1) {
+                        s->syms[--k].litlen = s->src[start + i - 1];
+                        s->syms[k].dist = 0;
+                        s->ll_freq[s->syms[k].litlen]++;
+                } else {
+                        s->syms[--k].litlen = o->from[i].len;
+                        s->syms[k].dist = o->from[i].dist;
+                        s->ll_freq[len_code(o->from[i].len)]++;
+                        s->d_freq[dist_code(o->from[i].dist)]++;
+                }
+        }
+}
+
+/*
+ * prices to start parse_piece off with: the code lengths a greedy parse of
+ * src[start, end) would get, on top of what's already in the block. static
+ * block prices would be simpler, but on data with few distinct bytes they
+ * make literals look so dear that the parse fills up with short matches,
+ * and the codes built from that parse only make things worse
+ */
+static void greedy_costs(struct deflate_state *s, const struct optimal *o,
+                         size_t start, size_t end, struct deflate_costs *c)
+{
+        uint8_t ll_lens[LL_CODES], d_lens[D_CODES];
+        uint32_t ll_freq[LL_CODES], d_freq[D_CODES];
+        const struct deflate_match *m;
+        size_t i;
+
+        memcpy(ll_freq, s->ll_freq, sizeof ll_freq);
+        memcpy(d_freq, s->d_freq, sizeof d_freq);
+        for (i = 0; i < end - start; ) {
+                if (o->first[i] == o->first[i + 1]) {
+                        ll_freq[s->src[start + i]]++;
+                        i++;
+                        continue;
+                }
+                m = &o->matches[o->first[i + 1] - 1];
+                ll_freq[len_code(m->len)]++;
+                d_freq[dist_code(m->dist)]++;
+                i += m->len;
+        }
+        ll_freq[END_OF_BLOCK] = 1;
+
+        build_lengths(s, ll_freq, LL_CODES, MAX_BITS, ll_lens);
+        build_lengths(s, d_freq, D_CODES, MAX_BITS, d_lens);
+        costs_from_lengths(c, ll_lens, d_lens);
+}
+
+/*
+ * parse each piece of the input twice: once with greedy_costs, and again
+ * with the prices from the Huffman codes the block would get with the first
+ * parse. pieces are collected into blocks of DEFLATE_BLOCK_SYMS symbols or
+ * so, like the other strategies, so that long runs don't pay for a block
+ * header every DEFLATE_OPT_BLOCK bytes
+ */
+static void deflate_optimal(struct deflate_state *s, int flush)
+{
+        size_t lookahead = flush ? 0 : DEFLATE_LOOKAHEAD;
+        uint8_t ll_lens[LL_CODES], d_lens[D_CODES];
+        uint32_t ll_freq[LL_CODES], d_freq[D_CODES];
+        uint32_t ll_all[LL_CODES], d_all[D_CODES];
+        struct optimal *o = s->opt;
+        struct deflate_costs costs;
+        size_t start, end, nsyms, all, joined, apart;
+        unsigned i;
+
+        while (s->end - s->pos > lookahead) {
+                start = s->pos;
+                end = s->end - start > DEFLATE_OPT_BLOCK
+                        ? start + DEFLATE_OPT_BLOCK : s->end;
+                if (find_matches(s, o, start, end)) {
+                        s->error = -P_ENOMEM;
+                        return;
+                }
+
+                /* the block so far, before this piece */
+                nsyms = s->nsyms;
+                memcpy(ll_freq, s->ll_freq, sizeof ll_freq);
+                memcpy(d_freq, s->d_freq, sizeof d_freq);
+
+                greedy_costs(s, o, start, end, &costs);
+                parse_piece(s, o, &costs, start, end);
+
+                s->ll_freq[END_OF_BLOCK] = 1;
+                build_lengths(s, s->ll_freq, LL_CODES, MAX_BITS, ll_lens);
+                build_lengths(s, s->d_freq, D_CODES, MAX_BITS, d_lens);
+                costs_from_lengths(&costs, ll_lens, d_lens);
+
+                s->nsyms = nsyms;
+                memcpy(s->ll_freq, ll_freq, sizeof ll_freq);
+                memcpy(s->d_freq, d_freq, sizeof d_freq);
+                parse_piece(s, o, &costs, start, end);
+
+                /*
+                 * if the piece is better off in a block of its own (random
+                 * bytes after a stretch of text, say), end the block
+                 * before it
+                 */
+                if (nsyms) {
+                        joined = dynamic_cost(s);
+                        memcpy(ll_all, s->ll_freq, sizeof ll_all);
+                        memcpy(d_all, s->d_freq, sizeof d_all);
+
+                        for (i = 0; i < LL_CODES; i++)
+                                s->ll_freq[i] = ll_all[i] - ll_freq[i];
+                        for (i = 0; i < D_CODES; i++)
+                                s->d_freq[i] = d_all[i] - d_freq[i];
+                        apart = dynamic_cost(s);
+                        memcpy(s->ll_freq, ll_freq, sizeof ll_freq);
+                        memcpy(s->d_freq, d_freq, sizeof d_freq);
+                        apart += dynamic_cost(s);
+
+                        if (apart < joined) {
+                                all = s->nsyms;
+                                s->nsyms = nsyms;
+                                flush_block(s, start, false);
+                                memmove(s->syms, s->syms + nsyms,
+                                        (all - nsyms) * sizeof *s->syms);
+                                s->nsyms = all - nsyms;
+                                for (i = 0; i < LL_CODES; i++)
+                                        s->ll_freq[i] = ll_all[i] - ll_freq[i];
+                                for (i = 0; i < D_CODES; i++)
+                                        s->d_freq[i] = d_all[i] - d_freq[i];
+                        } else {
+                                memcpy(s->ll_freq, ll_all, sizeof ll_all);
+                                memcpy(s->d_freq, d_all, sizeof d_all);
+                        }
+                }
+
+                s->pos = end;
+                if (s->nsyms >= DEFLATE_BLOCK_SYMS)
+                        flush_block(s, end, false);
+        }
+}
+
+/* stream */
+
+static void deflate_run(struct deflate_state *s, int flush)
+{
+        switch (s->level->strategy) {
+        case DEFLATE_STORE:
+                deflate_stored(s, flush);
+                break;
+        case DEFLATE_GREEDY:
+                deflate_greedy(s, flush);
+                break;
+        case DEFLATE_LAZY:
+                deflate_lazy(s, flush);
+                break;
+        case DEFLATE_OPTIMAL:
+                deflate_optimal(s, flush);
+                break;
+        }
+}
+
+/*
+ * slide the oldest ZLIB_WINDOW_SIZE bytes out of the window. the
+ * strategies never stop with less than DEFLATE_LOOKAHEAD bytes to go unless
+ * flushing, so by the time the window is full, pos is at least two windows
+ * in and everything behind it that a match could still reach is kept
+ */
+static void slide(struct deflate_state *s)
+{
+        size_t i;
+
+        memmove(s->src, s->src + ZLIB_WINDOW_SIZE,
+                s->end - ZLIB_WINDOW_SIZE);
+        s->end -= ZLIB_WINDOW_SIZE;
+        s->pos -= ZLIB_WINDOW_SIZE;
+        if (s->block_start >= ZLIB_WINDOW_SIZE) {
+                s->block_start -= ZLIB_WINDOW_SIZE;
+        } else {
+                s->block_start = 0;
+                s->can_store = false;
+        }
+
+        /* chain entries are positions plus one, so 0 still means none */
+        for (i = 0; i < DEFLATE_HASH_SIZE; i++)
+                s->head[i] = s->head[i] > ZLIB_WINDOW_SIZE
+                        ? s->head[i] - ZLIB_WINDOW_SIZE : 0;
+        for (i = 0; i < ZLIB_WINDOW_SIZE; i++)
+                s->prev[i] = s->prev[i] > ZLIB_WINDOW_SIZE
+                        ? s->prev[i] - ZLIB_WINDOW_SIZE : 0;
+}
+
+int zlib_deflate_init(struct zlib_stream *stream, int level)
+{
+        struct deflate_state *s;
+        struct optimal *o;
+
+        if (level < 0 || level > ZLIB_LEVEL_BEST)
+                return -P_EINVAL;
+
+        s = calloc(1, sizeof *s);
+        if (!s)
+                return -P_ENOMEM;
+        stream->z_deflate = s;
+
+        s->level = &levels[level];
+        s->adler = 1;
+        s->can_store = true;
+        s->src = malloc(DEFLATE_WIN_SIZE);
+        s->syms = malloc((DEFLATE_BLOCK_SYMS + DEFLATE_OPT_BLOCK)
+                         * sizeof *s->syms);
+        if (!s->src || !s->syms)
+                goto nomem;
+
+        if (s->level->strategy == DEFLATE_OPTIMAL) {
+                o = s->opt = calloc(1, sizeof *o);
+                if (!o)
+                        goto nomem;
+                o->first = malloc((DEFLATE_OPT_BLOCK + 1) * sizeof *o->first);
+                o->cost = malloc((DEFLATE_OPT_BLOCK + 1) * sizeof *o->cost);
+                o->from = malloc((DEFLATE_OPT_BLOCK + 1) * sizeof *o->from);
+                if (!o->first || !o->cost || !o->from)
+                        goto nomem;
+        }
+        return 0;
+
+nomem:
+        zlib_deflate_end(stream);
+        return -P_ENOMEM;
+}
+
+int zlib_deflate_raw_init(struct zlib_stream *stream, int level)
+{
+        int err;
+
+        err = zlib_deflate_init(stream, level);
+        if (err)
+                return err;
+
+        stream->z_deflate->raw = true;
+        stream->z_deflate->started = true;
+        return 0;
+}
+
+int zlib_deflate_dictionary(struct zlib_stream *stream, const uint8_t *dict,
+                            size_t size)
+{
+        struct deflate_state *s = stream->z_deflate;
+        size_t i;
+
+        /* a zlib stream would need FDICT and the dictionary's adler32 */
+        if (!s || !s->raw || s->end)
+                return -P_EINVAL;
+
+        if (size > ZLIB_WINDOW_SIZE) {
+                dict += size - ZLIB_WINDOW_SIZE;
+                size = ZLIB_WINDOW_SIZE;
+        }
+
+        memcpy(s->src, dict, size);
+        s->end = s->pos = s->block_start = size;
+        for (i = 0; i < size; i++)
+                insert(s, i);
+
+        return 0;
+}
+
+int zlib_deflate(struct zlib_stream *stream, int flush)
+{
+        struct deflate_state *s = stream->z_deflate;
+        uint8_t *dst;
+        size_t n;
+
+        if (!s)
+                return -P_EINVAL;
+        s->stream = stream;
+
+        /* 32K window, deflate, and the level (roughly) in FLEVEL */
+        if (!s->started) {
+                if (reserve(s, 2))
+                        return s->error;
+                n = s->level - levels;
+                dst = stream->z_dst + stream->z_dst_idx;
+                dst[0] = 0x78;
+                dst[1] = (n < 2 ? 0 : n < 6 ? 1 : n == 6 ? 2 : 3) << 6;
+                dst[1] += 31 - (dst[0] * 256 + dst[1]) % 31;
+                stream->z_dst_idx += 2;
+                s->started = true;
+        }
+
+        while (stream->z_src_idx < stream->z_src_end && !s->error) {
+                if (s->end == DEFLATE_WIN_SIZE)
+                        slide(s);
+
+                n = stream->z_src_end - stream->z_src_idx;
+                if (n > DEFLATE_WIN_SIZE - s->end)
+                        n = DEFLATE_WIN_SIZE - s->end;
+                memcpy(s->src + s->end, stream->z_src + stream->z_src_idx,
+                       n);
+                s->adler = adler32_update(s->adler, s->src + s->end, n);
+                s->end += n;
+                stream->z_src_idx += n;
+
+                deflate_run(s, ZLIB_NO_FLUSH);
+        }
+        if (flush == ZLIB_NO_FLUSH || s->error)
+                return s->error;
+
+        deflate_run(s, flush);
+        if (s->level->strategy != DEFLATE_STORE
+            && (s->nsyms || flush == ZLIB_FINISH))
+                flush_block(s, s->pos, flush == ZLIB_FINISH);
+        if (reserve(s, 16))
+                return s->error;
+
+        if (flush == ZLIB_SYNC_FLUSH) {
+                /* an empty stored block gets us to a byte boundary */
+                put_stored(s, s->pos, s->pos, false);
+        } else if (s->raw) {
+                align_bits(s);
+        } else {
+                align_bits(s);
+                dst = stream->z_dst + stream->z_dst_idx;
+                dst[0] = s->adler >> 24;
+                dst[1] = s->adler >> 16;
+                dst[2] = s->adler >> 8;
+                dst[3] = s->adler;
+                stream->z_dst_idx += 4;
+        }
+        return 0;
+}
+
+void zlib_deflate_end(struct zlib_stream *stream)
+{
+        struct deflate_state *s = stream->z_deflate;
+
+        if (!s)
+                return;
+        if (s->opt) {
+                free(s->opt->matches);
+                free(s->opt->first);
+                free(s->opt->cost);
+                free(s->opt->from);
+                free(s->opt);
+        }
+        free(s->syms);
+        free(s->src);
+        free(s);
+        stream->z_deflate = NULL;
+}
+
+size_t zlib_compress_bound(size_t size)
+{
+        /*
+         * no block comes out bigger than storing its input, which costs 5
+         * bytes (plus a partial one) per block, unless the start of the
+         * block has been slid out of the window. that only happens to
+         * blocks covering more than a window's worth of input, which
+         * compress well. there's a block at least every DEFLATE_BLOCK_SYMS
+         * bytes. add the zlib header and trailer
+         */
+        return size + 6 * (size / DEFLATE_BLOCK_SYMS + size / STORED_MAX + 2)
+                + 6;
+}
+
+int zlib_compress(struct zlib_stream *stream, int level)
+{
+        size_t bound;
+        uint8_t *dst;
+        int error;
+
+        /* make room up front, so that z_dst shouldn't need to grow */
+        bound = zlib_compress_bound(stream->z_src_end - stream->z_src_idx);
+        if (!stream->z_dst || stream->z_dst_end - stream->z_dst_idx < bound) {
+                dst = realloc(stream->z_dst, stream->z_dst_idx + bound);
+                if (!dst)
+                        return -P_ENOMEM;
+                stream->z_dst = dst;
+                stream->z_dst_end = stream->z_dst_idx + bound;
+        }
+
+        error = zlib_deflate_init(stream, level);
+        if (error)
+                return error;
+        error = zlib_deflate(stream, ZLIB_FINISH);
+        zlib_deflate_end(stream);
+        return error;
+}
@@ -0,0 +1,776 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "encode.h"
+#include "error.h"
+#include "pool.h"
+#include "util.h"
+#include "zlib.h"
+
+/* IDAT chunks hold this much compressed data (the last one can be less) */
+#define ENCODE_IDAT_SIZE (64UL << 10)
+
+/*
+ * the filter kernels work on VEC bytes at a time, using the gcc/clang
+ * vector extensions so that they come out as SSE2/NEON without any
+ * intrinsics. rows are padded out to a multiple of VEC, with ROW_PAD zero
+ * bytes in front so the pixel to the left of the first one reads as 0
+ */
+#define VEC 16
+#define ROW_PAD VEC
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef int8_t v16s8 __attribute__((vector_size(16)));
+typedef int16_t v16s16 __attribute__((vector_size(32)));
+typedef uint16_t v16u16 __attribute__((vector_size(32)));
+
+/*
+ * the threaded encoder cuts the image into bands of about this many bytes
+ * of filtered data, each filtered and deflated by itself on a pool thread
+ * (see zlib_deflate_raw_init). the ZLIB_WINDOW_SIZE bytes before a band
+ * are its dictionary, so it compresses about as well as it would have as
+ * part of one stream, for the cost of a sync flush
+ */
+#define BAND_SIZE (256UL << 10)
+
+/* rows going through the filters */
+struct row_filter {
+        /* bytes in a row not counting the filter byte, and per pixel */
+        size_t row_bytes;
+        unsigned bpp;
+
+        /* pick a filter for each row, or always use FILTER_NONE */
+        bool adaptive;
+
+        /* current and previous rows as they were handed to us */
+        uint8_t *cur;
+        uint8_t *prev;
+
+        /* the current row run through each filter, after its type byte */
+        uint8_t *filtered[FILTER_TYPES];
+};
+
+struct band {
+        struct pool_job job;
+        struct png_encoder *enc;
+
+        /* image row the band starts at */
+        uint32_t y0;
+
+        /*
+         * raw rows: the ctx rows before the band, which are filtered for
+         * the dictionary, then the band's own nrows. if skip is set, the
+         * first row is only there for the next one to be filtered against
+         */
+        uint8_t *raw;
+        uint32_t ctx;
+        uint32_t nrows;
+        bool skip;
+
+        /* the first piece has the zlib header, the last ends the stream */
+        bool first;
+        bool last;
+
+        /* the compressed band, and the adler32 and length of its input */
+        struct zlib_stream stream;
+        uint32_t adler;
+        size_t len;
+        int err;
+};
+
+struct png_encoder {
+        int (*write)(const uint8_t *buf, size_t size, void *priv);
+        void *priv;
+        int level;
+
+        /* rows still to come */
+        uint32_t rows;
+
+        struct row_filter filter;
+
+        /*
+         * compressed data not yet written out. without threads, this is
+         * the deflater too
+         */
+        struct zlib_stream stream;
+        bool started;
+
+        /*
+         * threads to encode with (0 for one per cpu), ENCODE_* flags, and
+         * the pool if there's more than one thread. rows go into band
+         * until there's band_rows of them, and ctx_rows before each band
+         * are kept for it. queue holds bands that are being encoded,
+         * oldest first
+         */
+        unsigned threads;
+        unsigned flags;
+        struct pool *pool;
+        uint32_t band_rows;
+        uint32_t ctx_rows;
+        struct band *band;
+        struct band **queue;
+        unsigned qhead;
+        unsigned qlen;
+        unsigned qmax;
+
+        /* adler32 of every band written out so far */
+        uint32_t adler;
+
+        /* our IDAT and IEND, and a buffer to put chunks together in */
+        struct png_image own;
+        struct chunk *idat;
+        struct chunk *iend;
+        uint8_t *out;
+        size_t out_size;
+
+        int error;
+};
+
+static unsigned color_channels(uint8_t color)
+{
+        switch (color) {
+        case COLOR_TRUE:
+                return 3;
+        case COLOR_GREY_ALPHA:
+                return 2;
+        case COLOR_TRUE_ALPHA:
+                return 4;
+        default:
+                return 1;
+        }
+}
+
+static inline v16u8 load(const uint8_t *p)
+{
+        v16u8 v;
+
+        memcpy(&v, p, sizeof v);
+        return v;
+}
+
+static inline void store(uint8_t *p, v16u8 v)
+{
+        memcpy(p, &v, sizeof v);
+}
+
+/*
+ * a macro rather than a function, since passing 32 byte vectors around by
+ * value isn't the same ABI with and without AVX
+ */
+#define ABS16(v) (((v) ^ ((v) >> 15)) - ((v) >> 15))
+
+/* the paeth predictor for 16 bytes at once. see paeth() in decode.c */
+static inline v16u8 paeth(v16u8 a8, v16u8 b8, v16u8 c8)
+{
+        v16s16 a, b, c, pa, pb, pc, use_a, use_b, pred;
+
+        a = __builtin_convertvector(a8, v16s16);
+        b = __builtin_convertvector(b8, v16s16);
+        c = __builtin_convertvector(c8, v16s16);
+
+        /* p = a + b - c, so p - a = b - c and p - b = a - c */
+        pa = b - c;
+        pb = a - c;
+        pc = pa + pb;
+        pc = ABS16(pc);
+        pa = ABS16(pa);
+        pb = ABS16(pb);
+
+        use_a = (pa <= pb) & (pa <= pc);
+        use_b = pb <= pc;
+        pred = (use_b & b) | (~use_b & c);
+        pred = (use_a & a) | (~use_a & pred);
+
+        return __builtin_convertvector(pred, v16u8);
+}
+
+/*
+ * add the absolute value of each byte, taken as signed, to acc. lanes not
+ * in keep count as 0
+ */
+static inline void add_abs(v16u16 *acc, v16u8 x, v16u8 keep)
+{
+        v16u8 m = (v16u8)((v16s8)x >> 7);
+
+        *acc += __builtin_convertvector(((x ^ m) - m) & keep, v16u16);
+}
+
+/*
+ * run the current row through every filter into rf->filtered, and pick
+ * the one whose output has the smallest sum of absolute values (taking
+ * the bytes as signed), which is the heuristic suggested in section 12.8
+ */
+static unsigned pick_filter(struct row_filter *rf)
+{
+        static const v16u8 lane = {0, 1, 2, 3, 4, 5, 6, 7,
+                                   8, 9, 10, 11, 12, 13, 14, 15};
+        const uint8_t *x = rf->cur, *b = rf->prev;
+        size_t len = rf->row_bytes, bpp = rf->bpp, i;
+        v16u8 vx, va, vb, vc, keep, out[FILTER_TYPES];
+        v16u16 acc[FILTER_TYPES];
+        uint64_t sum[FILTER_TYPES];
+        unsigned f, k, n, best;
+
+        memset(acc, 0, sizeof acc);
+        memset(sum, 0, sizeof sum);
+
+        for (i = 0, n = 0; i < len; i += VEC) {
+                vx = load(x + i);
+                va = load(x + i - bpp);
+                vb = load(b + i);
+                vc = load(b + i - bpp);
+
+                out[FILTER_NONE] = vx;
+                out[FILTER_SUB] = vx - va;
+                out[FILTER_UP] = vx - vb;
+                /* floor((a + b) / 2) without overflowing a byte */
+                out[FILTER_AVERAGE] = vx - ((va & vb) + ((va ^ vb) >> 1));
+                out[FILTER_PAETH] = vx - paeth(va, vb, vc);
+
+                /* the padding past the end of the row doesn't count */
+                k = len - i < VEC ? len - i : VEC;
+                keep = (v16u8)(lane < (uint8_t)k);
+
+                for (f = 0; f < FILTER_TYPES; f++) {
+                        store(rf->filtered[f] + 1 + i, out[f]);
+                        add_abs(&acc[f], out[f], keep);
+                }
+
+                /* lanes go up by at most 128 a time, so empty them often */
+                if (++n == 256 || i + VEC >= len) {
+                        for (f = 0; f < FILTER_TYPES; f++) {
+                                for (k = 0; k < VEC; k++)
+                                        sum[f] += acc[f][k];
+                                acc[f] = (v16u16){0};
+                        }
+                        n = 0;
+                }
+        }
+
+        best = FILTER_NONE;
+        for (f = FILTER_SUB; f < FILTER_TYPES; f++)
+                if (sum[f] < sum[best])
+                        best = f;
+        return best;
+}
+
+static int filter_init(struct row_filter *rf, size_t row_bytes, unsigned bpp,
+                       bool adaptive)
+{
+        size_t size;
+        unsigned f;
+
+        memset(rf, 0, sizeof *rf);
+        rf->row_bytes = row_bytes;
+        rf->bpp = bpp;
+        rf->adaptive = adaptive;
+
+        size = (row_bytes + VEC - 1) / VEC * VEC;
+        rf->cur = calloc(1, ROW_PAD + size);
+        rf->prev = calloc(1, ROW_PAD + size);
+        if (!rf->cur || !rf->prev) {
+                free(rf->cur);
+                free(rf->prev);
+                rf->cur = rf->prev = NULL;
+                return -P_ENOMEM;
+        }
+        rf->cur += ROW_PAD;
+        rf->prev += ROW_PAD;
+
+        for (f = 0; adaptive && f < FILTER_TYPES; f++) {
+                rf->filtered[f] = malloc(1 + size);
+                if (!rf->filtered[f])
+                        return -P_ENOMEM;
+                rf->filtered[f][0] = f;
+        }
+
+        return 0;
+}
+
+static void filter_fini(struct row_filter *rf)
+{
+        unsigned f;
+
+        if (rf->cur)
+                free(rf->cur - ROW_PAD);
+        if (rf->prev)
+                free(rf->prev - ROW_PAD);
+        for (f = 0; f < FILTER_TYPES; f++)
+                free(rf->filtered[f]);
+}
+
+/*
+ * filter the next row. returns it with its filter type byte in front, good
+ * until the next call
+ */
+static const uint8_t *filter_row(struct row_filter *rf, const uint8_t *row)
+{
+        const uint8_t *out;
+        uint8_t *tmp;
+
+        memcpy(rf->cur, row, rf->row_bytes);
+        if (rf->adaptive)
+                out = rf->filtered[pick_filter(rf)];
+        else
+                out = rf->cur - 1; /* a pad byte, so FILTER_NONE */
+
+        tmp = rf->prev;
+        rf->prev = rf->cur;
+        rf->cur = tmp;
+
+        return out;
+}
+
+static int emit(struct png_encoder *enc, const uint8_t *buf, size_t size)
+{
+        return enc->write(buf, size, enc->priv) ? -P_EIO : 0;
+}
+
+static int emit_chunk(struct png_encoder *enc, const struct chunk *chunk)
+{
+        uint8_t *out;
+        ssize_t ret;
+
+        if (enc->out_size < chunk->length + MIN_CHUNK_SIZE) {
+                out = realloc(enc->out, chunk->length + MIN_CHUNK_SIZE);
+                if (!out)
+                        return -P_ENOMEM;
+                enc->out = out;
+                enc->out_size = chunk->length + MIN_CHUNK_SIZE;
+        }
+
+        ret = write_chunk(chunk, enc->out, enc->out_size);
+        if (ret < 0)
+                return ret;
+        return emit(enc, enc->out, ret);
+}
+
+/*
+ * write compressed data out in ENCODE_IDAT_SIZE chunks, holding on to
+ * what's left over unless all is set
+ */
+static int flush_idat(struct png_encoder *enc, bool all)
+{
+        struct zlib_stream *stream = &enc->stream;
+        size_t off, n;
+        int err;
+
+        for (off = 0; off < stream->z_dst_idx; off += n) {
+                n = stream->z_dst_idx - off;
+                if (n > ENCODE_IDAT_SIZE)
+                        n = ENCODE_IDAT_SIZE;
+                else if (n < ENCODE_IDAT_SIZE && !all)
+                        break;
+
+                enc->idat->length = n;
+                data_chunk(enc->idat)->buf = stream->z_dst + off;
+                err = emit_chunk(enc, enc->idat);
+                if (err)
+                        return err;
+        }
+
+        memmove(stream->z_dst, stream->z_dst + off, stream->z_dst_idx - off);
+        stream->z_dst_idx -= off;
+        return 0;
+}
+
+/* filter and deflate a band. runs on a pool thread */
+static void band_run(struct pool_job *job)
+{
+        struct band *band = container_of(job, struct band, job);
+        struct png_encoder *enc = band->enc;
+        struct row_filter rf;
+        size_t line, off, dict;
+        uint8_t *filtered;
+        const uint8_t *row;
+        uint32_t i;
+        int err;
+
+        line = enc->filter.row_bytes + 1;
+        filtered = malloc((size_t)(band->ctx + band->nrows) * line);
+        err = filter_init(&rf, enc->filter.row_bytes, enc->filter.bpp,
+                          enc->filter.adaptive);
+        if (!err && !filtered)
+                err = -P_ENOMEM;
+        if (err)
+                goto out;
+
+        for (i = 0, off = 0; i < band->ctx + band->nrows; i++) {
+                row = filter_row(&rf, band->raw + i * rf.row_bytes);
+                if (!i && band->skip)
+                        continue;
+                memcpy(filtered + off, row, line);
+                off += line;
+        }
+        free(band->raw);
+        band->raw = NULL;
+
+        dict = (band->ctx - band->skip) * line;
+        band->len = off - dict;
+        band->adler = adler32_update(1, filtered + dict, band->len);
+
+        if (band->first) {
+                err = zlib_deflate_init(&band->stream, enc->level);
+        } else {
+                err = zlib_deflate_raw_init(&band->stream, enc->level);
+                if (!err)
+                        err = zlib_deflate_dictionary(&band->stream, filtered,
+                                                      dict);
+        }
+        if (!err) {
+                band->stream.z_src = filtered + dict;
+                band->stream.z_src_end = band->len;
+                err = zlib_deflate(&band->stream, band->last ? ZLIB_FINISH
+                                   : ZLIB_SYNC_FLUSH);
+        }
+        zlib_deflate_end(&band->stream);
+
+out:
+        filter_fini(&rf);
+        free(filtered);
+        band->err = err;
+}
+
+static void band_free(struct band *band)
+{
+        free(band->raw);
+        free(band->stream.z_dst);
+        free(band);
+}
+
+/* start the band after prev (or the first one), with its context rows */
+static struct band *band_new(struct png_encoder *enc, const struct band *prev)
+{
+        size_t row_bytes = enc->filter.row_bytes;
+        struct band *band;
+
+        band = calloc(1, sizeof *band);
+        if (!band)
+                return NULL;
+        band->raw = malloc((enc->ctx_rows + enc->band_rows) * row_bytes);
+        if (!band->raw) {
+                free(band);
+                return NULL;
+        }
+
+        band->job.fn = band_run;
+        band->enc = enc;
+        band->first = !prev;
+        band->y0 = prev ? prev->y0 + prev->nrows : 0;
+        band->ctx = band->y0 < enc->ctx_rows ? band->y0 : enc->ctx_rows;
+        band->skip = band->ctx == enc->ctx_rows;
+        if (prev)
+                memcpy(band->raw, prev->raw + (prev->ctx + prev->nrows
+                                               - band->ctx) * row_bytes,
+                       band->ctx * row_bytes);
+
+        return band;
+}
+
+/* add to the compressed data waiting to be written out */
+static int append(struct png_encoder *enc, const uint8_t *buf, size_t size)
+{
+        struct zlib_stream *stream = &enc->stream;
+        uint8_t *dst;
+
+        if (stream->z_dst_end - stream->z_dst_idx < size) {
+                dst = realloc(stream->z_dst, stream->z_dst_idx + size);
+                if (!dst)
+                        return -P_ENOMEM;
+                stream->z_dst = dst;
+                stream->z_dst_end = stream->z_dst_idx + size;
+        }
+
+        memcpy(stream->z_dst + stream->z_dst_idx, buf, size);
+        stream->z_dst_idx += size;
+        return 0;
+}
+
+/* wait for the oldest band, and write it out */
+static int band_retire(struct png_encoder *enc)
+{
+        struct band *band;
+        uint8_t trailer[4];
+        int err;
+
+        band = enc->queue[enc->qhead];
+        enc->qhead = (enc->qhead + 1) % enc->qmax;
+        enc->qlen--;
+
+        pool_wait(enc->pool, &band->job);
+        err = band->err;
+        if (!err) {
+                enc->adler = band->first ? band->adler
+                        : adler32_combine(enc->adler, band->adler, band->len);
+                err = append(enc, band->stream.z_dst, band->stream.z_dst_idx);
+        }
+
+        /* a lone band ends with its own adler32 */
+        if (!err && band->last && !band->first) {
+                trailer[0] = enc->adler >> 24;
+                trailer[1] = enc->adler >> 16;
+                trailer[2] = enc->adler >> 8;
+                trailer[3] = enc->adler;
+                err = append(enc, trailer, sizeof trailer);
+        }
+        if (!err)
+                err = flush_idat(enc, band->last);
+
+        band_free(band);
+        return err;
+}
+
+/* hand the current band to the pool, and start the next */
+static int band_submit(struct png_encoder *enc)
+{
+        struct band *band = enc->band;
+        int err;
+
+        band->last = !enc->rows;
+        enc->band = NULL;
+        if (!band->last) {
+                enc->band = band_new(enc, band);
+                if (!enc->band) {
+                        band_free(band);
+                        return -P_ENOMEM;
+                }
+        }
+
+        /* don't get too far ahead of the writing */
+        if (enc->qlen == enc->qmax) {
+                err = band_retire(enc);
+                if (err) {
+                        band_free(band);
+                        return err;
+                }
+        }
+
+        pool_submit(enc->pool, &band->job);
+        enc->queue[(enc->qhead + enc->qlen) % enc->qmax] = band;
+        enc->qlen++;
+        return 0;
+}
+
+struct png_encoder *png_encoder_new(int (*write)(const uint8_t *buf,
+                                                 size_t size, void *priv),
+                                    void *priv, int level)
+{
+        struct png_encoder *enc;
+
+        if (level < ZLIB_LEVEL_STORE || level > ZLIB_LEVEL_BEST)
+                return NULL;
+
+        enc = calloc(1, sizeof *enc);
+        if (!enc)
+                return NULL;
+
+        enc->write = write;
+        enc->priv = priv;
+        enc->level = level;
+        enc->threads = 1;
+        return enc;
+}
+
+int png_encoder_set_threads(struct png_encoder *enc, unsigned threads,
+                            unsigned flags)
+{
+        if (enc->started)
+                return -P_EINVAL;
+
+        enc->threads = threads;
+        enc->flags = flags;
+        return 0;
+}
+
+/* set up for threaded encoding */
+static int start_bands(struct png_encoder *enc)
+{
+        size_t line = enc->filter.row_bytes + 1;
+
+        enc->pool = pool_new(enc->threads);
+        if (!enc->pool)
+                return -P_ENOMEM;
+
+        enc->band_rows = BAND_SIZE / line ? BAND_SIZE / line : 1;
+        /* independent bands only need the row before them to filter */
+        if (enc->flags & ENCODE_INDEPENDENT)
+                enc->ctx_rows = 1;
+        else
+                enc->ctx_rows = (ZLIB_WINDOW_SIZE + line - 1) / line + 1;
+        enc->qmax = 2 * pool_threads(enc->pool);
+        enc->queue = calloc(enc->qmax, sizeof *enc->queue);
+        enc->band = band_new(enc, NULL);
+        if (!enc->queue || !enc->band)
+                return -P_ENOMEM;
+
+        return 0;
+}
+
+int png_encoder_start(struct png_encoder *enc, struct png_image *img)
+{
+        struct header_chunk *hc;
+        struct chunk *chunk;
+        unsigned bits;
+        int err;
+
+        if (enc->started)
+                return -P_EINVAL;
+
+        chunk = lookup_chunk(img, CHUNK_IHDR);
+        if (!chunk)
+                return -P_ENOCHUNK;
+        hc = header_chunk(chunk);
+        if (hc->interlace != INTERLACE_NONE)
+                return -P_ENOTSUP;
+        if (hc->color == COLOR_INDEXED && !lookup_chunk(img, CHUNK_PLTE))
+                return -P_ENOCHUNK;
+
+        bits = hc->depth * color_channels(hc->color);
+        enc->rows = hc->height;
+
+        /*
+         * filtering doesn't do palette indices or packed pixels any good,
+         * so those rows go out as they are (section 12.8 again)
+         */
+        err = filter_init(&enc->filter, ((size_t)hc->width * bits + 7) / 8,
+                          (bits + 7) / 8,
+                          hc->color != COLOR_INDEXED && hc->depth >= 8);
+        if (err)
+                return err;
+
+        if (enc->threads == 1)
+                err = zlib_deflate_init(&enc->stream, enc->level);
+        else
+                err = start_bands(enc);
+        if (err)
+                return err;
+
+        enc->idat = new_chunk(&enc->own, CHUNK_IDAT, 0);
+        enc->iend = new_chunk(&enc->own, CHUNK_IEND, 0);
+        if (!enc->idat || !enc->iend)
+                return -P_ENOMEM;
+        enc->started = true;
+
+        /* the header has to be first. everything else goes in list order */
+        err = emit(enc, png_magic, sizeof png_magic);
+        if (!err)
+                err = emit_chunk(enc, chunk);
+        for (chunk = img->first; !err && chunk; chunk = chunk->next) {
+                switch (chunk->c_tmpl->ct_type_idx) {
+                case CHUNK_IHDR:
+                case CHUNK_IDAT:
+                case CHUNK_IEND:
+                        break;
+                default:
+                        err = emit_chunk(enc, chunk);
+                }
+        }
+
+        enc->error = err;
+        return err;
+}
+
+int png_encoder_row(struct png_encoder *enc, const uint8_t *row)
+{
+        size_t row_bytes = enc->filter.row_bytes;
+        struct band *band = enc->band;
+
+        if (enc->error)
+                return enc->error;
+        if (!enc->started || !enc->rows)
+                return -P_EINVAL;
+        enc->rows--;
+
+        if (enc->pool) {
+                memcpy(band->raw + (band->ctx + band->nrows) * row_bytes, row,
+                       row_bytes);
+                if (++band->nrows == enc->band_rows || !enc->rows)
+                        enc->error = band_submit(enc);
+                return enc->error;
+        }
+
+        enc->stream.z_src = filter_row(&enc->filter, row);
+        enc->stream.z_src_idx = 0;
+        enc->stream.z_src_end = row_bytes + 1;
+        enc->error = zlib_deflate(&enc->stream, ZLIB_NO_FLUSH);
+        if (!enc->error)
+                enc->error = flush_idat(enc, false);
+
+        return enc->error;
+}
+
+int png_encoder_finish(struct png_encoder *enc)
+{
+        if (enc->error)
+                return enc->error;
+        if (!enc->started || enc->rows)
+                return -P_EINVAL;
+
+        if (enc->pool) {
+                while (!enc->error && enc->qlen)
+                        enc->error = band_retire(enc);
+        } else {
+                enc->stream.z_src_idx = enc->stream.z_src_end = 0;
+                enc->error = zlib_deflate(&enc->stream, ZLIB_FINISH);
+                if (!enc->error)
+                        enc->error = flush_idat(enc, true);
+        }
+        if (!enc->error)
+                enc->error = emit_chunk(enc, enc->iend);
+
+        return enc->error;
+}
+
+void png_encoder_free(struct png_encoder *enc)
+{
+        struct band *band;
+
+        if (!enc)
+                return;
+
+        /* bands still out have to finish before they can go */
+        for (; enc->qlen; enc->qlen--) {
+                band = enc->queue[enc->qhead];
+                enc->qhead = (enc->qhead + 1) % enc->qmax;
+                pool_wait(enc->pool, &band->job);
+                band_free(band);
+        }
+        if (enc->band)
+                band_free(enc->band);
+        free(enc->queue);
+        pool_free(enc->pool);
+
+        filter_fini(&enc->filter);
+
+        zlib_end(&enc->stream);
+        free(enc->stream.z_dst);
+        free_chunks(&enc->own);
+        free(enc->out);
+        free(enc);
+}
+
+int png_encode(struct png_image *img, const uint8_t *data, size_t stride,
+               int (*write)(const uint8_t *buf, size_t size, void *priv),
+               void *priv, int level, unsigned threads, unsigned flags)
+{
+        struct png_encoder *enc;
+        int err;
+
+        enc = png_encoder_new(write, priv, level);
+        if (!enc)
+                return -P_ENOMEM;
+
+        err = png_encoder_set_threads(enc, threads, flags);
+        if (!err)
+                err = png_encoder_start(enc, img);
+        for (; !err && enc->rows; data += stride)
+                err = png_encoder_row(enc, data);
+        if (!err)
+                err = png_encoder_finish(enc);
+
+        png_encoder_free(enc);
+        return err;
+}
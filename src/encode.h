@@ -0,0 +1,74 @@
+#ifndef PNG_ENCODE_H
+#define PNG_ENCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chunk.h"
+
+/*
+ * png writing. the chunks describing an image are built with
+ * add_header_chunk and friends (see chunk.h), then its rows are handed to
+ * an encoder one at a time. each row is filtered and fed to the deflater
+ * as it comes in, and IDAT chunks are written out as compressed data piles
+ * up, so only a couple of rows and the deflate window are ever held on to.
+ * interlaced images aren't supported.
+ */
+struct png_encoder;
+
+/*
+ * allocate an encoder. write is called with each piece of the file in
+ * order; if it returns nonzero, encoding stops with -P_EIO. level is a
+ * zlib compression level (see zlib.h). returns NULL if level is bad or
+ * we're out of memory.
+ */
+struct png_encoder *png_encoder_new(int (*write)(const uint8_t *buf,
+                                                 size_t size, void *priv),
+                                    void *priv, int level);
+
+/*
+ * encode with threads threads (0 for one per cpu) rather than just on the
+ * calling one. rows are then collected into bands, which are filtered and
+ * deflated in parallel as separate pieces of the zlib stream, each primed
+ * with the 32K of data before it; IDAT chunks still come out in order
+ * through write. flags is any of the ENCODE_* flags below. call before
+ * png_encoder_start.
+ */
+int png_encoder_set_threads(struct png_encoder *enc, unsigned threads,
+                            unsigned flags);
+
+/*
+ * don't prime bands with the data before them. compression is a little
+ * worse, but every band can then be inflated by itself, which is the
+ * cheapest case for png_decode_threads
+ */
+#define ENCODE_INDEPENDENT 0x1
+
+/*
+ * write the signature and every chunk in img, other than IDAT and IEND
+ * which are up to the encoder. img needs a header, and a palette if it's
+ * indexed color.
+ */
+int png_encoder_start(struct png_encoder *enc, struct png_image *img);
+
+/*
+ * encode the next row. row holds its pixels packed the same way as they
+ * are in the file (so 16 bit samples are big endian), without the filter
+ * type byte.
+ */
+int png_encoder_row(struct png_encoder *enc, const uint8_t *row);
+
+/* call after the last row to finish the image data and write IEND */
+int png_encoder_finish(struct png_encoder *enc);
+
+void png_encoder_free(struct png_encoder *enc);
+
+/*
+ * encode img whose rows are at data, stride bytes apart, with threads and
+ * flags as for png_encoder_set_threads
+ */
+int png_encode(struct png_image *img, const uint8_t *data, size_t stride,
+               int (*write)(const uint8_t *buf, size_t size, void *priv),
+               void *priv, int level, unsigned threads, unsigned flags);
+
+#endif /* PNG_ENCODE_H */
@@ -10,5 +10,6 @@ const char *error_to_msg[__P_EMAX] = {
         [P_EINVAL]    = "invalid value",
         [P_ENOCHUNK]  = "missing chunk",
         [P_EBADCSUM]  = "bad checksum",
-        [P_ENOTSUP]   = "not supported"
+        [P_ENOTSUP]   = "not supported",
+        [P_EIO]       = "i/o error"
 };
@@ -14,6 +14,7 @@ enum {
         P_ENOCHUNK,
         P_EBADCSUM,
         P_ENOTSUP,
+        P_EIO,
         __P_EMAX
 };
 
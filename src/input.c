@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "input.h"
+#include "trace.h"
+
+/* pieces handed out per ring */
+#define INPUT_PIECES 4
+
+static int open_mmap(struct png_input *in)
+{
+        void *map;
+
+        /* mmap doesn't like empty files */
+        if (!in->size)
+                return 0;
+
+        map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (map == MAP_FAILED)
+                return -P_EIO;
+
+        /* more read-ahead, and drop pages behind us sooner */
+        posix_madvise(map, in->size, POSIX_MADV_SEQUENTIAL);
+        in->map = map;
+        return 0;
+}
+
+static int open_pread(struct png_input *in)
+{
+        in->ring = malloc(in->ring_size);
+        if (!in->ring)
+                return -P_ENOMEM;
+
+        /* advisory, so don't care if it fails */
+        posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return 0;
+}
+
+int input_open(struct png_input *in, const char *fname,
+               enum input_backend backend, size_t ring_size)
+{
+        struct stat s;
+        uint64_t tr;
+        int error;
+
+        tr = trace_begin();
+        memset(in, 0, sizeof *in);
+        in->backend = backend;
+        in->ring_size = ring_size ? ring_size : INPUT_RING_SIZE;
+        in->piece = in->ring_size / INPUT_PIECES;
+        if (!in->piece)
+                return -P_EINVAL;
+
+        in->fd = open(fname, O_RDONLY);
+        if (in->fd == -1)
+                return -P_EIO;
+
+        error = -P_EIO;
+        if (fstat(in->fd, &s) == -1)
+                goto out_close;
+        in->size = s.st_size;
+
+        switch (backend) {
+        case INPUT_MMAP:
+                error = open_mmap(in);
+                break;
+        case INPUT_PREAD:
+                error = open_pread(in);
+                break;
+        default:
+                error = -P_EINVAL;
+        }
+        if (error)
+                goto out_close;
+        trace_end("open", tr);
+        return 0;
+
+out_close:
+        close(in->fd);
+        in->fd = -1;
+        return error;
+}
+
+/* fill the next piece of the ring, retrying short reads */
+static ssize_t read_piece(struct png_input *in, const uint8_t **buf)
+{
+        uint8_t *dst;
+        size_t want, got;
+        ssize_t ret;
+
+        dst = in->ring + (in->off / in->piece % INPUT_PIECES) * in->piece;
+        want = in->size - in->off < in->piece ? in->size - in->off : in->piece;
+
+        for (got = 0; got < want; got += ret) {
+                ret = pread(in->fd, dst + got, want - got, in->off + got);
+                if (ret == -1 && errno == EINTR)
+                        ret = 0;
+                else if (ret <= 0)
+                        return -P_EIO;
+        }
+
+        *buf = dst;
+        return want;
+}
+
+ssize_t input_next(struct png_input *in, const uint8_t **buf)
+{
+        ssize_t ret;
+
+        if (in->off >= in->size)
+                return 0;
+
+        if (in->backend == INPUT_MMAP) {
+                *buf = in->map + in->off;
+                ret = in->size - in->off < in->piece
+                        ? in->size - in->off : in->piece;
+        } else {
+                ret = read_piece(in, buf);
+                if (ret < 0)
+                        return ret;
+        }
+
+        in->off += ret;
+        return ret;
+}
+
+void input_close(struct png_input *in)
+{
+        if (in->map)
+                munmap((void *)in->map, in->size);
+        free(in->ring);
+        if (in->fd != -1)
+                close(in->fd);
+}
+
+int input_read_file(const char *fname, uint8_t **buf, size_t *size)
+{
+        struct stat st;
+        uint8_t *data;
+        ssize_t ret;
+        size_t done;
+        int fd, err = 0;
+
+        fd = open(fname, O_RDONLY);
+        if (fd == -1)
+                return -P_EIO;
+        if (fstat(fd, &st) == -1) {
+                close(fd);
+                return -P_EIO;
+        }
+
+        data = malloc(st.st_size ? st.st_size : 1);
+        if (!data) {
+                close(fd);
+                return -P_ENOMEM;
+        }
+
+        for (done = 0; done < (size_t)st.st_size; done += ret) {
+                ret = read(fd, data + done, st.st_size - done);
+                if (ret <= 0) {
+                        err = -P_EIO;
+                        break;
+                }
+        }
+        close(fd);
+
+        if (err) {
+                free(data);
+                return err;
+        }
+        *buf = data;
+        *size = st.st_size;
+        return 0;
+}
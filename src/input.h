@@ -0,0 +1,74 @@
+#ifndef PNG_INPUT_H
+#define PNG_INPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * ways of getting a file's bytes off of disk, front to back, a piece at a
+ * time (for the push decoder).
+ */
+enum input_backend {
+        /*
+         * map the whole file, advised sequential. cheap when the file is
+         * cached, but a cold multi-gigabyte file is a lot of page faults
+         * and a lot of resident file pages.
+         */
+        INPUT_MMAP = 0,
+
+        /*
+         * pread into a fixed size ring buffer, with POSIX_FADV_SEQUENTIAL
+         * for more read-ahead. none of the file is ever mapped, so
+         * resident memory stays at the size of the ring no matter how big
+         * the file is.
+         */
+        INPUT_PREAD
+};
+
+/* default ring size */
+#define INPUT_RING_SIZE (256UL << 10)
+
+struct png_input {
+        enum input_backend backend;
+        int fd;
+
+        /* file size, and how far into it we've handed out */
+        size_t size;
+        size_t off;
+
+        /* bytes handed out by each call to input_next */
+        size_t piece;
+
+        /* the whole file, for INPUT_MMAP */
+        const uint8_t *map;
+
+        /* the ring, for INPUT_PREAD. it's read into a piece at a time */
+        uint8_t *ring;
+        size_t ring_size;
+};
+
+/*
+ * open fname for reading with the given backend. ring_size is the size of
+ * the ring buffer (0 for the default); either way, input_next hands out
+ * pieces a quarter of that size.
+ */
+int input_open(struct png_input *in, const char *fname,
+               enum input_backend backend, size_t ring_size);
+
+/*
+ * point *buf at the next piece of the file. returns its size, 0 at the end
+ * of the file, or a negative error. with INPUT_PREAD, a piece is a quarter
+ * of the ring, so it stays valid for the next three calls.
+ */
+ssize_t input_next(struct png_input *in, const uint8_t **buf);
+
+void input_close(struct png_input *in);
+
+/*
+ * read all of fname into a buffer from malloc, for the tools that want a
+ * whole (smallish) file at once. *buf is only set on success.
+ */
+int input_read_file(const char *fname, uint8_t **buf, size_t *size);
+
+#endif /* PNG_INPUT_H */
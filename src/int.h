@@ -78,7 +78,7 @@ static inline bool read_png_uint(const uint8_t *buf, uint32_t *out)
         return PNG_UINT_MIN <= val && val <= PNG_UINT_MAX;
 }
 
-static uint16_t read_png_uint16(const uint8_t *buf)
+static inline uint16_t read_png_uint16(const uint8_t *buf)
 {
         uint16_t b0, b1;
 
@@ -88,4 +88,19 @@ static uint16_t read_png_uint16(const uint8_t *buf)
         return b0 << 8 | b1;
 }
 
+/* write a 4 byte big endian value to a buffer without bounds checking */
+static inline void __write_png_int_raw(uint8_t *buf, uint32_t val)
+{
+        buf[0] = val >> 24;
+        buf[1] = val >> 16;
+        buf[2] = val >> 8;
+        buf[3] = val;
+}
+
+static inline void write_png_uint16(uint8_t *buf, uint16_t val)
+{
+        buf[0] = val >> 8;
+        buf[1] = val;
+}
+
 #endif /* PNG_INT_H */
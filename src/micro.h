@@ -0,0 +1,37 @@
+#ifndef PNG_MICRO_H
+#define PNG_MICRO_H
+
+#include <stddef.h>
+
+/*
+ * a microbenchmark of one of the decoder's inner loops, for bench -m. the
+ * functions they time are static, so each set lives in a file that
+ * #includes the source file the functions are in (bench_zlib.c pulls in
+ * zlib.c, bench_chunk.c pulls in chunk.c), and bench links against those
+ * instead of zlib.o and chunk.o.
+ */
+struct micro {
+        const char *name;
+
+        /* build the input once, into *state. returns 0 or a negative error */
+        int (*setup)(void **state);
+
+        /*
+         * one timed repetition. returns the number of bytes it got
+         * through, or a negative error
+         */
+        long (*run)(void *state);
+
+        void (*teardown)(void *state);
+};
+
+extern const struct micro zlib_micros[];
+extern const size_t zlib_nmicros;
+
+extern const struct micro chunk_micros[];
+extern const size_t chunk_nmicros;
+
+/* how much input each microbenchmark works through per repetition */
+#define MICRO_SIZE (1UL << 20)
+
+#endif /* PNG_MICRO_H */
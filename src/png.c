@@ -2,23 +2,36 @@
  * Eric Mueller -- hacky PNG decoding
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include "anim.h"
+#include "batch.h"
+#include "cache.h"
 #include "chunk.h"
+#include "decode.h"
+#include "encode.h"
+#include "error.h"
+#include "input.h"
+#include "push.h"
+#include "sidecar.h"
+#include "trace.h"
 
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define array_size(a) (sizeof (a) / sizeof (a[0]))
 
-/* magic 8 bytes at the beginning of an image */
-static uint8_t png_magic[] = {137, 80, 78, 71, 13, 10, 26, 10};
-
+/* how much the -n cache can hold */
+#define PNG_CACHE_BUDGET (256UL << 20)
 
 /* print an error message and bail */
 void error(const char *msg)
@@ -56,23 +69,541 @@ size_t parse_magic(const uint8_t *buf, size_t buf_size)
         return magic_size;
 }
 
+/* write decoded pixels out as a PAM (netpbm) image */
+static void write_pam(const char *fname, const struct png_pixels *pixels)
+{
+        FILE *f;
+        uint32_t y;
+
+        f = fopen(fname, "wb");
+        if (!f)
+                error("couldn't open output file");
+
+        fprintf(f, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\n"
+                "TUPLTYPE RGB_ALPHA\nENDHDR\n", pixels->width, pixels->height);
+        for (y = 0; y < pixels->height; y++)
+                fwrite(pixels->data + y * pixels->stride, 4, pixels->width, f);
+
+        fclose(f);
+}
+
+static int write_file(const uint8_t *buf, size_t size, void *priv)
+{
+        return fwrite(buf, 1, size, priv) != size;
+}
+
+/* encode decoded pixels as an 8 bit RGBA png */
+static void write_png(const char *fname, const struct png_pixels *pixels,
+                      int level, unsigned threads, unsigned flags)
+{
+        static const char software[] = "libpngem";
+        struct png_image img;
+        struct tm *tm;
+        time_t now;
+        FILE *f;
+        int err;
+
+        img.first = NULL;
+        now = time(NULL);
+        tm = gmtime(&now);
+
+        err = add_header_chunk(&img, pixels->width, pixels->height, 8,
+                               COLOR_TRUE_ALPHA, INTERLACE_NONE);
+        if (!err)
+                err = add_text_chunk(&img, "Software", software,
+                                     sizeof software - 1);
+        if (!err)
+                err = add_time_chunk(&img, tm->tm_year + 1900, tm->tm_mon + 1,
+                                     tm->tm_mday, tm->tm_hour, tm->tm_min,
+                                     tm->tm_sec);
+        if (err)
+                error(e2msg(err));
+
+        f = fopen(fname, "wb");
+        if (!f)
+                error("couldn't open output file");
+
+        err = png_encode(&img, pixels->data, pixels->stride, write_file, f,
+                         level, threads, flags);
+        if (fclose(f) && !err)
+                err = -P_EIO;
+        free_chunks(&img);
+        if (err)
+                error(e2msg(err));
+}
+
+static void usage(void)
+{
+        error("usage: png [-r x,y,w,h | -s wxh | -p pass | -a [-F frame] | "
+              "[-i mmap|pread] [-f bytes] |\n"
+              "           -b y,h [-k spacing] | -n runs [-s wxh]] "
+              "[-o out.pam]\n"
+              "           [-x sidecar] [-t threads | -P | -S] "
+              "[-e out.png [-l level] [-I]] [-T trace.json] file\n"
+              "       png -c [-i pread] [-T trace.json] file...");
+}
+
+/* where push_row puts rows from the push decoder */
+struct push_out {
+        struct png_push *push;
+        struct png_pixels *pixels;
+};
+
+static int push_row(const struct png_row *row, void *priv)
+{
+        struct push_out *po = priv;
+        struct png_pixels *pixels = po->pixels;
+        struct header_chunk *hc;
+        uint8_t *out;
+        uint32_t i;
+
+        /* the header has been parsed by the time the first row shows up */
+        if (!pixels->data) {
+                hc = header_chunk(lookup_chunk(png_push_image(po->push),
+                                               CHUNK_IHDR));
+                pixels->width = hc->width;
+                pixels->height = hc->height;
+                pixels->stride = (size_t)hc->width * 4;
+                pixels->data = calloc(hc->height, pixels->stride);
+                if (!pixels->data)
+                        return 1;
+        }
+
+        out = pixels->data + row->y * pixels->stride + row->x0 * 4;
+        for (i = 0; i < row->n; i++, out += row->dx * 4)
+                memcpy(out, row->rgba + i * 4, 4);
+        return 0;
+}
+
+/*
+ * decode with the push decoder, reading the file with the given backend
+ * and feeding it slice bytes at a time (or a whole piece, if slice is 0)
+ */
+static int push_decode(const char *fname, enum input_backend backend,
+                       size_t slice, struct png_pixels *pixels)
+{
+        struct png_input in;
+        struct push_out po;
+        const uint8_t *buf;
+        ssize_t ret;
+        size_t off, n;
+        int err;
+
+        memset(pixels, 0, sizeof *pixels);
+        err = input_open(&in, fname, backend, 0);
+        if (err)
+                return err;
+
+        po.pixels = pixels;
+        po.push = png_push_new(push_row, &po);
+        if (!po.push) {
+                err = -P_ENOMEM;
+                goto out_input;
+        }
+
+        while (!err && (ret = input_next(&in, &buf)) > 0) {
+                for (off = 0; off < (size_t)ret && !err; off += n) {
+                        n = slice && slice < ret - off ? slice : ret - off;
+                        err = png_push_feed(po.push, buf + off, n);
+                }
+        }
+        if (!err && ret < 0)
+                err = ret;
+        if (err > 0)
+                err = -P_ENOMEM;
+        if (!err)
+                err = png_push_finish(po.push);
+
+        png_push_free(po.push);
+out_input:
+        input_close(&in);
+        return err;
+}
+
+/* for -c: report each file. priv points at the file names and a count */
+struct check {
+        char **fnames;
+        size_t failed;
+};
+
+static void check_done(size_t file, int err, struct png_image *img,
+                       void *priv)
+{
+        struct check *check = priv;
+        (void)img;
+
+        if (err) {
+                printf("%s: %s\n", check->fnames[file], e2msg(err));
+                check->failed++;
+        } else {
+                printf("%s: ok\n", check->fnames[file]);
+        }
+}
+
+static const struct png_batch_ops check_ops = {
+        .done = check_done
+};
+
+/*
+ * draw each frame of an animation once, writing frame n to out_name.n if
+ * out_name isn't NULL. if seek isn't NULL, draw only frame *seek instead.
+ */
+static int decode_anim(struct png_image *img, const char *out_name,
+                       const uint32_t *seek)
+{
+        const struct png_pixels *canvas;
+        const struct frame_chunk *fc;
+        struct png_anim *anim;
+        char name[4096];
+        uint32_t n;
+        int err;
+
+        err = png_anim_new(img, &anim);
+        if (err)
+                return err;
+
+        /* a frame past the end is refused by png_anim_seek */
+        for (n = seek ? *seek : 0; seek || n < png_anim_frames(anim); n++) {
+                if (seek)
+                        err = png_anim_seek(anim, n, &canvas, &fc);
+                else
+                        err = png_anim_next(anim, &canvas, &fc);
+                if (err)
+                        break;
+                printf("frame %u: %ux%u at (%u,%u) for %u/%u s\n", n,
+                       fc->width, fc->height, fc->x, fc->y, fc->delay_num,
+                       fc->delay_den ? fc->delay_den : 100);
+                if (out_name) {
+                        snprintf(name, sizeof name, "%s.%u", out_name, n);
+                        write_pam(name, canvas);
+                }
+                if (seek)
+                        break;
+        }
+
+        png_anim_free(anim);
+        return err;
+}
+
+/*
+ * decode rows [y, y + h) the way a server handing out bands of a huge
+ * image would: index it with one full decode, then go from there
+ */
+static int decode_band(struct png_image *img, uint32_t y, uint32_t h,
+                       size_t spacing, struct png_pixels *out)
+{
+        struct png_index *index;
+        struct png_pixels full;
+        int err;
+
+        err = png_decode_indexed(img, spacing, &full, &index);
+        if (err)
+                return err;
+        png_pixels_free(&full);
+
+        err = png_decode_rows(img, index, y, h, out);
+        png_index_free(index);
+        return err;
+}
+
+/*
+ * decode a file in memory runs times through a decoded image cache, the
+ * way a server handing out the same image over and over would
+ */
+static int decode_cached(const uint8_t *buf, size_t size, uint32_t w,
+                         uint32_t h, unsigned long runs, const char *out_name)
+{
+        const struct png_pixels *pixels;
+        struct png_cache_stats stats;
+        struct png_cache *cache;
+        unsigned long i;
+        int err = 0;
+
+        cache = png_cache_new(PNG_CACHE_BUDGET);
+        if (!cache)
+                return -P_ENOMEM;
+
+        for (i = 0; i < runs && !err; i++) {
+                err = png_cache_decode(cache, buf, size, w, h, &pixels);
+                if (err)
+                        break;
+                if (out_name && i == runs - 1)
+                        write_pam(out_name, pixels);
+                png_cache_put(pixels);
+        }
+
+        png_cache_stats(cache, &stats);
+        printf("cache: %llu hits, %llu misses, %llu evictions, "
+               "%zu images in %zu bytes\n",
+               (unsigned long long)stats.hits,
+               (unsigned long long)stats.misses,
+               (unsigned long long)stats.evictions, stats.images,
+               stats.bytes);
+        png_cache_free(cache);
+        return err;
+}
+
+/* print the nonzero buckets of a zlib_stats histogram */
+static void print_hist(const char *what, const uint64_t *hist)
+{
+        unsigned i;
+
+        printf("  %s:", what);
+        for (i = 0; i < ZLIB_STATS_HIST; i++)
+                if (hist[i])
+                        printf(" %lu-%lu:%llu", 1UL << i, (2UL << i) - 1,
+                               (unsigned long long)hist[i]);
+        printf("\n");
+}
+
+#define MS(ns) ((ns) / 1e6)
+
+/* for -S: where parsing and decoding went */
+static void print_stats(const struct chunk_stats *cs,
+                        const struct png_decode_stats *ds)
+{
+        const struct zlib_stats *zs = &ds->zlib;
+        uint64_t symbols_ns;
+
+        /* whatever inflating didn't spend elsewhere went on symbols */
+        symbols_ns = zs->zs_total_ns - zs->zs_tree_ns - zs->zs_adler_ns
+                - zs->zs_drain_ns;
+
+        printf("parse: %llu chunks, %llu bytes in %.3f ms "
+               "(%.3f ms checking crcs)\n",
+               (unsigned long long)cs->cs_chunks,
+               (unsigned long long)cs->cs_bytes, MS(cs->cs_parse_ns),
+               MS(cs->cs_crc_ns));
+        printf("inflate: %llu bytes to %llu in %.3f ms: trees %.3f ms, "
+               "symbols %.3f ms, adler32 %.3f ms\n",
+               (unsigned long long)zs->zs_in, (unsigned long long)zs->zs_out,
+               MS(zs->zs_total_ns), MS(zs->zs_tree_ns), MS(symbols_ns),
+               MS(zs->zs_adler_ns));
+        printf("  blocks: %llu stored, %llu static, %llu dynamic; %llu "
+               "reused trees\n",
+               (unsigned long long)zs->zs_stored_blocks,
+               (unsigned long long)zs->zs_static_blocks,
+               (unsigned long long)zs->zs_dynamic_blocks,
+               (unsigned long long)zs->zs_tree_hits);
+        printf("  %llu symbols; bytes from %llu literals, %llu in %llu "
+               "matches, %llu stored\n",
+               (unsigned long long)zs->zs_symbols,
+               (unsigned long long)zs->zs_literal_bytes,
+               (unsigned long long)zs->zs_match_bytes,
+               (unsigned long long)zs->zs_matches,
+               (unsigned long long)zs->zs_stored_bytes);
+        print_hist("match lengths", zs->zs_len_hist);
+        print_hist("match distances", zs->zs_dist_hist);
+        printf("  %llu output reallocs\n",
+               (unsigned long long)zs->zs_reallocs);
+        printf("rows: %llu (%llu none, %llu sub, %llu up, %llu average, "
+               "%llu paeth)\n", (unsigned long long)ds->rows,
+               (unsigned long long)ds->filters[0],
+               (unsigned long long)ds->filters[1],
+               (unsigned long long)ds->filters[2],
+               (unsigned long long)ds->filters[3],
+               (unsigned long long)ds->filters[4]);
+        printf("  unfilter %.3f ms, convert %.3f ms\n", MS(ds->unfilter_ns),
+               MS(ds->convert_ns));
+        printf("decode: %.3f ms, %.3f ms of it checking deferred crcs\n",
+               MS(ds->total_ns), MS(ds->crc_ns));
+}
+
+static int print_pass(const struct png_pixels *preview, unsigned pass,
+                      size_t src_read, void *priv)
+{
+        (void)preview;
+        (void)priv;
+
+        printf("pass %u done after %zu compressed bytes\n", pass, src_read);
+        return 0;
+}
+
 int main(int argc, char **argv)
 {
         const char *fname;
+        const char *out_name = NULL;
+        const char *enc_name = NULL;
+        int level = ZLIB_LEVEL_DEFAULT;
+        unsigned threads = 1;
+        unsigned enc_flags = 0;
+        unsigned parse_flags = 0;
         const uint8_t *fbuf;
-        int fd;
+        int fd, opt, err;
         size_t size;
         size_t offset;
+        size_t src_read;
         ssize_t ret;
         struct chunk *chunk;
         struct png_image image;
+        struct png_pixels pixels;
+        struct png_rect rect;
+        uint32_t scale_w, scale_h;
+        unsigned last_pass = 0;
+        size_t push_size = 0;
+        enum input_backend backend = INPUT_MMAP;
+        bool push = false;
+        bool check = false;
+        struct check results;
+        bool have_rect = false;
+        bool have_scale = false;
+        bool pipelined = false;
+        bool animated = false;
+        uint32_t seek_frame;
+        bool seek = false;
+        const char *sidecar = NULL;
+        uint32_t band_y, band_h;
+        bool have_band = false;
+        size_t spacing = PNG_INDEX_SPACING;
+        unsigned long cache_runs = 0;
+        bool show_stats = false;
+        const char *trace_name = NULL;
+        uint64_t tr;
+        struct chunk_stats chunk_stats;
+        struct png_decode_stats decode_stats;
 
         image.first = NULL;
+        memset(&chunk_stats, 0, sizeof chunk_stats);
+        memset(&decode_stats, 0, sizeof decode_stats);
 
-        if (argc < 2)
+        while ((opt = getopt(argc, argv, "r:s:p:i:f:o:e:l:t:PIaF:cx:b:k:n:ST:")) != -1) {
+                switch (opt) {
+                case 'r':
+                        if (sscanf(optarg, "%u,%u,%u,%u", &rect.x, &rect.y,
+                                   &rect.w, &rect.h) != 4)
+                                usage();
+                        have_rect = true;
+                        break;
+                case 's':
+                        if (sscanf(optarg, "%ux%u", &scale_w, &scale_h) != 2)
+                                usage();
+                        have_scale = true;
+                        break;
+                case 'p':
+                        last_pass = atoi(optarg);
+                        if (!last_pass)
+                                usage();
+                        break;
+                case 'i':
+                        if (!strcmp(optarg, "mmap"))
+                                backend = INPUT_MMAP;
+                        else if (!strcmp(optarg, "pread"))
+                                backend = INPUT_PREAD;
+                        else
+                                usage();
+                        push = true;
+                        break;
+                case 'f':
+                        push_size = strtoul(optarg, NULL, 0);
+                        if (!push_size)
+                                usage();
+                        push = true;
+                        break;
+                case 'o':
+                        out_name = optarg;
+                        break;
+                case 'e':
+                        enc_name = optarg;
+                        break;
+                case 'l':
+                        level = atoi(optarg);
+                        if (level < ZLIB_LEVEL_STORE || level > ZLIB_LEVEL_BEST)
+                                usage();
+                        break;
+                case 't':
+                        threads = strtoul(optarg, NULL, 0);
+                        break;
+                case 'P':
+                        pipelined = true;
+                        break;
+                case 'I':
+                        enc_flags |= ENCODE_INDEPENDENT;
+                        break;
+                case 'a':
+                        animated = true;
+                        break;
+                case 'F':
+                        seek_frame = strtoul(optarg, NULL, 0);
+                        seek = true;
+                        break;
+                case 'c':
+                        check = true;
+                        break;
+                case 'x':
+                        sidecar = optarg;
+                        break;
+                case 'b':
+                        if (sscanf(optarg, "%u,%u", &band_y, &band_h) != 2)
+                                usage();
+                        have_band = true;
+                        break;
+                case 'k':
+                        spacing = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        cache_runs = strtoul(optarg, NULL, 0);
+                        if (!cache_runs)
+                                usage();
+                        break;
+                case 'S':
+                        show_stats = true;
+                        break;
+                case 'T':
+                        trace_name = optarg;
+                        break;
+                default:
+                        usage();
+                }
+        }
+
+        if (optind >= argc)
                 error("must provide a filename");
+
+        /* stats only come from a plain serial decode */
+        if (show_stats && (have_rect || have_band || have_scale || last_pass
+                           || pipelined || threads != 1 || animated
+                           || push || check || cache_runs))
+                usage();
+
+        /* written out at exit, however we get there */
+        if (trace_name) {
+                err = trace_start(trace_name);
+                if (err)
+                        error(e2msg(err));
+        }
         
-        fname = argv[1];
+        /* decode every file given, io_uring permitting */
+        if (check) {
+                results.fnames = argv + optind;
+                results.failed = 0;
+                err = png_batch_decode((const char *const *)argv + optind,
+                                       argc - optind, &check_ops, &results,
+                                       0, 0, backend == INPUT_PREAD
+                                       ? BATCH_NO_URING : 0);
+                if (err)
+                        error(e2msg(err));
+                return !!results.failed;
+        }
+
+        fname = argv[optind];
+
+        /* the push decoder does its own reading */
+        if (push) {
+                err = push_decode(fname, backend, push_size, &pixels);
+                if (err) {
+                        fprintf(stderr, "decode failed: %s\n", e2msg(err));
+                        return 1;
+                }
+                if (out_name)
+                        write_pam(out_name, &pixels);
+                if (enc_name)
+                        write_png(enc_name, &pixels, level, threads,
+                                  enc_flags);
+                png_pixels_free(&pixels);
+                return 0;
+        }
+
+        tr = trace_begin();
         fd = open(fname, O_RDONLY);
         if (fd == -1)
                 error("open failed");
@@ -81,22 +612,60 @@ int main(int argc, char **argv)
         fbuf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
         if (fbuf == MAP_FAILED)
                 error("mmap failed");
+        trace_end("open", tr);
 
         offset = parse_magic(fbuf, size);
         if (!offset)
                 error("failed to parse magic");
 
+        /* the cache parses and decodes for itself */
+        if (cache_runs) {
+                err = decode_cached(fbuf, size, have_scale ? scale_w : 0,
+                                    have_scale ? scale_h : 0, cache_runs,
+                                    out_name);
+                if (err) {
+                        fprintf(stderr, "decode failed: %s\n", e2msg(err));
+                        return 1;
+                }
+                munmap((void*)fbuf, size);
+                close(fd);
+                return 0;
+        }
+
+        /* let threaded decodes check the image data's crcs on the side */
+        if (threads != 1 || pipelined)
+                parse_flags |= PARSE_DEFER_CRC;
+
         printf("start of buff is at %p, end at %p\n", (void*)fbuf,
                (void*)(fbuf + size));
 
-        for (;;) {
+        tr = trace_begin();
+
+        /* find the chunks through a sidecar, making one if need be */
+        if (sidecar) {
+                ret = sidecar_parse(sidecar, fd, fbuf, size, &image,
+                                    parse_flags);
+                if (ret < 0)
+                        error(e2msg(ret));
+                offset = ret;
+        }
+
+        while (!sidecar) {
                 printf("offset is %zu\n", offset);
-                ret = parse_next_chunk(fbuf + offset, size - offset, &image);
+                if (show_stats)
+                        ret = parse_next_chunk_stats(fbuf + offset,
+                                                     size - offset, &image,
+                                                     parse_flags,
+                                                     &chunk_stats);
+                else
+                        ret = parse_next_chunk(fbuf + offset, size - offset,
+                                               &image, parse_flags);
                 if (ret < 0)
                         break;
 
                 offset += ret;
         }
+        trace_end("chunk walk", tr);
 
         if (size != offset)
                 printf("ended parsing chunks without traversing whole file\n");
@@ -112,6 +681,55 @@ int main(int argc, char **argv)
                 chunk = chunk->next;
         }
 
+        if (animated) {
+                err = decode_anim(&image, out_name,
+                                  seek ? &seek_frame : NULL);
+                if (err) {
+                        fprintf(stderr, "decode failed: %s\n", e2msg(err));
+                        return 1;
+                }
+                if (sidecar)
+                        sidecar_update(sidecar, fd, &image);
+                munmap((void*)fbuf, size);
+                close(fd);
+                return 0;
+        }
+
+        if (have_rect)
+                err = png_decode_region(&image, &rect, &pixels, &src_read);
+        else if (have_band)
+                err = decode_band(&image, band_y, band_h, spacing, &pixels);
+        else if (have_scale)
+                err = png_decode_scaled(&image, scale_w, scale_h, &pixels);
+        else if (last_pass)
+                err = png_decode_progressive(&image, last_pass, print_pass,
+                                             NULL, &pixels, &src_read);
+        else if (pipelined)
+                err = png_decode_pipelined(&image, &pixels);
+        else if (show_stats)
+                err = png_decode_stats(&image, &pixels, &decode_stats);
+        else
+                err = png_decode_threads(&image, &pixels, threads);
+        if (err) {
+                fprintf(stderr, "decode failed: %s\n", e2msg(err));
+                return 1;
+        }
+
+        /* deferred crcs were checked by the decode, so remember that */
+        if (sidecar)
+                sidecar_update(sidecar, fd, &image);
+
+        if (have_rect)
+                printf("decoded %ux%u region at (%u,%u), read %zu compressed "
+                       "bytes\n", rect.w, rect.h, rect.x, rect.y, src_read);
+        if (show_stats)
+                print_stats(&chunk_stats, &decode_stats);
+        if (out_name)
+                write_pam(out_name, &pixels);
+        if (enc_name)
+                write_png(enc_name, &pixels, level, threads, enc_flags);
+        png_pixels_free(&pixels);
+
         munmap((void*)fbuf, size);
         close(fd);
         return 0;
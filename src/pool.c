@@ -0,0 +1,154 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "trace.h"
+
+struct pool {
+        pthread_mutex_t lock;
+
+        /* signalled when a job is queued, or when it's time to stop */
+        pthread_cond_t work;
+
+        /* broadcast whenever a job finishes */
+        pthread_cond_t done;
+
+        /* queued jobs, oldest first */
+        struct pool_job *head;
+        struct pool_job *tail;
+
+        bool stopping;
+
+        unsigned nthreads;
+        pthread_t *threads;
+};
+
+static void *worker(void *arg)
+{
+        struct pool *pool = arg;
+        struct pool_job *job;
+
+        pthread_mutex_lock(&pool->lock);
+        for (;;) {
+                while (!pool->head && !pool->stopping)
+                        pthread_cond_wait(&pool->work, &pool->lock);
+                if (!pool->head)
+                        break;
+
+                job = pool->head;
+                pool->head = job->next;
+                if (!pool->head)
+                        pool->tail = NULL;
+                pthread_mutex_unlock(&pool->lock);
+
+                trace_image(job->image);
+                job->fn(job);
+
+                pthread_mutex_lock(&pool->lock);
+                job->done = true;
+                pthread_cond_broadcast(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return NULL;
+}
+
+struct pool *pool_new(unsigned threads)
+{
+        struct pool *pool;
+        long cpus;
+
+        if (!threads) {
+                cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                threads = cpus > 0 ? cpus : 1;
+        }
+
+        pool = calloc(1, sizeof *pool);
+        if (!pool)
+                return NULL;
+        pool->threads = calloc(threads, sizeof *pool->threads);
+        if (!pool->threads)
+                goto out_pool;
+
+        if (pthread_mutex_init(&pool->lock, NULL))
+                goto out_threads;
+        if (pthread_cond_init(&pool->work, NULL))
+                goto out_lock;
+        if (pthread_cond_init(&pool->done, NULL))
+                goto out_work;
+
+        for (; pool->nthreads < threads; pool->nthreads++)
+                if (pthread_create(&pool->threads[pool->nthreads], NULL,
+                                   worker, pool))
+                        break;
+
+        /* make do with fewer threads, so long as there's one */
+        if (pool->nthreads)
+                return pool;
+
+        pthread_cond_destroy(&pool->done);
+out_work:
+        pthread_cond_destroy(&pool->work);
+out_lock:
+        pthread_mutex_destroy(&pool->lock);
+out_threads:
+        free(pool->threads);
+out_pool:
+        free(pool);
+        return NULL;
+}
+
+unsigned pool_threads(const struct pool *pool)
+{
+        return pool->nthreads;
+}
+
+void pool_submit(struct pool *pool, struct pool_job *job)
+{
+        job->next = NULL;
+        job->done = false;
+        job->image = trace_current_image();
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->tail)
+                pool->tail->next = job;
+        else
+                pool->head = job;
+        pool->tail = job;
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(struct pool *pool, struct pool_job *job)
+{
+        pthread_mutex_lock(&pool->lock);
+        while (!job->done)
+                pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(struct pool *pool)
+{
+        unsigned i;
+
+        if (!pool)
+                return;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < pool->nthreads; i++)
+                pthread_join(pool->threads[i], NULL);
+
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+        free(pool);
+}
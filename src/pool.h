@@ -0,0 +1,40 @@
+#ifndef PNG_POOL_H
+#define PNG_POOL_H
+
+#include <stdbool.h>
+
+/*
+ * a fixed size pool of worker threads running jobs off of a fifo queue.
+ * jobs are embedded in whatever the caller wants to hand the worker (see
+ * container_of in util.h), so nothing is allocated per job.
+ */
+struct pool;
+
+struct pool_job {
+        /* called on a worker thread */
+        void (*fn)(struct pool_job *job);
+
+        /* private */
+        struct pool_job *next;
+        bool done;
+
+        /* the submitter's trace_image, passed on to the worker */
+        unsigned image;
+};
+
+/* start threads workers, or one per online cpu if threads is 0 */
+struct pool *pool_new(unsigned threads);
+
+/* number of worker threads in the pool */
+unsigned pool_threads(const struct pool *pool);
+
+/* queue a job. job->fn must be set */
+void pool_submit(struct pool *pool, struct pool_job *job);
+
+/* wait for a submitted job to finish */
+void pool_wait(struct pool *pool, struct pool_job *job);
+
+/* finish every queued job and stop the workers */
+void pool_free(struct pool *pool);
+
+#endif /* PNG_POOL_H */
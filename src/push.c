@@ -0,0 +1,361 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "crc.h"
+#include "decode.h"
+#include "error.h"
+#include "int.h"
+#include "push.h"
+#include "zlib.h"
+
+/*
+ * compressed input we hold on to between calls. this only ever needs to
+ * fit the longest thing zlib_inflate won't consume piecemeal (a dynamic
+ * block header, a few hundred bytes), the rest is just batching.
+ */
+#define PUSH_INPUT_SIZE 4096
+
+static const uint8_t push_magic[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+/* where we are in the file */
+enum push_state {
+        PUSH_MAGIC = 0,
+
+        /* length and type fields of a chunk */
+        PUSH_HEADER,
+
+        /* data and crc of a chunk that gets buffered and parsed whole */
+        PUSH_CHUNK,
+
+        /* data of an IDAT chunk, which goes straight to the inflater */
+        PUSH_IDAT,
+
+        /* crc of an IDAT chunk */
+        PUSH_IDAT_CRC,
+
+        /* past IEND */
+        PUSH_END
+};
+
+struct png_push {
+        enum push_state state;
+
+        /*
+         * fixed size fields (magic, chunk header, IDAT crc) that can be
+         * split across calls are collected here
+         */
+        uint8_t hdr[8];
+        size_t hdr_fill;
+
+        /* length field of the current chunk, and bytes of it still to come */
+        uint32_t length;
+        size_t left;
+
+        /* a whole non-IDAT chunk, length and type fields included */
+        uint8_t *chunk;
+        size_t chunk_fill;
+
+        /* running crc of the current IDAT chunk */
+        uint32_t crc;
+
+        struct png_image img;
+
+        /* set up at the first IDAT */
+        bool started;
+        struct png_decoder dec;
+        struct zlib_stream stream;
+
+        /* compressed bytes from z_src_idx up to in_fill are unconsumed */
+        uint8_t in[PUSH_INPUT_SIZE];
+        size_t in_fill;
+
+        /* set once the zlib stream (and so the image) is complete */
+        bool inflated;
+
+        /* a row converted to RGBA for the callback */
+        uint8_t *rgba;
+
+        int (*row)(const struct png_row *row, void *priv);
+        void *priv;
+};
+
+/* copy up to want - *fill bytes into dst. returns how many were taken */
+static size_t collect(uint8_t *dst, size_t *fill, size_t want,
+                      const uint8_t *buf, size_t len)
+{
+        size_t n = want - *fill;
+
+        if (n > len)
+                n = len;
+        memcpy(dst + *fill, buf, n);
+        *fill += n;
+        return n;
+}
+
+static int push_row(struct png_decoder *dec, const uint8_t *row)
+{
+        struct png_push *push = dec->priv;
+        struct png_row r;
+
+        convert_row(dec, row, 0, dec->pass_w, push->rgba, 4);
+
+        r.y = dec->y0 + dec->pass_y * dec->dy;
+        r.x0 = dec->x0;
+        r.dx = dec->dx;
+        r.n = dec->pass_w;
+        r.pass = dec->pass;
+        r.rgba = push->rgba;
+        return push->row(&r, push->priv);
+}
+
+static int push_start(struct png_push *push)
+{
+        int error;
+
+        error = decoder_init(&push->dec, &push->img);
+        if (error)
+                return error;
+        push->dec.row = push_row;
+        push->dec.priv = push;
+
+        memset(&push->stream, 0, sizeof push->stream);
+        push->stream.z_src = push->in;
+        push->stream.z_drain = decoder_drain;
+        push->stream.z_drain_size = push->dec.row_bytes + 1;
+        push->stream.z_priv = &push->dec;
+        push->started = true;
+
+        push->rgba = malloc((size_t)push->dec.width * 4);
+        if (!push->rgba)
+                return -P_ENOMEM;
+
+        return zlib_inflate_init(&push->stream);
+}
+
+/* inflate whatever is in the input buffer, then keep only the leftovers */
+static int push_inflate(struct png_push *push)
+{
+        struct zlib_stream *stream = &push->stream;
+        int error;
+
+        stream->z_src_end = push->in_fill;
+        error = zlib_inflate(stream);
+        if (!error) {
+                push->inflated = true;
+                if (!push->dec.done)
+                        error = -P_EINVAL;
+        } else if (error == Z_STOPPED) {
+                if (push->dec.error)
+                        error = push->dec.error;
+        } else if (error == -P_E2SMALL) {
+                error = 0;
+        }
+
+        push->in_fill -= stream->z_src_idx;
+        memmove(push->in, push->in + stream->z_src_idx, push->in_fill);
+        stream->z_src_idx = 0;
+        return error;
+}
+
+/* feed IDAT data to the inflater. returns bytes taken or a negative error */
+static ssize_t push_idat(struct png_push *push, const uint8_t *buf,
+                         size_t len)
+{
+        size_t n;
+        int error;
+
+        if (!push->started) {
+                error = push_start(push);
+                if (error)
+                        return error;
+        }
+
+        if (len > push->left)
+                len = push->left;
+
+        /* trailing junk after the end of the zlib stream is ignored */
+        if (push->inflated) {
+                push->crc = crc32_update(push->crc, buf, len);
+                return len;
+        }
+
+        n = collect(push->in, &push->in_fill, PUSH_INPUT_SIZE, buf, len);
+        push->crc = crc32_update(push->crc, buf, n);
+
+        error = push_inflate(push);
+        if (error < 0)
+                return error;
+
+        /* the input buffer is big enough for anything inflate can't split */
+        if (!n && push->in_fill == PUSH_INPUT_SIZE)
+                return -P_EINVAL;
+
+        return n;
+}
+
+/* the chunk header is in hdr; work out what to do with the chunk */
+static int push_header(struct png_push *push)
+{
+        if (!read_png_uint(push->hdr, &push->length))
+                return -P_ERANGE;
+
+        if (!memcmp(push->hdr + 4, "IDAT", 4)) {
+                push->crc = crc32(push->hdr + 4, 4);
+                push->left = push->length;
+                push->state = PUSH_IDAT;
+                return 0;
+        }
+
+        /* IDATs must be consecutive, and end before anything else */
+        if (push->started && !push->inflated)
+                return -P_EINVAL;
+
+        push->chunk = malloc((size_t)push->length + 12);
+        if (!push->chunk)
+                return -P_ENOMEM;
+        memcpy(push->chunk, push->hdr, 8);
+        push->chunk_fill = 8;
+        push->state = PUSH_CHUNK;
+        return 0;
+}
+
+/* a whole non-IDAT chunk is buffered, so parse it */
+static int push_chunk(struct png_push *push)
+{
+        ssize_t ret;
+
+        ret = parse_next_chunk(push->chunk, push->chunk_fill, &push->img,
+                               0);
+        free(push->chunk);
+        push->chunk = NULL;
+        if (ret < 0)
+                return ret;
+
+        if (!memcmp(push->hdr + 4, "IEND", 4))
+                push->state = PUSH_END;
+        else
+                push->state = PUSH_HEADER;
+        return 0;
+}
+
+struct png_push *png_push_new(int (*row)(const struct png_row *row,
+                                         void *priv),
+                              void *priv)
+{
+        struct png_push *push;
+
+        push = calloc(1, sizeof *push);
+        if (!push)
+                return NULL;
+
+        push->row = row;
+        push->priv = priv;
+        return push;
+}
+
+int png_push_feed(struct png_push *push, const uint8_t *buf, size_t len)
+{
+        ssize_t ret;
+        size_t n;
+        int error;
+
+        while (len) {
+                switch (push->state) {
+                case PUSH_MAGIC:
+                        n = collect(push->hdr, &push->hdr_fill, 8, buf, len);
+                        if (push->hdr_fill == 8) {
+                                if (memcmp(push->hdr, push_magic, 8))
+                                        return -P_EINVAL;
+                                push->hdr_fill = 0;
+                                push->state = PUSH_HEADER;
+                        }
+                        break;
+
+                case PUSH_HEADER:
+                        n = collect(push->hdr, &push->hdr_fill, 8, buf, len);
+                        if (push->hdr_fill == 8) {
+                                push->hdr_fill = 0;
+                                error = push_header(push);
+                                if (error)
+                                        return error;
+                        }
+                        break;
+
+                case PUSH_CHUNK:
+                        n = collect(push->chunk, &push->chunk_fill,
+                                    (size_t)push->length + 12, buf, len);
+                        if (push->chunk_fill == (size_t)push->length + 12) {
+                                error = push_chunk(push);
+                                if (error)
+                                        return error;
+                        }
+                        break;
+
+                case PUSH_IDAT:
+                        if (push->left) {
+                                ret = push_idat(push, buf, len);
+                                if (ret < 0)
+                                        return ret;
+                                n = ret;
+                                push->left -= n;
+                        } else {
+                                n = 0;
+                        }
+                        if (!push->left)
+                                push->state = PUSH_IDAT_CRC;
+                        break;
+
+                case PUSH_IDAT_CRC:
+                        n = collect(push->hdr, &push->hdr_fill, 4, buf, len);
+                        if (push->hdr_fill == 4) {
+                                push->hdr_fill = 0;
+                                if (__read_png_int_raw(push->hdr)
+                                    != (int32_t)push->crc)
+                                        return -P_EBADCSUM;
+                                push->state = PUSH_HEADER;
+                        }
+                        break;
+
+                case PUSH_END:
+                default:
+                        return -P_EINVAL;
+                }
+
+                buf += n;
+                len -= n;
+
+                if (push->dec.stopped)
+                        return 1;
+        }
+
+        return 0;
+}
+
+int png_push_finish(struct png_push *push)
+{
+        if (push->state != PUSH_END || !push->inflated)
+                return -P_E2SMALL;
+        return 0;
+}
+
+struct png_image *png_push_image(struct png_push *push)
+{
+        return &push->img;
+}
+
+void png_push_free(struct png_push *push)
+{
+        if (push->started) {
+                zlib_end(&push->stream);
+                free(push->stream.z_dst);
+        }
+        decoder_fini(&push->dec);
+        free_chunks(&push->img);
+        free(push->chunk);
+        free(push->rgba);
+        free(push);
+}
@@ -0,0 +1,63 @@
+#ifndef PNG_PUSH_H
+#define PNG_PUSH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chunk.h"
+
+/*
+ * push mode decoding: rather than parsing a whole file that's already in
+ * memory, bytes are fed in as they turn up (off of a socket, say) in
+ * pieces of any size, and scanlines are handed out as soon as they can be
+ * decoded. Only the inflate window, a couple of rows, and a small input
+ * buffer are held on to between calls. The exception is non-IDAT chunks,
+ * which are buffered whole, since they're parsed by parse_next_chunk.
+ */
+struct png_push;
+
+/* a decoded scanline, or one adam7 pass's worth of one */
+struct png_row {
+        /* row in the image */
+        uint32_t y;
+
+        /* the row covers pixels x0, x0 + dx, x0 + 2 * dx, ... */
+        uint32_t x0;
+        uint32_t dx;
+
+        /* number of pixels in the row */
+        uint32_t n;
+
+        /* adam7 pass (0-6). always 0 if the image isn't interlaced */
+        unsigned pass;
+
+        /* n RGBA pixels, packed. only valid during the callback */
+        const uint8_t *rgba;
+};
+
+/*
+ * allocate a push decoder. row is called with each scanline; if it returns
+ * nonzero, decoding stops and png_push_feed returns 1.
+ */
+struct png_push *png_push_new(int (*row)(const struct png_row *row,
+                                         void *priv),
+                              void *priv);
+
+/*
+ * feed the next len bytes of the file. returns 0 if all of them were
+ * consumed, 1 if the row callback stopped us, or a negative error.
+ */
+int png_push_feed(struct png_push *push, const uint8_t *buf, size_t len);
+
+/*
+ * call once there's no more input. returns 0 if the whole image was
+ * decoded, or -P_E2SMALL if the file was cut short.
+ */
+int png_push_finish(struct png_push *push);
+
+/* the chunks parsed so far */
+struct png_image *png_push_image(struct png_push *push);
+
+void png_push_free(struct png_push *push);
+
+#endif /* PNG_PUSH_H */
@@ -0,0 +1,191 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+/* how many times to yield and look again before going to sleep */
+#define RING_SPINS 64
+
+struct ring {
+        uint8_t *buf;
+        size_t size;
+
+        /*
+         * bytes written and read so far. head only moves in ring_write and
+         * tail only in ring_consume, so head - tail is what's in the ring
+         */
+        atomic_size_t head;
+        atomic_size_t tail;
+
+        /* set by the producer when it's done, and by the consumer to quit */
+        atomic_bool closed;
+        atomic_bool stopped;
+
+        /*
+         * for a side with nothing to do to sleep on. the ring can't be
+         * both full and empty, so only one side ever sleeps at a time
+         */
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        atomic_bool sleeping;
+};
+
+struct ring *ring_new(size_t size)
+{
+        struct ring *ring;
+
+        ring = calloc(1, sizeof *ring);
+        if (!ring)
+                return NULL;
+
+        for (ring->size = 1; ring->size < size; ring->size *= 2)
+                ;
+        ring->buf = malloc(ring->size);
+        if (!ring->buf)
+                goto out_ring;
+
+        if (pthread_mutex_init(&ring->lock, NULL))
+                goto out_buf;
+        if (pthread_cond_init(&ring->cond, NULL))
+                goto out_lock;
+
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->closed, false);
+        atomic_init(&ring->stopped, false);
+        atomic_init(&ring->sleeping, false);
+        return ring;
+
+out_lock:
+        pthread_mutex_destroy(&ring->lock);
+out_buf:
+        free(ring->buf);
+out_ring:
+        free(ring);
+        return NULL;
+}
+
+void ring_free(struct ring *ring)
+{
+        pthread_cond_destroy(&ring->cond);
+        pthread_mutex_destroy(&ring->lock);
+        free(ring->buf);
+        free(ring);
+}
+
+static bool writable(struct ring *ring)
+{
+        return atomic_load(&ring->stopped)
+                || atomic_load(&ring->head) - atomic_load(&ring->tail)
+                < ring->size;
+}
+
+static bool readable(struct ring *ring)
+{
+        return atomic_load(&ring->closed)
+                || atomic_load(&ring->head) != atomic_load(&ring->tail);
+}
+
+/*
+ * wait for ready to be true. the other side moves its index (or sets a
+ * flag) before checking sleeping, and we set sleeping before checking
+ * ready, so at least one of us sees the other and we can't both miss
+ */
+static void ring_wait(struct ring *ring, bool (*ready)(struct ring *))
+{
+        unsigned i;
+
+        for (i = 0; i < RING_SPINS; i++) {
+                if (ready(ring))
+                        return;
+                sched_yield();
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        atomic_store(&ring->sleeping, true);
+        while (!ready(ring))
+                pthread_cond_wait(&ring->cond, &ring->lock);
+        atomic_store(&ring->sleeping, false);
+        pthread_mutex_unlock(&ring->lock);
+}
+
+/* wake the other side up if it's asleep */
+static void ring_wake(struct ring *ring)
+{
+        if (!atomic_load(&ring->sleeping))
+                return;
+
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_signal(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+}
+
+int ring_write(struct ring *ring, const uint8_t *buf, size_t size)
+{
+        size_t head, off, n;
+
+        while (size) {
+                ring_wait(ring, writable);
+                if (atomic_load(&ring->stopped))
+                        return 1;
+
+                /* fill up to the end of the buffer, then come around */
+                head = atomic_load_explicit(&ring->head,
+                                            memory_order_relaxed);
+                n = ring->size - (head - atomic_load(&ring->tail));
+                off = head & (ring->size - 1);
+                if (n > ring->size - off)
+                        n = ring->size - off;
+                if (n > size)
+                        n = size;
+
+                memcpy(ring->buf + off, buf, n);
+                atomic_store(&ring->head, head + n);
+                ring_wake(ring);
+
+                buf += n;
+                size -= n;
+        }
+
+        return 0;
+}
+
+void ring_close(struct ring *ring)
+{
+        atomic_store(&ring->closed, true);
+        ring_wake(ring);
+}
+
+size_t ring_peek(struct ring *ring, const uint8_t **buf)
+{
+        size_t tail, off, n;
+
+        ring_wait(ring, readable);
+
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        n = atomic_load(&ring->head) - tail;
+        off = tail & (ring->size - 1);
+        if (n > ring->size - off)
+                n = ring->size - off;
+
+        *buf = ring->buf + off;
+        return n;
+}
+
+void ring_consume(struct ring *ring, size_t n)
+{
+        atomic_fetch_add(&ring->tail, n);
+        ring_wake(ring);
+}
+
+void ring_stop(struct ring *ring)
+{
+        atomic_store(&ring->stopped, true);
+        ring_wake(ring);
+}
@@ -0,0 +1,42 @@
+#ifndef PNG_RING_H
+#define PNG_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * a byte ring buffer between one producer thread and one consumer thread.
+ * each side only ever moves its own index, so passing data through takes
+ * no locks. a side that finds the ring full (or empty) spins for a bit
+ * before going to sleep until the other side gets around to it.
+ */
+struct ring;
+
+/* size is rounded up to a power of two */
+struct ring *ring_new(size_t size);
+void ring_free(struct ring *ring);
+
+/*
+ * producer: copy size bytes in, waiting for room as needed. returns
+ * nonzero if the consumer has called ring_stop, and there's no point
+ * writing anything more
+ */
+int ring_write(struct ring *ring, const uint8_t *buf, size_t size);
+
+/* producer: that's everything */
+void ring_close(struct ring *ring);
+
+/*
+ * consumer: wait for something to read and point *buf at it, returning
+ * how much of it there is in one piece. returns 0 once the producer has
+ * closed the ring and everything has been read
+ */
+size_t ring_peek(struct ring *ring, const uint8_t **buf);
+
+/* consumer: done with the first n bytes from ring_peek */
+void ring_consume(struct ring *ring, size_t n);
+
+/* consumer: don't want any more */
+void ring_stop(struct ring *ring);
+
+#endif /* PNG_RING_H */
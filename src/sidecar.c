@@ -0,0 +1,360 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "chunk.h"
+#include "crc.h"
+#include "error.h"
+#include "input.h"
+#include "int.h"
+#include "sidecar.h"
+
+static const uint8_t sidecar_magic[8] = {137, 'P', 'N', 'G', 'I', 'D', 'X', 10};
+
+/* the type field of an IDAT chunk */
+#define IDAT_TYPE 0x49444154
+
+#define SIDECAR_HEADER_SIZE 56
+#define SIDECAR_ENTRY_SIZE 24
+
+/* where a chunk is, as stored in a sidecar */
+struct sidecar_entry {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t type;
+        uint32_t crc;
+        uint32_t flags;
+};
+
+/* what ties a sidecar to the file it describes */
+struct sidecar_key {
+        uint64_t size;
+        uint64_t ino;
+        uint64_t dev;
+        uint64_t mtime_sec;
+        uint32_t mtime_nsec;
+};
+
+static void write_u64(uint8_t *buf, uint64_t val)
+{
+        __write_png_int_raw(buf, val >> 32);
+        __write_png_int_raw(buf + 4, val);
+}
+
+static uint32_t read_u32(const uint8_t *buf)
+{
+        return (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+static uint64_t read_u64(const uint8_t *buf)
+{
+        return (uint64_t)read_u32(buf) << 32 | read_u32(buf + 4);
+}
+
+static int sidecar_key(int fd, struct sidecar_key *key)
+{
+        struct stat st;
+
+        if (fstat(fd, &st))
+                return -P_EIO;
+
+        key->size = st.st_size;
+        key->ino = st.st_ino;
+        key->dev = st.st_dev;
+        key->mtime_sec = st.st_mtim.tv_sec;
+        key->mtime_nsec = st.st_mtim.tv_nsec;
+        return 0;
+}
+
+/* add one chunk described by a sidecar entry to img */
+static int load_chunk(const struct sidecar_entry *e, const uint8_t *buf,
+                      size_t size, struct png_image *img, unsigned flags)
+{
+        struct data_chunk *dc;
+        struct chunk *chunk;
+        bool crc_ok = e->flags & SIDECAR_CRC_OK;
+        ssize_t ret;
+
+        if (e->offset < 8 || e->offset > size
+            || size - e->offset < e->length + MIN_CHUNK_SIZE)
+                return -P_EINVAL;
+
+        /*
+         * the point of a sidecar: image data is found without touching
+         * it, unless its crc still has to be checked right now
+         */
+        if (e->type == IDAT_TYPE) {
+                if (!crc_ok && !(flags & PARSE_DEFER_CRC)
+                    && crc32(buf + e->offset + 4, e->length + 4) != e->crc)
+                        return -P_EBADCSUM;
+
+                chunk = new_chunk(img, CHUNK_IDAT, e->length);
+                if (!chunk)
+                        return -P_ENOMEM;
+                dc = data_chunk(chunk);
+                dc->buf = buf + e->offset + 8;
+                dc->crc = e->crc;
+                dc->crc_unchecked = !crc_ok;
+                return 0;
+        }
+
+        /* anything else is small, and gets parsed as usual */
+        ret = parse_next_chunk(buf + e->offset, size - e->offset, img,
+                               flags | (crc_ok ? PARSE_CRC_OK : 0));
+        if (ret < 0)
+                return ret;
+        return (size_t)ret == e->length + MIN_CHUNK_SIZE ? 0 : -P_EINVAL;
+}
+
+/*
+ * read the sidecar at path into *sc, if it's there and goes with the file
+ * key describes, and set *n to the number of chunks in it. returns
+ * -P_ENOCHUNK if there's no usable sidecar.
+ */
+static int sidecar_read(const char *path, const struct sidecar_key *key,
+                        uint8_t **sc, uint32_t *n)
+{
+        size_t sc_size;
+        uint8_t *p;
+
+        if (input_read_file(path, &p, &sc_size))
+                return -P_ENOCHUNK;
+
+        if (sc_size < SIDECAR_HEADER_SIZE
+            || memcmp(p, sidecar_magic, sizeof sidecar_magic)
+            || read_u32(p + 8) != SIDECAR_VERSION)
+                goto out;
+
+        *n = read_u32(p + 12);
+        if (read_u64(p + 16) != key->size
+            || read_u64(p + 24) != key->ino
+            || read_u64(p + 32) != key->dev
+            || read_u64(p + 40) != key->mtime_sec
+            || read_u32(p + 48) != key->mtime_nsec
+            || (sc_size - SIDECAR_HEADER_SIZE) / SIDECAR_ENTRY_SIZE != *n)
+                goto out;
+
+        *sc = p;
+        return 0;
+out:
+        free(p);
+        return -P_ENOCHUNK;
+}
+
+/*
+ * find img's chunks from the sidecar at path. returns -P_ENOCHUNK if
+ * there's no usable sidecar, in which case img is left empty.
+ */
+static int sidecar_load(const char *path, const struct sidecar_key *key,
+                        const uint8_t *buf, size_t size,
+                        struct png_image *img, unsigned flags)
+{
+        struct sidecar_entry e;
+        const uint8_t *p;
+        uint8_t *sc;
+        uint32_t n, i;
+        int error;
+
+        error = sidecar_read(path, key, &sc, &n);
+        if (error)
+                return error;
+
+        error = -P_ENOCHUNK;
+        p = sc + SIDECAR_HEADER_SIZE;
+        for (i = 0; i < n; i++, p += SIDECAR_ENTRY_SIZE) {
+                e.offset = read_u64(p);
+                e.length = read_u32(p + 8);
+                e.type = read_u32(p + 12);
+                e.crc = read_u32(p + 16);
+                e.flags = read_u32(p + 20);
+
+                error = load_chunk(&e, buf, size, img, flags);
+                if (error)
+                        break;
+        }
+
+        /*
+         * a sidecar that doesn't match the file is as good as none. a full
+         * parse will then find whatever is wrong with it.
+         */
+        if (error) {
+                free_chunks(img);
+                if (error != -P_ENOMEM)
+                        error = -P_ENOCHUNK;
+        }
+        free(sc);
+        return error;
+}
+
+/*
+ * write size bytes of sidecar to path. it's written to one side and
+ * renamed into place so that nobody ever sees half of one.
+ */
+static int sidecar_write(const char *path, const uint8_t *sc, size_t size)
+{
+        char *tmp;
+        FILE *f;
+        int error = -P_EIO;
+
+        tmp = malloc(strlen(path) + 5);
+        if (!tmp)
+                return -P_ENOMEM;
+
+        sprintf(tmp, "%s.tmp", path);
+        f = fopen(tmp, "wb");
+        if (!f)
+                goto out;
+        if (fwrite(sc, 1, size, f) != size) {
+                fclose(f);
+                remove(tmp);
+                goto out;
+        }
+        if (fclose(f) || rename(tmp, path)) {
+                remove(tmp);
+                goto out;
+        }
+        error = 0;
+out:
+        free(tmp);
+        return error;
+}
+
+/*
+ * write a sidecar for the n chunks in img, which start at offsets, to
+ * path
+ */
+static int sidecar_save(const char *path, const struct sidecar_key *key,
+                        const uint8_t *buf, const struct png_image *img,
+                        const size_t *offsets, uint32_t n)
+{
+        const struct chunk *chunk;
+        uint8_t *sc, *p;
+        size_t size;
+        uint32_t i, flags;
+        int error;
+
+        size = SIDECAR_HEADER_SIZE + (size_t)n * SIDECAR_ENTRY_SIZE;
+        sc = calloc(1, size);
+        if (!sc)
+                return -P_ENOMEM;
+
+        memcpy(sc, sidecar_magic, sizeof sidecar_magic);
+        __write_png_int_raw(sc + 8, SIDECAR_VERSION);
+        __write_png_int_raw(sc + 12, n);
+        write_u64(sc + 16, key->size);
+        write_u64(sc + 24, key->ino);
+        write_u64(sc + 32, key->dev);
+        write_u64(sc + 40, key->mtime_sec);
+        __write_png_int_raw(sc + 48, key->mtime_nsec);
+
+        p = sc + SIDECAR_HEADER_SIZE;
+        chunk = img->first;
+        for (i = 0; i < n; i++, chunk = chunk->next, p += SIDECAR_ENTRY_SIZE) {
+                /* everything that parsed had its crc checked, or deferred */
+                flags = SIDECAR_CRC_OK;
+                if (chunk->c_tmpl->ct_type_idx == CHUNK_IDAT
+                    && data_chunk(chunk)->crc_unchecked)
+                        flags = 0;
+
+                write_u64(p, offsets[i]);
+                __write_png_int_raw(p + 8, chunk->length);
+                memcpy(p + 12, buf + offsets[i] + 4, 4);
+                memcpy(p + 16, buf + offsets[i] + 8 + chunk->length, 4);
+                __write_png_int_raw(p + 20, flags);
+        }
+
+        error = sidecar_write(path, sc, size);
+        free(sc);
+        return error;
+}
+
+ssize_t sidecar_parse(const char *path, int fd, const uint8_t *buf,
+                      size_t size, struct png_image *img, unsigned flags)
+{
+        struct sidecar_key key;
+        size_t *offsets = NULL, *tmp;
+        size_t off, n = 0, cap = 0;
+        ssize_t ret;
+        int error;
+
+        error = sidecar_key(fd, &key);
+        if (error)
+                return error;
+
+        error = sidecar_load(path, &key, buf, size, img, flags);
+        if (error != -P_ENOCHUNK)
+                return error ? error : (ssize_t)size;
+
+        /* the slow way, remembering where each chunk was */
+        for (off = 8; off < size; off += ret) {
+                if (n == cap) {
+                        cap = cap ? 2 * cap : 64;
+                        tmp = realloc(offsets, cap * sizeof *offsets);
+                        if (!tmp) {
+                                free(offsets);
+                                return -P_ENOMEM;
+                        }
+                        offsets = tmp;
+                }
+
+                ret = parse_next_chunk(buf + off, size - off, img, flags);
+                if (ret < 0)
+                        break;
+                offsets[n++] = off;
+        }
+
+        /*
+         * only files that parse all the way through get a sidecar. it's
+         * just a cache, so not being able to write one doesn't matter.
+         */
+        if (off == size)
+                sidecar_save(path, &key, buf, img, offsets, n);
+
+        free(offsets);
+        return off;
+}
+
+int sidecar_update(const char *path, int fd, const struct png_image *img)
+{
+        struct sidecar_key key;
+        const struct chunk *chunk;
+        bool changed = false;
+        uint8_t *sc, *p;
+        uint32_t n, i;
+        int error;
+
+        error = sidecar_key(fd, &key);
+        if (error)
+                return error;
+
+        error = sidecar_read(path, &key, &sc, &n);
+        if (error)
+                return error;
+
+        /* the chunks are in img in the same order as in the sidecar */
+        p = sc + SIDECAR_HEADER_SIZE;
+        chunk = img->first;
+        for (i = 0; i < n && chunk; i++, chunk = chunk->next,
+             p += SIDECAR_ENTRY_SIZE) {
+                if (chunk->c_tmpl->ct_type_idx != CHUNK_IDAT
+                    || data_chunk(chunk)->crc_unchecked
+                    || read_u32(p + 20) & SIDECAR_CRC_OK)
+                        continue;
+                __write_png_int_raw(p + 20, read_u32(p + 20)
+                                    | SIDECAR_CRC_OK);
+                changed = true;
+        }
+
+        if (changed)
+                error = sidecar_write(path, sc,
+                                      SIDECAR_HEADER_SIZE
+                                      + (size_t)n * SIDECAR_ENTRY_SIZE);
+        free(sc);
+        return error;
+}
@@ -0,0 +1,56 @@
+#ifndef PNG_SIDECAR_H
+#define PNG_SIDECAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chunk.h"
+
+/*
+ * a sidecar is a small file next to a png that remembers where its chunks
+ * are, what type and how long they are, and whether their crcs have been
+ * checked. it's tied to the file it describes by size, inode, device and
+ * mtime, so one that's out of date is just ignored. with a good sidecar,
+ * IDAT chunks (which are most of a big file) are found without reading
+ * any of them, and nothing that was checked before is checked again.
+ *
+ * the format is big endian throughout, like png itself: a header
+ *
+ *   magic (8), version (4), number of chunks (4), file size (8),
+ *   inode (8), device (8), mtime seconds (8), mtime nanoseconds (4),
+ *   reserved (4)
+ *
+ * then for each chunk in order
+ *
+ *   offset in the file (8), length (4), type (4), crc (4), flags (4)
+ */
+#define SIDECAR_VERSION 1
+
+/* sidecar chunk flags */
+#define SIDECAR_CRC_OK 0x1 /* the crc has been checked */
+
+/*
+ * parse the chunks of the png file open as fd, which is mapped at buf
+ * (size bytes, starting with the signature), into img, which should be
+ * empty. if the sidecar at path is there and up to date, the chunks are
+ * found from it; otherwise they're parsed one after another with
+ * parse_next_chunk, and if that gets to the end of the file a new sidecar
+ * is written to path. flags are PARSE_* flags, as for parse_next_chunk.
+ * returns how far into the file parsing got, or a negative error.
+ *
+ * with PARSE_DEFER_CRC, IDAT chunks whose crcs weren't checked yet go
+ * into the sidecar as unchecked, since they only get checked as the image
+ * is decoded. sidecar_update records them once they have been.
+ */
+ssize_t sidecar_parse(const char *path, int fd, const uint8_t *buf,
+                      size_t size, struct png_image *img, unsigned flags);
+
+/*
+ * mark the IDAT chunks in the sidecar at path as checked if they have been
+ * since sidecar_parse put them in img (by crc_check_wait, say). nothing is
+ * written if none have, or if the sidecar has gone or is out of date.
+ */
+int sidecar_update(const char *path, int fd, const struct png_image *img);
+
+#endif /* PNG_SIDECAR_H */
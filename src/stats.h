@@ -0,0 +1,21 @@
+#ifndef PNG_STATS_H
+#define PNG_STATS_H
+
+#include <stdint.h>
+
+/*
+ * helpers for the optional decode statistics (struct zlib_stats,
+ * struct chunk_stats and struct png_decode_stats). none of this is touched
+ * unless a caller asks for stats.
+ */
+
+/* nanoseconds on the monotonic clock */
+uint64_t stats_clock(void);
+
+/* histogram bucket for x > 0: bucket i counts [2^i, 2^(i+1)) */
+static inline unsigned stats_bucket(uint32_t x)
+{
+        return 31 - __builtin_clz(x);
+}
+
+#endif /* PNG_STATS_H */
@@ -0,0 +1,209 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "trace.h"
+
+/* events per block of a thread's buffer */
+#define TRACE_BLOCK_EVENTS 4096
+
+struct trace_event {
+        const char *name;
+        uint64_t start;
+        uint64_t end;
+        unsigned image;
+};
+
+struct trace_block {
+        struct trace_block *next;
+        unsigned count;
+        struct trace_event events[TRACE_BLOCK_EVENTS];
+};
+
+/* one thread's spans, in the order they ended */
+struct trace_buf {
+        /* the next thread's buffer on the global list */
+        struct trace_buf *next;
+
+        unsigned tid;
+        struct trace_block *first;
+        struct trace_block *last;
+};
+
+bool trace_enabled;
+
+static const char *trace_path;
+static uint64_t trace_epoch;
+
+/* every thread's buffer. threads push themselves on the front */
+static _Atomic(struct trace_buf *) trace_bufs;
+static atomic_uint trace_tids;
+
+/*
+ * bumped by every trace_start, so a thread whose buffer was freed by the
+ * last trace_stop knows to make a new one
+ */
+static atomic_uint trace_gen;
+
+static _Thread_local struct trace_buf *self;
+static _Thread_local unsigned self_gen;
+static _Thread_local unsigned self_image;
+
+void trace_image(unsigned image)
+{
+        self_image = image;
+}
+
+unsigned trace_current_image(void)
+{
+        return self_image;
+}
+
+static struct trace_buf *trace_self(void)
+{
+        struct trace_buf *buf;
+        unsigned gen;
+
+        gen = atomic_load_explicit(&trace_gen, memory_order_relaxed);
+        if (self && self_gen == gen)
+                return self;
+
+        buf = calloc(1, sizeof *buf);
+        if (!buf)
+                return NULL;
+        buf->tid = atomic_fetch_add(&trace_tids, 1);
+        buf->next = atomic_load(&trace_bufs);
+        while (!atomic_compare_exchange_weak(&trace_bufs, &buf->next, buf))
+                ;
+
+        self = buf;
+        self_gen = gen;
+        return buf;
+}
+
+void trace_span(const char *name, uint64_t start, uint64_t end)
+{
+        struct trace_buf *buf;
+        struct trace_block *block;
+        struct trace_event *ev;
+
+        /* running out of memory just loses spans */
+        buf = trace_self();
+        if (!buf)
+                return;
+
+        block = buf->last;
+        if (!block || block->count == TRACE_BLOCK_EVENTS) {
+                block = malloc(sizeof *block);
+                if (!block)
+                        return;
+                block->next = NULL;
+                block->count = 0;
+                if (buf->last)
+                        buf->last->next = block;
+                else
+                        buf->first = block;
+                buf->last = block;
+        }
+
+        ev = &block->events[block->count++];
+        ev->name = name;
+        ev->start = start;
+        ev->end = end;
+        ev->image = self_image;
+}
+
+static void trace_exit(void)
+{
+        trace_stop();
+}
+
+int trace_start(const char *path)
+{
+        static bool registered;
+
+        if (trace_enabled)
+                return -P_EINVAL;
+        if (!registered) {
+                if (atexit(trace_exit))
+                        return -P_ENOMEM;
+                registered = true;
+        }
+
+        trace_path = path;
+        trace_epoch = stats_clock();
+        atomic_fetch_add(&trace_gen, 1);
+        atomic_store(&trace_tids, 0);
+        trace_enabled = true;
+        return 0;
+}
+
+/* microseconds since trace_start, which is what the format wants */
+static double trace_us(uint64_t t)
+{
+        return (double)(t - trace_epoch) / 1e3;
+}
+
+static void write_buf(FILE *f, const struct trace_buf *buf, bool *first)
+{
+        const struct trace_block *block;
+        const struct trace_event *ev;
+        unsigned i;
+
+        fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": 1, \"tid\": %u, \"args\": {\"name\": "
+                "\"thread %u\"}}", *first ? "" : ",", buf->tid, buf->tid);
+        *first = false;
+
+        for (block = buf->first; block; block = block->next) {
+                for (i = 0; i < block->count; i++) {
+                        ev = &block->events[i];
+                        fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"png\", "
+                                "\"ph\": \"X\", \"ts\": %.3f, "
+                                "\"dur\": %.3f, \"pid\": 1, \"tid\": %u, "
+                                "\"args\": {\"image\": %u}}", ev->name,
+                                trace_us(ev->start),
+                                (double)(ev->end - ev->start) / 1e3,
+                                buf->tid, ev->image);
+                }
+        }
+}
+
+int trace_stop(void)
+{
+        struct trace_buf *buf, *next_buf;
+        struct trace_block *block, *next;
+        bool first = true;
+        FILE *f;
+        int err = 0;
+
+        if (!trace_enabled)
+                return 0;
+        trace_enabled = false;
+
+        f = fopen(trace_path, "w");
+        if (f)
+                fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+        buf = atomic_exchange(&trace_bufs, NULL);
+        for (; buf; buf = next_buf) {
+                next_buf = buf->next;
+                if (f)
+                        write_buf(f, buf, &first);
+                for (block = buf->first; block; block = next) {
+                        next = block->next;
+                        free(block);
+                }
+                free(buf);
+        }
+
+        if (!f)
+                return -P_EIO;
+        fprintf(f, "\n]}\n");
+        if (ferror(f))
+                err = -P_EIO;
+        if (fclose(f))
+                err = -P_EIO;
+        return err;
+}
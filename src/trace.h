@@ -0,0 +1,63 @@
+#ifndef PNG_TRACE_H
+#define PNG_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/*
+ * spans of time spent in each stage of decoding, written out as Chrome
+ * trace event json (chrome://tracing or ui.perfetto.dev) so you can see
+ * which threads were busy with what, and when they sat idle. every thread
+ * records into a buffer of its own, so there's no locking and nothing is
+ * shared while decoding; the buffers are only walked by trace_stop.
+ *
+ * a span is recorded like so:
+ *
+ *      uint64_t t = trace_begin();
+ *      ...
+ *      trace_end("inflate block", t);
+ *
+ * with tracing off that's a test of trace_enabled and nothing else. names
+ * have to be string constants, since only the pointer is kept.
+ */
+
+/* set between trace_start and trace_stop. don't touch */
+extern bool trace_enabled;
+
+/*
+ * start recording, to be written to path by trace_stop, or at exit if
+ * that never gets called. call before starting any threads that should be
+ * traced. returns 0 or a negative error.
+ */
+int trace_start(const char *path);
+
+/*
+ * write out everything recorded so far and stop recording. threads that
+ * recorded anything have to be done with it by now.
+ */
+int trace_stop(void);
+
+/*
+ * tag this thread's spans with image from now on (they start out as image
+ * 0), for telling apart files decoded in the same batch
+ */
+void trace_image(unsigned image);
+unsigned trace_current_image(void);
+
+/* record a span from start to end, times from stats_clock */
+void trace_span(const char *name, uint64_t start, uint64_t end);
+
+static inline uint64_t trace_begin(void)
+{
+        return trace_enabled ? stats_clock() : 0;
+}
+
+static inline void trace_end(const char *name, uint64_t start)
+{
+        if (start)
+                trace_span(name, start, stats_clock());
+}
+
+#endif /* PNG_TRACE_H */
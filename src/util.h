@@ -11,6 +11,20 @@
         ((__type *)((char *)(__ptr) - offsetof(__type, __member)))
 
 
+/*
+ * chatter about what the decoder is up to. compiled out unless DEBUG is
+ * defined, but still type checked
+ */
+#ifdef DEBUG
+#define pr_debug(...) printf(__VA_ARGS__)
+#else
+#define pr_debug(...)                                                   \
+        do {                                                            \
+                if (0)                                                  \
+                        printf(__VA_ARGS__);                            \
+        } while (0)
+#endif
+
 #define BUG()                                                           \
         do {                                                            \
                 fprintf(stderr, "BUG! %s:%d %s\n",                      \
@@ -1,11 +1,15 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "error.h"
 #include "int.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 #include "zlib.h"
 
@@ -91,6 +95,27 @@ static uint8_t read_bit(struct zlib_stream *stream)
         return bit & 1;
 }
 
+/*
+ * the next nbits (no more than 17) of a stream without reading them. there
+ * have to be at least 3 bytes left
+ */
+static uint32_t look_bits(struct zlib_stream *stream, unsigned nbits)
+{
+        const uint8_t *src = stream_src(stream);
+        uint32_t bits;
+
+        bits = src[0] | src[1] << 8 | (uint32_t)src[2] << 16;
+        return bits >> stream->z_src_bidx & ((1U << nbits) - 1);
+}
+
+/* step past nbits that look_bits has seen */
+static void drop_bits(struct zlib_stream *stream, unsigned nbits)
+{
+        nbits += stream->z_src_bidx;
+        stream->z_src_idx += nbits / 8;
+        stream->z_src_bidx = nbits % 8;
+}
+
 static uint8_t read_byte(struct zlib_stream *stream)
 {
         return read_bits(stream, 8);
@@ -102,7 +127,7 @@ static int parse_header(struct zlib_stream *stream)
         size_t wsize;
         bool fdict;
 
-        printf("parse_header: entering\n");
+        pr_debug("parse_header: entering\n");
 
         if (stream_sbytes(stream) < 2)
                 return -P_E2SMALL;
@@ -110,7 +135,7 @@ static int parse_header(struct zlib_stream *stream)
         cmf = read_byte(stream);
         flg = read_byte(stream);
 
-        printf("cmf: 0x%x, flg: 0x%x\n", cmf, flg);
+        pr_debug("cmf: 0x%x, flg: 0x%x\n", cmf, flg);
 
         if ((cmf*256 + flg) % 31)
                 return -P_EBADCSUM;
@@ -124,18 +149,159 @@ static int parse_header(struct zlib_stream *stream)
 
         fdict = flg & 0x20;
         if (fdict) {
-                printf("got fdict. I don't know what to do with this\n");
+                pr_debug("got fdict. I don't know what to do with this\n");
                 return -P_ENOTSUP;
         }
 
         return 0;
 }
 
-static int realloc_stream(struct zlib_stream *stream)
+/* grow the output buffer so that at least n more bytes fit */
+static int realloc_stream(struct zlib_stream *stream, size_t n)
+{
+        size_t end;
+        uint8_t *dst;
+
+        end = stream->z_dst_end ? stream->z_dst_end : n;
+        while (end - stream->z_dst_idx < n)
+                end *= 2;
+
+        dst = realloc(stream->z_dst, end);
+        if (!dst)
+                return -P_ENOMEM;
+
+        stream->z_dst = dst;
+        stream->z_dst_end = end;
+        if (stream->z_stats)
+                stream->z_stats->zs_reallocs++;
+        return 0;
+}
+
+#define ADLER_MOD 65521
+
+/*
+ * the sums can't overflow 32 bits within this many bytes (this is the same
+ * bound zlib uses), so we only have to reduce once per block of bytes
+ */
+#define ADLER_NMAX 5552
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *buf, size_t size)
+{
+        uint32_t s1 = adler & 0xffff;
+        uint32_t s2 = adler >> 16;
+        size_t i, n;
+
+        while (size) {
+                n = size < ADLER_NMAX ? size : ADLER_NMAX;
+                for (i = 0; i < n; i++) {
+                        s1 += buf[i];
+                        s2 += s1;
+                }
+                s1 %= ADLER_MOD;
+                s2 %= ADLER_MOD;
+                buf += n;
+                size -= n;
+        }
+
+        return s2 << 16 | s1;
+}
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+        uint32_t rem, s1, s2;
+
+        /*
+         * appending len2 bytes adds their sum to s1, and adds their s2 plus
+         * len2 times the old s1 to s2. both of the new sums start from 1
+         * rather than 0, which is what the - 1 and - rem undo
+         */
+        rem = len2 % ADLER_MOD;
+        s1 = adler1 & 0xffff;
+        s2 = rem * s1 % ADLER_MOD;
+        s1 += (adler2 & 0xffff) + ADLER_MOD - 1;
+        s2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_MOD - rem;
+
+        if (s1 >= ADLER_MOD)
+                s1 -= ADLER_MOD;
+        if (s1 >= ADLER_MOD)
+                s1 -= ADLER_MOD;
+        if (s2 >= 2 * ADLER_MOD)
+                s2 -= 2 * ADLER_MOD;
+        if (s2 >= ADLER_MOD)
+                s2 -= ADLER_MOD;
+
+        return s2 << 16 | s1;
+}
+
+static uint32_t adler32(const uint8_t *buf, size_t size)
+{
+        return adler32_update(1, buf, size);
+}
+
+/*
+ * hand everything inflated since the last drain to the output sink.
+ * returns Z_STOPPED if the sink doesn't want any more.
+ */
+static int drain_stream(struct zlib_stream *stream)
+{
+        struct zlib_stats *stats = stream->z_stats;
+        const uint8_t *buf;
+        uint64_t t0, t1, tr;
+        size_t size;
+        int stop;
+
+        buf = stream->z_dst + stream->z_drain_idx;
+        size = stream->z_dst_idx - stream->z_drain_idx;
+
+        t0 = stats ? stats_clock() : 0;
+        tr = trace_begin();
+        stream->z_adler = adler32_update(stream->z_adler, buf, size);
+        stream->z_drain_idx = stream->z_dst_idx;
+        stream->z_drain_mark = stream->z_dst_idx + stream->z_drain_size;
+        trace_end("adler32", tr);
+        t1 = stats ? stats_clock() : 0;
+
+        stop = size && stream->z_drain(stream, buf, size);
+        if (stats) {
+                stats->zs_adler_ns += t1 - t0;
+                stats->zs_drain_ns += stats_clock() - t1;
+        }
+        return stop ? Z_STOPPED : 0;
+}
+
+/*
+ * make sure there is room for at least n more bytes of output. with an
+ * output sink we drain what we have and slide the last window's worth of
+ * output down to the front of z_dst, otherwise z_dst just grows.
+ */
+static int reserve_stream(struct zlib_stream *stream, size_t n)
 {
-        stream->z_dst_end *= 2;
-        stream->z_dst = realloc(stream->z_dst, stream->z_dst_end);
-        return stream->z_dst ? 0 : -P_ENOMEM;
+        size_t keep;
+        int error;
+
+        if (stream_dbytes(stream) >= n)
+                return 0;
+
+        if (!stream->z_drain)
+                return realloc_stream(stream, n);
+
+        error = drain_stream(stream);
+        if (error)
+                return error;
+
+        keep = stream->z_dst_idx < ZLIB_WINDOW_SIZE
+                ? stream->z_dst_idx : ZLIB_WINDOW_SIZE;
+        memmove(stream->z_dst, stream_dst(stream) - keep, keep);
+        stream->z_dst_slid += stream->z_dst_idx - keep;
+        stream->z_dst_idx = keep;
+        stream->z_drain_idx = keep;
+        stream->z_drain_mark = keep + stream->z_drain_size;
+
+        /* zlib_decompress sizes the window so that this can't happen */
+        if (stream_dbytes(stream) < n)
+                BUG();
+
+        return 0;
 }
 
 struct huff_sym {
@@ -177,6 +343,28 @@ struct huff_range {
 #define HUFF_DIST_SIZE 32
 #define HUFF_NR_RANGES 16
 
+#define HUFF_END_OF_BLOCK 256
+#define HUFF_LEN_BASE 257
+#define HUFF_LL_MAX 285
+
+/* a huff_tree's lookup table is indexed by this many bits of input */
+#define HUFF_TABLE_BITS 11
+#define HUFF_TABLE_SIZE (1U << HUFF_TABLE_BITS)
+
+/*
+ * An entry in a lookup table, saying what the next HUFF_TABLE_BITS bits of
+ * input decode to. If they start with a literal whose code is short enough
+ * that the code after it fits in the rest of them too, and that's also a
+ * literal, the entry holds both. e_bits is the total length of the codes,
+ * or 0 if the first code is longer than HUFF_TABLE_BITS (or isn't one).
+ */
+struct huff_entry {
+        uint32_t e_sym:9;
+        uint32_t e_sym2:8;
+        uint32_t e_bits:5;
+        uint32_t e_count:2;
+};
+
 /*
  * A struct huff_tree is a mapping from the huffman encodings of a given
  * alphabet to their actual values. It is specialized to the representation
@@ -195,6 +383,12 @@ struct huff_tree {
          * to Huffamn code x with length L"
          */
         struct huff_range h_ranges[HUFF_NR_RANGES];
+
+        /*
+         * HUFF_TABLE_SIZE entries answering the same thing for short codes
+         * in one go. only the length/literal tree has one
+         */
+        struct huff_entry *h_table;
 };
 
 static struct huff_tree *huff_alloc(unsigned entries)
@@ -220,8 +414,10 @@ static struct huff_tree *huff_alloc(unsigned entries)
 
 static void huff_free(struct huff_tree *t)
 {
-        if (t)
+        if (t) {
                 free(t->h_syms);
+                free(t->h_table);
+        }
         free(t);
 }
 
@@ -241,21 +437,21 @@ static void dump_ranges(const struct huff_tree *tree)
         unsigned i, j;
         const struct huff_range *range;
 
-        printf("begin range dump for huff_tree (%p)\n", (void*)tree);
-        printf("tree->h_nsyms: %u\n", tree->h_nsyms);
+        pr_debug("begin range dump for huff_tree (%p)\n", (void*)tree);
+        pr_debug("tree->h_nsyms: %u\n", tree->h_nsyms);
 
         for (i = 0; i < HUFF_NR_RANGES; i++) {
                 range = &tree->h_ranges[i];
-                printf("range %d. r_count: %d, r_len: %d, r_start: 0x%x\n",
+                pr_debug("range %d. r_count: %d, r_len: %d, r_start: 0x%x\n",
                        i, range->r_count, range->r_len, range->r_start);
                 for (j = 0; j < range->r_count; j++) {
-                        printf("(%d,%d) ", range->r_syms[j].s_sym,
+                        pr_debug("(%d,%d) ", range->r_syms[j].s_sym,
                                range->r_syms[j].s_len);
                 }
                 if (range->r_count)
-                        printf("\n");
+                        pr_debug("\n");
         }
-        printf("end range dump\n");
+        pr_debug("end range dump\n");
 }
 
 /*
@@ -324,7 +520,7 @@ static int huff_init_ranges(struct huff_tree *tree)
                         continue;
 
                 if (range->r_end - 1 & ~((1U << range->r_len) - 1)) {
-                        printf("bad range: len %d, end 0x%x\n",
+                        pr_debug("bad range: len %d, end 0x%x\n",
                                range->r_len, range->r_end);
                         ret = -P_EINVAL;
                 }
@@ -355,8 +551,8 @@ static int huff_read(struct zlib_stream *stream, struct huff_tree *tree,
                 } while (range->r_len > bits);
 
                 if (code < range->r_start) {
-                        printf("got code < r_start? probably bad\n");
-                        printf("code: %d, r_start %d, bits: %d\n",
+                        pr_debug("got code < r_start? probably bad\n");
+                        pr_debug("code: %d, r_start %d, bits: %d\n",
                                code, range->r_start, bits);
                         error = -P_EINVAL;
                         goto out;
@@ -368,14 +564,218 @@ static int huff_read(struct zlib_stream *stream, struct huff_tree *tree,
         }
 
         error = -P_EINVAL;
-        printf("couldn't read symbol from stream\n");
-        printf("code 0x%x, bits %d\n", code, bits);
+        pr_debug("couldn't read symbol from stream\n");
+        pr_debug("code 0x%x, bits %d\n", code, bits);
         //dump_ranges(tree);
 
 out:
         return error;
 }
 
+/* the low len bits of code, backwards */
+static unsigned huff_reverse(unsigned code, unsigned len)
+{
+        unsigned rev = 0;
+
+        while (len--) {
+                rev = rev << 1 | (code & 1);
+                code >>= 1;
+        }
+        return rev;
+}
+
+/*
+ * build the lookup table for a length/literal tree whose ranges are set up.
+ * codes come most significant bit first but the input is read from the
+ * least significant bit up, so a code of length L fills every entry whose
+ * low L bits are the code reversed. then every entry starting with a
+ * literal is checked for a second literal in the bits left over: whatever
+ * entry those bits index on their own (the bits past them being zero) is
+ * right so long as its code fits in them.
+ */
+static int huff_build_table(struct huff_tree *tree)
+{
+        const struct huff_range *range;
+        struct huff_entry *table, next;
+        unsigned i, j, idx, len;
+
+        table = calloc(HUFF_TABLE_SIZE, sizeof *table);
+        if (!table)
+                return -P_ENOMEM;
+
+        for (i = 0; i < HUFF_NR_RANGES; i++) {
+                range = &tree->h_ranges[i];
+                len = range->r_len;
+                if (!len || len > HUFF_TABLE_BITS)
+                        continue;
+
+                for (j = 0; j < range->r_count; j++) {
+                        idx = huff_reverse(range->r_start + j, len);
+                        for (; idx < HUFF_TABLE_SIZE; idx += 1U << len) {
+                                table[idx].e_sym = range->r_syms[j].s_sym;
+                                table[idx].e_bits = len;
+                                table[idx].e_count = 1;
+                        }
+                }
+        }
+
+        /* top down, so table[i >> len] hasn't been given a second yet */
+        for (i = HUFF_TABLE_SIZE; i--; ) {
+                len = table[i].e_bits;
+                if (!len || table[i].e_sym >= HUFF_END_OF_BLOCK)
+                        continue;
+
+                next = table[i >> len];
+                if (!next.e_bits || next.e_count != 1
+                    || next.e_sym >= HUFF_END_OF_BLOCK
+                    || len + next.e_bits > HUFF_TABLE_BITS)
+                        continue;
+
+                table[i].e_sym2 = next.e_sym;
+                table[i].e_bits = len + next.e_bits;
+                table[i].e_count = 2;
+        }
+
+        tree->h_table = table;
+        return 0;
+}
+
+/*
+ * Trees built for recent blocks. Encoders often send the same code lengths
+ * for block after block, and a block that matches one in here just points
+ * the stream at the trees it already has rather than building them over
+ * again. Entries are found by a hash of the raw code lengths, and then
+ * checked length by length. The static trees get an entry of their own,
+ * with no lengths. The cache owns every tree the stream points at.
+ */
+#define HUFF_CACHE_SIZE 4
+
+struct huff_cache_entry {
+        uint32_t e_hash;
+
+        /* hlit + hdist code lengths, or none for the static trees */
+        uint16_t e_hlit;
+        uint16_t e_nlens;
+        uint8_t e_lens[HUFF_LL_SIZE + HUFF_DIST_SIZE];
+
+        /* NULL if the entry is empty */
+        struct huff_tree *e_lltree;
+        struct huff_tree *e_dtree;
+
+        /* c_clock when it was last used, to find the one to evict */
+        uint64_t e_used;
+};
+
+struct huff_cache {
+        struct huff_cache_entry c_entries[HUFF_CACHE_SIZE];
+        uint64_t c_clock;
+};
+
+/* fnv-1a over the code lengths and where the distance ones start */
+static uint32_t huff_hash(const uint8_t *lens, unsigned nlens, unsigned hlit)
+{
+        uint32_t hash = 2166136261U ^ hlit;
+        unsigned i;
+
+        for (i = 0; i < nlens; i++)
+                hash = (hash ^ lens[i]) * 16777619U;
+        return hash;
+}
+
+/* point the stream at cached trees for these lengths, if there are any */
+static bool huff_cache_lookup(struct zlib_stream *stream, uint32_t hash,
+                              const uint8_t *lens, unsigned nlens,
+                              unsigned hlit)
+{
+        struct huff_cache *cache = stream->z_huff_cache;
+        struct huff_cache_entry *e;
+        unsigned i;
+
+        if (!cache)
+                return false;
+
+        for (i = 0; i < HUFF_CACHE_SIZE; i++) {
+                e = &cache->c_entries[i];
+                if (!e->e_lltree || e->e_hash != hash || e->e_hlit != hlit
+                    || e->e_nlens != nlens
+                    || (nlens && memcmp(e->e_lens, lens, nlens)))
+                        continue;
+
+                e->e_used = ++cache->c_clock;
+                stream->z_lltree = e->e_lltree;
+                stream->z_dtree = e->e_dtree;
+                if (stream->z_stats)
+                        stream->z_stats->zs_tree_hits++;
+                return true;
+        }
+        return false;
+}
+
+/*
+ * hand newly built trees over to the cache, in place of the least recently
+ * used entry, and point the stream at them. on failure the trees are freed
+ */
+static int huff_cache_insert(struct zlib_stream *stream, uint32_t hash,
+                             const uint8_t *lens, unsigned nlens,
+                             unsigned hlit, struct huff_tree *lltree,
+                             struct huff_tree *dtree)
+{
+        struct huff_cache *cache = stream->z_huff_cache;
+        struct huff_cache_entry *e, *victim;
+        unsigned i;
+
+        if (!cache) {
+                cache = calloc(1, sizeof *cache);
+                if (!cache) {
+                        huff_free(lltree);
+                        huff_free(dtree);
+                        return -P_ENOMEM;
+                }
+                stream->z_huff_cache = cache;
+        }
+
+        victim = &cache->c_entries[0];
+        for (i = 0; i < HUFF_CACHE_SIZE; i++) {
+                e = &cache->c_entries[i];
+                if (!e->e_lltree) {
+                        victim = e;
+                        break;
+                }
+                if (e->e_used < victim->e_used)
+                        victim = e;
+        }
+
+        /* nothing points at the victim's trees; the block before is over */
+        huff_free(victim->e_lltree);
+        huff_free(victim->e_dtree);
+
+        victim->e_hash = hash;
+        victim->e_hlit = hlit;
+        victim->e_nlens = nlens;
+        if (nlens)
+                memcpy(victim->e_lens, lens, nlens);
+        victim->e_lltree = lltree;
+        victim->e_dtree = dtree;
+        victim->e_used = ++cache->c_clock;
+
+        stream->z_lltree = lltree;
+        stream->z_dtree = dtree;
+        return 0;
+}
+
+static void huff_cache_free(struct huff_cache *cache)
+{
+        unsigned i;
+
+        if (!cache)
+                return;
+        for (i = 0; i < HUFF_CACHE_SIZE; i++) {
+                huff_free(cache->c_entries[i].e_lltree);
+                huff_free(cache->c_entries[i].e_dtree);
+        }
+        free(cache);
+}
+
 /*
  * Deflate streams can opt not to include dymanic huffman trees and instead
  * rely on defaults defined in the standard. This function creates the
@@ -399,7 +799,8 @@ out:
  * value.
  *
  * XXX: we don't really need to generate these trees on the fly, we
- * technically know them at compile time
+ * technically know them at compile time. they are only built the first
+ * time, and after that they come out of the cache.
  */
 static int make_static_trees(struct zlib_stream *stream)
 {
@@ -408,6 +809,9 @@ static int make_static_trees(struct zlib_stream *stream)
         uint16_t tmp;
         unsigned i, offset;
 
+        if (huff_cache_lookup(stream, 0, NULL, 0, 0))
+                return 0;
+
         lltree = huff_alloc(HUFF_LL_SIZE);
         if (!lltree)
                 return -P_ENOMEM;
@@ -427,7 +831,7 @@ static int make_static_trees(struct zlib_stream *stream)
         range->r_len = 7;
         range->r_syms = lltree->h_syms;
         range->r_start = 0x0;
-        range->r_end =  0x17;
+        range->r_end = 0x18;
         range->r_count = range->r_end - range->r_start;
         offset = range->r_count;
         for (tmp = 256, i = 0; tmp <= 279; tmp++, i++)
@@ -438,7 +842,7 @@ static int make_static_trees(struct zlib_stream *stream)
         range->r_len = 8;
         range->r_syms = lltree->h_syms + offset;
         range->r_start = 0x30;
-        range->r_end = 0xc7;
+        range->r_end = 0xc8;
         range->r_count = range->r_end - range->r_start;
         offset += range->r_count;
         for (tmp = 0, i = 0; tmp <= 143; tmp++, i++)
@@ -451,7 +855,7 @@ static int make_static_trees(struct zlib_stream *stream)
         range->r_len = 9;
         range->r_syms = lltree->h_syms + offset;
         range->r_start = 0x190;
-        range->r_end = 0x1ff;
+        range->r_end = 0x200;
         range->r_count = range->r_end - range->r_start;
         for (tmp = 144, i = 0; tmp <= 255; tmp++, i++)
                 range->r_syms[i] = SYM_INIT(tmp, range->r_len);
@@ -461,14 +865,18 @@ static int make_static_trees(struct zlib_stream *stream)
         range->r_len = 5;
         range->r_syms = dtree->h_syms;
         range->r_start = 0;
-        range->r_end = 31;
+        range->r_end = 32;
         range->r_count = range->r_end - range->r_start;
         for (tmp = 0, i = 0; tmp <= 31; tmp++, i++)
                 range->r_syms[i] = SYM_INIT(tmp, range->r_len);
 
-        stream->z_lltree = lltree;
-        stream->z_dtree = dtree;
-        return 0;
+        if (huff_build_table(lltree)) {
+                huff_free(lltree);
+                huff_free(dtree);
+                return -P_ENOMEM;
+        }
+
+        return huff_cache_insert(stream, 0, NULL, 0, 0, lltree, dtree);
 }
 
 #define HLIT_BITS 5
@@ -527,23 +935,31 @@ static const uint8_t code_length_mapping[] =
  *              (3 bits of length)
  *          18: Repeat a code length of 0 for 11 - 138 times
  *              (7 bits of length)
+ *
+ * The lengths are read into an array first, so that if a block before this
+ * one had the same lengths, its trees can be reused from the cache.
  */
 static int make_dynamic_trees(struct zlib_stream *stream)
 {
-        struct huff_tree *cltree, *lltree, *dtree, *tree;
-        unsigned hlit, hdist, hclen, i, rcount, offset;
+        uint8_t lens[HUFF_LL_SIZE + HUFF_DIST_SIZE];
+        struct huff_tree *cltree, *lltree, *dtree;
+        unsigned hlit, hdist, hclen, i, rcount;
         uint16_t len, prev_len;
+        uint32_t hash;
         int error;
 
-        /* parse the 3 lengths at the beginning of the tree */
-        if (stream_sbytes(stream) < (HLIT_BITS+HDIST_BITS+HCLEN_BITS)/8 + 1)
+        /*
+         * parse the 3 lengths at the beginning of the tree. with up to 7
+         * bits of the first byte already read, they can take 3 bytes
+         */
+        if (stream_sbytes(stream) < (7+HLIT_BITS+HDIST_BITS+HCLEN_BITS)/8 + 1)
                 return -P_E2SMALL;
 
         hlit = read_bits(stream, HLIT_BITS) + HLIT_BIAS;
         hdist = read_bits(stream, HDIST_BITS) + HDIST_BIAS;
         hclen = read_bits(stream, HCLEN_BITS) + HCLEN_BIAS;
 
-        printf("hlit: %d, hdist: %d, hclen: %d\n", hlit, hdist, hclen);
+        pr_debug("hlit: %d, hdist: %d, hclen: %d\n", hlit, hdist, hclen);
 
         /* allocate and initialize the code length tree */
         cltree = huff_alloc(hclen);
@@ -560,34 +976,17 @@ static int make_dynamic_trees(struct zlib_stream *stream)
                 cltree->h_syms[i] = SYM_INIT(code_length_mapping[i], len);
         }
 
-        printf("initializing ranges for cltree\n");
+        pr_debug("initializing ranges for cltree\n");
 
         error = huff_init_ranges(cltree);
         if (error)
                 goto free_cltree;
 
-        /* allocate and initialize length/litteral and distance trees */
-        error = -P_ENOMEM;
-        lltree = huff_alloc(hlit);
-        if (!lltree)
-                goto free_cltree;
-
-        dtree = huff_alloc(hdist);
-        if (!dtree)
-                goto free_lltree;
-
-        printf("about to read dynamic trees\n");
+        pr_debug("about to read dynamic trees\n");
 
         rcount = 0;
         prev_len = 0;
-        tree = lltree;
-        offset = 0;
         for (i = 0; i < hlit + hdist; i++) {
-                if (i == hlit) {
-                        offset = i;
-                        tree = dtree;
-                }
-
                 /*
                  * we're not repeating the previous value, so read the next
                  * length from the stream
@@ -604,12 +1003,12 @@ static int make_dynamic_trees(struct zlib_stream *stream)
                          */
                         if (stream_sbytes(stream) < 3) {
                                 error = -P_E2SMALL;
-                                goto free_dtree;
+                                goto free_cltree;
                         }
 
                         error = huff_read(stream, cltree, &len);
                         if (error) {
-                                goto free_dtree;
+                                goto free_cltree;
                         }
 
                         switch (len) {
@@ -635,28 +1034,49 @@ static int make_dynamic_trees(struct zlib_stream *stream)
                         rcount--;
                 }
 
-                tree->h_syms[i - offset] = SYM_INIT(i - offset, len);
+                lens[i] = len;
                 prev_len = len;
         }
 
-        printf("about to init lltree and dtree ranges\n");
+        hash = huff_hash(lens, hlit + hdist, hlit);
+        error = 0;
+        if (huff_cache_lookup(stream, hash, lens, hlit + hdist, hlit))
+                goto free_cltree;
+
+        /* allocate and initialize length/litteral and distance trees */
+        error = -P_ENOMEM;
+        lltree = huff_alloc(hlit);
+        if (!lltree)
+                goto free_cltree;
+
+        dtree = huff_alloc(hdist);
+        if (!dtree)
+                goto free_lltree;
+
+        for (i = 0; i < hlit; i++)
+                lltree->h_syms[i] = SYM_INIT(i, lens[i]);
+        for (i = 0; i < hdist; i++)
+                dtree->h_syms[i] = SYM_INIT(i, lens[hlit + i]);
+
+        pr_debug("about to init lltree and dtree ranges\n");
         error = huff_init_ranges(lltree);
         if (error)
                 goto free_dtree;
         error = huff_init_ranges(dtree);
         if (error)
                 goto free_dtree;
-
-        stream->z_lltree = lltree;
-        stream->z_dtree = dtree;
+        error = huff_build_table(lltree);
+        if (error)
+                goto free_dtree;
 
         /*
          * everything succeeded, but we still need to clean up the cltree
          * since it is not used out side of constructing the lltree and
          * dtree
          */
-        printf("about to return sucessfully\n");
-        error = 0;
+        pr_debug("about to return sucessfully\n");
+        error = huff_cache_insert(stream, hash, lens, hlit + hdist, hlit,
+                                  lltree, dtree);
         goto free_cltree;
 
 free_dtree:
@@ -668,16 +1088,20 @@ free_cltree:
         return error;
 }
 
+static uint16_t read_le16(const uint8_t *buf)
+{
+        return buf[0] | buf[1] << 8;
+}
+
 /*
- * handle decompression for an uncompressed block. (i.e. compression type
- * == non) Starts on byte boundary, and next 4 bytes are a 2 byte
- * big-endian length followed by a 2 byte bit-endian negated length (for
- * integrity).
+ * start an uncompressed block. (i.e. compression type == none) Starts on
+ * a byte boundary, and the next 4 bytes are a 2 byte little-endian length
+ * followed by a 2 byte little-endian negated length (for integrity). The
+ * data itself is copied by copy_stored.
  */
 static int deflate_none(struct zlib_stream *stream)
 {
         uint16_t len, nlen;
-        int error;
 
         /* eat any remaining bits in the byte we're in */
         if (stream->z_src_bidx) {
@@ -685,41 +1109,64 @@ static int deflate_none(struct zlib_stream *stream)
                 stream->z_src_idx++;
         }
 
-        if (stream_sbytes(stream) < 4) {
-                printf("stream too small when parsing len and nlen\n");
+        if (stream_sbytes(stream) < 4)
                 return -P_E2SMALL;
-        }
 
-        len = read_png_uint16(stream_src(stream));
+        /* unlike png integers, these are little endian */
+        len = read_le16(stream_src(stream));
         stream->z_src_idx += sizeof len;
-        nlen = read_png_uint16(stream_src(stream));
+        nlen = read_le16(stream_src(stream));
         stream->z_src_idx += sizeof nlen;
 
-        if (nlen != ~len) {
-                printf("len != ~nlen. len=%x, nlen=%x\n", len, nlen);
+        if ((nlen ^ len) != 0xffff) {
+                pr_debug("len != ~nlen. len=%x, nlen=%x\n", len, nlen);
                 return -P_EINVAL;
         }
 
-        if (len > stream_sbytes(stream)) {
-                printf("not enough bytes in stream.\n");
-                return -P_EINVAL;
-        } else if (len > stream_dbytes(stream)) {
-                error = realloc_stream(stream);
+        stream->z_stored = len;
+        return 0;
+}
+
+/*
+ * copy as much of the current uncompressed block as we have input for. we
+ * copy at most a window at a time so that a sliding output window never
+ * has to hold the whole block.
+ */
+static int copy_stored(struct zlib_stream *stream)
+{
+        size_t n;
+        int error;
+
+        while (stream->z_stored) {
+                n = stream->z_stored;
+                if (n > ZLIB_WINDOW_SIZE)
+                        n = ZLIB_WINDOW_SIZE;
+                if (n > stream_sbytes(stream))
+                        n = stream_sbytes(stream);
+                if (!n)
+                        return -P_E2SMALL;
+
+                error = reserve_stream(stream, n);
                 if (error)
                         return error;
-        }
 
-        memcpy(stream_dst(stream), stream_src(stream), len);
-        stream->z_src_idx += len;
-        stream->z_dst_idx += len;
+                memcpy(stream_dst(stream), stream_src(stream), n);
+                stream->z_src_idx += n;
+                stream->z_dst_idx += n;
+                stream->z_stored -= n;
+                if (stream->z_stats)
+                        stream->z_stats->zs_stored_bytes += n;
+
+                if (stream->z_dst_idx >= stream->z_drain_mark) {
+                        error = drain_stream(stream);
+                        if (error)
+                                return error;
+                }
+        }
 
         return 0;
 }
 
-#define HUFF_END_OF_BLOCK 256
-#define HUFF_LEN_BASE 257
-#define HUFF_LL_MAX 285
-
 /*
  * The following arrays of magic are taken from this table from section
  * 3.2.5 of the standard. They are used for reading length and distance
@@ -791,167 +1238,1254 @@ static void zlib_memcpy(uint8_t *dst, const uint8_t *src, size_t n)
         }
 }
 
-static int deflate_huffman(struct zlib_stream *stream)
+/*
+ * read the rest of a match after its length code: the length's extra
+ * bits, then the distance
+ */
+static int read_match(struct zlib_stream *stream, uint16_t llvalue,
+                      uint16_t *len, uint16_t *dist)
 {
+        uint8_t ebits;
         int error;
-        uint16_t llvalue, len, dist;
-        uint8_t ebits, *start;
 
-        printf("entering %s\n", __func__);
+        *len = len_base_offsets[llvalue - HUFF_LEN_BASE];
+        ebits = len_extra_bits[llvalue - HUFF_LEN_BASE];
+        if (ebits)
+                *len += read_bits(stream, ebits);
 
-        for (;;) {
-                if (stream_sbytes(stream) < 3)
-                        return -P_E2SMALL;
+        error = huff_read(stream, stream->z_dtree, dist);
+        if (error)
+                return error;
+        if (*dist >= sizeof dist_base_offsets / sizeof *dist_base_offsets)
+                return -P_EINVAL;
 
-                error = huff_read(stream, stream->z_lltree, &llvalue);
-                if (error)
-                        return error;
+        ebits = dist_extra_bits[*dist];
+        *dist = dist_base_offsets[*dist];
+        if (ebits)
+                *dist += read_bits(stream, ebits);
+        return 0;
+}
 
-                if (llvalue < HUFF_END_OF_BLOCK) {
-                        if (!stream_dbytes(stream)) {
-                                error = realloc_stream(stream);
-                                if (error)
-                                        return error;
-                        }
+static void count_literals(struct zlib_stats *stats, unsigned n)
+{
+        stats->zs_symbols += n;
+        stats->zs_literal_bytes += n;
+}
 
-                        stream->z_dst[stream->z_dst_idx++] = llvalue;
-                } else if (llvalue == HUFF_END_OF_BLOCK) {
-                        return 0;
-                } else if (llvalue <= HUFF_LL_MAX) {
-                        /*
-                         * we need at most 5 bits extra for length, 15 bits
-                         * for a maximum length distance Huffman code, and
-                         * 13 bits extra for distance, which is 33 bits,
-                         * so anything more than 4 bytes is okay. We're
-                         * always guarenteed this because there's a 4 byte
-                         * checksum at the end anyway
-                         */
-                        if (stream_sbytes(stream) < 5)
-                                return -P_E2SMALL;
+static void count_match(struct zlib_stats *stats, uint16_t len, uint16_t dist)
+{
+        stats->zs_symbols += 2;
+        stats->zs_matches++;
+        stats->zs_match_bytes += len;
+        stats->zs_len_hist[stats_bucket(len)]++;
+        stats->zs_dist_hist[stats_bucket(dist)]++;
+}
+
+/*
+ * input and output that one trip round inflate_fast can use up. a length
+ * code, its extra bits, a distance code and its extra bits come to 48 bits,
+ * which with the bits left in the first byte is 7 bytes, and look_bits
+ * reads 3 bytes wherever it is. a match is at most 258 bytes, and
+ * copy_match can write 7 past the end of one
+ */
+#define FAST_IN 8
+#define FAST_OUT (258 + 8)
+
+/*
+ * copy a match from dist bytes back. if that's at least 8 bytes back, no
+ * 8 bytes copied overlap the 8 they're copied to, so it goes 8 at a time;
+ * that can run up to 7 bytes past the end of the match
+ */
+static void copy_match(uint8_t *dst, size_t dist, size_t len)
+{
+        const uint8_t *src = dst - dist;
+        uint8_t *end = dst + len;
+
+        if (dist < 8) {
+                zlib_memcpy(dst, src, len);
+                return;
+        }
+
+        do {
+                memcpy(dst, src, 8);
+                dst += 8;
+                src += 8;
+        } while (dst < end);
+}
 
-                        len = len_base_offsets[llvalue - HUFF_LEN_BASE];
-                        ebits = len_extra_bits[llvalue - HUFF_LEN_BASE];
-                        if (ebits)
-                                len += read_bits(stream, ebits);
+/*
+ * deflate_huffman's loop for while there's at least FAST_IN bytes of input
+ * left and room for FAST_OUT bytes of output, so that none of that has to
+ * be checked symbol by symbol. it stops when either runs low, or once z_drain
+ * is due, and leaves the rest to deflate_huffman. returns 1 at the end of
+ * the block, 0 if it stopped short of it, or a negative error
+ */
+static int inflate_fast(struct zlib_stream *stream)
+{
+        struct zlib_stats *stats = stream->z_stats;
+        const struct huff_entry *table = stream->z_lltree->h_table;
+        struct huff_entry entry;
+        size_t in_end, out_end;
+        uint16_t llvalue, len, dist;
+        uint8_t *dst;
+        int error;
 
-                        error = huff_read(stream, stream->z_dtree, &dist);
+        if (stream->z_src_end < FAST_IN || stream->z_dst_end < FAST_OUT)
+                return 0;
+        in_end = stream->z_src_end - FAST_IN;
+        out_end = stream->z_dst_end - FAST_OUT;
+        if (out_end > stream->z_drain_mark)
+                out_end = stream->z_drain_mark;
+
+        while (stream->z_src_idx < in_end && stream->z_dst_idx < out_end) {
+                entry = table[look_bits(stream, HUFF_TABLE_BITS)];
+                if (entry.e_bits) {
+                        drop_bits(stream, entry.e_bits);
+                        llvalue = entry.e_sym;
+                } else {
+                        error = huff_read(stream, stream->z_lltree,
+                                          &llvalue);
                         if (error)
                                 return error;
+                }
 
-                        ebits = dist_extra_bits[dist];
-                        dist = dist_base_offsets[dist];
-                        if (ebits)
-                                dist += read_bits(stream, ebits);
+                dst = stream_dst(stream);
+                if (entry.e_count == 2) {
+                        dst[0] = llvalue;
+                        dst[1] = entry.e_sym2;
+                        stream->z_dst_idx += 2;
+                        if (stats)
+                                count_literals(stats, 2);
+                        continue;
+                }
+                if (llvalue < HUFF_END_OF_BLOCK) {
+                        dst[0] = llvalue;
+                        stream->z_dst_idx++;
+                        if (stats)
+                                count_literals(stats, 1);
+                        continue;
+                }
+                if (llvalue == HUFF_END_OF_BLOCK) {
+                        if (stats)
+                                stats->zs_symbols++;
+                        return 1;
+                }
+                if (llvalue > HUFF_LL_MAX)
+                        return -P_EINVAL;
 
-                        if (stream_dbytes(stream) < len) {
-                                error = realloc_stream(stream);
-                                if (error)
-                                        return error;
+                error = read_match(stream, llvalue, &len, &dist);
+                if (error)
+                        return error;
+
+                /*
+                 * the one thing about a match that has to be checked: it
+                 * can't reach back past the start of the output
+                 */
+                if (dist > stream->z_dst_idx)
+                        return -P_EINVAL;
+
+                copy_match(dst, dist, len);
+                stream->z_dst_idx += len;
+                if (stats)
+                        count_match(stats, len, dist);
+        }
+        return 0;
+}
+
+/*
+ * inflate a huffman block, in inflate_fast while it can and a symbol at a
+ * time with every check in between
+ */
+static int deflate_huffman(struct zlib_stream *stream)
+{
+        struct zlib_stats *stats = stream->z_stats;
+        const struct huff_entry *table = stream->z_lltree->h_table;
+        struct huff_entry entry;
+        int error;
+        uint16_t llvalue, len, dist;
+        uint8_t *start;
+        size_t idx;
+        char bidx;
+
+        pr_debug("entering %s\n", __func__);
+
+        for (;;) {
+                error = inflate_fast(stream);
+                if (error)
+                        return error < 0 ? error : 0;
+
+                /*
+                 * if we run out of input part way through a symbol, or
+                 * z_drain stops us before it's written out, back up to the
+                 * start of it so we can pick up from there
+                 */
+                idx = stream->z_src_idx;
+                bidx = stream->z_src_bidx;
+
+                if (stream_sbytes(stream) < 3)
+                        return -P_E2SMALL;
+
+                /* short codes come straight out of the table */
+                entry = table[look_bits(stream, HUFF_TABLE_BITS)];
+                if (entry.e_bits) {
+                        drop_bits(stream, entry.e_bits);
+                        llvalue = entry.e_sym;
+                } else {
+                        error = huff_read(stream, stream->z_lltree,
+                                          &llvalue);
+                        if (error)
+                                return error;
+                }
+
+                if (entry.e_count == 2) {
+                        error = reserve_stream(stream, 2);
+                        if (error)
+                                goto back_up;
+
+                        stream->z_dst[stream->z_dst_idx++] = llvalue;
+                        stream->z_dst[stream->z_dst_idx++] = entry.e_sym2;
+                        if (stats)
+                                count_literals(stats, 2);
+                } else if (llvalue < HUFF_END_OF_BLOCK) {
+                        error = reserve_stream(stream, 1);
+                        if (error)
+                                goto back_up;
+
+                        stream->z_dst[stream->z_dst_idx++] = llvalue;
+                        if (stats)
+                                count_literals(stats, 1);
+                } else if (llvalue == HUFF_END_OF_BLOCK) {
+                        if (stats)
+                                stats->zs_symbols++;
+                        return 0;
+                } else if (llvalue <= HUFF_LL_MAX) {
+                        /*
+                         * we need at most 5 bits extra for length, 15 bits
+                         * for a maximum length distance Huffman code, and
+                         * 13 bits extra for distance, which is 33 bits,
+                         * so anything more than 4 bytes is okay. We're
+                         * always guarenteed this because there's a 4 byte
+                         * checksum at the end anyway
+                         */
+                        if (stream_sbytes(stream) < 5) {
+                                error = -P_E2SMALL;
+                                goto back_up;
                         }
 
+                        error = read_match(stream, llvalue, &len, &dist);
+                        if (error)
+                                return error;
+
+                        /* don't reach back past the start of the output */
+                        if (dist > stream->z_dst_idx)
+                                return -P_EINVAL;
+
+                        error = reserve_stream(stream, len);
+                        if (error)
+                                goto back_up;
+
                         start = stream_dst(stream) - dist;
                         zlib_memcpy(stream_dst(stream), start, len);
                         stream->z_dst_idx += len;
+                        if (stats)
+                                count_match(stats, len, dist);
                 } else {
-                        BUG();
+                        /* 286 and 287 only show up in corrupt streams */
+                        return -P_EINVAL;
+                }
+
+                if (stream->z_dst_idx >= stream->z_drain_mark) {
+                        error = drain_stream(stream);
+                        if (error)
+                                return error;
                 }
         }
 
+back_up:
+        stream->z_src_idx = idx;
+        stream->z_src_bidx = bidx;
+        return error;
+}
+
+/*
+ * Output for inflating part of a stream without the data that came before
+ * it. Back-references to before the start come out as markers instead of
+ * bytes: symbol MARK_BASE + w stands for byte w of the ZLIB_WINDOW_SIZE
+ * bytes before the start, to be filled in once those are known. The
+ * first ZLIB_WINDOW_SIZE symbols are those markers in order, so a copy
+ * doesn't need to care how far back it reaches.
+ */
+#define MARK_BASE 256
+
+struct marked {
+        uint16_t *syms;
+        size_t len;
+        size_t size;
+};
+
+static int marked_init(struct marked *m)
+{
+        size_t i;
+
+        m->size = 4 * ZLIB_WINDOW_SIZE;
+        m->syms = malloc(m->size * sizeof *m->syms);
+        if (!m->syms)
+                return -P_ENOMEM;
+
+        for (i = 0; i < ZLIB_WINDOW_SIZE; i++)
+                m->syms[i] = MARK_BASE + i;
+        m->len = ZLIB_WINDOW_SIZE;
         return 0;
 }
 
-#define ADLER_MOD 65521
+/* make room for n more symbols */
+static int marked_reserve(struct marked *m, size_t n)
+{
+        uint16_t *syms;
+        size_t size;
 
-static uint32_t adler32(const uint8_t *buf, size_t size)
+        if (m->size - m->len >= n)
+                return 0;
+
+        for (size = m->size; size - m->len < n; size *= 2)
+                ;
+        syms = realloc(m->syms, size * sizeof *syms);
+        if (!syms)
+                return -P_ENOMEM;
+
+        m->syms = syms;
+        m->size = size;
+        return 0;
+}
+
+/* copy_stored, but into a struct marked. we always have the whole input */
+static int marked_stored(struct zlib_stream *stream, struct marked *m)
+{
+        const uint8_t *src;
+        size_t i;
+        int error;
+
+        if (stream_sbytes(stream) < stream->z_stored)
+                return -P_E2SMALL;
+
+        error = marked_reserve(m, stream->z_stored);
+        if (error)
+                return error;
+
+        src = stream_src(stream);
+        for (i = 0; i < stream->z_stored; i++)
+                m->syms[m->len++] = src[i];
+        stream->z_src_idx += stream->z_stored;
+        stream->z_stored = 0;
+        return 0;
+}
+
+/* deflate_huffman, but into a struct marked */
+static int marked_huffman(struct zlib_stream *stream, struct marked *m)
 {
-        uint32_t s1 = 1;
-        uint32_t s2 = 0;
+        uint16_t llvalue, len, dist, *dst, *src;
         size_t i;
+        int error;
+
+        for (;;) {
+                if (stream_sbytes(stream) < 5)
+                        return -P_E2SMALL;
 
-        /* todo: is the compiler smart enough to get rid of these mods? */
-        for (i = 0; i < size; i++) {
-                s1 = (s1 + buf[i]) % ADLER_MOD;
-                s2 = (s2 + s1) % ADLER_MOD;
+                error = huff_read(stream, stream->z_lltree, &llvalue);
+                if (error)
+                        return error;
+
+                if (llvalue < HUFF_END_OF_BLOCK) {
+                        error = marked_reserve(m, 1);
+                        if (error)
+                                return error;
+                        m->syms[m->len++] = llvalue;
+                        continue;
+                }
+                if (llvalue == HUFF_END_OF_BLOCK)
+                        return 0;
+                if (llvalue > HUFF_LL_MAX)
+                        return -P_EINVAL;
+
+                error = read_match(stream, llvalue, &len, &dist);
+                if (error)
+                        return error;
+                if (dist > m->len)
+                        return -P_EINVAL;
+
+                error = marked_reserve(m, len);
+                if (error)
+                        return error;
+
+                dst = m->syms + m->len;
+                src = dst - dist;
+                for (i = 0; i < len; i++)
+                        dst[i] = src[i];
+                m->len += len;
         }
+}
 
-        return s2 << 16 | s1;
+/* free the trees for the current block, and every other one cached */
+static void free_trees(struct zlib_stream *stream)
+{
+        huff_cache_free(stream->z_huff_cache);
+        stream->z_huff_cache = NULL;
+        stream->z_lltree = NULL;
+        stream->z_dtree = NULL;
 }
 
-int zlib_decompress(struct zlib_stream *stream)
+void zlib_end(struct zlib_stream *stream)
 {
-        int error, btype, bfinal;
-        uint32_t adler;
+        free_trees(stream);
+        zlib_deflate_end(stream);
+}
 
-        printf("entering zlib_decompress\n");
+int zlib_inflate_init(struct zlib_stream *stream)
+{
+        /*
+         * with an output sink we only need the window, room for the
+         * longest match, and whatever the sink wants to see at once
+         */
+        if (!stream->z_dst) {
+                if (stream->z_drain)
+                        stream->z_dst_end = 2 * ZLIB_WINDOW_SIZE
+                                + stream->z_drain_size;
+                else
+                        stream->z_dst_end = 20*stream->z_src_end;
+
+                stream->z_dst = malloc(stream->z_dst_end);
+                if (!stream->z_dst)
+                        return -P_ENOMEM;
+        }
 
-        stream->z_dst_end = 20*stream->z_src_end;
-        stream->z_dst = malloc(stream->z_dst_end);
-        if (!stream->z_dst)
-                return -P_ENOMEM;
+        stream->z_state = Z_STATE_HEADER;
+        stream->z_adler = 1;
+        stream->z_dst_slid = 0;
+        stream->z_drain_idx = stream->z_dst_idx;
+        stream->z_drain_mark = stream->z_drain
+                ? stream->z_dst_idx + stream->z_drain_size : SIZE_MAX;
+        return 0;
+}
+
+/* read a block header and get ready to decode the block */
+static int start_block(struct zlib_stream *stream)
+{
+        struct zlib_stats *stats = stream->z_stats;
+        uint64_t t0 = 0, tr = 0;
+        int error, btype;
+
+        pr_debug("zlib_decompress: entering main loop\n");
 
-        error = parse_header(stream);
-        if (error < 0)
+        /* read block header from input stream */
+        stream->z_final = read_bits(stream, BLK_BFINAL_BTS);
+        btype = read_bits(stream, BLK_BTYPE_BTS);
+
+        pr_debug("bfinal is %d, btype is %d\n", stream->z_final, btype);
+
+        /* handle block types */
+        switch (btype) {
+        case BLK_BTYPE_RESERVED:
+                pr_debug("got bad btype\n");
+                return -P_EINVAL;
+
+        case BLK_BTYPE_NONE:
+                pr_debug("zlib_decompress: btype none\n");
+                error = deflate_none(stream);
+                stream->z_state = Z_STATE_STORED;
+                if (stats && !error)
+                        stats->zs_stored_blocks++;
                 return error;
-        if (!stream_sbytes(stream))
+
+        case BLK_BTYPE_DYNAMIC:
+                pr_debug("zlib_decompress: btype dynamic\n");
+                if (stats)
+                        t0 = stats_clock();
+                tr = trace_begin();
+                error = make_dynamic_trees(stream);
+                stream->z_state = Z_STATE_HUFFMAN;
+                if (stats && !error)
+                        stats->zs_dynamic_blocks++;
+                break;
+
+        case BLK_BTYPE_STATIC:
+                pr_debug("zlib_decompress: btype static\n");
+                if (stats)
+                        t0 = stats_clock();
+                tr = trace_begin();
+                error = make_static_trees(stream);
+                stream->z_state = Z_STATE_HUFFMAN;
+                if (stats && !error)
+                        stats->zs_static_blocks++;
+                break;
+
+        default:
+                BUG();
+        }
+
+        trace_end("build trees", tr);
+        if (stats)
+                stats->zs_tree_ns += stats_clock() - t0;
+        return error;
+}
+
+/* check the adler32 at the end of the stream against adler */
+static int check_adler(struct zlib_stream *stream, uint32_t adler)
+{
+        uint32_t stored;
+        size_t total;
+
+        /* first eat any remaining bits */
+        if (stream->z_src_bidx) {
+                stream->z_src_bidx = 0;
+                stream->z_src_idx++;
+        }
+        if (stream_sbytes(stream) < 4)
                 return -P_E2SMALL;
+        stored = __read_png_int_raw(stream_src(stream));
+        stream->z_src_idx += 4;
+        if (stored != adler) {
+                pr_debug("adler32 checksum did not match\n");
+                return -P_EBADCSUM;
+        }
 
-        do {
-                printf("zlib_decompress: entering main loop\n");
+        /* woo we made it */
+        total = stream->z_dst_slid + stream->z_dst_idx;
+        pr_debug("inflated stream size is %zuK, ", total >> 10);
+        pr_debug("compression ratio: %f\n",
+               (double)total/(double)stream->z_src_idx);
+        return 0;
+}
 
-                /* read block header from input stream */
-                bfinal = read_bits(stream, BLK_BFINAL_BTS);
-                btype = read_bits(stream, BLK_BTYPE_BTS);
+/* validate the checksum at the end of the stream */
+static int check_stream(struct zlib_stream *stream)
+{
+        uint64_t t0, tr;
+        int error;
 
-                printf("bfinal is %d, btype is %d\n", bfinal, btype);
+        /* hand whatever is left to the sink */
+        if (stream->z_drain) {
+                error = drain_stream(stream);
+                if (error)
+                        return error;
+        } else {
+                t0 = stream->z_stats ? stats_clock() : 0;
+                tr = trace_begin();
+                stream->z_adler = adler32(stream->z_dst, stream->z_dst_idx);
+                trace_end("adler32", tr);
+                if (stream->z_stats)
+                        stream->z_stats->zs_adler_ns += stats_clock() - t0;
+        }
 
-                /* handle block types */
-                switch (btype) {
-                case BLK_BTYPE_RESERVED:
-                        printf("got bad btype\n");
-                        return -P_EINVAL;
+        return check_adler(stream, stream->z_adler);
+}
+
+/* where the stream is, in bits */
+static size_t stream_bit(const struct zlib_stream *stream)
+{
+        return 8 * stream->z_src_idx + stream->z_src_bidx;
+}
+
+void zlib_index_init(struct zlib_index *index, size_t spacing)
+{
+        memset(index, 0, sizeof *index);
+        index->zi_spacing = spacing;
+}
+
+void zlib_index_free(struct zlib_index *index)
+{
+        size_t i;
+
+        for (i = 0; i < index->zi_count; i++) {
+                free(index->zi_points[i].c_window);
+                free(index->zi_points[i].c_priv);
+        }
+        free(index->zi_points);
+        index->zi_points = NULL;
+        index->zi_count = 0;
+        index->zi_cap = 0;
+}
+
+const struct zlib_checkpoint *zlib_index_find(const struct zlib_index *index,
+                                              size_t out)
+{
+        size_t lo = 0, hi = index->zi_count, mid;
+
+        /* find the first checkpoint past out; the one before it is it */
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (index->zi_points[mid].c_out <= out)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo ? &index->zi_points[lo - 1] : NULL;
+}
+
+/*
+ * take a checkpoint if it's been zi_spacing bytes since the last one. only
+ * called between blocks.
+ */
+static int index_point(struct zlib_stream *stream)
+{
+        struct zlib_index *index = stream->z_index;
+        struct zlib_checkpoint *cp, *points;
+        struct zlib_stream ws;
+        size_t out, last, wlen, cap;
+        uint8_t *window;
+        int error;
+
+        out = stream->z_dst_slid + stream->z_dst_idx;
+        last = index->zi_count
+                ? index->zi_points[index->zi_count - 1].c_out : 0;
+        if (!stream->z_drain || out - last < index->zi_spacing)
+                return 0;
+
+        /* z_adler (and zi_save) need to have seen everything before here */
+        error = drain_stream(stream);
+        if (error)
+                return error;
+
+        if (index->zi_count == index->zi_cap) {
+                cap = index->zi_cap ? 2 * index->zi_cap : 16;
+                points = realloc(index->zi_points, cap * sizeof *points);
+                if (!points)
+                        return -P_ENOMEM;
+                index->zi_points = points;
+                index->zi_cap = cap;
+        }
+
+        cp = &index->zi_points[index->zi_count];
+        memset(cp, 0, sizeof *cp);
+        cp->c_bit = stream_bit(stream);
+        cp->c_out = out;
+        cp->c_adler = stream->z_adler;
+
+        /* filtered image data usually deflates to a fraction of a window */
+        wlen = stream->z_dst_idx < ZLIB_WINDOW_SIZE
+                ? stream->z_dst_idx : ZLIB_WINDOW_SIZE;
+        memset(&ws, 0, sizeof ws);
+        ws.z_src = stream_dst(stream) - wlen;
+        ws.z_src_end = wlen;
+        error = zlib_compress(&ws, ZLIB_LEVEL_FAST);
+        if (error) {
+                free(ws.z_dst);
+                return error;
+        }
+
+        /* zlib_compress leaves plenty of slack */
+        window = realloc(ws.z_dst, ws.z_dst_idx);
+        cp->c_window = window ? window : ws.z_dst;
+        cp->c_window_size = ws.z_dst_idx;
+
+        if (index->zi_save) {
+                error = index->zi_save(stream, cp);
+                if (error) {
+                        free(cp->c_window);
+                        return error;
+                }
+        }
 
-                case BLK_BTYPE_NONE:
-                        printf("zlib_decompress: btype none\n");
-                        error = deflate_none(stream);
+        index->zi_count++;
+        return 0;
+}
+
+int zlib_inflate_resume(struct zlib_stream *stream,
+                        const struct zlib_checkpoint *cp)
+{
+        struct zlib_stream ws;
+        size_t wlen;
+        int error;
+
+        if (!stream->z_drain)
+                return -P_EINVAL;
+        if (cp->c_bit > 8 * stream->z_src_end)
+                return -P_ERANGE;
+
+        stream->z_dst_idx = 0;
+        error = zlib_inflate_init(stream);
+        if (error)
+                return error;
+
+        /* put the window back where back-references expect it */
+        wlen = cp->c_out < ZLIB_WINDOW_SIZE ? cp->c_out : ZLIB_WINDOW_SIZE;
+        memset(&ws, 0, sizeof ws);
+        ws.z_src = cp->c_window;
+        ws.z_src_end = cp->c_window_size;
+        ws.z_dst = stream->z_dst;
+        ws.z_dst_end = stream->z_dst_end;
+        error = zlib_decompress(&ws);
+        zlib_end(&ws);
+
+        /* a bad window could have made it grow */
+        stream->z_dst = ws.z_dst;
+        stream->z_dst_end = ws.z_dst_end;
+        if (error)
+                return error;
+        if (ws.z_dst_idx != wlen)
+                return -P_EINVAL;
+
+        stream->z_src_idx = cp->c_bit / 8;
+        stream->z_src_bidx = cp->c_bit % 8;
+        stream->z_state = Z_STATE_BLOCK;
+        stream->z_adler = cp->c_adler;
+        stream->z_dst_idx = wlen;
+        stream->z_dst_slid = cp->c_out - wlen;
+        stream->z_drain_idx = wlen;
+        stream->z_drain_mark = wlen + stream->z_drain_size;
+        return 0;
+}
+
+/*
+ * inflate blocks until the last one is done, leaving the stream in
+ * Z_STATE_CHECK with the checksum still to be read, or until the start of
+ * a block is at or past bit end. if m is set, output goes there rather
+ * than z_dst.
+ */
+static int inflate_until(struct zlib_stream *stream, size_t end,
+                         struct marked *m)
+{
+        uint64_t tr;
+        size_t idx;
+        char bidx;
+        int error;
+
+        for (;;) {
+                switch (stream->z_state) {
+                case Z_STATE_HEADER:
+                        error = parse_header(stream);
                         if (error)
                                 return error;
-                        continue;
+                        stream->z_state = Z_STATE_BLOCK;
+                        break;
 
-                case BLK_BTYPE_DYNAMIC:
-                        printf("zlib_decompress: btype dynamic\n");
-                        error = make_dynamic_trees(stream);
+                case Z_STATE_BLOCK:
+                        if (stream_bit(stream) >= end)
+                                return 0;
+                        if (stream->z_index && !m) {
+                                error = index_point(stream);
+                                if (error)
+                                        return error;
+                        }
+                        /* the header bits can run into a second byte */
+                        if (8 * stream_sbytes(stream)
+                            < (size_t)stream->z_src_bidx + BLK_BFINAL_BTS
+                            + BLK_BTYPE_BTS)
+                                return -P_E2SMALL;
+
+                        /*
+                         * block headers are all or nothing: if the input
+                         * runs out part way through, back up and start
+                         * over once there's more
+                         */
+                        idx = stream->z_src_idx;
+                        bidx = stream->z_src_bidx;
+                        error = start_block(stream);
+                        if (error == -P_E2SMALL) {
+                                stream->z_src_idx = idx;
+                                stream->z_src_bidx = bidx;
+                                stream->z_state = Z_STATE_BLOCK;
+                        }
+                        if (error)
+                                return error;
+                        break;
+
+                case Z_STATE_STORED:
+                        tr = trace_begin();
+                        error = m ? marked_stored(stream, m)
+                                : copy_stored(stream);
+                        trace_end("inflate block", tr);
                         if (error)
                                 return error;
+                        stream->z_state = stream->z_final
+                                ? Z_STATE_CHECK : Z_STATE_BLOCK;
                         break;
 
-                case BLK_BTYPE_STATIC:
-                        printf("zlib_decompress: btype static\n");
-                        error = make_static_trees(stream);
+                case Z_STATE_HUFFMAN:
+                        tr = trace_begin();
+                        error = m ? marked_huffman(stream, m)
+                                : deflate_huffman(stream);
+                        trace_end("inflate block", tr);
                         if (error)
                                 return error;
+                        stream->z_state = stream->z_final
+                                ? Z_STATE_CHECK : Z_STATE_BLOCK;
                         break;
 
-                default:
-                        BUG();
+                case Z_STATE_CHECK:
+                case Z_STATE_DONE:
+                        return 0;
+                }
+        }
+}
+
+static int inflate_stream(struct zlib_stream *stream)
+{
+        int error;
+
+        error = inflate_until(stream, SIZE_MAX, NULL);
+        if (error || stream->z_state == Z_STATE_DONE)
+                return error;
+
+        error = check_stream(stream);
+        if (error)
+                return error;
+        stream->z_state = Z_STATE_DONE;
+        return 0;
+}
+
+int zlib_inflate(struct zlib_stream *stream)
+{
+        struct zlib_stats *stats = stream->z_stats;
+        size_t in = 0, out = 0;
+        uint64_t t0 = 0;
+        int error;
+
+        if (stats) {
+                t0 = stats_clock();
+                in = stream->z_src_idx;
+                out = stream->z_dst_slid + stream->z_dst_idx;
+        }
+
+        error = inflate_stream(stream);
+
+        /* hand over everything we have before waiting on more input */
+        if (error == -P_E2SMALL && stream->z_drain && drain_stream(stream))
+                error = Z_STOPPED;
+
+        if (stats) {
+                stats->zs_in += stream->z_src_idx - in;
+                stats->zs_out += stream->z_dst_slid + stream->z_dst_idx - out;
+                stats->zs_total_ns += stats_clock() - t0;
+        }
+        return error;
+}
+
+int zlib_decompress(struct zlib_stream *stream)
+{
+        int error;
+
+        pr_debug("entering zlib_decompress\n");
+
+        error = zlib_inflate_init(stream);
+        if (error)
+                return error;
+
+        return zlib_inflate(stream);
+}
+
+
+/*
+ * zlib_decompress_parallel cuts the input into segments of at least this
+ * many compressed bytes
+ */
+#define SEGMENT_MIN (256UL << 10)
+
+/* the empty stored block that a sync or full flush ends with */
+static const uint8_t flush_marker[] = {0x00, 0x00, 0xff, 0xff};
+
+/* a byte of a segment's output that comes from before the segment */
+struct mark {
+        /* where it is in the segment's output */
+        size_t pos;
+
+        /* which byte of the ZLIB_WINDOW_SIZE before the segment it is */
+        uint16_t w;
+};
+
+struct segment {
+        struct pool_job job;
+
+        /*
+         * bit offsets into the input: the segment starts at the first
+         * thing that looks like a block at or after target, and stops at
+         * the first block boundary at or after stop
+         */
+        size_t target;
+        size_t stop;
+
+        /*
+         * the segment inflated on its own from bit start. the stream is
+         * left where it stopped, with the output in z_dst. bytes that came
+         * from before the segment are zero there and listed in marks, and
+         * adler is the adler32 of the output as it is. ok is set if all of
+         * that worked
+         */
+        size_t start;
+        struct zlib_stream stream;
+        struct mark *marks;
+        size_t nmarks;
+        uint32_t adler;
+        bool ok;
+};
+
+/* nbits (no more than 25) bits at bit offset bit */
+static uint32_t peek_bits(const uint8_t *src, size_t bit, unsigned nbits)
+{
+        uint32_t word;
+
+        src += bit / 8;
+        word = src[0] | src[1] << 8 | src[2] << 16 | (uint32_t)src[3] << 24;
+        return word >> bit % 8 & ((1U << nbits) - 1);
+}
+
+/* is bit just past a flush marker? */
+static bool after_flush(const uint8_t *src, size_t bit)
+{
+        return !(bit % 8) && bit / 8 >= sizeof flush_marker
+                && !memcmp(src + bit / 8 - sizeof flush_marker, flush_marker,
+                           sizeof flush_marker);
+}
+
+/*
+ * could a dynamic block start at bit? the alphabet sizes have to be in
+ * range and the code length code has to be complete, which very little
+ * junk gets past
+ */
+static bool dynamic_header(const uint8_t *src, size_t bit)
+{
+        unsigned hdr, hclen, len, i, kraft = 0;
+
+        hdr = peek_bits(src, bit, BLK_BFINAL_BTS + BLK_BTYPE_BTS
+                        + HLIT_BITS + HDIST_BITS + HCLEN_BITS);
+        if ((hdr >> BLK_BFINAL_BTS & 0x3) != BLK_BTYPE_DYNAMIC)
+                return false;
+        hdr >>= BLK_BFINAL_BTS + BLK_BTYPE_BTS;
+
+        /* at most 286 length/literal and 30 distance codes */
+        if ((hdr & 0x1f) > 29 || (hdr >> HLIT_BITS & 0x1f) > 29)
+                return false;
+
+        hclen = (hdr >> (HLIT_BITS + HDIST_BITS)) + HCLEN_BIAS;
+        bit += BLK_BFINAL_BTS + BLK_BTYPE_BTS + HLIT_BITS + HDIST_BITS
+                + HCLEN_BITS;
+        for (i = 0; i < hclen; i++, bit += CLEN_BITS) {
+                len = peek_bits(src, bit, CLEN_BITS);
+                if (len)
+                        kraft += 1U << (7 - len);
+        }
+
+        return kraft == 1U << 7;
+}
+
+/* the number of codes in a tree, and whether they use up every bit pattern */
+static bool huff_complete(const struct huff_tree *tree, unsigned *count)
+{
+        const struct huff_range *range;
+        unsigned long kraft = 0;
+        unsigned i;
+
+        *count = 0;
+        for (i = 0; i < HUFF_NR_RANGES; i++) {
+                range = &tree->h_ranges[i];
+                if (!range->r_len)
+                        continue;
+                *count += range->r_count;
+                kraft += (unsigned long)range->r_count
+                        << (HUFF_NR_RANGES - 1 - range->r_len);
+        }
+
+        return kraft == 1UL << (HUFF_NR_RANGES - 1);
+}
+
+/*
+ * point a segment's stream at bit, ready to inflate. unless bit is just
+ * past a flush marker, the block there has to be a dynamic one with
+ * sensible trees
+ */
+static int segment_seek(struct segment *seg, size_t bit)
+{
+        struct zlib_stream *stream = &seg->stream;
+        unsigned count;
+        int error;
+
+        free_trees(stream);
+        stream->z_dst_idx = 0;
+        stream->z_src_idx = bit / 8;
+        stream->z_src_bidx = bit % 8;
+        stream->z_state = bit ? Z_STATE_BLOCK : Z_STATE_HEADER;
+        if (!bit || after_flush(stream->z_src, bit))
+                return 0;
+
+        error = start_block(stream);
+        if (error)
+                return error;
+
+        /* incomplete trees only turn up in junk (or in tiny blocks) */
+        if (!huff_complete(stream->z_lltree, &count))
+                return -P_EINVAL;
+        if (!huff_complete(stream->z_dtree, &count) && count > 1)
+                return -P_EINVAL;
+        return 0;
+}
+
+/*
+ * turn symbols into the segment's output: bytes, with markers zeroed and
+ * listed in seg->marks
+ */
+static int segment_unmark(struct segment *seg, const struct marked *m)
+{
+        struct zlib_stream *stream = &seg->stream;
+        struct mark *marks;
+        size_t i, n, size = 0;
+        uint16_t sym;
+        int error;
+
+        n = m->len - ZLIB_WINDOW_SIZE;
+        error = reserve_stream(stream, n);
+        if (error)
+                return error;
+
+        for (i = 0; i < n; i++) {
+                sym = m->syms[ZLIB_WINDOW_SIZE + i];
+                if (sym < MARK_BASE) {
+                        stream->z_dst[i] = sym;
+                        continue;
                 }
 
-                error = deflate_huffman(stream);
+                if (seg->nmarks == size) {
+                        size = size ? 2 * size : 1024;
+                        marks = realloc(seg->marks, size * sizeof *marks);
+                        if (!marks)
+                                return -P_ENOMEM;
+                        seg->marks = marks;
+                }
+                seg->marks[seg->nmarks].pos = i;
+                seg->marks[seg->nmarks].w = sym - MARK_BASE;
+                seg->nmarks++;
+                stream->z_dst[i] = 0;
+        }
+
+        stream->z_dst_idx = n;
+        return 0;
+}
+
+/*
+ * inflate a segment from bit. first as bytes, which works if nothing
+ * reaches back before bit, and if that fails, again with markers
+ */
+static int segment_inflate(struct segment *seg, size_t bit)
+{
+        struct marked m;
+        int error;
+
+        error = segment_seek(seg, bit);
+        if (!error)
+                error = inflate_until(&seg->stream, seg->stop, NULL);
+        if (!error || !bit)
+                return error;
+
+        error = segment_seek(seg, bit);
+        if (error)
+                return error;
+
+        error = marked_init(&m);
+        if (error)
+                return error;
+        error = inflate_until(&seg->stream, seg->stop, &m);
+        if (!error)
+                error = segment_unmark(seg, &m);
+        free(m.syms);
+        return error;
+}
+
+/*
+ * find where a segment starts and inflate it. runs on a pool thread.
+ * anything that looks like a block start might not be one, so if
+ * inflating from there fails we keep looking
+ */
+static void segment_run(struct pool_job *job)
+{
+        struct segment *seg = container_of(job, struct segment, job);
+        struct zlib_stream *stream = &seg->stream;
+        size_t bit, last;
+
+        stream->z_dst_end = ZLIB_WINDOW_SIZE;
+        stream->z_dst = malloc(stream->z_dst_end);
+        if (!stream->z_dst)
+                return;
+        zlib_inflate_init(stream);
+
+        /* leave room to peek at a whole dynamic block header */
+        last = stream->z_src_end > 16 ? 8 * (stream->z_src_end - 16) : 0;
+        if (last > seg->stop)
+                last = seg->stop;
+
+        for (bit = seg->target; bit <= last; bit++) {
+                if (bit && !after_flush(stream->z_src, bit)
+                    && !dynamic_header(stream->z_src, bit))
+                        continue;
+
+                seg->nmarks = 0;
+                if (!segment_inflate(seg, bit)) {
+                        seg->start = bit;
+                        seg->ok = true;
+                        break;
+                }
+                if (!bit)
+                        break;
+        }
+        free_trees(stream);
+
+        if (seg->ok)
+                seg->adler = adler32(stream->z_dst, stream->z_dst_idx);
+}
+
+/* inflate in order until bit end, keeping adler up to date */
+static int inflate_in_order(struct zlib_stream *stream, size_t end,
+                            uint32_t *adler)
+{
+        size_t done;
+        int error;
+
+        done = stream->z_dst_idx;
+        error = inflate_until(stream, end, NULL);
+        *adler = adler32_update(*adler, stream->z_dst + done,
+                                stream->z_dst_idx - done);
+        return error;
+}
+
+/*
+ * add a segment's output to the stream, which has everything before it,
+ * filling in its markers from the window before it
+ */
+static int segment_splice(struct zlib_stream *stream, struct segment *seg,
+                          uint32_t *adler)
+{
+        struct zlib_stream *part = &seg->stream;
+        uint64_t s1, s2, d1 = 0, d2 = 0;
+        const struct mark *mark;
+        size_t i, base, len;
+        uint8_t *dst, v;
+        int error;
+
+        base = stream->z_dst_idx;
+        len = part->z_dst_idx;
+        error = reserve_stream(stream, len);
+        if (error)
+                return error;
+
+        dst = stream_dst(stream);
+        memcpy(dst, part->z_dst, len);
+
+        /*
+         * each byte v filled in at pos adds v to the first adler sum and
+         * (len - pos) * v to the second
+         */
+        for (i = 0; i < seg->nmarks; i++) {
+                mark = &seg->marks[i];
+                if (base + mark->w < ZLIB_WINDOW_SIZE)
+                        return -P_EINVAL;
+                v = stream->z_dst[base + mark->w - ZLIB_WINDOW_SIZE];
+                dst[mark->pos] = v;
+                d1 += v;
+                d2 += (uint64_t)((len - mark->pos) % ADLER_MOD) * v;
+        }
+        s1 = ((seg->adler & 0xffff) + d1) % ADLER_MOD;
+        s2 = ((seg->adler >> 16) + d2) % ADLER_MOD;
+
+        stream->z_dst_idx += len;
+        stream->z_src_idx = part->z_src_idx;
+        stream->z_src_bidx = part->z_src_bidx;
+        stream->z_state = part->z_state;
+        *adler = adler32_combine(*adler, s2 << 16 | s1, len);
+        return 0;
+}
+
+/*
+ * add a segment to the output, which has everything up to the segment
+ * before it. we inflate in order up to where the segment starts, and if
+ * that lands on a block boundary right there (which also proves it really
+ * is one), we can use what the worker did. otherwise we carry on in order
+ * through to where the segment stops
+ */
+static int segment_retire(struct zlib_stream *stream, struct segment *seg,
+                          uint32_t *adler)
+{
+        int error;
+
+        if (seg->ok) {
+                error = seg->start
+                        ? inflate_in_order(stream, seg->start, adler) : 0;
                 if (error)
                         return error;
-        } while (!bfinal);
 
-        /* validate the checksum.. first eat any remaining bits */
-        if (stream->z_src_bidx)
-                stream->z_src_idx++;
-        adler = __read_png_int_raw(stream_src(stream));
-        if (adler != adler32(stream->z_dst, stream->z_dst_idx)) {
-                printf("adler32 checksum did not match\n");
-                return -P_EBADCSUM;
+                if (stream_bit(stream) == seg->start
+                    && (!seg->start || stream->z_state == Z_STATE_BLOCK))
+                        return segment_splice(stream, seg, adler);
         }
 
-        /* woo we made it */
-        printf("inflated stream size is %luK, ", stream->z_dst_idx >> 10);
-        printf("compression ratio: %f\n",
-               (double)stream->z_dst_idx/(double)stream->z_src_idx);
-        return 0;
+        pr_debug("inflating segment at bit %zu in order\n", seg->target);
+        return inflate_in_order(stream, seg->stop, adler);
+}
+
+int zlib_decompress_parallel(struct zlib_stream *stream, unsigned threads)
+{
+        size_t nsegs, queued, qmax, i, size, end;
+        struct segment *segs;
+        struct pool *pool;
+        uint32_t adler = 1;
+        int error;
+
+        if (stream->z_drain)
+                return -P_EINVAL;
+        if (threads == 1 || stream->z_src_end <= SEGMENT_MIN)
+                return zlib_decompress(stream);
+
+        error = zlib_inflate_init(stream);
+        if (error)
+                return error;
+
+        pool = pool_new(threads);
+        if (!pool)
+                return -P_ENOMEM;
+
+        /* a few segments per thread */
+        end = stream->z_src_end;
+        size = end / (4 * pool_threads(pool));
+        if (size < SEGMENT_MIN)
+                size = SEGMENT_MIN;
+        nsegs = end / size;
+
+        segs = calloc(nsegs, sizeof *segs);
+        if (!segs) {
+                error = -P_ENOMEM;
+                goto out;
+        }
+        for (i = 0; i < nsegs; i++) {
+                segs[i].job.fn = segment_run;
+                segs[i].target = 8 * i * size;
+                segs[i].stop = i + 1 < nsegs ? 8 * (i + 1) * size : SIZE_MAX;
+                segs[i].stream.z_src = stream->z_src;
+                segs[i].stream.z_src_end = end;
+        }
+
+        /*
+         * keep a couple of segments per thread in flight, and put them
+         * together in order as they finish
+         */
+        qmax = 2 * pool_threads(pool);
+        for (i = 0, queued = 0; i < nsegs; i++) {
+                while (!error && queued < nsegs && queued < i + qmax)
+                        pool_submit(pool, &segs[queued++].job);
+                if (i == queued)
+                        break;
+
+                pool_wait(pool, &segs[i].job);
+                if (!error)
+                        error = segment_retire(stream, &segs[i], &adler);
+                free(segs[i].stream.z_dst);
+                free(segs[i].marks);
+        }
+
+        if (!error && stream->z_state != Z_STATE_CHECK)
+                error = -P_E2SMALL;
+        if (!error)
+                error = check_adler(stream, adler);
+        if (!error)
+                stream->z_state = Z_STATE_DONE;
+out:
+        pool_free(pool);
+        free(segs);
+        return error;
 }
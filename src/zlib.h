@@ -2,9 +2,121 @@
 #define PNG_ZLIB_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 
+/* size of the deflate back-reference window */
+#define ZLIB_WINDOW_SIZE (1UL << 15)
+
+/* positive return value of zlib_decompress when z_drain asked us to stop */
+#define Z_STOPPED 1
+
+struct zlib_stream;
+
+/*
+ * a place in a stream that inflating can be picked up from later without
+ * going back to the start, as in zlib's examples/zran.c. checkpoints are
+ * always between blocks, so picking up again only needs the bit position
+ * and the window of output before it.
+ */
+struct zlib_checkpoint {
+        /* where the next block starts in z_src, in bits */
+        size_t c_bit;
+
+        /* how many bytes were inflated before then, and their adler32 */
+        size_t c_out;
+        uint32_t c_adler;
+
+        /*
+         * the last ZLIB_WINDOW_SIZE bytes of that output (or all of it, if
+         * there's less), deflated to keep checkpoints small
+         */
+        uint8_t *c_window;
+        size_t c_window_size;
+
+        /* whatever zi_save stashes here. freed along with the index */
+        void *c_priv;
+};
+
+/* checkpoints taken during one pass through a stream, in order */
+struct zlib_index {
+        struct zlib_checkpoint *zi_points;
+        size_t zi_count;
+        size_t zi_cap;
+
+        /* take a checkpoint every time this much more has been inflated */
+        size_t zi_spacing;
+
+        /*
+         * if set, called with each new checkpoint so whoever is on the
+         * other end of z_drain can save their own state alongside it.
+         * everything up to c_out has been drained by then.
+         */
+        int (*zi_save)(struct zlib_stream *stream,
+                       struct zlib_checkpoint *cp);
+};
+
+/* buckets in a zlib_stats histogram, enough for distances up to 32K */
+#define ZLIB_STATS_HIST 16
+
+/*
+ * what inflating a stream did and where the time went, collected only if
+ * z_stats is set. everything adds up across calls, so zero it to start.
+ * times are in nanoseconds; whatever zs_total_ns doesn't account for in
+ * the others is decoding symbols and copying matches.
+ */
+struct zlib_stats {
+        /* blocks of each type */
+        uint64_t zs_stored_blocks;
+        uint64_t zs_static_blocks;
+        uint64_t zs_dynamic_blocks;
+
+        /* huffman blocks whose trees were already built for an earlier one */
+        uint64_t zs_tree_hits;
+
+        /* huffman symbols decoded, lengths and distances both counting */
+        uint64_t zs_symbols;
+
+        /* output bytes that came from literals, matches and stored blocks */
+        uint64_t zs_literal_bytes;
+        uint64_t zs_match_bytes;
+        uint64_t zs_stored_bytes;
+
+        /*
+         * matches by length and by distance, in power of two buckets:
+         * bucket i counts [2^i, 2^(i+1)) (see stats_bucket)
+         */
+        uint64_t zs_matches;
+        uint64_t zs_len_hist[ZLIB_STATS_HIST];
+        uint64_t zs_dist_hist[ZLIB_STATS_HIST];
+
+        /* times z_dst had to be grown */
+        uint64_t zs_reallocs;
+
+        /* compressed bytes consumed and bytes inflated */
+        uint64_t zs_in;
+        uint64_t zs_out;
+
+        /* building trees, the adler32, and in z_drain */
+        uint64_t zs_tree_ns;
+        uint64_t zs_adler_ns;
+        uint64_t zs_drain_ns;
+
+        /* all of zlib_inflate (and so zlib_decompress) */
+        uint64_t zs_total_ns;
+};
+
+/* where zlib_inflate is in the stream, so that it can pick up again */
+enum zlib_state {
+        Z_STATE_HEADER = 0,
+        Z_STATE_BLOCK,
+        Z_STATE_STORED,
+        Z_STATE_HUFFMAN,
+        Z_STATE_CHECK,
+        Z_STATE_DONE
+};
+
 struct zlib_stream {
         /* public fields */
         const uint8_t *z_src;
@@ -16,16 +128,190 @@ struct zlib_stream {
         size_t z_dst_idx;
         size_t z_dst_end;
 
+        /*
+         * optional output sink. If set, z_dst is a fixed size sliding
+         * window rather than a buffer that grows to hold the whole
+         * output, and inflated bytes are handed to z_drain in order as
+         * soon as at least z_drain_size of them are pending. A nonzero
+         * return from z_drain stops decompression, and zlib_decompress
+         * returns Z_STOPPED. z_priv is for the sink to use as it likes.
+         */
+        int (*z_drain)(struct zlib_stream *stream, const uint8_t *buf,
+                       size_t size);
+        size_t z_drain_size;
+        void *z_priv;
+
+        /*
+         * optional index to take checkpoints into as the stream is
+         * inflated. only streams with an output sink can be indexed.
+         */
+        struct zlib_index *z_index;
+
+        /* optional statistics, added to as the stream is inflated */
+        struct zlib_stats *z_stats;
+
         /* internal fields */
         size_t wsize;
 
+        enum zlib_state z_state;
+
+        /* is the current block the last one? */
+        bool z_final;
+
+        /* bytes left to copy in the current uncompressed block */
+        size_t z_stored;
+
+        /* output bytes that have been slid out of the front of z_dst */
+        size_t z_dst_slid;
+
+        /* index of the first byte in z_dst that has not been drained */
+        size_t z_drain_idx;
+
+        /* drain once z_dst_idx reaches this */
+        size_t z_drain_mark;
+
+        /* running adler32 of drained output */
+        uint32_t z_adler;
+
         /* length/litteral tree */
         struct huff_tree *z_lltree;
 
         /* distance tree */
         struct huff_tree *z_dtree;
+
+        /* trees built for recent blocks, which own the two above */
+        struct huff_cache *z_huff_cache;
+
+        /* compressor state, for zlib_deflate */
+        struct deflate_state *z_deflate;
 };
 
+/*
+ * Inflate z_src into z_dst. If z_dst is NULL it is allocated here; either
+ * way the caller frees it. Returns 0, Z_STOPPED, or a negative error.
+ */
 int zlib_decompress(struct zlib_stream *stream);
 
+/*
+ * zlib_decompress on threads threads (0 for one per cpu). The input is cut
+ * into segments, and each is inflated on its own from the first thing
+ * after its cut that looks like the start of a block: just past an empty
+ * stored block (00 00 ff ff, which is how sync and full flushes end), or
+ * a plausible dynamic block header. Back-references to before a segment
+ * come out as placeholders, which are filled in from the 32K before it as
+ * the segments are put together in order, with their adler32s combined. A
+ * guess that turns out not to be a block boundary just means inflating
+ * that stretch in order on the calling thread, so the result is always the
+ * same as zlib_decompress. z_drain isn't supported.
+ */
+int zlib_decompress_parallel(struct zlib_stream *stream, unsigned threads);
+
+/*
+ * Incremental decompression: zlib_inflate_init sets a stream up (and
+ * allocates z_dst as above), then zlib_inflate consumes as much of
+ * z_src as it can. If it runs out of input part way through, it returns
+ * -P_E2SMALL having consumed only whole symbols (whole headers for block
+ * and zlib headers), so the caller can move the unconsumed input around,
+ * append more, and call it again. With z_drain set, everything inflated so
+ * far is drained before returning -P_E2SMALL. Returns 0 once the checksum has been
+ * verified, and Z_STOPPED if z_drain asked to stop; calling it again
+ * after that carries on where it left off.
+ */
+int zlib_inflate_init(struct zlib_stream *stream);
+int zlib_inflate(struct zlib_stream *stream);
+
+/* set up an empty index taking checkpoints spacing inflated bytes apart */
+void zlib_index_init(struct zlib_index *index, size_t spacing);
+
+/* free an index's checkpoints (but not the index itself) */
+void zlib_index_free(struct zlib_index *index);
+
+/* the last checkpoint at or before output byte out, or NULL if none is */
+const struct zlib_checkpoint *zlib_index_find(const struct zlib_index *index,
+                                              size_t out);
+
+/*
+ * like zlib_inflate_init, but set the stream up to carry on from a
+ * checkpoint taken in an earlier pass over the same z_src, so zlib_inflate
+ * then hands z_drain what comes after cp->c_out. z_drain has to be set.
+ * the checksum at the end still gets verified, since the checkpoint knows
+ * the adler32 of everything before it.
+ */
+int zlib_inflate_resume(struct zlib_stream *stream,
+                        const struct zlib_checkpoint *cp);
+
+/*
+ * free internal state hanging off of a stream (but not z_dst), whether it
+ * was inflating or deflating
+ */
+void zlib_end(struct zlib_stream *stream);
+
+/* compression levels for zlib_compress */
+#define ZLIB_LEVEL_STORE 0
+#define ZLIB_LEVEL_FAST 1
+#define ZLIB_LEVEL_DEFAULT 6
+#define ZLIB_LEVEL_BEST 9
+
+/*
+ * Deflate z_src into a zlib stream at z_dst + z_dst_idx. z_dst is grown
+ * (or allocated, if NULL) to make room for zlib_compress_bound() bytes, and
+ * either way the caller frees it. Levels 1-3 match greedily, 4-8 lazily
+ * and 9 parses optimally; 0 just stores. Returns 0 or a negative error.
+ */
+int zlib_compress(struct zlib_stream *stream, int level);
+
+/*
+ * about the most zlib_compress can write for size bytes of input. it's only
+ * a hint; z_dst is grown if it turns out not to be enough
+ */
+size_t zlib_compress_bound(size_t size);
+
+/* flush modes for zlib_deflate */
+#define ZLIB_NO_FLUSH 0
+#define ZLIB_SYNC_FLUSH 1
+#define ZLIB_FINISH 2
+
+/*
+ * Streaming compression: zlib_deflate_init sets a stream up to deflate at
+ * level, then each call to zlib_deflate takes all of z_src (moving
+ * z_src_idx up to z_src_end), so the caller can refill it for the next
+ * call. Output is appended at z_dst + z_dst_idx, and z_dst is grown (or
+ * allocated) as needed; the caller can take bytes out and reset z_dst_idx
+ * between calls. Input is held back until there's enough of it to match
+ * against, unless flush is set: ZLIB_SYNC_FLUSH ends the current block and
+ * pads to a byte boundary with an empty stored block (00 00 ff ff), so
+ * everything so far can be inflated, and ZLIB_FINISH ends the stream.
+ * Returns 0 or a negative error. zlib_deflate_end (or zlib_end) frees the
+ * state.
+ */
+int zlib_deflate_init(struct zlib_stream *stream, int level);
+int zlib_deflate(struct zlib_stream *stream, int flush);
+void zlib_deflate_end(struct zlib_stream *stream);
+
+/*
+ * Same as zlib_deflate_init, but with no zlib header or adler32 trailer,
+ * for deflate data that's going to be spliced into another stream. One
+ * compressed piece by piece this way (ending each piece with a sync flush
+ * and only the last with ZLIB_FINISH) can be joined into one stream by
+ * putting a zlib header in front and the adler32s, combined, at the end.
+ */
+int zlib_deflate_raw_init(struct zlib_stream *stream, int level);
+
+/*
+ * Prime a raw deflater with the input that came before this piece (only
+ * the last ZLIB_WINDOW_SIZE bytes of it matter), so matches can reach back
+ * into it. Call before any input.
+ */
+int zlib_deflate_dictionary(struct zlib_stream *stream, const uint8_t *dict,
+                            size_t size);
+
+/* update a running adler32 (start from 1) with size more bytes */
+uint32_t adler32_update(uint32_t adler, const uint8_t *buf, size_t size);
+
+/*
+ * the adler32 of two pieces of data one after the other, from each one's
+ * adler32 and the length of the second
+ */
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2);
+
 #endif /* PNG_ZLIB_H */